@@ -121,6 +121,29 @@ pub struct ConfigToml {
     pub wal_receiver_protocol: PostgresClientProtocol,
     pub page_service_pipelining: PageServicePipeliningConfig,
     pub get_vectored_concurrent_io: GetVectoredConcurrentIo,
+    /// Size of each of the request and response rings in the shared memory that is
+    /// set up between pageserver and each WAL redo process. 0 means that all the
+    /// data goes through the pipes instead.
+    pub walredo_shmem_ring_size: usize,
+    /// Fork the WAL redo processes from a pre-initialized template process per
+    /// Postgres version, instead of starting each one from scratch.
+    pub walredo_fork_server: bool,
+    /// Number of pages that the WAL redo process can hold in its in-memory smgr,
+    /// for records that touch more pages than fit in its buffer cache. 0 means
+    /// the default of the WAL redo process.
+    pub walredo_inmem_smgr_pages: usize,
+    /// Number of pages that each WAL redo process can reconstruct at the same time.
+    /// With more than one, the inputs of a large page are streamed to the process
+    /// in chunks, and the requests for other pages can go in between.
+    pub walredo_redo_slots: usize,
+    /// Size the shared memory of the WAL redo processes like for a postmaster
+    /// with the default settings, instead of for the single process that they
+    /// are. Only for measuring the difference; not meant for production.
+    pub walredo_postmaster_shmem_sizes: bool,
+    /// If set, append every page reconstructed by a WAL redo process, with the
+    /// inputs that went into it, to a corpus file at this path. For replaying in
+    /// the `bench_walredo_replay` benchmark; not meant for production.
+    pub walredo_capture_path: Option<Utf8PathBuf>,
 }
 
 #[derive(Debug, Clone, PartialEq, Eq, serde::Serialize, serde::Deserialize)]
@@ -406,6 +429,16 @@ pub mod defaults {
 
     pub const DEFAULT_WAL_RECEIVER_PROTOCOL: utils::postgres_client::PostgresClientProtocol =
         utils::postgres_client::PostgresClientProtocol::Vanilla;
+
+    pub const DEFAULT_WALREDO_SHMEM_RING_SIZE: usize = 0;
+
+    pub const DEFAULT_WALREDO_FORK_SERVER: bool = false;
+
+    pub const DEFAULT_WALREDO_INMEM_SMGR_PAGES: usize = 0;
+
+    pub const DEFAULT_WALREDO_REDO_SLOTS: usize = 1;
+
+    pub const DEFAULT_WALREDO_POSTMASTER_SHMEM_SIZES: bool = false;
 }
 
 impl Default for ConfigToml {
@@ -506,6 +539,12 @@ fn default() -> Self {
             } else {
                 GetVectoredConcurrentIo::SidecarTask
             },
+            walredo_shmem_ring_size: (DEFAULT_WALREDO_SHMEM_RING_SIZE),
+            walredo_fork_server: (DEFAULT_WALREDO_FORK_SERVER),
+            walredo_inmem_smgr_pages: (DEFAULT_WALREDO_INMEM_SMGR_PAGES),
+            walredo_redo_slots: (DEFAULT_WALREDO_REDO_SLOTS),
+            walredo_postmaster_shmem_sizes: (DEFAULT_WALREDO_POSTMASTER_SHMEM_SIZES),
+            walredo_capture_path: None,
         }
     }
 }
@@ -1466,6 +1466,8 @@ pub enum PagestreamFeMessage {
     GetPage(PagestreamGetPageRequest),
     DbSize(PagestreamDbSizeRequest),
     GetSlruSegment(PagestreamGetSlruSegmentRequest),
+    GetPageRange(PagestreamGetPageRangeRequest),
+    GetPageIfModified(PagestreamGetPageIfModifiedRequest),
     #[cfg(feature = "testing")]
     Test(PagestreamTestRequest),
 }
@@ -1479,6 +1481,9 @@ pub enum PagestreamBeMessage {
     Error(PagestreamErrorResponse),
     DbSize(PagestreamDbSizeResponse),
     GetSlruSegment(PagestreamGetSlruSegmentResponse),
+    GetPageRange(PagestreamGetPageRangeResponse),
+    GetPageCompressed(PagestreamGetPageCompressedResponse),
+    NotModified(PagestreamNotModifiedResponse),
     #[cfg(feature = "testing")]
     Test(PagestreamTestResponse),
 }
@@ -1491,6 +1496,8 @@ enum PagestreamFeMessageTag {
     GetPage = 2,
     DbSize = 3,
     GetSlruSegment = 4,
+    GetPageRange = 5,
+    GetPageIfModified = 6,
     /* future tags above this line */
     /// For testing purposes, not available in production.
     #[cfg(feature = "testing")]
@@ -1506,6 +1513,9 @@ enum PagestreamBeMessageTag {
     Error = 103,
     DbSize = 104,
     GetSlruSegment = 105,
+    GetPageRange = 106,
+    GetPageCompressed = 107,
+    NotModified = 108,
     /* future tags above this line */
     /// For testing purposes, not available in production.
     #[cfg(feature = "testing")]
@@ -1521,6 +1531,8 @@ fn try_from(value: u8) -> Result<Self, u8> {
             2 => Ok(PagestreamFeMessageTag::GetPage),
             3 => Ok(PagestreamFeMessageTag::DbSize),
             4 => Ok(PagestreamFeMessageTag::GetSlruSegment),
+            5 => Ok(PagestreamFeMessageTag::GetPageRange),
+            6 => Ok(PagestreamFeMessageTag::GetPageIfModified),
             #[cfg(feature = "testing")]
             99 => Ok(PagestreamFeMessageTag::Test),
             _ => Err(value),
@@ -1538,6 +1550,9 @@ fn try_from(value: u8) -> Result<Self, u8> {
             103 => Ok(PagestreamBeMessageTag::Error),
             104 => Ok(PagestreamBeMessageTag::DbSize),
             105 => Ok(PagestreamBeMessageTag::GetSlruSegment),
+            106 => Ok(PagestreamBeMessageTag::GetPageRange),
+            107 => Ok(PagestreamBeMessageTag::GetPageCompressed),
+            108 => Ok(PagestreamBeMessageTag::NotModified),
             #[cfg(feature = "testing")]
             199 => Ok(PagestreamBeMessageTag::Test),
             _ => Err(value),
@@ -1574,12 +1589,58 @@ fn try_from(value: u8) -> Result<Self, u8> {
 // We copy fields from request to response to make checking more reliable: request ID is formed from process ID
 // and local counter, so in principle there can be duplicated requests IDs if process PID is reused.
 //
+// V4 uses the same message format as V3, and adds the GetPageRange request, which fetches a
+// contiguous run of blocks of a relation fork with a single request/response pair. All blocks
+// of the range must be stored on the same shard.
+//
+// V4 also adds the GetPageIfModified request, for revalidating a copy of a page that the client
+// already has. It carries the LSN of the client's copy (the LSN in its page header). If the page
+// version at the request LSN has the same page LSN, the pageserver responds with a small
+// NotModified message instead of the page image; otherwise with a regular GetPage response.
+//
 #[derive(Debug, PartialEq, Eq, Clone, Copy)]
 pub enum PagestreamProtocolVersion {
     V2,
     V3,
+    V4,
+}
+
+/// Compression of page images in GetPage responses, negotiated with the `--compression=<algorithm>`
+/// option of the `pagestream_v{3,4}` command. When enabled, the pageserver sends each page either
+/// as a regular GetPage response, or as a GetPageCompressed response if that is smaller.
+///
+/// The discriminant is sent on the wire. Keep in sync with `PagestreamCompression` in
+/// `pagestore_client.h`.
+#[derive(Debug, PartialEq, Eq, Clone, Copy)]
+#[repr(u8)]
+pub enum PagestreamCompressionAlgorithm {
+    Zstd = 1,
 }
 
+impl FromStr for PagestreamCompressionAlgorithm {
+    type Err = anyhow::Error;
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s {
+            "zstd" => Ok(Self::Zstd),
+            _ => anyhow::bail!("unsupported pagestream compression algorithm: {s}"),
+        }
+    }
+}
+
+impl TryFrom<u8> for PagestreamCompressionAlgorithm {
+    type Error = u8;
+    fn try_from(value: u8) -> Result<Self, u8> {
+        match value {
+            1 => Ok(Self::Zstd),
+            _ => Err(value),
+        }
+    }
+}
+
+/// Maximum number of blocks that can be requested with a single GetPageRange request.
+/// Keep in sync with `MAX_GETPAGE_RANGE_BLOCKS` in `pagestore_client.h`.
+pub const PAGESTREAM_MAX_GETPAGE_RANGE_BLOCKS: u32 = 128;
+
 pub type RequestId = u64;
 
 #[derive(Debug, PartialEq, Eq, Clone, Copy)]
@@ -1608,6 +1669,23 @@ pub struct PagestreamGetPageRequest {
     pub blkno: u32,
 }
 
+#[derive(Debug, PartialEq, Eq, Clone, Copy)]
+pub struct PagestreamGetPageRangeRequest {
+    pub hdr: PagestreamRequest,
+    pub rel: RelTag,
+    pub blkno: u32,
+    pub nblocks: u32,
+}
+
+#[derive(Debug, PartialEq, Eq, Clone, Copy)]
+pub struct PagestreamGetPageIfModifiedRequest {
+    pub hdr: PagestreamRequest,
+    pub rel: RelTag,
+    pub blkno: u32,
+    /// LSN in the page header of the client's copy of the page.
+    pub page_lsn: Lsn,
+}
+
 #[derive(Debug, PartialEq, Eq, Clone, Copy)]
 pub struct PagestreamDbSizeRequest {
     pub hdr: PagestreamRequest,
@@ -1639,6 +1717,27 @@ pub struct PagestreamGetPageResponse {
     pub page: Bytes,
 }
 
+/// A GetPage response whose page image is compressed with `algorithm`.
+#[derive(Debug)]
+pub struct PagestreamGetPageCompressedResponse {
+    pub req: PagestreamGetPageRequest,
+    pub algorithm: PagestreamCompressionAlgorithm,
+    pub data: Bytes,
+}
+
+#[derive(Debug)]
+pub struct PagestreamGetPageRangeResponse {
+    pub req: PagestreamGetPageRangeRequest,
+    /// One page image for each block in `req.blkno..req.blkno + req.nblocks`, in block order.
+    pub pages: Vec<Bytes>,
+}
+
+/// Response to a GetPageIfModified request when the client's copy of the page is current.
+#[derive(Debug)]
+pub struct PagestreamNotModifiedResponse {
+    pub req: PagestreamGetPageIfModifiedRequest,
+}
+
 #[derive(Debug)]
 pub struct PagestreamGetSlruSegmentResponse {
     pub req: PagestreamGetSlruSegmentRequest,
@@ -1684,7 +1783,7 @@ pub struct TenantHistorySize {
 
 impl PagestreamFeMessage {
     /// Serialize a compute -> pageserver message. This is currently only used in testing
-    /// tools. Always uses protocol version 3.
+    /// tools. Always uses the V3 message format, which is shared with V4.
     pub fn serialize(&self) -> Bytes {
         let mut bytes = BytesMut::new();
 
@@ -1739,6 +1838,32 @@ pub fn serialize(&self) -> Bytes {
                 bytes.put_u8(req.kind);
                 bytes.put_u32(req.segno);
             }
+
+            Self::GetPageRange(req) => {
+                bytes.put_u8(PagestreamFeMessageTag::GetPageRange as u8);
+                bytes.put_u64(req.hdr.reqid);
+                bytes.put_u64(req.hdr.request_lsn.0);
+                bytes.put_u64(req.hdr.not_modified_since.0);
+                bytes.put_u32(req.rel.spcnode);
+                bytes.put_u32(req.rel.dbnode);
+                bytes.put_u32(req.rel.relnode);
+                bytes.put_u8(req.rel.forknum);
+                bytes.put_u32(req.blkno);
+                bytes.put_u32(req.nblocks);
+            }
+
+            Self::GetPageIfModified(req) => {
+                bytes.put_u8(PagestreamFeMessageTag::GetPageIfModified as u8);
+                bytes.put_u64(req.hdr.reqid);
+                bytes.put_u64(req.hdr.request_lsn.0);
+                bytes.put_u64(req.hdr.not_modified_since.0);
+                bytes.put_u32(req.rel.spcnode);
+                bytes.put_u32(req.rel.dbnode);
+                bytes.put_u32(req.rel.relnode);
+                bytes.put_u8(req.rel.forknum);
+                bytes.put_u32(req.blkno);
+                bytes.put_u64(req.page_lsn.0);
+            }
             #[cfg(feature = "testing")]
             Self::Test(req) => {
                 bytes.put_u8(PagestreamFeMessageTag::Test as u8);
@@ -1770,7 +1895,7 @@ pub fn parse<R: std::io::Read>(
                 Lsn::from(body.read_u64::<BigEndian>()?),
                 Lsn::from(body.read_u64::<BigEndian>()?),
             ),
-            PagestreamProtocolVersion::V3 => (
+            PagestreamProtocolVersion::V3 | PagestreamProtocolVersion::V4 => (
                 body.read_u64::<BigEndian>()?,
                 Lsn::from(body.read_u64::<BigEndian>()?),
                 Lsn::from(body.read_u64::<BigEndian>()?),
@@ -1847,6 +1972,50 @@ pub fn parse<R: std::io::Read>(
                     segno: body.read_u32::<BigEndian>()?,
                 },
             )),
+            PagestreamFeMessageTag::GetPageRange => {
+                if protocol_version != PagestreamProtocolVersion::V4 {
+                    anyhow::bail!("GetPageRange request requires protocol version 4");
+                }
+                Ok(PagestreamFeMessage::GetPageRange(
+                    PagestreamGetPageRangeRequest {
+                        hdr: PagestreamRequest {
+                            reqid,
+                            request_lsn,
+                            not_modified_since,
+                        },
+                        rel: RelTag {
+                            spcnode: body.read_u32::<BigEndian>()?,
+                            dbnode: body.read_u32::<BigEndian>()?,
+                            relnode: body.read_u32::<BigEndian>()?,
+                            forknum: body.read_u8()?,
+                        },
+                        blkno: body.read_u32::<BigEndian>()?,
+                        nblocks: body.read_u32::<BigEndian>()?,
+                    },
+                ))
+            }
+            PagestreamFeMessageTag::GetPageIfModified => {
+                if protocol_version != PagestreamProtocolVersion::V4 {
+                    anyhow::bail!("GetPageIfModified request requires protocol version 4");
+                }
+                Ok(PagestreamFeMessage::GetPageIfModified(
+                    PagestreamGetPageIfModifiedRequest {
+                        hdr: PagestreamRequest {
+                            reqid,
+                            request_lsn,
+                            not_modified_since,
+                        },
+                        rel: RelTag {
+                            spcnode: body.read_u32::<BigEndian>()?,
+                            dbnode: body.read_u32::<BigEndian>()?,
+                            relnode: body.read_u32::<BigEndian>()?,
+                            forknum: body.read_u8()?,
+                        },
+                        blkno: body.read_u32::<BigEndian>()?,
+                        page_lsn: Lsn::from(body.read_u64::<BigEndian>()?),
+                    },
+                ))
+            }
             #[cfg(feature = "testing")]
             PagestreamFeMessageTag::Test => Ok(PagestreamFeMessage::Test(PagestreamTestRequest {
                 hdr: PagestreamRequest {
@@ -1905,6 +2074,27 @@ pub fn serialize(&self, protocol_version: PagestreamProtocolVersion) -> Bytes {
                         bytes.put(&resp.segment[..]);
                     }
 
+                    Self::GetPageRange(resp) => {
+                        // Not reachable in practice: the request is only accepted with V4.
+                        bytes.put_u8(Tag::GetPageRange as u8);
+                        bytes.put_u32(resp.pages.len() as u32);
+                        for page in &resp.pages {
+                            bytes.put(&page[..]);
+                        }
+                    }
+
+                    Self::GetPageCompressed(resp) => {
+                        // Not reachable in practice: compression requires V3 or later.
+                        bytes.put_u8(Tag::GetPageCompressed as u8);
+                        bytes.put_u8(resp.algorithm as u8);
+                        bytes.put(&resp.data[..]);
+                    }
+
+                    Self::NotModified(_) => {
+                        // Not reachable in practice: the request is only accepted with V4.
+                        bytes.put_u8(Tag::NotModified as u8);
+                    }
+
                     #[cfg(feature = "testing")]
                     Self::Test(resp) => {
                         bytes.put_u8(Tag::Test as u8);
@@ -1915,7 +2105,7 @@ pub fn serialize(&self, protocol_version: PagestreamProtocolVersion) -> Bytes {
                     }
                 }
             }
-            PagestreamProtocolVersion::V3 => {
+            PagestreamProtocolVersion::V3 | PagestreamProtocolVersion::V4 => {
                 match self {
                     Self::Exists(resp) => {
                         bytes.put_u8(Tag::Exists as u8);
@@ -1982,6 +2172,49 @@ pub fn serialize(&self, protocol_version: PagestreamProtocolVersion) -> Bytes {
                         bytes.put(&resp.segment[..]);
                     }
 
+                    Self::GetPageRange(resp) => {
+                        bytes.put_u8(Tag::GetPageRange as u8);
+                        bytes.put_u64(resp.req.hdr.reqid);
+                        bytes.put_u64(resp.req.hdr.request_lsn.0);
+                        bytes.put_u64(resp.req.hdr.not_modified_since.0);
+                        bytes.put_u32(resp.req.rel.spcnode);
+                        bytes.put_u32(resp.req.rel.dbnode);
+                        bytes.put_u32(resp.req.rel.relnode);
+                        bytes.put_u8(resp.req.rel.forknum);
+                        bytes.put_u32(resp.req.blkno);
+                        bytes.put_u32(resp.pages.len() as u32);
+                        for page in &resp.pages {
+                            bytes.put(&page[..]);
+                        }
+                    }
+
+                    Self::GetPageCompressed(resp) => {
+                        bytes.put_u8(Tag::GetPageCompressed as u8);
+                        bytes.put_u64(resp.req.hdr.reqid);
+                        bytes.put_u64(resp.req.hdr.request_lsn.0);
+                        bytes.put_u64(resp.req.hdr.not_modified_since.0);
+                        bytes.put_u32(resp.req.rel.spcnode);
+                        bytes.put_u32(resp.req.rel.dbnode);
+                        bytes.put_u32(resp.req.rel.relnode);
+                        bytes.put_u8(resp.req.rel.forknum);
+                        bytes.put_u32(resp.req.blkno);
+                        bytes.put_u8(resp.algorithm as u8);
+                        bytes.put(&resp.data[..]);
+                    }
+
+                    Self::NotModified(resp) => {
+                        bytes.put_u8(Tag::NotModified as u8);
+                        bytes.put_u64(resp.req.hdr.reqid);
+                        bytes.put_u64(resp.req.hdr.request_lsn.0);
+                        bytes.put_u64(resp.req.hdr.not_modified_since.0);
+                        bytes.put_u32(resp.req.rel.spcnode);
+                        bytes.put_u32(resp.req.rel.dbnode);
+                        bytes.put_u32(resp.req.rel.relnode);
+                        bytes.put_u8(resp.req.rel.forknum);
+                        bytes.put_u32(resp.req.blkno);
+                        bytes.put_u64(resp.req.page_lsn.0);
+                    }
+
                     #[cfg(feature = "testing")]
                     Self::Test(resp) => {
                         bytes.put_u8(Tag::Test as u8);
@@ -2135,6 +2368,92 @@ pub fn deserialize(buf: Bytes) -> anyhow::Result<Self> {
                         segment: segment.into(),
                     })
                 }
+                Tag::GetPageRange => {
+                    let reqid = buf.read_u64::<BigEndian>()?;
+                    let request_lsn = Lsn(buf.read_u64::<BigEndian>()?);
+                    let not_modified_since = Lsn(buf.read_u64::<BigEndian>()?);
+                    let rel = RelTag {
+                        spcnode: buf.read_u32::<BigEndian>()?,
+                        dbnode: buf.read_u32::<BigEndian>()?,
+                        relnode: buf.read_u32::<BigEndian>()?,
+                        forknum: buf.read_u8()?,
+                    };
+                    let blkno = buf.read_u32::<BigEndian>()?;
+                    let nblocks = buf.read_u32::<BigEndian>()?;
+                    let mut pages = Vec::with_capacity(nblocks as usize);
+                    for _ in 0..nblocks {
+                        let mut page = vec![0; BLCKSZ as usize];
+                        buf.read_exact(&mut page)?;
+                        pages.push(page.into());
+                    }
+                    Self::GetPageRange(PagestreamGetPageRangeResponse {
+                        req: PagestreamGetPageRangeRequest {
+                            hdr: PagestreamRequest {
+                                reqid,
+                                request_lsn,
+                                not_modified_since,
+                            },
+                            rel,
+                            blkno,
+                            nblocks,
+                        },
+                        pages,
+                    })
+                }
+                Tag::GetPageCompressed => {
+                    let reqid = buf.read_u64::<BigEndian>()?;
+                    let request_lsn = Lsn(buf.read_u64::<BigEndian>()?);
+                    let not_modified_since = Lsn(buf.read_u64::<BigEndian>()?);
+                    let rel = RelTag {
+                        spcnode: buf.read_u32::<BigEndian>()?,
+                        dbnode: buf.read_u32::<BigEndian>()?,
+                        relnode: buf.read_u32::<BigEndian>()?,
+                        forknum: buf.read_u8()?,
+                    };
+                    let blkno = buf.read_u32::<BigEndian>()?;
+                    let algorithm = PagestreamCompressionAlgorithm::try_from(buf.read_u8()?)
+                        .map_err(|algo| anyhow::anyhow!("invalid compression algorithm {algo}"))?;
+                    let mut data = Vec::new();
+                    buf.read_to_end(&mut data)?;
+                    Self::GetPageCompressed(PagestreamGetPageCompressedResponse {
+                        req: PagestreamGetPageRequest {
+                            hdr: PagestreamRequest {
+                                reqid,
+                                request_lsn,
+                                not_modified_since,
+                            },
+                            rel,
+                            blkno,
+                        },
+                        algorithm,
+                        data: data.into(),
+                    })
+                }
+                Tag::NotModified => {
+                    let reqid = buf.read_u64::<BigEndian>()?;
+                    let request_lsn = Lsn(buf.read_u64::<BigEndian>()?);
+                    let not_modified_since = Lsn(buf.read_u64::<BigEndian>()?);
+                    let rel = RelTag {
+                        spcnode: buf.read_u32::<BigEndian>()?,
+                        dbnode: buf.read_u32::<BigEndian>()?,
+                        relnode: buf.read_u32::<BigEndian>()?,
+                        forknum: buf.read_u8()?,
+                    };
+                    let blkno = buf.read_u32::<BigEndian>()?;
+                    let page_lsn = Lsn(buf.read_u64::<BigEndian>()?);
+                    Self::NotModified(PagestreamNotModifiedResponse {
+                        req: PagestreamGetPageIfModifiedRequest {
+                            hdr: PagestreamRequest {
+                                reqid,
+                                request_lsn,
+                                not_modified_since,
+                            },
+                            rel,
+                            blkno,
+                            page_lsn,
+                        },
+                    })
+                }
                 #[cfg(feature = "testing")]
                 Tag::Test => {
                     let reqid = buf.read_u64::<BigEndian>()?;
@@ -2176,6 +2495,9 @@ pub fn kind(&self) -> &'static str {
             Self::Error(_) => "Error",
             Self::DbSize(_) => "DbSize",
             Self::GetSlruSegment(_) => "GetSlruSegment",
+            Self::GetPageRange(_) => "GetPageRange",
+            Self::GetPageCompressed(_) => "GetPageCompressed",
+            Self::NotModified(_) => "NotModified",
             #[cfg(feature = "testing")]
             Self::Test(_) => "Test",
         }
@@ -2268,6 +2590,132 @@ fn test_pagestream() {
         }
     }
 
+    #[test]
+    fn test_pagestream_getpage_range() {
+        let msg = PagestreamFeMessage::GetPageRange(PagestreamGetPageRangeRequest {
+            hdr: PagestreamRequest {
+                reqid: 1,
+                request_lsn: Lsn(4),
+                not_modified_since: Lsn(3),
+            },
+            rel: RelTag {
+                forknum: 1,
+                spcnode: 2,
+                dbnode: 3,
+                relnode: 4,
+            },
+            blkno: 7,
+            nblocks: 3,
+        });
+        let bytes = msg.serialize();
+        let reconstructed =
+            PagestreamFeMessage::parse(&mut bytes.clone().reader(), PagestreamProtocolVersion::V4)
+                .unwrap();
+        assert!(msg == reconstructed);
+
+        // Older protocol versions don't know about the range request
+        assert!(
+            PagestreamFeMessage::parse(&mut bytes.reader(), PagestreamProtocolVersion::V3)
+                .is_err()
+        );
+
+        let PagestreamFeMessage::GetPageRange(req) = msg else {
+            unreachable!()
+        };
+        let pages: Vec<Bytes> = (0..req.nblocks)
+            .map(|i| Bytes::from(vec![i as u8; BLCKSZ as usize]))
+            .collect();
+        let resp = PagestreamBeMessage::GetPageRange(PagestreamGetPageRangeResponse {
+            req,
+            pages: pages.clone(),
+        });
+        let PagestreamBeMessage::GetPageRange(decoded) =
+            PagestreamBeMessage::deserialize(resp.serialize(PagestreamProtocolVersion::V4))
+                .unwrap()
+        else {
+            panic!("unexpected response type");
+        };
+        assert_eq!(decoded.req, req);
+        assert_eq!(decoded.pages, pages);
+    }
+
+    #[test]
+    fn test_pagestream_getpage_compressed() {
+        let req = PagestreamGetPageRequest {
+            hdr: PagestreamRequest {
+                reqid: 1,
+                request_lsn: Lsn(4),
+                not_modified_since: Lsn(3),
+            },
+            rel: RelTag {
+                forknum: 1,
+                spcnode: 2,
+                dbnode: 3,
+                relnode: 4,
+            },
+            blkno: 7,
+        };
+        let data = Bytes::from_static(b"not really zstd");
+        let resp = PagestreamBeMessage::GetPageCompressed(PagestreamGetPageCompressedResponse {
+            req,
+            algorithm: PagestreamCompressionAlgorithm::Zstd,
+            data: data.clone(),
+        });
+        let PagestreamBeMessage::GetPageCompressed(decoded) =
+            PagestreamBeMessage::deserialize(resp.serialize(PagestreamProtocolVersion::V3))
+                .unwrap()
+        else {
+            panic!("unexpected response type");
+        };
+        assert_eq!(decoded.req, req);
+        assert_eq!(decoded.algorithm, PagestreamCompressionAlgorithm::Zstd);
+        assert_eq!(decoded.data, data);
+
+        assert_eq!(
+            PagestreamCompressionAlgorithm::from_str("zstd").unwrap(),
+            PagestreamCompressionAlgorithm::Zstd
+        );
+        assert!(PagestreamCompressionAlgorithm::from_str("lz4").is_err());
+    }
+
+    #[test]
+    fn test_pagestream_getpage_if_modified() {
+        let req = PagestreamGetPageIfModifiedRequest {
+            hdr: PagestreamRequest {
+                reqid: 1,
+                request_lsn: Lsn(4),
+                not_modified_since: Lsn(3),
+            },
+            rel: RelTag {
+                forknum: 0,
+                spcnode: 2,
+                dbnode: 3,
+                relnode: 4,
+            },
+            blkno: 7,
+            page_lsn: Lsn(2),
+        };
+        let msg = PagestreamFeMessage::GetPageIfModified(req);
+        let bytes = msg.serialize();
+        let reconstructed =
+            PagestreamFeMessage::parse(&mut bytes.clone().reader(), PagestreamProtocolVersion::V4)
+                .unwrap();
+        assert!(msg == reconstructed);
+        assert!(
+            PagestreamFeMessage::parse(&mut bytes.reader(), PagestreamProtocolVersion::V3)
+                .is_err()
+        );
+
+        let resp = PagestreamBeMessage::NotModified(PagestreamNotModifiedResponse { req });
+        let PagestreamBeMessage::NotModified(decoded) =
+            PagestreamBeMessage::deserialize(resp.serialize(PagestreamProtocolVersion::V4))
+                .unwrap()
+        else {
+            panic!("unexpected response type");
+        };
+        assert_eq!(decoded.req, req);
+    }
+
     #[test]
     fn test_tenantinfo_serde() {
         // Test serialization/deserialization of TenantInfo
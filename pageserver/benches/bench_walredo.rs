@@ -13,6 +13,13 @@
 //! - `redo_work = ping / short / medium``
 //! - `nclients = [1, 2, 4, 8, 16, 32, 64, 128]`
 //!
+//! The `short_shmem_ring` and `medium_shmem_ring` groups repeat `short` and `medium`
+//! with `walredo_shmem_ring_size` set, to compare the shared memory transport against
+//! the pipes.
+//!
+//! Separately, [`bench_spawn`] measures the latency from launching a new walredo
+//! process to its first redo, with and without `walredo_fork_server`.
+//!
 //! We let `criterion` determine the `n_redos` using `iter_custom`.
 //! The idea is that for each `(redo_work, nclients)` combination,
 //! criterion will run the `bench_impl` multiple times with different `n_redos`.
@@ -73,7 +80,10 @@
 
 fn bench(c: &mut Criterion) {
     macro_rules! bench_group {
-        ($name:expr, $redo_work:expr) => {{
+        ($name:expr, $redo_work:expr) => {
+            bench_group!($name, 0, $redo_work)
+        };
+        ($name:expr, $shmem_ring_size:expr, $redo_work:expr) => {{
             let name: &str = $name;
             let nclients = [1, 2, 4, 8, 16, 32, 64, 128];
             for nclients in nclients {
@@ -82,7 +92,9 @@ macro_rules! bench_group {
                     BenchmarkId::from_parameter(nclients),
                     &nclients,
                     |b, nclients| {
-                        b.iter_custom(|iters| bench_impl($redo_work, iters, *nclients));
+                        b.iter_custom(|iters| {
+                            bench_impl($redo_work, iters, *nclients, $shmem_ring_size)
+                        });
                     },
                 );
             }
@@ -115,19 +127,74 @@ macro_rules! bench_group {
         static REQUEST: Lazy<Request> = Lazy::new(Request::medium_input);
         make_redo_work(&REQUEST)
     });
+    //
+    // the same, over the shared memory ring
+    //
+    let shmem_ring_size = 1024 * 1024;
+    bench_group!("short_shmem_ring", shmem_ring_size, {
+        static REQUEST: Lazy<Request> = Lazy::new(Request::short_input);
+        make_redo_work(&REQUEST)
+    });
+    bench_group!("medium_shmem_ring", shmem_ring_size, {
+        static REQUEST: Lazy<Request> = Lazy::new(Request::medium_input);
+        make_redo_work(&REQUEST)
+    });
 }
-criterion::criterion_group!(benches, bench);
+
+fn bench_spawn(c: &mut Criterion) {
+    static REQUEST: Lazy<Request> = Lazy::new(Request::short_input);
+
+    let mut group = c.benchmark_group("spawn");
+    for fork_server in [false, true] {
+        let repo_dir = camino_tempfile::tempdir_in(env!("CARGO_TARGET_TMPDIR")).unwrap();
+        let mut conf = PageServerConf::dummy_conf(repo_dir.path().to_path_buf());
+        conf.walredo_fork_server = fork_server;
+        let conf: &'static PageServerConf = Box::leak(Box::new(conf));
+
+        let rt = tokio::runtime::Builder::new_multi_thread()
+            .enable_all()
+            .build()
+            .unwrap();
+
+        let name = if fork_server { "fork_server" } else { "exec" };
+        group.bench_function(name, |b| {
+            b.iter_custom(|iters| {
+                rt.block_on(async {
+                    let mut total = Duration::ZERO;
+                    for _ in 0..iters {
+                        let tenant_shard_id = TenantShardId::unsharded(TenantId::generate());
+                        let mgr = PostgresRedoManager::new(conf, tenant_shard_id);
+                        let start = Instant::now();
+                        let page = REQUEST.execute(&mgr).await.unwrap();
+                        total += start.elapsed();
+                        assert_eq!(page.remaining(), 8192);
+                        drop(mgr);
+                    }
+                    total
+                })
+            });
+        });
+    }
+}
+
+criterion::criterion_group!(benches, bench, bench_spawn);
 criterion::criterion_main!(benches);
 
 // Returns the sum of each client's wall-clock time spent executing their share of the n_redos.
-fn bench_impl<F, Fut>(redo_work: Arc<F>, n_redos: u64, nclients: u64) -> Duration
+fn bench_impl<F, Fut>(
+    redo_work: Arc<F>,
+    n_redos: u64,
+    nclients: u64,
+    shmem_ring_size: usize,
+) -> Duration
 where
     F: Fn(Arc<PostgresRedoManager>) -> Fut + Send + Sync + 'static,
     Fut: Future<Output = ()> + Send + 'static,
 {
     let repo_dir = camino_tempfile::tempdir_in(env!("CARGO_TARGET_TMPDIR")).unwrap();
 
-    let conf = PageServerConf::dummy_conf(repo_dir.path().to_path_buf());
+    let mut conf = PageServerConf::dummy_conf(repo_dir.path().to_path_buf());
+    conf.walredo_shmem_ring_size = shmem_ring_size;
     let conf = Box::leak(Box::new(conf));
     let tenant_shard_id = TenantShardId::unsharded(TenantId::generate());
 
@@ -0,0 +1,188 @@
+//! Replay a captured corpus of WAL redo requests through a WAL redo process.
+//!
+//! Unlike `bench_walredo`, which repeats a couple of hard-coded requests, this
+//! replays real requests, so it exercises the same record types and page
+//! access patterns as the workload the corpus was captured from.
+//!
+//! # Capturing a corpus
+//!
+//! Set `walredo_capture_path` in `pageserver.toml` to an absolute path, run a
+//! workload against the pageserver, and make sure the pages actually get
+//! reconstructed, e.g. with a small `shared_buffers` and the local file cache
+//! disabled on the compute. See `pageserver::walredo::corpus` for the format.
+//! `test_runner/regress/test_walredo_capture.py` does exactly that, and keeps the
+//! corpus in its test output directory.
+//!
+//! # Running
+//!
+//! ```text
+//! WALREDO_CORPUS=/path/to/corpus cargo bench --bench bench_walredo_replay
+//! ```
+//!
+//! `WALREDO_REPLAY_PASSES` sets how many times the corpus is replayed (default 3),
+//! and `WALREDO_SHMEM_RING_SIZE`, `WALREDO_INMEM_SMGR_PAGES` and `WALREDO_REDO_SLOTS`
+//! are passed on to the pageserver config. The requests are replayed one at a time, in the order
+//! they were captured, with one WAL redo process per Postgres version. Every
+//! returned page is compared against the captured one.
+//!
+//! The report has the records and pages per second, the latency percentiles of
+//! the requests, the peak and current RSS of the WAL redo processes, and how many
+//! records they applied and skipped because of a later full-page image.
+
+use std::collections::BTreeMap;
+use std::time::{Duration, Instant};
+
+use anyhow::Context;
+use camino::Utf8PathBuf;
+use pageserver::config::PageServerConf;
+use pageserver::walredo::corpus::{read_corpus, CorpusEntry};
+use pageserver::walredo::PostgresRedoManager;
+use pageserver_api::shard::TenantShardId;
+use utils::id::TenantId;
+
+fn env_or<T: std::str::FromStr>(name: &str, default: T) -> anyhow::Result<T>
+where
+    T::Err: std::error::Error + Send + Sync + 'static,
+{
+    match std::env::var(name) {
+        Ok(val) => val.parse().with_context(|| format!("parse {name}")),
+        Err(_) => Ok(default),
+    }
+}
+
+fn main() -> anyhow::Result<()> {
+    let Ok(corpus_path) = std::env::var("WALREDO_CORPUS") else {
+        eprintln!("WALREDO_CORPUS is not set, skipping the walredo replay benchmark");
+        return Ok(());
+    };
+    let corpus = read_corpus(&Utf8PathBuf::from(corpus_path))?;
+    anyhow::ensure!(!corpus.is_empty(), "the corpus is empty");
+    let passes: usize = env_or("WALREDO_REPLAY_PASSES", 3)?;
+
+    let repo_dir = camino_tempfile::tempdir_in(env!("CARGO_TARGET_TMPDIR")).unwrap();
+    let mut conf = PageServerConf::dummy_conf(repo_dir.path().to_path_buf());
+    conf.walredo_shmem_ring_size = env_or("WALREDO_SHMEM_RING_SIZE", 0)?;
+    conf.walredo_inmem_smgr_pages = env_or("WALREDO_INMEM_SMGR_PAGES", 0)?;
+    conf.walredo_redo_slots = env_or("WALREDO_REDO_SLOTS", 1)?;
+    let conf: &'static PageServerConf = Box::leak(Box::new(conf));
+
+    let rt = tokio::runtime::Builder::new_multi_thread()
+        .enable_all()
+        .build()
+        .unwrap();
+    rt.block_on(replay(conf, &corpus, passes))
+}
+
+async fn replay(
+    conf: &'static PageServerConf,
+    corpus: &[CorpusEntry],
+    passes: usize,
+) -> anyhow::Result<()> {
+    let mut managers = BTreeMap::new();
+    for entry in corpus {
+        managers.entry(entry.pg_version).or_insert_with(|| {
+            PostgresRedoManager::new(conf, TenantShardId::unsharded(TenantId::generate()))
+        });
+    }
+
+    // Launch the processes before we start the clock
+    for entry in corpus {
+        execute(&managers[&entry.pg_version], entry).await?;
+    }
+
+    let mut latencies = Vec::with_capacity(corpus.len() * passes);
+    let mut records = 0;
+    let mut mismatches = 0;
+    let started_at = Instant::now();
+    for _ in 0..passes {
+        for entry in corpus {
+            let start = Instant::now();
+            let page = execute(&managers[&entry.pg_version], entry).await?;
+            latencies.push(start.elapsed());
+            records += entry.records.len();
+            if page != entry.page {
+                mismatches += 1;
+            }
+        }
+    }
+    let elapsed = started_at.elapsed();
+
+    latencies.sort();
+    let percentile = |p: f64| latencies[((latencies.len() - 1) as f64 * p) as usize];
+    println!(
+        "replayed {} pages, {} records in {:.3} s",
+        latencies.len(),
+        records,
+        elapsed.as_secs_f64()
+    );
+    println!("records/s: {:.0}", records as f64 / elapsed.as_secs_f64());
+    println!(
+        "pages/s:   {:.0}",
+        latencies.len() as f64 / elapsed.as_secs_f64()
+    );
+    for (name, latency) in [
+        ("p50", percentile(0.50)),
+        ("p90", percentile(0.90)),
+        ("p99", percentile(0.99)),
+        ("p99.9", percentile(0.999)),
+        ("max", *latencies.last().unwrap()),
+    ] {
+        println!("latency {name}: {}", format_latency(latency));
+    }
+    for (pg_version, manager) in &managers {
+        let stats = manager.stats(*pg_version).await?;
+        println!(
+            "walredo v{pg_version}: {} records applied, {} skipped",
+            stats.records_applied, stats.records_skipped
+        );
+        if let Some(process) = manager.status().process {
+            let (hwm, rss) = (
+                read_proc_status_kb(process.pid, "VmHWM"),
+                read_proc_status_kb(process.pid, "VmRSS"),
+            );
+            println!(
+                "walredo v{pg_version} pid {}: peak RSS {} KiB, RSS {} KiB",
+                process.pid,
+                hwm.map_or("?".to_string(), |v| v.to_string()),
+                rss.map_or("?".to_string(), |v| v.to_string()),
+            );
+        }
+    }
+
+    for manager in managers.values() {
+        manager.shutdown().await;
+    }
+    anyhow::ensure!(
+        mismatches == 0,
+        "{mismatches} reconstructed pages differ from the captured ones"
+    );
+    Ok(())
+}
+
+async fn execute(
+    manager: &PostgresRedoManager,
+    entry: &CorpusEntry,
+) -> anyhow::Result<bytes::Bytes> {
+    manager
+        .request_redo(
+            entry.key,
+            entry.lsn,
+            entry.base_img.clone(),
+            entry.records.clone(),
+            entry.pg_version,
+        )
+        .await
+        .with_context(|| format!("request_redo for key {} at {}", entry.key, entry.lsn))
+}
+
+fn format_latency(d: Duration) -> String {
+    format!("{:.1} µs", d.as_secs_f64() * 1e6)
+}
+
+fn read_proc_status_kb(pid: u32, field: &str) -> Option<u64> {
+    let status = std::fs::read_to_string(format!("/proc/{pid}/status")).ok()?;
+    status
+        .lines()
+        .find_map(|line| line.strip_prefix(field)?.strip_prefix(':'))
+        .and_then(|value| value.split_whitespace().next()?.parse().ok())
+}
@@ -193,6 +193,28 @@ pub struct PageServerConf {
     pub page_service_pipelining: pageserver_api::config::PageServicePipeliningConfig,
 
     pub get_vectored_concurrent_io: pageserver_api::config::GetVectoredConcurrentIo,
+
+    /// Size of each of the shared memory rings used to talk to the WAL redo
+    /// processes, or 0 to use only the pipes.
+    pub walredo_shmem_ring_size: usize,
+
+    /// Fork the WAL redo processes from a template process, see
+    /// `walredo::process::fork_server`.
+    pub walredo_fork_server: bool,
+
+    /// Capacity of the in-memory smgr of the WAL redo processes, in pages, or 0
+    /// for their default.
+    pub walredo_inmem_smgr_pages: usize,
+
+    /// Number of redo slots in each WAL redo process, see `walredo::process`.
+    pub walredo_redo_slots: usize,
+
+    /// Keep the postmaster's shared memory sizes in the WAL redo processes, for
+    /// comparison.
+    pub walredo_postmaster_shmem_sizes: bool,
+
+    /// Corpus file to capture the WAL redo requests to, see `walredo::corpus`.
+    pub walredo_capture_path: Option<Utf8PathBuf>,
 }
 
 /// Token for authentication to safekeepers
@@ -355,6 +377,12 @@ pub fn parse_and_validate(
             wal_receiver_protocol,
             page_service_pipelining,
             get_vectored_concurrent_io,
+            walredo_shmem_ring_size,
+            walredo_fork_server,
+            walredo_inmem_smgr_pages,
+            walredo_redo_slots,
+            walredo_postmaster_shmem_sizes,
+            walredo_capture_path,
         } = config_toml;
 
         let mut conf = PageServerConf {
@@ -400,6 +428,12 @@ pub fn parse_and_validate(
             wal_receiver_protocol,
             page_service_pipelining,
             get_vectored_concurrent_io,
+            walredo_shmem_ring_size,
+            walredo_fork_server,
+            walredo_inmem_smgr_pages,
+            walredo_redo_slots,
+            walredo_postmaster_shmem_sizes,
+            walredo_capture_path,
 
             // ------------------------------------------------------------
             // fields that require additional validation or custom handling
@@ -1891,6 +1891,7 @@ pub(crate) fn observe<T>(self, res: &Result<T, QueryError>) {
 
 #[derive(Clone, Copy, enum_map::Enum, IntoStaticStr)]
 pub(crate) enum ComputeCommandKind {
+    PageStreamV4,
     PageStreamV3,
     PageStreamV2,
     Basebackup,
@@ -2484,6 +2485,22 @@ pub(crate) struct WalIngestMetrics {
     .expect("failed to define a metric")
 });
 
+#[rustfmt::skip]
+pub(crate) static WAL_REDO_PROCESS_FIRST_RESPONSE_DURATION_HISTOGRAM: Lazy<Histogram> = Lazy::new(|| {
+    register_histogram!(
+        "pageserver_wal_redo_process_first_response_duration",
+        "Histogram of the time from the start of WalRedoProcess::launch to the first response from the process",
+        vec![
+            0.0002, 0.0004, 0.0006, 0.0008, 0.0010,
+            0.0020, 0.0040, 0.0060, 0.0080, 0.0100,
+            0.0200, 0.0400, 0.0600, 0.0800, 0.1000,
+            0.2000, 0.4000, 0.6000, 0.8000, 1.0000,
+            1.5000, 2.0000, 2.5000, 3.0000, 4.0000, 10.0000
+        ],
+    )
+    .expect("failed to define a metric")
+});
+
 pub(crate) struct WalRedoProcessCounters {
     pub(crate) started: IntCounter,
     pub(crate) killed_by_cause: enum_map::EnumMap<WalRedoKillCause, IntCounter>,
@@ -3954,6 +3971,7 @@ pub fn preinitialize_metrics(conf: &'static PageServerConf) {
         &WAL_REDO_RECORDS_HISTOGRAM,
         &WAL_REDO_BYTES_HISTOGRAM,
         &WAL_REDO_PROCESS_LAUNCH_DURATION_HISTOGRAM,
+        &WAL_REDO_PROCESS_FIRST_RESPONSE_DURATION_HISTOGRAM,
         &PAGE_SERVICE_BATCH_SIZE_GLOBAL,
         &PAGE_SERVICE_SMGR_BATCH_WAIT_TIME_GLOBAL,
     ]
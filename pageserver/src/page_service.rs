@@ -13,11 +13,12 @@
 };
 use pageserver_api::models::{self, TenantState};
 use pageserver_api::models::{
-    PagestreamBeMessage, PagestreamDbSizeRequest, PagestreamDbSizeResponse,
-    PagestreamErrorResponse, PagestreamExistsRequest, PagestreamExistsResponse,
-    PagestreamFeMessage, PagestreamGetPageRequest, PagestreamGetSlruSegmentRequest,
-    PagestreamGetSlruSegmentResponse, PagestreamNblocksRequest, PagestreamNblocksResponse,
-    PagestreamProtocolVersion, PagestreamRequest,
+    PagestreamBeMessage, PagestreamCompressionAlgorithm, PagestreamDbSizeRequest,
+    PagestreamDbSizeResponse, PagestreamErrorResponse, PagestreamExistsRequest,
+    PagestreamExistsResponse, PagestreamFeMessage, PagestreamGetPageCompressedResponse,
+    PagestreamGetPageRequest, PagestreamGetSlruSegmentRequest, PagestreamGetSlruSegmentResponse,
+    PagestreamNblocksRequest, PagestreamNblocksResponse, PagestreamProtocolVersion,
+    PagestreamRequest,
 };
 use pageserver_api::shard::TenantShardId;
 use postgres_backend::{
@@ -72,7 +73,7 @@
 use pageserver_api::models::PageTraceEvent;
 use pageserver_api::reltag::SlruKind;
 use postgres_ffi::pg_constants::DEFAULTTABLESPACE_OID;
-use postgres_ffi::BLCKSZ;
+use postgres_ffi::{page_get_lsn, BLCKSZ};
 
 /// How long we may wait for a [`crate::tenant::mgr::TenantSlot::InProgress`]` and/or a [`crate::tenant::Tenant`] which
 /// is not yet in state [`TenantState::Active`].
@@ -580,6 +581,8 @@ fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
 
 struct BatchedGetPageRequest {
     req: PagestreamGetPageRequest,
+    /// Set for GetPageIfModified requests: the page LSN of the client's copy of the page.
+    if_modified_since: Option<Lsn>,
     timer: SmgrOpTimer,
 }
 
@@ -623,6 +626,13 @@ enum BatchedFeMessage {
         shard: timeline::handle::WeakHandle<TenantManagerTypes>,
         req: models::PagestreamGetSlruSegmentRequest,
     },
+    GetPageRange {
+        span: Span,
+        timer: SmgrOpTimer,
+        shard: timeline::handle::WeakHandle<TenantManagerTypes>,
+        effective_request_lsn: Lsn,
+        req: models::PagestreamGetPageRangeRequest,
+    },
     #[cfg(feature = "testing")]
     Test {
         span: Span,
@@ -641,7 +651,8 @@ fn observe_execution_start(&mut self, at: Instant) {
             BatchedFeMessage::Exists { timer, .. }
             | BatchedFeMessage::Nblocks { timer, .. }
             | BatchedFeMessage::DbSize { timer, .. }
-            | BatchedFeMessage::GetSlruSegment { timer, .. } => {
+            | BatchedFeMessage::GetSlruSegment { timer, .. }
+            | BatchedFeMessage::GetPageRange { timer, .. } => {
                 timer.observe_execution_start(at);
             }
             BatchedFeMessage::GetPage { pages, .. } => {
@@ -752,6 +763,20 @@ async fn pagestream_read_message<IO>(
         let neon_fe_msg =
             PagestreamFeMessage::parse(&mut copy_data_bytes.reader(), protocol_version)?;
 
+        // A GetPageIfModified request is processed like a GetPage request, and can be batched
+        // with them. Only the response differs, see handle_get_page_at_lsn_request_batched.
+        let (neon_fe_msg, if_modified_since) = match neon_fe_msg {
+            PagestreamFeMessage::GetPageIfModified(req) => (
+                PagestreamFeMessage::GetPage(PagestreamGetPageRequest {
+                    hdr: req.hdr,
+                    rel: req.rel,
+                    blkno: req.blkno,
+                }),
+                Some(req.page_lsn),
+            ),
+            msg => (msg, None),
+        };
+
         // TODO: turn in to async closure once available to avoid repeating received_at
         async fn record_op_start_and_throttle(
             shard: &timeline::handle::Handle<TenantManagerTypes>,
@@ -917,9 +942,102 @@ macro_rules! respond_error {
                     span,
                     shard: shard.downgrade(),
                     effective_request_lsn,
-                    pages: smallvec::smallvec![BatchedGetPageRequest { req, timer }],
+                    pages: smallvec::smallvec![BatchedGetPageRequest {
+                        req,
+                        if_modified_since,
+                        timer
+                    }],
                 }
             }
+            PagestreamFeMessage::GetPageRange(req) => {
+                let span = tracing::info_span!(parent: parent_span, "handle_get_page_range_request", rel = %req.rel, blkno = %req.blkno, nblocks = %req.nblocks, req_lsn = %req.hdr.request_lsn);
+
+                macro_rules! respond_error {
+                    ($error:expr) => {{
+                        let error = BatchedFeMessage::RespondError {
+                            span,
+                            error: BatchedPageStreamError {
+                                req: req.hdr,
+                                err: $error,
+                            },
+                        };
+                        Ok(Some(error))
+                    }};
+                }
+
+                if req.nblocks == 0 || req.nblocks > models::PAGESTREAM_MAX_GETPAGE_RANGE_BLOCKS {
+                    return respond_error!(PageStreamError::BadRequest(
+                        format!("invalid number of blocks in range request: {}", req.nblocks)
+                            .into()
+                    ));
+                }
+                let Some(end_blkno) = req.blkno.checked_add(req.nblocks) else {
+                    return respond_error!(PageStreamError::BadRequest(
+                        "block range in range request overflows".into()
+                    ));
+                };
+
+                let key = rel_block_to_key(req.rel, req.blkno);
+                let shard = match timeline_handles
+                    .get(tenant_id, timeline_id, ShardSelector::Page(key))
+                    .instrument(span.clone()) // sets `shard_id` field
+                    .await
+                {
+                    Ok(tl) => tl,
+                    Err(GetActiveTimelineError::Tenant(GetActiveTenantError::NotFound(_))) => {
+                        // See the comment for GetPage above.
+                        return respond_error!(PageStreamError::Reconnect(
+                            "getpage range request routed to wrong shard".into()
+                        ));
+                    }
+                    Err(e) => {
+                        return respond_error!(e.into());
+                    }
+                };
+
+                // The client only sends ranges that don't cross a stripe boundary, so all
+                // blocks must be stored on the shard that holds the first one.
+                let shard_identity = shard.get_shard_identity();
+                if !(req.blkno..end_blkno)
+                    .all(|blkno| shard_identity.is_key_local(&rel_block_to_key(req.rel, blkno)))
+                {
+                    return respond_error!(PageStreamError::BadRequest(
+                        "getpage range request spans multiple shards".into()
+                    ));
+                }
+
+                let timer = record_op_start_and_throttle(
+                    &shard,
+                    metrics::SmgrQueryType::GetPageAtLsn,
+                    received_at,
+                )
+                .await?;
+
+                let effective_request_lsn = match Self::wait_or_get_last_lsn(
+                    &shard,
+                    req.hdr.request_lsn,
+                    req.hdr.not_modified_since,
+                    &shard.get_latest_gc_cutoff_lsn(),
+                    ctx,
+                )
+                .await
+                {
+                    Ok(lsn) => lsn,
+                    Err(e) => {
+                        return respond_error!(e);
+                    }
+                };
+                BatchedFeMessage::GetPageRange {
+                    span,
+                    timer,
+                    shard: shard.downgrade(),
+                    effective_request_lsn,
+                    req,
+                }
+            }
+            PagestreamFeMessage::GetPageIfModified(_) => {
+                unreachable!("converted to GetPage above")
+            }
             #[cfg(feature = "testing")]
             PagestreamFeMessage::Test(req) => {
                 let span = tracing::info_span!(parent: parent_span, "handle_test_request");
@@ -1042,6 +1160,7 @@ fn pagestream_do_batch(
         }
     }
 
+    #[allow(clippy::too_many_arguments)]
     #[instrument(level = tracing::Level::DEBUG, skip_all)]
     async fn pagesteam_handle_batched_message<IO>(
         &mut self,
@@ -1050,6 +1169,7 @@ async fn pagesteam_handle_batched_message<IO>(
         io_concurrency: IoConcurrency,
         cancel: &CancellationToken,
         protocol_version: PagestreamProtocolVersion,
+        mut compressor: Option<&mut PageCompressor>,
         ctx: &RequestContext,
     ) -> Result<(), QueryError>
     where
@@ -1162,6 +1282,30 @@ async fn pagesteam_handle_batched_message<IO>(
                     span,
                 )
             }
+            BatchedFeMessage::GetPageRange {
+                span,
+                timer,
+                shard,
+                effective_request_lsn,
+                req,
+            } => {
+                fail::fail_point!("ps::handle-pagerequest-message::getpage");
+                (
+                    vec![self
+                        .handle_get_page_range_request(
+                            &*shard.upgrade()?,
+                            effective_request_lsn,
+                            &req,
+                            io_concurrency,
+                            ctx,
+                        )
+                        .instrument(span.clone())
+                        .await
+                        .map(|msg| (msg, timer))
+                        .map_err(|err| BatchedPageStreamError { err, req: req.hdr })],
+                    span,
+                )
+            }
             #[cfg(feature = "testing")]
             BatchedFeMessage::Test {
                 span,
@@ -1230,6 +1374,11 @@ async fn pagesteam_handle_batched_message<IO>(
                 Ok((response_msg, timer)) => (response_msg, Some(timer)),
             };
 
+            let response_msg = match compressor.as_deref_mut() {
+                Some(compressor) => compressor.compress_getpage_response(response_msg)?,
+                None => response_msg,
+            };
+
             //
             // marshal & transmit response message
             //
@@ -1303,6 +1452,7 @@ async fn handle_pagerequests<IO>(
         tenant_id: TenantId,
         timeline_id: TimelineId,
         protocol_version: PagestreamProtocolVersion,
+        compression: Option<PagestreamCompressionAlgorithm>,
         ctx: RequestContext,
     ) -> Result<(), QueryError>
     where
@@ -1333,6 +1483,11 @@ async fn handle_pagerequests<IO>(
             },
         );
 
+        let compressor = compression
+            .map(PageCompressor::new)
+            .transpose()
+            .context("create page compressor")?;
+
         let pgb_reader = pgb
             .split()
             .context("implementation error: split pgb into reader and writer")?;
@@ -1354,6 +1509,7 @@ async fn handle_pagerequests<IO>(
                     request_span,
                     pipelining_config,
                     protocol_version,
+                    compressor,
                     io_concurrency,
                     &ctx,
                 )
@@ -1368,6 +1524,7 @@ async fn handle_pagerequests<IO>(
                     timeline_handles,
                     request_span,
                     protocol_version,
+                    compressor,
                     io_concurrency,
                     &ctx,
                 )
@@ -1396,6 +1553,7 @@ async fn handle_pagerequests_serial<IO>(
         mut timeline_handles: TimelineHandles,
         request_span: Span,
         protocol_version: PagestreamProtocolVersion,
+        mut compressor: Option<PageCompressor>,
         io_concurrency: IoConcurrency,
         ctx: &RequestContext,
     ) -> (
@@ -1437,6 +1595,7 @@ async fn handle_pagerequests_serial<IO>(
                     io_concurrency.clone(),
                     &cancel,
                     protocol_version,
+                    compressor.as_mut(),
                     ctx,
                 )
                 .await;
@@ -1462,6 +1621,7 @@ async fn handle_pagerequests_pipelined<IO>(
         request_span: Span,
         pipelining_config: PageServicePipeliningConfigPipelined,
         protocol_version: PagestreamProtocolVersion,
+        mut compressor: Option<PageCompressor>,
         io_concurrency: IoConcurrency,
         ctx: &RequestContext,
     ) -> (
@@ -1609,6 +1769,7 @@ macro_rules! pipeline_stage {
                         io_concurrency.clone(),
                         &cancel,
                         protocol_version,
+                        compressor.as_mut(),
                         &ctx,
                     )
                     .await?;
@@ -1904,13 +2065,28 @@ async fn handle_get_page_at_lsn_request_batched(
                 .zip(results.into_iter())
                 .map(|(req, res)| {
                     res.map(|page| {
-                        (
-                            PagestreamBeMessage::GetPage(models::PagestreamGetPageResponse {
+                        let response = match req.if_modified_since {
+                            // The client's copy of the page is still current: don't send it again.
+                            Some(page_lsn)
+                                if page_lsn != Lsn::INVALID && page_get_lsn(&page) == page_lsn =>
+                            {
+                                PagestreamBeMessage::NotModified(
+                                    models::PagestreamNotModifiedResponse {
+                                        req: models::PagestreamGetPageIfModifiedRequest {
+                                            hdr: req.req.hdr,
+                                            rel: req.req.rel,
+                                            blkno: req.req.blkno,
+                                            page_lsn,
+                                        },
+                                    },
+                                )
+                            }
+                            _ => PagestreamBeMessage::GetPage(models::PagestreamGetPageResponse {
                                 req: req.req,
                                 page,
                             }),
-                            req.timer,
-                        )
+                        };
+                        (response, req.timer)
                     })
                     .map_err(|e| BatchedPageStreamError {
                         err: PageStreamError::from(e),
@@ -1920,6 +2096,56 @@ async fn handle_get_page_at_lsn_request_batched(
         )
     }
 
+    /// Handles a GetPageRange request by looking up all pages of the range with a single
+    /// vectored get. The response carries all page images, so any error fails the whole range.
+    #[instrument(skip_all, fields(shard_id))]
+    async fn handle_get_page_range_request(
+        &mut self,
+        timeline: &Timeline,
+        effective_lsn: Lsn,
+        req: &models::PagestreamGetPageRangeRequest,
+        io_concurrency: IoConcurrency,
+        ctx: &RequestContext,
+    ) -> Result<PagestreamBeMessage, PageStreamError> {
+        let blknos: Vec<u32> = (req.blkno..req.blkno + req.nblocks).collect();
+
+        timeline
+            .query_metrics
+            .observe_getpage_batch_start(blknos.len());
+
+        if let Some(page_trace) = timeline.page_trace.load().as_ref() {
+            let time = SystemTime::now();
+            for blkno in &blknos {
+                let key = rel_block_to_key(req.rel, *blkno).to_compact();
+                // Ignore error (trace buffer may be full or tracer may have disconnected).
+                _ = page_trace.try_send(PageTraceEvent {
+                    key,
+                    effective_lsn,
+                    time,
+                });
+            }
+        }
+
+        let results = timeline
+            .get_rel_page_at_lsn_batched(
+                blknos.iter().map(|blkno| (&req.rel, blkno)),
+                effective_lsn,
+                io_concurrency,
+                ctx,
+            )
+            .await;
+        assert_eq!(results.len(), blknos.len());
+
+        let pages = results
+            .into_iter()
+            .collect::<Result<Vec<_>, _>>()
+            .map_err(PageStreamError::from)?;
+
+        Ok(PagestreamBeMessage::GetPageRange(
+            models::PagestreamGetPageRangeResponse { req: *req, pages },
+        ))
+    }
+
     #[instrument(skip_all, fields(shard_id))]
     async fn handle_get_slru_segment_request(
         &mut self,
@@ -2178,12 +2404,13 @@ struct FullBackupCmd {
     prev_lsn: Option<Lsn>,
 }
 
-/// `pagestream_v2 tenant timeline`
+/// `pagestream_v{2,3,4} tenant timeline [--compression=<algorithm>]`
 #[derive(Debug, Clone, Eq, PartialEq)]
 struct PageStreamCmd {
     tenant_id: TenantId,
     timeline_id: TimelineId,
     protocol_version: PagestreamProtocolVersion,
+    compression: Option<PagestreamCompressionAlgorithm>,
 }
 
 /// `lease lsn tenant timeline lsn`
@@ -2206,7 +2433,7 @@ enum PageServiceCmd {
 impl PageStreamCmd {
     fn parse(query: &str, protocol_version: PagestreamProtocolVersion) -> anyhow::Result<Self> {
         let parameters = query.split_whitespace().collect_vec();
-        if parameters.len() != 2 {
+        if parameters.len() < 2 || parameters.len() > 3 {
             bail!(
                 "invalid number of parameters for pagestream command: {}",
                 query
@@ -2216,10 +2443,24 @@ fn parse(query: &str, protocol_version: PagestreamProtocolVersion) -> anyhow::Re
             .with_context(|| format!("Failed to parse tenant id from {}", parameters[0]))?;
         let timeline_id = TimelineId::from_str(parameters[1])
             .with_context(|| format!("Failed to parse timeline id from {}", parameters[1]))?;
+        let compression = match parameters.get(2) {
+            Some(flag) => {
+                let Some(algorithm) = flag.strip_prefix("--compression=") else {
+                    bail!("invalid flag for pagestream command: {flag}");
+                };
+                // Compressed responses carry the V3 response header.
+                if protocol_version == PagestreamProtocolVersion::V2 {
+                    bail!("compression is not supported with pagestream_v2");
+                }
+                Some(PagestreamCompressionAlgorithm::from_str(algorithm)?)
+            }
+            None => None,
+        };
         Ok(Self {
             tenant_id,
             timeline_id,
             protocol_version,
+            compression,
         })
     }
 }
@@ -2365,6 +2606,10 @@ fn parse(query: &str) -> anyhow::Result<Self> {
                 other,
                 PagestreamProtocolVersion::V3,
             )?)),
+            "pagestream_v4" => Ok(Self::PageStream(PageStreamCmd::parse(
+                other,
+                PagestreamProtocolVersion::V4,
+            )?)),
             "basebackup" => Ok(Self::BaseBackup(BaseBackupCmd::parse(other)?)),
             "fullbackup" => Ok(Self::FullBackup(FullBackupCmd::parse(other)?)),
             "lease" => {
@@ -2447,6 +2692,7 @@ async fn process_query(
                 tenant_id,
                 timeline_id,
                 protocol_version,
+                compression,
             }) => {
                 tracing::Span::current()
                     .record("tenant_id", field::display(tenant_id))
@@ -2456,11 +2702,19 @@ async fn process_query(
                 let command_kind = match protocol_version {
                     PagestreamProtocolVersion::V2 => ComputeCommandKind::PageStreamV2,
                     PagestreamProtocolVersion::V3 => ComputeCommandKind::PageStreamV3,
+                    PagestreamProtocolVersion::V4 => ComputeCommandKind::PageStreamV4,
                 };
                 COMPUTE_COMMANDS_COUNTERS.for_command(command_kind).inc();
 
-                self.handle_pagerequests(pgb, tenant_id, timeline_id, protocol_version, ctx)
-                    .await?;
+                self.handle_pagerequests(
+                    pgb,
+                    tenant_id,
+                    timeline_id,
+                    protocol_version,
+                    compression,
+                    ctx,
+                )
+                .await?;
             }
             PageServiceCmd::BaseBackup(BaseBackupCmd {
                 tenant_id,
@@ -2615,6 +2869,52 @@ fn from(e: crate::tenant::timeline::handle::HandleUpgradeError) -> Self {
     }
 }
 
+/// Compresses the page images of GetPage responses, with the algorithm that the client asked
+/// for in the pagestream command. There is one per connection, so that the compression
+/// context is set up once, rather than for every page.
+struct PageCompressor {
+    algorithm: PagestreamCompressionAlgorithm,
+    zstd: zstd::bulk::Compressor<'static>,
+}
+
+impl PageCompressor {
+    fn new(algorithm: PagestreamCompressionAlgorithm) -> anyhow::Result<Self> {
+        let zstd = match algorithm {
+            // The fastest level, pages are on the critical path
+            PagestreamCompressionAlgorithm::Zstd => zstd::bulk::Compressor::new(1)?,
+        };
+        Ok(Self { algorithm, zstd })
+    }
+
+    /// Compress the page image of a GetPage response. Other responses, and pages that don't
+    /// get any smaller, are returned unchanged.
+    fn compress_getpage_response(
+        &mut self,
+        response_msg: PagestreamBeMessage,
+    ) -> anyhow::Result<PagestreamBeMessage> {
+        let PagestreamBeMessage::GetPage(resp) = response_msg else {
+            return Ok(response_msg);
+        };
+        let compressed = match self.algorithm {
+            PagestreamCompressionAlgorithm::Zstd => self
+                .zstd
+                .compress(&resp.page[..])
+                .context("compress page")?,
+        };
+        if compressed.len() < resp.page.len() {
+            Ok(PagestreamBeMessage::GetPageCompressed(
+                PagestreamGetPageCompressedResponse {
+                    req: resp.req,
+                    algorithm: self.algorithm,
+                    data: compressed.into(),
+                },
+            ))
+        } else {
+            Ok(PagestreamBeMessage::GetPage(resp))
+        }
+    }
+}
+
 fn set_tracing_field_shard_id(timeline: &Timeline) {
     debug_assert_current_span_has_tenant_and_timeline_id_no_shard_id();
     tracing::Span::current().record(
@@ -2649,6 +2949,20 @@ fn pageservice_cmd_parse() {
                 tenant_id,
                 timeline_id,
                 protocol_version: PagestreamProtocolVersion::V2,
+                compression: None,
+            })
+        );
+        let cmd = PageServiceCmd::parse(&format!(
+            "pagestream_v3 {tenant_id} {timeline_id} --compression=zstd"
+        ))
+        .unwrap();
+        assert_eq!(
+            cmd,
+            PageServiceCmd::PageStream(PageStreamCmd {
+                tenant_id,
+                timeline_id,
+                protocol_version: PagestreamProtocolVersion::V3,
+                compression: Some(PagestreamCompressionAlgorithm::Zstd),
             })
         );
         let cmd = PageServiceCmd::parse(&format!("basebackup {tenant_id} {timeline_id}")).unwrap();
@@ -2793,6 +3107,14 @@ fn pageservice_cmd_err_handling() {
         assert!(cmd.is_err());
         let cmd = PageServiceCmd::parse(&format!("pagestream_v2 {tenant_id}xxx {timeline_id}xxx"));
         assert!(cmd.is_err());
+        let cmd = PageServiceCmd::parse(&format!(
+            "pagestream_v2 {tenant_id} {timeline_id} --compression=zstd"
+        ));
+        assert!(cmd.is_err());
+        let cmd = PageServiceCmd::parse(&format!(
+            "pagestream_v3 {tenant_id} {timeline_id} --compression=lz4"
+        ));
+        assert!(cmd.is_err());
         let cmd = PageServiceCmd::parse(&format!(
             "basebackup {tenant_id} {timeline_id} --gzip --gzip"
         ));
@@ -512,6 +512,24 @@ pub async fn request_redo(
         }
     }
 
+    /// Reconstruct many pages at once, see [`PostgresRedoManager::request_redo_batch`].
+    /// Returns the result of each request, in the order of `requests`.
+    ///
+    /// # Cancel-Safety
+    ///
+    /// This method is cancellation-safe.
+    pub async fn request_redo_batch(
+        &self,
+        requests: Vec<walredo::RedoRequest>,
+        pg_version: u32,
+    ) -> Vec<Result<bytes::Bytes, walredo::Error>> {
+        match self {
+            Self::Prod(_, mgr) => mgr.request_redo_batch(requests, pg_version).await,
+            #[cfg(test)]
+            Self::Test(mgr) => mgr.request_redo_batch(requests, pg_version).await,
+        }
+    }
+
     pub(crate) fn status(&self) -> Option<WalRedoManagerStatus> {
         match self {
             WalRedoManager::Prod(_, m) => Some(m.status()),
@@ -5713,6 +5731,24 @@ pub async fn request_redo(
                 Ok(test_img(&s))
             }
         }
+
+        /// # Cancel-Safety
+        ///
+        /// This method is cancellation-safe.
+        pub async fn request_redo_batch(
+            &self,
+            requests: Vec<walredo::RedoRequest>,
+            pg_version: u32,
+        ) -> Vec<Result<Bytes, walredo::Error>> {
+            let mut results = Vec::with_capacity(requests.len());
+            for req in requests {
+                results.push(
+                    self.request_redo(req.key, req.lsn, req.base_img, req.records, pg_version)
+                        .await,
+                );
+            }
+            results
+        }
     }
 }
 
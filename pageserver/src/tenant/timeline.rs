@@ -22,6 +22,7 @@
 use fail::fail_point;
 use futures::{stream::FuturesUnordered, StreamExt};
 use handle::ShardTimelineId;
+use itertools::Either;
 use layer_manager::Shutdown;
 use offload::OffloadError;
 use once_cell::sync::Lazy;
@@ -593,6 +594,14 @@ fn from(_: layer_manager::Shutdown) -> Self {
     }
 }
 
+/// How to reconstruct a value from the base image and WAL records found for it.
+enum ReconstructPlan {
+    /// The base image is the value, there are no WAL records to apply.
+    Image(Bytes),
+    /// The WAL records need to be applied with the WAL redo manager.
+    Redo(walredo::RedoRequest),
+}
+
 impl GetVectoredError {
     #[cfg(test)]
     pub(crate) fn is_missing_key_error(&self) -> bool {
@@ -1194,7 +1203,7 @@ pub(super) async fn get_vectored_impl(
                     let converted = match state.collect_pending_ios().await {
                         Ok(ok) => ok,
                         Err(err) => {
-                            return (key, Err(err));
+                            return (key, Either::Left(Err(err)));
                         }
                     };
                     DELTAS_PER_READ_GLOBAL.observe(converted.num_deltas() as f64);
@@ -1208,17 +1217,33 @@ pub(super) async fn get_vectored_impl(
                         "{converted:?}"
                     );
 
-                    (
-                        key,
-                        walredo_self.reconstruct_value(key, lsn, converted).await,
-                    )
+                    // The pages that can go in a batch to the WAL redo process wait for the
+                    // IOs of the other keys. The rest are reconstructed right away.
+                    let value = match Self::plan_reconstruct(key, lsn, converted) {
+                        Ok(ReconstructPlan::Image(img)) => Ok(img),
+                        Ok(ReconstructPlan::Redo(req)) if req.can_batch() => {
+                            return (key, Either::Right(req));
+                        }
+                        Ok(ReconstructPlan::Redo(req)) => walredo_self.redo_value(req).await,
+                        Err(err) => Err(err),
+                    };
+                    (key, Either::Left(value))
                 }
             });
         }
+        let collected = futs.collect::<Vec<_>>().await;
 
-        let results = futs
-            .collect::<BTreeMap<Key, Result<Bytes, PageReconstructError>>>()
-            .await;
+        let mut results = BTreeMap::new();
+        let mut to_batch = Vec::new();
+        for (key, res) in collected {
+            match res {
+                Either::Left(value) => {
+                    results.insert(key, value);
+                }
+                Either::Right(req) => to_batch.push(req),
+            }
+        }
+        results.extend(self.redo_values(to_batch).await);
 
         // For aux file keys (v1 or v2) the vectored read path does not return an error
         // when they're missing. Instead they are omitted from the resulting btree
@@ -5597,8 +5622,49 @@ async fn reconstruct_value(
         &self,
         key: Key,
         request_lsn: Lsn,
-        mut data: ValueReconstructState,
+        data: ValueReconstructState,
     ) -> Result<Bytes, PageReconstructError> {
+        match Self::plan_reconstruct(key, request_lsn, data)? {
+            ReconstructPlan::Image(img) => Ok(img),
+            ReconstructPlan::Redo(req) => self.redo_value(req).await,
+        }
+    }
+
+    /// Reconstruct the values of a vectored read that need Postgres WAL redo.
+    ///
+    /// They are sent to the WAL redo manager as one batch, so that they cost a single
+    /// round trip to the WAL redo process, see [`super::WalRedoManager::request_redo_batch`].
+    async fn redo_values(
+        &self,
+        requests: Vec<walredo::RedoRequest>,
+    ) -> Vec<(Key, Result<Bytes, PageReconstructError>)> {
+        let walredo_mgr = match self.walredo_mgr.as_ref() {
+            Some(walredo_mgr) if requests.len() > 1 => walredo_mgr,
+            _ => {
+                let mut results = Vec::with_capacity(requests.len());
+                for req in requests {
+                    results.push((req.key, self.redo_value(req).await));
+                }
+                return results;
+            }
+        };
+
+        let keys = requests.iter().map(|req| req.key).collect::<Vec<_>>();
+        let results = walredo_mgr
+            .request_redo_batch(requests, self.pg_version)
+            .await;
+        keys.into_iter()
+            .zip(results.into_iter().map(Self::map_redo_result))
+            .collect()
+    }
+
+    /// Check the base image and WAL records in 'data', and work out whether the value
+    /// needs WAL redo.
+    fn plan_reconstruct(
+        key: Key,
+        request_lsn: Lsn,
+        mut data: ValueReconstructState,
+    ) -> Result<ReconstructPlan, PageReconstructError> {
         // Perform WAL redo if needed
         data.records.reverse();
 
@@ -5611,7 +5677,7 @@ async fn reconstruct_value(
                     img_lsn,
                     request_lsn,
                 );
-                Ok(img.clone())
+                Ok(ReconstructPlan::Image(img.clone()))
             } else {
                 Err(PageReconstructError::from(anyhow!(
                     "base image for {key} at {request_lsn} not found"
@@ -5640,27 +5706,38 @@ async fn reconstruct_value(
                 } else {
                     trace!("found {} WAL records that will init the page for {} at {}, performing WAL redo", data.records.len(), key, request_lsn);
                 };
-                let res = self
-                    .walredo_mgr
-                    .as_ref()
-                    .context("timeline has no walredo manager")
-                    .map_err(PageReconstructError::WalRedo)?
-                    .request_redo(key, request_lsn, data.img, data.records, self.pg_version)
-                    .await;
-                let img = match res {
-                    Ok(img) => img,
-                    Err(walredo::Error::Cancelled) => return Err(PageReconstructError::Cancelled),
-                    Err(walredo::Error::Other(e)) => {
-                        return Err(PageReconstructError::WalRedo(
-                            e.context("reconstruct a page image"),
-                        ))
-                    }
-                };
-                Ok(img)
+                Ok(ReconstructPlan::Redo(walredo::RedoRequest {
+                    key,
+                    lsn: request_lsn,
+                    base_img: data.img,
+                    records: data.records,
+                }))
             }
         }
     }
 
+    /// Reconstruct a single value with the WAL redo manager.
+    async fn redo_value(&self, req: walredo::RedoRequest) -> Result<Bytes, PageReconstructError> {
+        let res = self
+            .walredo_mgr
+            .as_ref()
+            .context("timeline has no walredo manager")
+            .map_err(PageReconstructError::WalRedo)?
+            .request_redo(req.key, req.lsn, req.base_img, req.records, self.pg_version)
+            .await;
+        Self::map_redo_result(res)
+    }
+
+    fn map_redo_result(res: Result<Bytes, walredo::Error>) -> Result<Bytes, PageReconstructError> {
+        match res {
+            Ok(img) => Ok(img),
+            Err(walredo::Error::Cancelled) => Err(PageReconstructError::Cancelled),
+            Err(walredo::Error::Other(e)) => Err(PageReconstructError::WalRedo(
+                e.context("reconstruct a page image"),
+            )),
+        }
+    }
+
     pub(crate) async fn spawn_download_all_remote_layers(
         self: Arc<Self>,
         request: DownloadRemoteLayersTaskSpawnRequest,
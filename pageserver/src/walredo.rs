@@ -24,6 +24,9 @@
 /// Code to apply [`NeonWalRecord`]s.
 pub(crate) mod apply_neon;
 
+/// Capture of redo requests for benchmarking.
+pub mod corpus;
+
 use crate::config::PageServerConf;
 use crate::metrics::{
     WAL_REDO_BYTES_HISTOGRAM, WAL_REDO_PROCESS_LAUNCH_DURATION_HISTOGRAM,
@@ -98,6 +101,9 @@ pub struct PostgresRedoManager {
     /// We could simplify this by getting rid of the [`Arc`].
     /// See the comment on [`Self::redo_process`] for more details.
     launched_processes: utils::sync::gate::Gate,
+
+    /// Where to capture the reconstructed pages to, if `walredo_capture_path` is set.
+    capture: Option<corpus::CorpusWriter>,
 }
 
 /// See [`PostgresRedoManager::redo_process`].
@@ -121,6 +127,36 @@ fn deref(&self) -> &Self::Target {
     }
 }
 
+/// One page to reconstruct with [`PostgresRedoManager::request_redo_batch`].
+pub struct RedoRequest {
+    pub key: Key,
+    pub lsn: Lsn,
+    pub base_img: Option<(Lsn, Bytes)>,
+    pub records: Vec<(Lsn, NeonWalRecord)>,
+}
+
+impl RedoRequest {
+    /// Can the page be reconstructed as part of a batch to the WAL redo process?
+    /// That's the case if all the records are Postgres records.
+    pub fn can_batch(&self) -> bool {
+        !self.records.is_empty()
+            && self
+                .records
+                .iter()
+                .all(|(_, rec)| matches!(rec, NeonWalRecord::Postgres { .. }))
+    }
+}
+
+/// Counters of a WAL redo process, see [`PostgresRedoManager::stats`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct WalRedoStats {
+    /// Records that were replayed.
+    pub records_applied: u64,
+    /// Records that were not replayed, because they were the only record of a
+    /// request, and had a full-page image of the page that was restored instead.
+    pub records_skipped: u64,
+}
+
 #[derive(Debug, thiserror::Error)]
 pub enum Error {
     #[error("cancelled")]
@@ -205,6 +241,70 @@ pub async fn request_redo(
         }
     }
 
+    /// Reconstruct many pages at once. Returns the result of each request, in the
+    /// order of `requests`.
+    ///
+    /// The requests that [can be batched](RedoRequest::can_batch) are sent to the
+    /// WAL redo process as one batch, which saves a round trip per page. The rest
+    /// are handled like [`Self::request_redo`] does, concurrently with the batch.
+    /// If the batch fails as a whole, its requests are retried one by one, so that
+    /// only the pages that can't be reconstructed get an error.
+    ///
+    /// # Cancel-Safety
+    ///
+    /// This method is cancellation-safe.
+    pub async fn request_redo_batch(
+        &self,
+        requests: Vec<RedoRequest>,
+        pg_version: u32,
+    ) -> Vec<Result<Bytes, Error>> {
+        let (batch, rest): (Vec<_>, Vec<_>) = requests
+            .into_iter()
+            .enumerate()
+            .partition(|(_, req)| req.can_batch());
+
+        let redo_one = |(i, req): (usize, RedoRequest)| async move {
+            let res = self
+                .request_redo(req.key, req.lsn, req.base_img, req.records, pg_version)
+                .await;
+            (i, res)
+        };
+        let redo_batch = async {
+            if batch.is_empty() {
+                return Vec::new();
+            }
+            let (indexes, batch): (Vec<_>, Vec<_>) = batch.into_iter().unzip();
+            match self.apply_batch_postgres_multi(&batch, pg_version).await {
+                Ok(pages) => indexes.into_iter().zip(pages.into_iter().map(Ok)).collect(),
+                Err(Error::Cancelled) => indexes
+                    .into_iter()
+                    .map(|i| (i, Err(Error::Cancelled)))
+                    .collect(),
+                Err(Error::Other(e)) => {
+                    warn!(
+                        "batched WAL redo of {} pages failed, retrying page by page: {e:#}",
+                        batch.len()
+                    );
+                    // One at a time, so that a request that brings the process down
+                    // doesn't take the others with it
+                    let mut results = Vec::with_capacity(batch.len());
+                    for item in indexes.into_iter().zip(batch) {
+                        results.push(redo_one(item).await);
+                    }
+                    results
+                }
+            }
+        };
+        let (batch_results, rest_results) = tokio::join!(
+            redo_batch,
+            futures::future::join_all(rest.into_iter().map(redo_one))
+        );
+
+        let mut results: Vec<_> = batch_results.into_iter().chain(rest_results).collect();
+        results.sort_unstable_by_key(|(i, _)| *i);
+        results.into_iter().map(|(_, res)| res).collect()
+    }
+
     /// Do a ping request-response roundtrip.
     ///
     /// Not used in production, but by Rust benchmarks.
@@ -221,6 +321,20 @@ pub async fn ping(&self, pg_version: u32) -> Result<(), Error> {
         .await
     }
 
+    /// Get the counters of the WAL redo process, launching it if needed.
+    ///
+    /// # Cancel-Safety
+    ///
+    /// This method is cancellation-safe.
+    pub async fn stats(&self, pg_version: u32) -> Result<WalRedoStats, Error> {
+        self.do_with_walredo_process(pg_version, |proc| async move {
+            proc.get_stats(Duration::from_secs(1))
+                .await
+                .map_err(Error::Other)
+        })
+        .await
+    }
+
     pub fn status(&self) -> WalRedoManagerStatus {
         WalRedoManagerStatus {
             last_redo_at: {
@@ -247,6 +361,11 @@ pub fn new(
         conf: &'static PageServerConf,
         tenant_shard_id: TenantShardId,
     ) -> PostgresRedoManager {
+        let capture = conf.walredo_capture_path.as_ref().and_then(|path| {
+            corpus::CorpusWriter::open(path)
+                .inspect_err(|e| warn!("not capturing walredo requests: {e:#}"))
+                .ok()
+        });
         // The actual process is launched lazily, on first request.
         PostgresRedoManager {
             tenant_shard_id,
@@ -254,6 +373,34 @@ pub fn new(
             last_redo_at: std::sync::Mutex::default(),
             redo_process: heavier_once_cell::OnceCell::default(),
             launched_processes: utils::sync::gate::Gate::default(),
+            capture,
+        }
+    }
+
+    /// Append a page reconstructed by the walredo process to the capture file,
+    /// if capturing is enabled.
+    fn capture(
+        &self,
+        pg_version: u32,
+        key: Key,
+        lsn: Lsn,
+        base_img: Option<(Lsn, Bytes)>,
+        records: &[(Lsn, NeonWalRecord)],
+        page: &Bytes,
+    ) {
+        let Some(capture) = &self.capture else {
+            return;
+        };
+        let entry = corpus::CorpusEntry {
+            pg_version,
+            key,
+            lsn,
+            base_img,
+            records: records.to_vec(),
+            page: page.clone(),
+        };
+        if let Err(e) = capture.append(&entry) {
+            warn!("failed to capture walredo request: {e:#}");
         }
     }
 
@@ -348,6 +495,7 @@ async fn do_with_walredo_process<
                         self.tenant_shard_id,
                         pg_version,
                     )
+                    .await
                     .context("launch walredo process")?,
                     _launched_processes_guard,
                 });
@@ -486,6 +634,99 @@ async fn apply_batch_postgres(
             }
             n_attempts += 1;
             if n_attempts > MAX_RETRY_ATTEMPTS || result.is_ok() {
+                if let Ok(page) = &result {
+                    self.capture(
+                        pg_version,
+                        key,
+                        lsn,
+                        base_img.clone().map(|img| (base_img_lsn, img)),
+                        records,
+                        page,
+                    );
+                }
+                return result;
+            }
+        }
+    }
+
+    ///
+    /// Process the requests with one batch request to wal-redo postgres
+    ///
+    /// # Cancel-Safety
+    ///
+    /// Cancellation safe.
+    async fn apply_batch_postgres_multi(
+        &self,
+        requests: &[RedoRequest],
+        pg_version: u32,
+    ) -> Result<Vec<Bytes>, Error> {
+        *(self.last_redo_at.lock().unwrap()) = Some(Instant::now());
+
+        let mut jobs = Vec::with_capacity(requests.len());
+        for req in requests {
+            let (rel, blknum) = req.key.to_rel_block().context("invalid record")?;
+            jobs.push(process::RedoJob {
+                rel,
+                blknum,
+                base_img: req.base_img.as_ref().map(|(_, img)| img),
+                records: &req.records,
+            });
+        }
+        let jobs = &jobs;
+
+        const MAX_RETRY_ATTEMPTS: u32 = 1;
+        let mut n_attempts = 0u32;
+        loop {
+            let closure = |proc: Arc<Process>| async move {
+                let started_at = std::time::Instant::now();
+
+                let result = proc
+                    .apply_wal_records_batch(jobs, self.conf.wal_redo_timeout)
+                    .await
+                    .context("apply_wal_records_batch");
+
+                let duration = started_at.elapsed();
+                WAL_REDO_TIME.observe(duration.as_secs_f64());
+                for job in jobs.iter() {
+                    WAL_REDO_RECORDS_HISTOGRAM.observe(job.records.len() as f64);
+                }
+
+                debug!(
+                    "postgres reconstructed {} pages in {} us",
+                    jobs.len(),
+                    duration.as_micros(),
+                );
+
+                if let Err(e) = result.as_ref() {
+                    error!(
+                        "error reconstructing a batch of {} pages n_attempts={}: {:?}",
+                        jobs.len(),
+                        n_attempts,
+                        e,
+                    );
+                }
+
+                result.map_err(Error::Other)
+            };
+            let result = self.do_with_walredo_process(pg_version, closure).await;
+
+            if result.is_ok() && n_attempts != 0 {
+                info!(n_attempts, "retried walredo succeeded");
+            }
+            n_attempts += 1;
+            if n_attempts > MAX_RETRY_ATTEMPTS || result.is_ok() {
+                if let Ok(pages) = &result {
+                    for (req, page) in requests.iter().zip(pages) {
+                        self.capture(
+                            pg_version,
+                            req.key,
+                            req.lsn,
+                            req.base_img.clone(),
+                            &req.records,
+                            page,
+                        );
+                    }
+                }
                 return result;
             }
         }
@@ -547,7 +788,7 @@ fn apply_record_neon(
 
 #[cfg(test)]
 mod tests {
-    use super::PostgresRedoManager;
+    use super::{PostgresRedoManager, RedoRequest, WalRedoStats};
     use crate::config::PageServerConf;
     use bytes::Bytes;
     use pageserver_api::key::Key;
@@ -597,6 +838,96 @@ async fn short_v14_redo() {
         assert_eq!(&expected, &*page);
     }
 
+    #[tokio::test]
+    async fn short_v14_redo_stats() {
+        let h = RedoHarness::new().unwrap();
+
+        for i in 1..=2 {
+            h.manager
+                .request_redo(
+                    Key {
+                        field1: 0,
+                        field2: 1663,
+                        field3: 13010,
+                        field4: 1259,
+                        field5: 0,
+                        field6: 0,
+                    },
+                    Lsn::from_str("0/16E2408").unwrap(),
+                    None,
+                    short_records(),
+                    14,
+                )
+                .instrument(h.span())
+                .await
+                .unwrap();
+
+            // neither of the short records has a full-page image
+            let stats = h.manager.stats(14).instrument(h.span()).await.unwrap();
+            assert_eq!(
+                stats,
+                WalRedoStats {
+                    records_applied: 2 * i,
+                    records_skipped: 0,
+                }
+            );
+        }
+    }
+
+    #[tokio::test]
+    async fn fpi_v14_redo_stats() {
+        let h = RedoHarness::new().unwrap();
+
+        let lsn = Lsn::from_str("0/16E2408").unwrap();
+        let mut image = std::fs::read("test_data/short_v14_redo.page").unwrap();
+        // pd_lsn, redo of the record sets it
+        image[0..4].copy_from_slice(&((lsn.0 >> 32) as u32).to_le_bytes());
+        image[4..8].copy_from_slice(&(lsn.0 as u32).to_le_bytes());
+        let fpi = (
+            lsn,
+            NeonWalRecord::Postgres {
+                will_init: true,
+                rec: fpi_v14_record(&image),
+            },
+        );
+
+        // The image alone is restored without redo
+        let page = h
+            .manager
+            .request_redo(short_key(), lsn, None, vec![fpi.clone()], 14)
+            .instrument(h.span())
+            .await
+            .unwrap();
+        assert_eq!(&image, &*page);
+        let stats = h.manager.stats(14).instrument(h.span()).await.unwrap();
+        assert_eq!(
+            stats,
+            WalRedoStats {
+                records_applied: 0,
+                records_skipped: 1,
+            }
+        );
+
+        // After other records, it's replayed, with the same result
+        let mut records = short_records();
+        records.push(fpi);
+        let page = h
+            .manager
+            .request_redo(short_key(), lsn, None, records, 14)
+            .instrument(h.span())
+            .await
+            .unwrap();
+        assert_eq!(&image, &*page);
+        let stats = h.manager.stats(14).instrument(h.span()).await.unwrap();
+        assert_eq!(
+            stats,
+            WalRedoStats {
+                records_applied: 3,
+                records_skipped: 1,
+            }
+        );
+    }
+
     #[tokio::test]
     async fn short_v14_fails_for_wrong_key_but_returns_zero_page() {
         let h = RedoHarness::new().unwrap();
@@ -627,6 +958,244 @@ async fn short_v14_fails_for_wrong_key_but_returns_zero_page() {
         assert_eq!(page, crate::ZERO_PAGE);
     }
 
+    #[tokio::test]
+    async fn short_v14_redo_batch() {
+        let expected = std::fs::read("test_data/short_v14_redo.page").unwrap();
+
+        let h = RedoHarness::new().unwrap();
+
+        let request = |field3| RedoRequest {
+            key: Key {
+                field1: 0,
+                field2: 1663,
+                field3,
+                field4: 1259,
+                field5: 0,
+                field6: 0,
+            },
+            lsn: Lsn::from_str("0/16E2408").unwrap(),
+            base_img: None,
+            records: short_records(),
+        };
+
+        // The middle one has the wrong key, so it comes back as a zero page,
+        // without affecting the others
+        let pages = h
+            .manager
+            .request_redo_batch(vec![request(13010), request(13130), request(13010)], 14)
+            .instrument(h.span())
+            .await
+            .into_iter()
+            .collect::<Result<Vec<_>, _>>()
+            .unwrap();
+
+        assert_eq!(pages.len(), 3);
+        assert_eq!(&expected, &*pages[0]);
+        assert_eq!(pages[1], crate::ZERO_PAGE);
+        assert_eq!(&expected, &*pages[2]);
+    }
+
+    #[tokio::test]
+    async fn short_v14_redo_batch_bad_request() {
+        let expected = std::fs::read("test_data/short_v14_redo.page").unwrap();
+
+        let h = RedoHarness::new().unwrap();
+
+        let request = |records| RedoRequest {
+            key: short_key(),
+            lsn: Lsn::from_str("0/16E2408").unwrap(),
+            base_img: None,
+            records,
+        };
+        let mut bad_records = short_records();
+        if let NeonWalRecord::Postgres { rec, .. } = &mut bad_records[1].1 {
+            *rec = rec.slice(..100);
+        }
+
+        // The truncated record fails the batch, and then only its own request
+        let results = h
+            .manager
+            .request_redo_batch(
+                vec![
+                    request(short_records()),
+                    request(bad_records),
+                    request(short_records()),
+                ],
+                14,
+            )
+            .instrument(h.span())
+            .await;
+
+        assert_eq!(results.len(), 3);
+        assert_eq!(&expected[..], &results[0].as_ref().unwrap()[..]);
+        assert!(results[1].is_err());
+        assert_eq!(&expected[..], &results[2].as_ref().unwrap()[..]);
+    }
+
+    #[tokio::test]
+    async fn short_v14_redo_shmem_ring() {
+        let expected = std::fs::read("test_data/short_v14_redo.page").unwrap();
+
+        // Small enough that the requests and responses have to wrap around, and
+        // the ones that don't fit go through the pipes.
+        let h = RedoHarness::with_conf(|conf| conf.walredo_shmem_ring_size = 20000).unwrap();
+
+        for _ in 0..5 {
+            let page = h
+                .manager
+                .request_redo(
+                    Key {
+                        field1: 0,
+                        field2: 1663,
+                        field3: 13010,
+                        field4: 1259,
+                        field5: 0,
+                        field6: 0,
+                    },
+                    Lsn::from_str("0/16E2408").unwrap(),
+                    None,
+                    short_records(),
+                    14,
+                )
+                .instrument(h.span())
+                .await
+                .unwrap();
+            assert_eq!(&expected, &*page);
+        }
+
+        // 3 pages don't fit in the response ring
+        let request = || RedoRequest {
+            key: Key {
+                field1: 0,
+                field2: 1663,
+                field3: 13010,
+                field4: 1259,
+                field5: 0,
+                field6: 0,
+            },
+            lsn: Lsn::from_str("0/16E2408").unwrap(),
+            base_img: None,
+            records: short_records(),
+        };
+        let pages = h
+            .manager
+            .request_redo_batch(vec![request(), request(), request()], 14)
+            .instrument(h.span())
+            .await
+            .into_iter()
+            .collect::<Result<Vec<_>, _>>()
+            .unwrap();
+        assert_eq!(pages.len(), 3);
+        for page in pages {
+            assert_eq!(&expected, &*page);
+        }
+    }
+
+    #[cfg(target_os = "linux")]
+    #[tokio::test]
+    async fn short_v14_redo_fork_server() {
+        let expected = std::fs::read("test_data/short_v14_redo.page").unwrap();
+
+        for shmem_ring_size in [0, 1024 * 1024] {
+            let h = RedoHarness::with_conf(|conf| {
+                conf.walredo_fork_server = true;
+                conf.walredo_shmem_ring_size = shmem_ring_size;
+            })
+            .unwrap();
+
+            let page = h
+                .manager
+                .request_redo(
+                    Key {
+                        field1: 0,
+                        field2: 1663,
+                        field3: 13010,
+                        field4: 1259,
+                        field5: 0,
+                        field6: 0,
+                    },
+                    Lsn::from_str("0/16E2408").unwrap(),
+                    None,
+                    short_records(),
+                    14,
+                )
+                .instrument(h.span())
+                .await
+                .unwrap();
+            assert_eq!(&expected, &*page);
+        }
+    }
+
+    #[tokio::test]
+    async fn short_v14_redo_inmem_smgr_pages() {
+        let expected = std::fs::read("test_data/short_v14_redo.page").unwrap();
+
+        let h = RedoHarness::with_conf(|conf| conf.walredo_inmem_smgr_pages = 4096).unwrap();
+
+        let page = h
+            .manager
+            .request_redo(
+                Key {
+                    field1: 0,
+                    field2: 1663,
+                    field3: 13010,
+                    field4: 1259,
+                    field5: 0,
+                    field6: 0,
+                },
+                Lsn::from_str("0/16E2408").unwrap(),
+                None,
+                short_records(),
+                14,
+            )
+            .instrument(h.span())
+            .await
+            .unwrap();
+        assert_eq!(&expected, &*page);
+    }
+
+    #[tokio::test]
+    async fn short_v14_redo_slots() {
+        let expected = std::fs::read("test_data/short_v14_redo.page").unwrap();
+
+        let h = RedoHarness::with_conf(|conf| conf.walredo_redo_slots = 4).unwrap();
+
+        // The first record initializes the page, so repeating the records gives the
+        // same page. With enough of them, they're sent in several chunks, and the
+        // other requests' messages go in between.
+        let long_records: Vec<_> = std::iter::repeat_with(short_records)
+            .take(100)
+            .flatten()
+            .collect();
+
+        let pages = futures::future::join_all((0..8).map(|i| {
+            h.manager
+                .request_redo(
+                    Key {
+                        field1: 0,
+                        field2: 1663,
+                        field3: 13010,
+                        field4: 1259,
+                        field5: 0,
+                        field6: 0,
+                    },
+                    Lsn::from_str("0/16E2408").unwrap(),
+                    None,
+                    if i % 2 == 0 {
+                        short_records()
+                    } else {
+                        long_records.clone()
+                    },
+                    14,
+                )
+                .instrument(h.span())
+        }))
+        .await;
+        for page in pages {
+            assert_eq!(&expected, &*page.unwrap());
+        }
+    }
+
     #[tokio::test]
     async fn test_stderr() {
         let h = RedoHarness::new().unwrap();
@@ -644,6 +1213,54 @@ async fn test_stderr() {
             .unwrap_err();
     }
 
+    /// The page of [`short_records`].
+    fn short_key() -> Key {
+        Key {
+            field1: 0,
+            field2: 1663,
+            field3: 13010,
+            field4: 1259,
+            field5: 0,
+            field6: 0,
+        }
+    }
+
+    /// A v14 XLOG_FPI record with `image` as the full-page image of [`short_key`].
+    fn fpi_v14_record(image: &[u8]) -> Bytes {
+        use bytes::BufMut;
+        use postgres_ffi::pg_constants;
+
+        let mut rec = Vec::new();
+        // XLogRecord, with xl_tot_len and xl_crc filled in below
+        rec.put_u32_le(0);
+        rec.put_u32_le(0); // xl_xid
+        rec.put_u64_le(0); // xl_prev
+        rec.put_u8(pg_constants::XLOG_FPI);
+        rec.put_u8(pg_constants::RM_XLOG_ID);
+        rec.put_u16_le(0);
+        rec.put_u32_le(0);
+        // XLogRecordBlockHeader of block 0 in the main fork, without data
+        rec.put_u8(0);
+        rec.put_u8(pg_constants::BKPBLOCK_HAS_IMAGE);
+        rec.put_u16_le(0);
+        // XLogRecordBlockImageHeader: the whole page, without a hole
+        rec.put_u16_le(image.len() as u16);
+        rec.put_u16_le(0);
+        rec.put_u8(postgres_ffi::v14::bindings::BKPIMAGE_APPLY);
+        // RelFileNode and block number
+        rec.put_u32_le(1663);
+        rec.put_u32_le(13010);
+        rec.put_u32_le(1259);
+        rec.put_u32_le(0);
+        rec.put_slice(image);
+
+        let tot_len = rec.len() as u32;
+        rec[0..4].copy_from_slice(&tot_len.to_le_bytes());
+        let crc = crc32c::crc32c_append(crc32c::crc32c(&rec[24..]), &rec[..20]);
+        rec[20..24].copy_from_slice(&crc.to_le_bytes());
+        Bytes::from(rec)
+    }
+
     #[allow(clippy::octal_escapes)]
     fn short_records() -> Vec<(Lsn, NeonWalRecord)> {
         vec![
@@ -673,10 +1290,14 @@ struct RedoHarness {
 
     impl RedoHarness {
         fn new() -> anyhow::Result<Self> {
+            Self::with_conf(|_| {})
+        }
+        fn with_conf(configure: impl FnOnce(&mut PageServerConf)) -> anyhow::Result<Self> {
             crate::tenant::harness::setup_logging();
 
             let repo_dir = camino_tempfile::tempdir()?;
-            let conf = PageServerConf::dummy_conf(repo_dir.path().to_path_buf());
+            let mut conf = PageServerConf::dummy_conf(repo_dir.path().to_path_buf());
+            configure(&mut conf);
             let conf = Box::leak(Box::new(conf));
             let tenant_shard_id = TenantShardId::unsharded(TenantId::generate());
 
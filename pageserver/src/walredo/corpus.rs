@@ -0,0 +1,168 @@
+//! Capture of WAL redo requests, to replay them in benchmarks.
+//!
+//! With `walredo_capture_path` set, every page that is reconstructed by a WAL redo
+//! process is appended to a corpus file at that path, along with the base image and
+//! the Postgres WAL records that went into it. The `bench_walredo_replay` benchmark
+//! replays such a corpus, and checks that it produces the same pages again.
+//!
+//! Pages that are reconstructed purely by [`super::apply_neon`] never reach the WAL
+//! redo process, so they are not captured.
+//!
+//! The entries are written by a dedicated thread, so that capturing doesn't block the
+//! async redo path on file I/O. If the thread falls behind by more than
+//! [`CAPTURE_QUEUE_LEN`] entries, further entries are dropped until it catches up.
+//!
+//! The file is a sequence of entries, each a big-endian u32 length followed by a
+//! [`CorpusEntry`] serialized with [`BeSer`].
+
+use std::fs::{File, OpenOptions};
+use std::io::{BufReader, ErrorKind, Read, Write};
+use std::sync::mpsc::{self, SyncSender, TrySendError};
+use std::thread::JoinHandle;
+
+use anyhow::Context;
+use bytes::Bytes;
+use camino::Utf8Path;
+use pageserver_api::key::Key;
+use pageserver_api::record::NeonWalRecord;
+use serde::{Deserialize, Serialize};
+use tracing::warn;
+use utils::bin_ser::BeSer;
+use utils::lsn::Lsn;
+
+/// One reconstructed page.
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+pub struct CorpusEntry {
+    pub pg_version: u32,
+    pub key: Key,
+    pub lsn: Lsn,
+    pub base_img: Option<(Lsn, Bytes)>,
+    pub records: Vec<(Lsn, NeonWalRecord)>,
+    /// The page that the WAL redo process returned.
+    pub page: Bytes,
+}
+
+/// How many serialized entries can wait for the writer thread.
+const CAPTURE_QUEUE_LEN: usize = 1024;
+
+pub(crate) struct CorpusWriter {
+    tx: Option<SyncSender<Vec<u8>>>,
+    thread: Option<JoinHandle<()>>,
+}
+
+impl CorpusWriter {
+    /// Open the corpus file for appending, and start the thread that writes to it.
+    /// Several writers can append to the same file, each entry is written with a
+    /// single `write` call.
+    pub(crate) fn open(path: &Utf8Path) -> anyhow::Result<Self> {
+        let mut file = OpenOptions::new()
+            .create(true)
+            .append(true)
+            .open(path)
+            .with_context(|| format!("open walredo capture file {path}"))?;
+        let (tx, rx) = mpsc::sync_channel::<Vec<u8>>(CAPTURE_QUEUE_LEN);
+        let thread = std::thread::Builder::new()
+            .name("walredo capture".to_owned())
+            .spawn(move || {
+                for buf in rx {
+                    if let Err(e) = file.write_all(&buf) {
+                        warn!("failed to write walredo capture entry: {e:#}");
+                    }
+                }
+            })
+            .context("spawn walredo capture thread")?;
+        Ok(CorpusWriter {
+            tx: Some(tx),
+            thread: Some(thread),
+        })
+    }
+
+    /// Queue an entry for appending. This never blocks: if the writer thread is too
+    /// far behind, the entry is dropped and an error is returned.
+    pub(crate) fn append(&self, entry: &CorpusEntry) -> anyhow::Result<()> {
+        let ser = entry.ser().context("serialize corpus entry")?;
+        let len = u32::try_from(ser.len()).context("corpus entry too large")?;
+        let mut buf = Vec::with_capacity(4 + ser.len());
+        buf.extend_from_slice(&len.to_be_bytes());
+        buf.extend_from_slice(&ser);
+        match self.tx.as_ref().expect("only taken on drop").try_send(buf) {
+            Ok(()) => Ok(()),
+            Err(TrySendError::Full(_)) => anyhow::bail!("capture queue is full"),
+            Err(TrySendError::Disconnected(_)) => anyhow::bail!("capture thread has exited"),
+        }
+    }
+}
+
+impl Drop for CorpusWriter {
+    /// Write out the queued entries before returning.
+    fn drop(&mut self) {
+        drop(self.tx.take());
+        if let Some(thread) = self.thread.take() {
+            let _ = thread.join();
+        }
+    }
+}
+
+/// Read all the entries of a corpus file.
+pub fn read_corpus(path: &Utf8Path) -> anyhow::Result<Vec<CorpusEntry>> {
+    let file = File::open(path).with_context(|| format!("open walredo corpus {path}"))?;
+    let mut reader = BufReader::new(file);
+    let mut entries = Vec::new();
+    loop {
+        let mut len = [0u8; 4];
+        match reader.read_exact(&mut len) {
+            Ok(()) => {}
+            Err(e) if e.kind() == ErrorKind::UnexpectedEof => break,
+            Err(e) => return Err(e).context("read corpus entry length"),
+        }
+        let mut buf = vec![0; u32::from_be_bytes(len) as usize];
+        reader
+            .read_exact(&mut buf)
+            .with_context(|| format!("read corpus entry {}", entries.len()))?;
+        entries.push(
+            CorpusEntry::des(&buf)
+                .with_context(|| format!("deserialize corpus entry {}", entries.len()))?,
+        );
+    }
+    Ok(entries)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn corpus_roundtrip() {
+        let dir = camino_tempfile::tempdir().unwrap();
+        let path = dir.path().join("corpus");
+
+        let entry = |blkno: u32| CorpusEntry {
+            pg_version: 16,
+            key: Key::from_i128(blkno as i128),
+            lsn: Lsn(0x1000 * blkno as u64),
+            base_img: (blkno % 2 == 0).then(|| (Lsn(0x10), Bytes::from(vec![blkno as u8; 8192]))),
+            records: vec![(
+                Lsn(0x20),
+                NeonWalRecord::Postgres {
+                    will_init: false,
+                    rec: Bytes::from_static(b"record"),
+                },
+            )],
+            page: Bytes::from(vec![0xaa; 8192]),
+        };
+
+        // two writers appending to the same file, like two tenants would
+        let w1 = CorpusWriter::open(&path).unwrap();
+        let w2 = CorpusWriter::open(&path).unwrap();
+        w1.append(&entry(1)).unwrap();
+        w2.append(&entry(2)).unwrap();
+        w1.append(&entry(3)).unwrap();
+        drop(w1);
+        drop(w2);
+
+        // the writers don't order their entries relative to each other
+        let mut entries = read_corpus(&path).unwrap();
+        entries.sort_by_key(|e| e.lsn);
+        assert_eq!(entries, vec![entry(1), entry(2), entry(3)]);
+    }
+}
@@ -1,11 +1,19 @@
+#[cfg(target_os = "linux")]
+mod fork_server;
 mod no_leak_child;
 /// The IPC protocol that pageserver and walredo process speak over their shared pipe.
 mod protocol;
+mod shmem_ring;
 
 use self::no_leak_child::NoLeakChild;
+use self::shmem_ring::ShmemRing;
+use super::WalRedoStats;
 use crate::{
     config::PageServerConf,
-    metrics::{WalRedoKillCause, WAL_REDO_PROCESS_COUNTERS, WAL_REDO_RECORD_COUNTER},
+    metrics::{
+        WalRedoKillCause, WAL_REDO_PROCESS_COUNTERS,
+        WAL_REDO_PROCESS_FIRST_RESPONSE_DURATION_HISTOGRAM, WAL_REDO_RECORD_COUNTER,
+    },
     page_cache::PAGE_SZ,
     span::debug_assert_current_span_has_tenant_id,
 };
@@ -18,8 +26,9 @@
 use std::sync::atomic::AtomicUsize;
 use std::{
     collections::VecDeque,
+    os::unix::process::CommandExt,
     process::{Command, Stdio},
-    time::Duration,
+    time::{Duration, Instant},
 };
 use tokio::io::{AsyncReadExt, AsyncWriteExt};
 use tracing::{debug, error, instrument, Instrument};
@@ -34,14 +43,91 @@ pub struct WalRedoProcess {
     child: Option<NoLeakChild>,
     stdout: tokio::sync::Mutex<Poison<ProcessOutput>>,
     stdin: tokio::sync::Mutex<Poison<ProcessInput>>,
+    /// Size of the response to each request that has been sent, but whose
+    /// response has not been read yet. Pushed in the order the requests were
+    /// written, under the `stdin` lock, and popped by the reader.
+    response_sizes: std::sync::Mutex<VecDeque<usize>>,
+    /// Shared memory that the batch requests and all the responses go through,
+    /// if `walredo_shmem_ring_size` is set.
+    ring: Option<ShmemRing>,
+    /// The redo slots of the process that are not in use, if `walredo_redo_slots`
+    /// is more than 1. [`Self::apply_wal_records`] streams the inputs of a page
+    /// into a slot in chunks of up to [`SLOT_INPUT_CHUNK_SIZE`], so that the
+    /// requests for other pages can go in between the chunks of a large one.
+    slots: Option<RedoSlots>,
+    /// When we started launching the process, until it has sent its first response.
+    launched_at: std::sync::Mutex<Option<Instant>>,
     /// Counter to separate same sized walredo inputs failing at the same millisecond.
     #[cfg(feature = "testing")]
     dump_sequence: AtomicUsize,
 }
 
+/// One page to reconstruct in [`WalRedoProcess::apply_wal_records_batch`].
+pub(crate) struct RedoJob<'a> {
+    pub rel: RelTag,
+    pub blknum: u32,
+    pub base_img: Option<&'a Bytes>,
+    pub records: &'a [(Lsn, NeonWalRecord)],
+}
+
+/// Writing a chunk of this size to the pipe normally doesn't need to wait for the
+/// WAL redo process to read it, the pipe buffer is 64 KiB by default.
+const SLOT_INPUT_CHUNK_SIZE: usize = 64 * 1024;
+
+struct RedoSlots {
+    free: std::sync::Mutex<Vec<u32>>,
+    available: tokio::sync::Semaphore,
+}
+
+/// A redo slot in use, returned to the free ones on drop.
+struct RedoSlot<'a> {
+    slots: &'a RedoSlots,
+    slot: u32,
+}
+
+impl RedoSlots {
+    fn new(n: usize) -> Self {
+        RedoSlots {
+            free: std::sync::Mutex::new((0..n as u32).rev().collect()),
+            available: tokio::sync::Semaphore::new(n),
+        }
+    }
+
+    /// Wait for a free slot.
+    ///
+    /// # Cancel-Safety
+    ///
+    /// Cancellation safe.
+    async fn acquire(&self) -> RedoSlot<'_> {
+        self.available
+            .acquire()
+            .await
+            .expect("the semaphore is never closed")
+            .forget();
+        let slot = self
+            .free
+            .lock()
+            .unwrap()
+            .pop()
+            .expect("a permit guarantees a free slot");
+        RedoSlot { slots: self, slot }
+    }
+}
+
+impl Drop for RedoSlot<'_> {
+    fn drop(&mut self) {
+        // If the request was cancelled half-way, the process abandons the block
+        // when the slot is used for the next one.
+        self.slots.free.lock().unwrap().push(self.slot);
+        self.slots.available.add_permits(1);
+    }
+}
+
 struct ProcessInput {
     stdin: tokio::process::ChildStdin,
     n_requests: usize,
+    /// End of the last request written to the request ring.
+    ring_produced: u64,
 }
 
 struct ProcessOutput {
@@ -55,49 +141,37 @@ impl WalRedoProcess {
     // Start postgres binary in special WAL redo mode.
     //
     #[instrument(skip_all,fields(pg_version=pg_version))]
-    pub(crate) fn launch(
+    pub(crate) async fn launch(
         conf: &'static PageServerConf,
         tenant_shard_id: TenantShardId,
         pg_version: u32,
     ) -> anyhow::Result<Self> {
         crate::span::debug_assert_current_span_has_tenant_id();
 
-        let pg_bin_dir_path = conf.pg_bin_dir(pg_version).context("pg_bin_dir")?; // TODO these should be infallible.
-        let pg_lib_dir_path = conf.pg_lib_dir(pg_version).context("pg_lib_dir")?;
+        let launched_at = Instant::now();
+        let ring = if conf.walredo_shmem_ring_size > 0 {
+            Some(
+                ShmemRing::create(conf.walredo_shmem_ring_size)
+                    .context("create shared memory ring")?,
+            )
+        } else {
+            None
+        };
 
-        use no_leak_child::NoLeakChildCommandExt;
-        // Start postgres itself
-        let child = Command::new(pg_bin_dir_path.join("postgres"))
-            // the first arg must be --wal-redo so the child process enters into walredo mode
-            .arg("--wal-redo")
-            // the child doesn't process this arg, but, having it in the argv helps indentify the
-            // walredo process for a particular tenant when debugging a pagserver
-            .args(["--tenant-shard-id", &format!("{tenant_shard_id}")])
-            .stdin(Stdio::piped())
-            .stderr(Stdio::piped())
-            .stdout(Stdio::piped())
-            .env_clear()
-            .env("LD_LIBRARY_PATH", &pg_lib_dir_path)
-            .env("DYLD_LIBRARY_PATH", &pg_lib_dir_path)
-            // NB: The redo process is not trusted after we sent it the first
-            // walredo work. Before that, it is trusted. Specifically, we trust
-            // it to
-            // 1. close all file descriptors except stdin, stdout, stderr because
-            //    pageserver might not be 100% diligent in setting FD_CLOEXEC on all
-            //    the files it opens, and
-            // 2. to use seccomp to sandbox itself before processing the first
-            //    walredo request.
-            .spawn_no_leak_child(tenant_shard_id)
-            .context("spawn process")?;
+        let child = if conf.walredo_fork_server {
+            fork_child(conf, tenant_shard_id, pg_version, ring.as_ref())
+                .await
+                .context("fork from walredo fork server")?
+        } else {
+            Self::spawn_child(conf, tenant_shard_id, pg_version, ring.as_ref())?
+        };
         WAL_REDO_PROCESS_COUNTERS.started.inc();
         let mut child = scopeguard::guard(child, |child| {
             error!("killing wal-redo-postgres process due to a problem during launch");
             child.kill_and_wait(WalRedoKillCause::Startup);
         });
 
-        let stdin = child.stdin.take().unwrap();
-        let stdout = child.stdout.take().unwrap();
-        let stderr = child.stderr.take().unwrap();
+        let (stdin, stdout, stderr) = child.take_stdio();
         let stderr = tokio::process::ChildStderr::from_std(stderr)
             .context("convert to tokio::ChildStderr")?;
         let stdin =
@@ -154,6 +228,7 @@ pub(crate) fn launch(
                 ProcessInput {
                     stdin,
                     n_requests: 0,
+                    ring_produced: 0,
                 },
             )),
             stdout: tokio::sync::Mutex::new(Poison::new(
@@ -164,11 +239,88 @@ pub(crate) fn launch(
                     n_processed_responses: 0,
                 },
             )),
+            response_sizes: std::sync::Mutex::new(VecDeque::new()),
+            ring,
+            slots: (conf.walredo_redo_slots > 1).then(|| RedoSlots::new(conf.walredo_redo_slots)),
+            launched_at: std::sync::Mutex::new(Some(launched_at)),
             #[cfg(feature = "testing")]
             dump_sequence: AtomicUsize::default(),
         })
     }
 
+    /// Start postgres in WAL redo mode.
+    fn spawn_child(
+        conf: &'static PageServerConf,
+        tenant_shard_id: TenantShardId,
+        pg_version: u32,
+        ring: Option<&ShmemRing>,
+    ) -> anyhow::Result<NoLeakChild> {
+        let pg_bin_dir_path = conf.pg_bin_dir(pg_version).context("pg_bin_dir")?; // TODO these should be infallible.
+        let pg_lib_dir_path = conf.pg_lib_dir(pg_version).context("pg_lib_dir")?;
+
+        use no_leak_child::NoLeakChildCommandExt;
+        // Start postgres itself
+        let mut cmd = Command::new(pg_bin_dir_path.join("postgres"));
+        cmd
+            // the first arg must be --wal-redo so the child process enters into walredo mode
+            .arg("--wal-redo")
+            // the child doesn't process this arg, but, having it in the argv helps indentify the
+            // walredo process for a particular tenant when debugging a pagserver
+            .args(["--tenant-shard-id", &format!("{tenant_shard_id}")])
+            .stdin(Stdio::piped())
+            .stderr(Stdio::piped())
+            .stdout(Stdio::piped())
+            .env_clear()
+            .env("LD_LIBRARY_PATH", &pg_lib_dir_path)
+            .env("DYLD_LIBRARY_PATH", &pg_lib_dir_path);
+        if conf.walredo_inmem_smgr_pages > 0 {
+            cmd.arg(format!(
+                "--inmem-smgr-pages={}",
+                conf.walredo_inmem_smgr_pages
+            ));
+        }
+        if conf.walredo_redo_slots > 1 {
+            cmd.arg(format!("--redo-slots={}", conf.walredo_redo_slots));
+        }
+        if conf.walredo_postmaster_shmem_sizes {
+            cmd.arg("--postmaster-shmem-sizes");
+        }
+        if let Some(ring) = ring {
+            // The child maps the ring from this fd before it closes the rest, see below.
+            cmd.arg("--shmem-ring");
+            let fd = ring.raw_fd();
+            // SAFETY: only async-signal-safe calls between fork and exec
+            unsafe {
+                cmd.pre_exec(move || {
+                    use nix::libc;
+                    if fd == shmem_ring::RING_FD {
+                        let flags = libc::fcntl(fd, libc::F_GETFD);
+                        if flags < 0
+                            || libc::fcntl(fd, libc::F_SETFD, flags & !libc::FD_CLOEXEC) < 0
+                        {
+                            return Err(std::io::Error::last_os_error());
+                        }
+                    } else if libc::dup2(fd, shmem_ring::RING_FD) < 0 {
+                        return Err(std::io::Error::last_os_error());
+                    }
+                    Ok(())
+                });
+            }
+        }
+        let child = cmd
+            // NB: The redo process is not trusted after we sent it the first
+            // walredo work. Before that, it is trusted. Specifically, we trust
+            // it to
+            // 1. close all file descriptors except stdin, stdout, stderr because
+            //    pageserver might not be 100% diligent in setting FD_CLOEXEC on all
+            //    the files it opens, and
+            // 2. to use seccomp to sandbox itself before processing the first
+            //    walredo request.
+            .spawn_no_leak_child(tenant_shard_id)
+            .context("spawn process")?;
+        Ok(child)
+    }
+
     pub(crate) fn id(&self) -> u32 {
         self.child
             .as_ref()
@@ -193,8 +345,45 @@ pub(crate) async fn apply_wal_records(
     ) -> anyhow::Result<Bytes> {
         debug_assert_current_span_has_tenant_id();
 
+        if self.ring.is_some() {
+            // Only ApplyBatch messages go through the ring, so send it as a batch of one.
+            let job = RedoJob {
+                rel,
+                blknum,
+                base_img: base_img.as_ref(),
+                records,
+            };
+            let mut pages = self
+                .apply_wal_records_batch(std::slice::from_ref(&job), wal_redo_timeout)
+                .await?;
+            return Ok(pages.swap_remove(0));
+        }
+
         let tag = protocol::BufferTag { rel, blknum };
 
+        let mut recs = Vec::with_capacity(records.len());
+        for (lsn, rec) in records.iter() {
+            if let NeonWalRecord::Postgres {
+                will_init: _,
+                rec: postgres_rec,
+            } = rec
+            {
+                recs.push((*lsn, &postgres_rec[..]));
+            } else {
+                anyhow::bail!("tried to pass neon wal record to postgres WAL redo");
+            }
+        }
+
+        let slot = match &self.slots {
+            Some(slots) => {
+                let Ok(slot) = tokio::time::timeout(wal_redo_timeout, slots.acquire()).await else {
+                    anyhow::bail!("WAL redo timed out waiting for a redo slot");
+                };
+                Some(slot)
+            }
+            None => None,
+        };
+
         // Serialize all the messages to send the WAL redo process first.
         //
         // This could be problematic if there are millions of records to replay,
@@ -204,30 +393,46 @@ pub(crate) async fn apply_wal_records(
         // Most requests start with a before-image with BLCKSZ bytes, followed by
         // by some other WAL records. Start with a buffer that can hold that
         // comfortably.
+        //
+        // With a redo slot, every chunk of the messages starts with selecting the
+        // slot, and `chunk_ends` has the end of each but the last one.
         let mut writebuf: Vec<u8> = Vec::with_capacity((BLCKSZ as usize) * 3);
+        let mut chunk_ends = Vec::new();
+        if let Some(slot) = &slot {
+            protocol::build_use_slot_msg(slot.slot, &mut writebuf);
+        }
         protocol::build_begin_redo_for_block_msg(tag, &mut writebuf);
         if let Some(img) = base_img {
             protocol::build_push_page_msg(tag, img, &mut writebuf);
         }
-        for (lsn, rec) in records.iter() {
-            if let NeonWalRecord::Postgres {
-                will_init: _,
-                rec: postgres_rec,
-            } = rec
-            {
-                protocol::build_apply_record_msg(*lsn, postgres_rec, &mut writebuf);
-            } else {
-                anyhow::bail!("tried to pass neon wal record to postgres WAL redo");
+        let chunk_size = if slot.is_some() {
+            SLOT_INPUT_CHUNK_SIZE
+        } else {
+            usize::MAX
+        };
+        for (i, chunk) in chunk_records(&recs, chunk_size).into_iter().enumerate() {
+            if i > 0 {
+                let slot = slot.as_ref().expect("only split into chunks with a slot");
+                chunk_ends.push(writebuf.len());
+                protocol::build_use_slot_msg(slot.slot, &mut writebuf);
             }
+            protocol::build_apply_records_msg(chunk.iter().copied(), &mut writebuf);
         }
         protocol::build_get_page_msg(tag, &mut writebuf);
         WAL_REDO_RECORD_COUNTER.inc_by(records.len() as u64);
 
-        let Ok(res) =
-            tokio::time::timeout(wal_redo_timeout, self.apply_wal_records0(&writebuf)).await
-        else {
+        let send = async {
+            let mut start = 0;
+            for end in &chunk_ends {
+                self.send_input(&writebuf[start..*end]).await?;
+                start = *end;
+            }
+            self.apply_wal_records0(&writebuf[start..], PAGE_SZ).await
+        };
+        let Ok(res) = tokio::time::timeout(wal_redo_timeout, send).await else {
             anyhow::bail!("WAL redo timed out");
         };
+        drop(slot);
 
         if res.is_err() {
             // not all of these can be caused by this particular input, however these are so rare
@@ -238,13 +443,87 @@ pub(crate) async fn apply_wal_records(
         res
     }
 
+    /// Reconstruct many pages with one request to the WAL redo process. Returns
+    /// the new page images, in the order of `jobs`.
+    ///
+    /// The jobs are independent of each other; this is the same as calling
+    /// [`Self::apply_wal_records`] for each of them, but the process handles
+    /// them back to back and returns all the pages with a single write.
+    ///
+    /// # Cancel-Safety
+    ///
+    /// Cancellation safe.
+    #[instrument(skip_all, fields(pid=%self.id(), njobs=jobs.len()))]
+    pub(crate) async fn apply_wal_records_batch(
+        &self,
+        jobs: &[RedoJob<'_>],
+        wal_redo_timeout: Duration,
+    ) -> anyhow::Result<Vec<Bytes>> {
+        debug_assert_current_span_has_tenant_id();
+
+        if jobs.is_empty() {
+            return Ok(Vec::new());
+        }
+
+        let mut writebuf: Vec<u8> = Vec::with_capacity((BLCKSZ as usize) * 2 * jobs.len());
+        let start = protocol::start_apply_batch_msg(&mut writebuf);
+        let mut nrecords = 0;
+        for job in jobs {
+            let mut recs = Vec::with_capacity(job.records.len());
+            for (lsn, rec) in job.records.iter() {
+                if let NeonWalRecord::Postgres {
+                    will_init: _,
+                    rec: postgres_rec,
+                } = rec
+                {
+                    recs.push((*lsn, &postgres_rec[..]));
+                } else {
+                    anyhow::bail!("tried to pass neon wal record to postgres WAL redo");
+                }
+            }
+            let tag = protocol::BufferTag {
+                rel: job.rel,
+                blknum: job.blknum,
+            };
+            protocol::build_batch_job(
+                start,
+                tag,
+                job.base_img.map(|img| &img[..]),
+                recs.into_iter(),
+                &mut writebuf,
+            );
+            nrecords += job.records.len();
+        }
+        protocol::finish_apply_batch_msg(start, jobs.len() as u32, &mut writebuf);
+        WAL_REDO_RECORD_COUNTER.inc_by(nrecords as u64);
+
+        let Ok(res) = tokio::time::timeout(
+            wal_redo_timeout,
+            self.apply_wal_records0(&writebuf, jobs.len() * PAGE_SZ),
+        )
+        .await
+        else {
+            anyhow::bail!("WAL redo timed out");
+        };
+
+        if res.is_err() {
+            self.record_and_log(&writebuf);
+        }
+
+        let pages = res?;
+        Ok((0..jobs.len())
+            .map(|i| pages.slice(i * PAGE_SZ..(i + 1) * PAGE_SZ))
+            .collect())
+    }
+
     /// Do a ping request-response roundtrip.
     ///
     /// Not used in production, but by Rust benchmarks.
     pub(crate) async fn ping(&self, timeout: Duration) -> anyhow::Result<()> {
         let mut writebuf: Vec<u8> = Vec::with_capacity(4);
         protocol::build_ping_msg(&mut writebuf);
-        let Ok(res) = tokio::time::timeout(timeout, self.apply_wal_records0(&writebuf)).await
+        let Ok(res) =
+            tokio::time::timeout(timeout, self.apply_wal_records0(&writebuf, PAGE_SZ)).await
         else {
             anyhow::bail!("WAL redo ping timed out");
         };
@@ -258,24 +537,88 @@ pub(crate) async fn ping(&self, timeout: Duration) -> anyhow::Result<()> {
         Ok(())
     }
 
+    /// Ask the process how many records it has applied, and how many it didn't
+    /// need to, because they only restored a full-page image.
+    pub(crate) async fn get_stats(&self, timeout: Duration) -> anyhow::Result<WalRedoStats> {
+        let mut writebuf: Vec<u8> = Vec::with_capacity(4);
+        protocol::build_get_stats_msg(&mut writebuf);
+        let Ok(res) = tokio::time::timeout(timeout, self.apply_wal_records0(&writebuf, 16)).await
+        else {
+            anyhow::bail!("WAL redo stats request timed out");
+        };
+        let response = res?;
+        Ok(WalRedoStats {
+            records_applied: u64::from_be_bytes(response[0..8].try_into().unwrap()),
+            records_skipped: u64::from_be_bytes(response[8..16].try_into().unwrap()),
+        })
+    }
+
+    /// Send messages that have no response, e.g. the first chunks of a page's
+    /// inputs in a redo slot.
+    ///
+    /// # Cancel-Safety
+    ///
+    /// Same as [`Self::apply_wal_records0`].
+    async fn send_input(&self, writebuf: &[u8]) -> anyhow::Result<()> {
+        let mut lock_guard = self.stdin.lock().await;
+        let mut poison_guard = lock_guard.check_and_arm()?;
+        poison_guard
+            .data_mut()
+            .stdin
+            .write_all(writebuf)
+            .await
+            .context("write to walredo stdin")?;
+        poison_guard.disarm();
+        Ok(())
+    }
+
+    /// Send a request, and wait for its response of `response_size` bytes.
+    ///
     /// # Cancel-Safety
     ///
     /// When not polled to completion (e.g. because in `tokio::select!` another
     /// branch becomes ready before this future), concurrent and subsequent
     /// calls may fail due to [`utils::poison::Poison::check_and_arm`] calls.
     /// Dispose of this process instance and create a new one.
-    async fn apply_wal_records0(&self, writebuf: &[u8]) -> anyhow::Result<Bytes> {
+    async fn apply_wal_records0(
+        &self,
+        writebuf: &[u8],
+        response_size: usize,
+    ) -> anyhow::Result<Bytes> {
         let request_no = {
             let mut lock_guard = self.stdin.lock().await;
             let mut poison_guard = lock_guard.check_and_arm()?;
             let input = poison_guard.data_mut();
-            input
-                .stdin
-                .write_all(writebuf)
-                .await
-                .context("write to walredo stdin")?;
+            // Put the payload of a batch in the ring if there's room, and send only
+            // its position through the pipe.
+            let mut in_ring = None;
+            if let Some(ring) = &self.ring {
+                if writebuf[0] == b'M' {
+                    in_ring = ring
+                        .put_request(input.ring_produced, &writebuf[5..])
+                        .context("write to walredo request ring")?;
+                }
+            }
+            if let Some(pos) = in_ring {
+                let payload_len = writebuf.len() - 5;
+                let mut msg = Vec::with_capacity(1 + 4 + 1 + 8 + 4);
+                protocol::build_ring_request_msg(b'M', pos, payload_len as u32, &mut msg);
+                input
+                    .stdin
+                    .write_all(&msg)
+                    .await
+                    .context("write to walredo stdin")?;
+                input.ring_produced = pos + payload_len as u64;
+            } else {
+                input
+                    .stdin
+                    .write_all(writebuf)
+                    .await
+                    .context("write to walredo stdin")?;
+            }
             let request_no = input.n_requests;
             input.n_requests += 1;
+            self.response_sizes.lock().unwrap().push_back(response_size);
             poison_guard.disarm();
             request_no
         };
@@ -297,17 +640,48 @@ async fn apply_wal_records0(&self, writebuf: &[u8]) -> anyhow::Result<Bytes> {
         let output = poison_guard.data_mut();
         let n_processed_responses = output.n_processed_responses;
         while n_processed_responses + output.pending_responses.len() <= request_no {
-            // We expect the WAL redo process to respond with an 8k page image. We read it
-            // into this buffer.
-            let mut resultbuf = vec![0; BLCKSZ.into()];
-            output
-                .stdout
-                .read_exact(&mut resultbuf)
-                .await
-                .context("read walredo stdout")?;
-            output
-                .pending_responses
-                .push_back(Some(Bytes::from(resultbuf)));
+            // We expect the WAL redo process to respond with one 8k page image per page
+            // requested, or the stats. We read it into this buffer.
+            let size = self
+                .response_sizes
+                .lock()
+                .unwrap()
+                .pop_front()
+                .expect("every request sent has a response size");
+            let response = match &self.ring {
+                None => read_response(&mut output.stdout, size).await?,
+                Some(ring) => {
+                    // In ring mode, each response is tagged with where it is
+                    let tag = output
+                        .stdout
+                        .read_u8()
+                        .await
+                        .context("read walredo stdout")?;
+                    match tag {
+                        b'R' => {
+                            let pos = output
+                                .stdout
+                                .read_u64()
+                                .await
+                                .context("read walredo stdout")?;
+                            let len = output
+                                .stdout
+                                .read_u32()
+                                .await
+                                .context("read walredo stdout")?;
+                            anyhow::ensure!(
+                                len as usize == size,
+                                "walredo process sent a response of {len} bytes, expected {size}"
+                            );
+                            ring.take_response(pos, size)
+                                .context("read walredo response ring")?
+                        }
+                        b'D' => read_response(&mut output.stdout, size).await?,
+                        _ => anyhow::bail!("unexpected walredo response tag {tag}"),
+                    }
+                }
+            };
+            output.pending_responses.push_back(Some(response));
         }
         // Replace our request's response with None in `pending_responses`.
         // Then make space in the ring buffer by clearing out any seqence of contiguous
@@ -353,6 +727,10 @@ async fn apply_wal_records0(&self, writebuf: &[u8]) -> anyhow::Result<Bytes> {
             }
         }
         poison_guard.disarm();
+        if let Some(launched_at) = self.launched_at.lock().unwrap().take() {
+            WAL_REDO_PROCESS_FIRST_RESPONSE_DURATION_HISTOGRAM
+                .observe(launched_at.elapsed().as_secs_f64());
+        }
         Ok(res)
     }
 
@@ -392,6 +770,61 @@ fn record_and_log(&self, writebuf: &[u8]) {
     fn record_and_log(&self, _: &[u8]) {}
 }
 
+/// Split the records of a page into consecutive chunks of about `chunk_size` bytes,
+/// with at least one record in each. There's always at least one chunk, maybe
+/// empty.
+fn chunk_records<'a, 'b>(
+    recs: &'a [(Lsn, &'b [u8])],
+    chunk_size: usize,
+) -> Vec<&'a [(Lsn, &'b [u8])]> {
+    let mut chunks = Vec::new();
+    let mut start = 0;
+    let mut size = 0;
+    for (i, (_, rec)) in recs.iter().enumerate() {
+        if i > start && size + rec.len() > chunk_size {
+            chunks.push(&recs[start..i]);
+            start = i;
+            size = 0;
+        }
+        size += rec.len();
+    }
+    chunks.push(&recs[start..]);
+    chunks
+}
+
+async fn read_response(
+    stdout: &mut tokio::process::ChildStdout,
+    size: usize,
+) -> anyhow::Result<Bytes> {
+    let mut resultbuf = vec![0; size];
+    stdout
+        .read_exact(&mut resultbuf)
+        .await
+        .context("read walredo stdout")?;
+    Ok(Bytes::from(resultbuf))
+}
+
+#[cfg(target_os = "linux")]
+async fn fork_child(
+    conf: &'static PageServerConf,
+    tenant_shard_id: TenantShardId,
+    pg_version: u32,
+    ring: Option<&ShmemRing>,
+) -> anyhow::Result<NoLeakChild> {
+    let child = fork_server::spawn(conf, pg_version, ring.map(|ring| ring.raw_fd())).await?;
+    Ok(NoLeakChild::forked(tenant_shard_id, child))
+}
+
+#[cfg(not(target_os = "linux"))]
+async fn fork_child(
+    _conf: &'static PageServerConf,
+    _tenant_shard_id: TenantShardId,
+    _pg_version: u32,
+    _ring: Option<&ShmemRing>,
+) -> anyhow::Result<NoLeakChild> {
+    anyhow::bail!("the walredo fork server is only supported on Linux")
+}
+
 impl Drop for WalRedoProcess {
     fn drop(&mut self) {
         self.child
@@ -0,0 +1,289 @@
+//! Fork server for WAL redo processes.
+//!
+//! A WAL redo process spends a while initializing before it can serve the first
+//! request, which adds up when we launch processes for many tenants at once, e.g.
+//! after a restart. With `walredo_fork_server`, we instead start one template
+//! process per Postgres binary, which initializes once and then forks ready-to-serve
+//! children on request. See "Fork server" at the top of
+//! pgxn/neon_walredo/walredoproc.c for the protocol.
+//!
+//! The children are not our children, so we get a pidfd for each of them to kill
+//! them and to wait for them to exit. The template process never processes any WAL,
+//! so unlike the children, it stays trusted.
+
+use std::collections::HashMap;
+use std::io::{self, IoSlice, IoSliceMut};
+use std::os::fd::{AsRawFd, BorrowedFd, FromRawFd, OwnedFd, RawFd};
+use std::process::{Child, ChildStderr, ChildStdin, ChildStdout, Command, Stdio};
+use std::sync::{Arc, Mutex};
+
+use anyhow::Context;
+use camino::{Utf8Path, Utf8PathBuf};
+use nix::libc;
+use nix::sys::socket::{recvmsg, sendmsg, ControlMessage, ControlMessageOwned, MsgFlags};
+use once_cell::sync::Lazy;
+use tracing::{info, warn};
+
+use crate::config::PageServerConf;
+
+/// A WAL redo process forked by a fork server.
+pub(crate) struct ForkedChild {
+    pid: u32,
+    pidfd: OwnedFd,
+    pub(crate) stdin: Option<ChildStdin>,
+    pub(crate) stdout: Option<ChildStdout>,
+    pub(crate) stderr: Option<ChildStderr>,
+}
+
+impl ForkedChild {
+    pub(crate) fn id(&self) -> u32 {
+        self.pid
+    }
+
+    pub(crate) fn kill(&mut self) -> io::Result<()> {
+        // SAFETY: plain syscall, the result is checked
+        let rc = unsafe {
+            libc::syscall(
+                libc::SYS_pidfd_send_signal,
+                self.pidfd.as_raw_fd(),
+                libc::SIGKILL,
+                std::ptr::null::<libc::siginfo_t>(),
+                0,
+            )
+        };
+        if rc != 0 {
+            let e = io::Error::last_os_error();
+            // Already exited and reaped by the fork server
+            if e.raw_os_error() != Some(libc::ESRCH) {
+                return Err(e);
+            }
+        }
+        Ok(())
+    }
+
+    /// Wait for the process to exit. We can't get its exit status, only the fork
+    /// server can.
+    pub(crate) fn wait(&mut self) -> io::Result<()> {
+        let mut pfd = libc::pollfd {
+            fd: self.pidfd.as_raw_fd(),
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        loop {
+            // SAFETY: we pass a single valid pollfd
+            if unsafe { libc::poll(&mut pfd, 1, -1) } >= 0 {
+                return Ok(());
+            }
+            let e = io::Error::last_os_error();
+            if e.kind() != io::ErrorKind::Interrupted {
+                return Err(e);
+            }
+        }
+    }
+}
+
+struct Template {
+    process: Child,
+    /// Our end of the Unix domain socket that is the template's stdin.
+    control: OwnedFd,
+}
+
+/// The template processes, by the directory of the postgres binary.
+///
+/// Each template has its own lock, held while talking to it, so that the global
+/// lock is only held to look it up.
+static TEMPLATES: Lazy<Mutex<HashMap<Utf8PathBuf, Arc<Mutex<Option<Template>>>>>> =
+    Lazy::new(|| Mutex::new(HashMap::new()));
+
+/// Fork a new WAL redo process. If `ring_fd` is given, it's passed to the
+/// process as its shared memory ring.
+///
+/// The exchange with the template blocks, so it runs in a blocking thread.
+pub(crate) async fn spawn(
+    conf: &'static PageServerConf,
+    pg_version: u32,
+    ring_fd: Option<RawFd>,
+) -> anyhow::Result<ForkedChild> {
+    let pg_bin_dir_path = conf.pg_bin_dir(pg_version).context("pg_bin_dir")?;
+    let pg_lib_dir_path = conf.pg_lib_dir(pg_version).context("pg_lib_dir")?;
+
+    // The blocking thread gets its own copy of the ring fd, because it keeps
+    // going if we're cancelled, and the caller closes the ring.
+    let ring_fd = ring_fd
+        // SAFETY: the caller keeps the fd open until we return
+        .map(|fd| unsafe { BorrowedFd::borrow_raw(fd) }.try_clone_to_owned())
+        .transpose()
+        .context("dup ring fd")?;
+
+    let template = Arc::clone(
+        TEMPLATES
+            .lock()
+            .unwrap()
+            .entry(pg_bin_dir_path.clone())
+            .or_default(),
+    );
+
+    let span = tracing::Span::current();
+    tokio::task::spawn_blocking(move || -> anyhow::Result<ForkedChild> {
+        let _g = span.entered();
+        let mut template = template.lock().unwrap();
+        // If the template has died since the last time we used it, start a new one
+        for attempt in 0..2 {
+            if template.is_none() {
+                *template = Some(
+                    Template::launch(conf, &pg_bin_dir_path, &pg_lib_dir_path)
+                        .context("launch walredo fork server")?,
+                );
+            }
+            let t = template.as_mut().expect("launched above");
+            match t.fork(ring_fd.as_ref().map(|fd| fd.as_raw_fd())) {
+                Ok(child) => return Ok(child),
+                Err(e) if attempt == 0 => {
+                    warn!(error = ?e, pid = t.process.id(), "walredo fork server failed, restarting it");
+                    *template = None;
+                }
+                Err(e) => return Err(e),
+            }
+        }
+        unreachable!()
+    })
+    .await
+    .context("join fork server task")?
+}
+
+impl Template {
+    fn launch(
+        conf: &'static PageServerConf,
+        pg_bin_dir_path: &Utf8Path,
+        pg_lib_dir_path: &Utf8Path,
+    ) -> anyhow::Result<Self> {
+        let mut sv = [0; 2];
+        // SAFETY: plain FFI call, the result is checked
+        let (ours, theirs) = unsafe {
+            if libc::socketpair(
+                libc::AF_UNIX,
+                libc::SOCK_SEQPACKET | libc::SOCK_CLOEXEC,
+                0,
+                sv.as_mut_ptr(),
+            ) != 0
+            {
+                return Err(io::Error::last_os_error()).context("socketpair");
+            }
+            (OwnedFd::from_raw_fd(sv[0]), OwnedFd::from_raw_fd(sv[1]))
+        };
+
+        let mut cmd = Command::new(pg_bin_dir_path.join("postgres"));
+        cmd.arg("--wal-redo").arg("--fork-server");
+        // The children inherit the settings of the template
+        if conf.walredo_inmem_smgr_pages > 0 {
+            cmd.arg(format!(
+                "--inmem-smgr-pages={}",
+                conf.walredo_inmem_smgr_pages
+            ));
+        }
+        if conf.walredo_redo_slots > 1 {
+            cmd.arg(format!("--redo-slots={}", conf.walredo_redo_slots));
+        }
+        if conf.walredo_postmaster_shmem_sizes {
+            cmd.arg("--postmaster-shmem-sizes");
+        }
+        let process = cmd
+            .stdin(Stdio::from(theirs))
+            .stdout(Stdio::null())
+            // the children get their own stderr, this is only for the template failing
+            .stderr(Stdio::inherit())
+            .env_clear()
+            .env("LD_LIBRARY_PATH", pg_lib_dir_path)
+            .env("DYLD_LIBRARY_PATH", pg_lib_dir_path)
+            // The template closes all file descriptors except stdin, stdout and stderr
+            // at startup, like the WAL redo processes themselves.
+            .spawn()
+            .context("spawn process")?;
+        info!(pid = process.id(), "launched walredo fork server");
+
+        Ok(Template {
+            process,
+            control: ours,
+        })
+    }
+
+    fn fork(&mut self, ring_fd: Option<RawFd>) -> anyhow::Result<ForkedChild> {
+        let (stdin_r, stdin_w) = pipe()?;
+        let (stdout_r, stdout_w) = pipe()?;
+        let (stderr_r, stderr_w) = pipe()?;
+
+        let mut fds = vec![
+            stdin_r.as_raw_fd(),
+            stdout_w.as_raw_fd(),
+            stderr_w.as_raw_fd(),
+        ];
+        fds.extend(ring_fd);
+        let req = [b'F', ring_fd.is_some() as u8];
+        sendmsg::<()>(
+            self.control.as_raw_fd(),
+            &[IoSlice::new(&req)],
+            &[ControlMessage::ScmRights(&fds)],
+            MsgFlags::empty(),
+            None,
+        )
+        .context("send spawn request")?;
+        // The fork server has its own copies now
+        drop((stdin_r, stdout_w, stderr_w));
+
+        let mut reply = [0u8; 4];
+        let mut cmsg_buffer = nix::cmsg_space!([RawFd; 1]);
+        let (nbytes, pidfd) = {
+            let mut iov = [IoSliceMut::new(&mut reply)];
+            let msg = recvmsg::<()>(
+                self.control.as_raw_fd(),
+                &mut iov,
+                Some(&mut cmsg_buffer),
+                MsgFlags::MSG_CMSG_CLOEXEC,
+            )
+            .context("receive spawn reply")?;
+            let mut pidfd = None;
+            for cmsg in msg.cmsgs() {
+                if let ControlMessageOwned::ScmRights(fds) = cmsg {
+                    for fd in fds {
+                        // SAFETY: we just received it, nobody else owns it
+                        let fd = unsafe { OwnedFd::from_raw_fd(fd) };
+                        pidfd.get_or_insert(fd);
+                    }
+                }
+            }
+            (msg.bytes, pidfd)
+        };
+        anyhow::ensure!(nbytes == reply.len(), "fork server closed the connection");
+        let pid = u32::from_be_bytes(reply);
+        let Some(pidfd) = pidfd.filter(|_| pid != 0) else {
+            anyhow::bail!("fork server failed to fork");
+        };
+
+        Ok(ForkedChild {
+            pid,
+            pidfd,
+            stdin: Some(ChildStdin::from(stdin_w)),
+            stdout: Some(ChildStdout::from(stdout_r)),
+            stderr: Some(ChildStderr::from(stderr_r)),
+        })
+    }
+}
+
+impl Drop for Template {
+    fn drop(&mut self) {
+        let _ = self.process.kill();
+        let _ = self.process.wait();
+    }
+}
+
+/// Returns the read and write ends of a new pipe.
+fn pipe() -> anyhow::Result<(OwnedFd, OwnedFd)> {
+    let mut fds = [0; 2];
+    // SAFETY: plain FFI call, the result is checked
+    unsafe {
+        if libc::pipe2(fds.as_mut_ptr(), libc::O_CLOEXEC) != 0 {
+            return Err(io::Error::last_os_error()).context("pipe2");
+        }
+        Ok((OwnedFd::from_raw_fd(fds[0]), OwnedFd::from_raw_fd(fds[1])))
+    }
+}
@@ -7,33 +7,35 @@
 use std::io;
 use std::process::Command;
 
-use std::ops::DerefMut;
-
-use std::ops::Deref;
-
-use std::process::Child;
+use std::process::{Child, ChildStderr, ChildStdin, ChildStdout};
 
 use pageserver_api::shard::TenantShardId;
 
-/// Wrapper type around `std::process::Child` which guarantees that the child
-/// will be killed and waited-for by this process before being dropped.
-pub(crate) struct NoLeakChild {
-    pub(crate) tenant_id: TenantShardId,
-    pub(crate) child: Option<Child>,
-}
+#[cfg(target_os = "linux")]
+use super::fork_server::ForkedChild;
 
-impl Deref for NoLeakChild {
-    type Target = Child;
+/// A WAL redo process, either spawned by us or forked by a fork server.
+pub(crate) enum WalRedoChild {
+    Spawned(Child),
+    #[cfg(target_os = "linux")]
+    Forked(ForkedChild),
+}
 
-    fn deref(&self) -> &Self::Target {
-        self.child.as_ref().expect("must not use from drop")
+impl WalRedoChild {
+    pub(crate) fn id(&self) -> u32 {
+        match self {
+            WalRedoChild::Spawned(child) => child.id(),
+            #[cfg(target_os = "linux")]
+            WalRedoChild::Forked(child) => child.id(),
+        }
     }
 }
 
-impl DerefMut for NoLeakChild {
-    fn deref_mut(&mut self) -> &mut Self::Target {
-        self.child.as_mut().expect("must not use from drop")
-    }
+/// Wrapper type around [`WalRedoChild`] which guarantees that the child
+/// will be killed and waited-for by this process before being dropped.
+pub(crate) struct NoLeakChild {
+    pub(crate) tenant_id: TenantShardId,
+    pub(crate) child: Option<WalRedoChild>,
 }
 
 impl NoLeakChild {
@@ -41,10 +43,36 @@ pub(crate) fn spawn(tenant_id: TenantShardId, command: &mut Command) -> io::Resu
         let child = command.spawn()?;
         Ok(NoLeakChild {
             tenant_id,
-            child: Some(child),
+            child: Some(WalRedoChild::Spawned(child)),
         })
     }
 
+    #[cfg(target_os = "linux")]
+    pub(crate) fn forked(tenant_id: TenantShardId, child: ForkedChild) -> Self {
+        NoLeakChild {
+            tenant_id,
+            child: Some(WalRedoChild::Forked(child)),
+        }
+    }
+
+    pub(crate) fn id(&self) -> u32 {
+        self.child.as_ref().expect("must not use from drop").id()
+    }
+
+    /// Take the pipes to the child's stdin, stdout and stderr. Can only be called once.
+    pub(crate) fn take_stdio(&mut self) -> (ChildStdin, ChildStdout, ChildStderr) {
+        let (stdin, stdout, stderr) = match self.child.as_mut().expect("must not use from drop") {
+            WalRedoChild::Spawned(child) => {
+                (child.stdin.take(), child.stdout.take(), child.stderr.take())
+            }
+            #[cfg(target_os = "linux")]
+            WalRedoChild::Forked(child) => {
+                (child.stdin.take(), child.stdout.take(), child.stderr.take())
+            }
+        };
+        (stdin.unwrap(), stdout.unwrap(), stderr.unwrap())
+    }
+
     pub(crate) fn kill_and_wait(mut self, cause: WalRedoKillCause) {
         let child = match self.child.take() {
             Some(child) => child,
@@ -54,10 +82,35 @@ pub(crate) fn kill_and_wait(mut self, cause: WalRedoKillCause) {
     }
 
     #[instrument(skip_all, fields(pid=child.id(), ?cause))]
-    pub(crate) fn kill_and_wait_impl(mut child: Child, cause: WalRedoKillCause) {
+    pub(crate) fn kill_and_wait_impl(child: WalRedoChild, cause: WalRedoKillCause) {
         scopeguard::defer! {
             WAL_REDO_PROCESS_COUNTERS.killed_by_cause[cause].inc();
         }
+        match child {
+            WalRedoChild::Spawned(child) => Self::kill_and_wait_spawned(child),
+            #[cfg(target_os = "linux")]
+            WalRedoChild::Forked(child) => Self::kill_and_wait_forked(child),
+        }
+    }
+
+    #[cfg(target_os = "linux")]
+    fn kill_and_wait_forked(mut child: ForkedChild) {
+        // Same as below, except that we go through the pidfd, so there's no
+        // confusion about which process this is.
+        if let Err(e) = child.kill() {
+            error!(error = %e, "failed to SIGKILL");
+        }
+        match child.wait() {
+            Ok(()) => {
+                info!("wait successful");
+            }
+            Err(e) => {
+                error!(error = %e, "wait error; the fork server will still reap the child");
+            }
+        }
+    }
+
+    fn kill_and_wait_spawned(mut child: Child) {
         let res = child.kill();
         if let Err(e) = res {
             // This branch is very unlikely because:
@@ -38,13 +38,38 @@ pub(crate) fn build_push_page_msg(tag: BufferTag, base_img: &[u8], buf: &mut Vec
     buf.put(base_img);
 }
 
-pub(crate) fn build_apply_record_msg(endlsn: Lsn, rec: &[u8], buf: &mut Vec<u8>) {
-    let len = 4 + 8 + rec.len();
+/// All the records to apply to the current block, in one message.
+pub(crate) fn build_apply_records_msg<'a>(
+    records: impl ExactSizeIterator<Item = (Lsn, &'a [u8])>,
+    buf: &mut Vec<u8>,
+) {
+    let start = buf.len();
 
-    buf.put_u8(b'A');
-    buf.put_u32(len as u32);
-    buf.put_u64(endlsn.0);
-    buf.put(rec);
+    buf.put_u8(b'L');
+    buf.put_u32(0); // length, filled in below
+    put_record_list(start, records, buf);
+
+    let len = buf.len() - start - 1;
+    buf[start + 1..start + 5].copy_from_slice(&(len as u32).to_be_bytes());
+}
+
+/// Append a list of records to the message started at `start`.
+///
+/// Each record is padded to start at an 8-byte boundary from the beginning of the
+/// payload, so that the WAL redo process can decode it in place.
+fn put_record_list<'a>(
+    start: usize,
+    records: impl ExactSizeIterator<Item = (Lsn, &'a [u8])>,
+    buf: &mut Vec<u8>,
+) {
+    buf.put_u32(records.len() as u32);
+    for (endlsn, rec) in records {
+        buf.put_u64(endlsn.0);
+        buf.put_u32(rec.len() as u32);
+        let payload_len = buf.len() - (start + 5);
+        buf.put_bytes(0, payload_len.next_multiple_of(8) - payload_len);
+        buf.put(rec);
+    }
 }
 
 pub(crate) fn build_get_page_msg(tag: BufferTag, buf: &mut Vec<u8>) {
@@ -56,7 +81,68 @@ pub(crate) fn build_get_page_msg(tag: BufferTag, buf: &mut Vec<u8>) {
         .expect("serialize BufferTag should always succeed");
 }
 
+/// Select the redo slot that the following messages apply to.
+pub(crate) fn build_use_slot_msg(slot: u32, buf: &mut Vec<u8>) {
+    buf.put_u8(b'U');
+    buf.put_u32(4 + 4);
+    buf.put_u32(slot);
+}
+
 pub(crate) fn build_ping_msg(buf: &mut Vec<u8>) {
     buf.put_u8(b'H');
     buf.put_u32(4);
 }
+
+pub(crate) fn build_get_stats_msg(buf: &mut Vec<u8>) {
+    buf.put_u8(b'S');
+    buf.put_u32(4);
+}
+
+/// Start an ApplyBatch message. Append the jobs with [`build_batch_job`], and
+/// then call [`finish_apply_batch_msg`] with the returned offset.
+pub(crate) fn start_apply_batch_msg(buf: &mut Vec<u8>) -> usize {
+    let start = buf.len();
+
+    buf.put_u8(b'M');
+    buf.put_u32(0); // length, filled in by finish_apply_batch_msg
+    buf.put_u32(0); // number of jobs, ditto
+    start
+}
+
+/// Append one page reconstruction to an ApplyBatch message started at `start`.
+pub(crate) fn build_batch_job<'a>(
+    start: usize,
+    tag: BufferTag,
+    base_img: Option<&[u8]>,
+    records: impl ExactSizeIterator<Item = (Lsn, &'a [u8])>,
+    buf: &mut Vec<u8>,
+) {
+    tag.ser_into(buf)
+        .expect("serialize BufferTag should always succeed");
+    match base_img {
+        Some(img) => {
+            assert!(img.len() == 8192);
+            buf.put_u8(1);
+            buf.put(img);
+        }
+        None => buf.put_u8(0),
+    }
+    put_record_list(start, records, buf);
+}
+
+/// A message whose payload of `len` bytes is at `pos` in the shared memory
+/// request ring.
+pub(crate) fn build_ring_request_msg(msgtype: u8, pos: u64, len: u32, buf: &mut Vec<u8>) {
+    buf.put_u8(b'R');
+    buf.put_u32(4 + 1 + 8 + 4);
+    buf.put_u8(msgtype);
+    buf.put_u64(pos);
+    buf.put_u32(len);
+}
+
+pub(crate) fn finish_apply_batch_msg(start: usize, njobs: u32, buf: &mut [u8]) {
+    let len = buf.len() - start - 1;
+
+    buf[start + 1..start + 5].copy_from_slice(&(len as u32).to_be_bytes());
+    buf[start + 5..start + 9].copy_from_slice(&njobs.to_be_bytes());
+}
@@ -0,0 +1,235 @@
+//! Shared memory transport between pageserver and the WAL redo process.
+//!
+//! A memfd that is mapped by both processes. It starts with a header, followed by
+//! a request ring that we write and the WAL redo process reads, and a response ring
+//! that it writes and we read. The pipes are only used to tell the other side where
+//! in the ring the next message is. See the comment at the top of
+//! pgxn/neon_walredo/walredoproc.c for the protocol.
+//!
+//! The WAL redo process is not trusted, so everything it writes to the ring, including
+//! the positions in the header, is validated before use.
+
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::sync::atomic::{AtomicU64, Ordering};
+
+use anyhow::Context;
+use bytes::Bytes;
+use nix::libc;
+
+/// The file descriptor number that the WAL redo process expects the ring at.
+pub(crate) const RING_FD: RawFd = 3;
+
+// These must match the definitions in walredoproc.c
+const RING_MAGIC: u32 = 0x4e57524e;
+const RING_VERSION: u32 = 1;
+const RING_HEADER_SIZE: usize = 4096;
+const RING_ALIGN: u64 = 8;
+
+// Offsets of the fields in WalRedoRingHeader
+const OFF_MAGIC: usize = 0;
+const OFF_VERSION: usize = 4;
+const OFF_REQUEST_SIZE: usize = 8;
+const OFF_RESPONSE_SIZE: usize = 16;
+const OFF_REQUEST_CONSUMED: usize = 24;
+const OFF_RESPONSE_CONSUMED: usize = 32;
+
+pub(crate) struct ShmemRing {
+    fd: OwnedFd,
+    base: *mut u8,
+    mapped_len: usize,
+    request_size: usize,
+    response_size: usize,
+}
+
+// The raw pointer is only used to access the mapping, which lives as long as `self`.
+// Concurrent access to the header goes through atomics, and the ring contents are
+// handed over through the pipes.
+unsafe impl Send for ShmemRing {}
+unsafe impl Sync for ShmemRing {}
+
+impl ShmemRing {
+    /// Create a ring with `size` bytes for the requests and `size` bytes for the responses.
+    pub(crate) fn create(size: usize) -> anyhow::Result<Self> {
+        let size = (size as u64).next_multiple_of(RING_ALIGN) as usize;
+        anyhow::ensure!(size > 0, "shared memory ring size must be positive");
+        let mapped_len = RING_HEADER_SIZE + 2 * size;
+
+        let fd = create_memfd()?;
+        // SAFETY: plain FFI call, the result is checked
+        unsafe {
+            if libc::ftruncate(fd.as_raw_fd(), mapped_len as libc::off_t) != 0 {
+                return Err(std::io::Error::last_os_error()).context("ftruncate");
+            }
+        }
+        // SAFETY: as above. The mapping is unmapped in Drop.
+        let base = unsafe {
+            let p = libc::mmap(
+                std::ptr::null_mut(),
+                mapped_len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED,
+                fd.as_raw_fd(),
+                0,
+            );
+            if p == libc::MAP_FAILED {
+                return Err(std::io::Error::last_os_error()).context("mmap");
+            }
+            p as *mut u8
+        };
+
+        let ring = ShmemRing {
+            fd,
+            base,
+            mapped_len,
+            request_size: size,
+            response_size: size,
+        };
+        // SAFETY: the header is within the mapping, and nobody else has it mapped yet.
+        // The memfd is zero-filled, so the consumed positions start at zero.
+        unsafe {
+            std::ptr::write(base.add(OFF_MAGIC) as *mut u32, RING_MAGIC);
+            std::ptr::write(base.add(OFF_VERSION) as *mut u32, RING_VERSION);
+            std::ptr::write(base.add(OFF_REQUEST_SIZE) as *mut u64, size as u64);
+            std::ptr::write(base.add(OFF_RESPONSE_SIZE) as *mut u64, size as u64);
+        }
+        Ok(ring)
+    }
+
+    /// The memfd, to be passed to the WAL redo process as [`RING_FD`].
+    pub(crate) fn raw_fd(&self) -> RawFd {
+        self.fd.as_raw_fd()
+    }
+
+    fn header_atomic(&self, offset: usize) -> &AtomicU64 {
+        // SAFETY: the offset is within the header, 8-byte aligned, and the
+        // mapping lives as long as `self`.
+        unsafe { &*(self.base.add(offset) as *const AtomicU64) }
+    }
+
+    /// Copy a message payload into the request ring, at or after position
+    /// `produced`. Returns the position it was written at, or None if there's
+    /// currently no room for it.
+    ///
+    /// Must only be called by one writer at a time, the one that owns `produced`.
+    pub(crate) fn put_request(&self, produced: u64, payload: &[u8]) -> anyhow::Result<Option<u64>> {
+        let size = self.request_size as u64;
+        let len = payload.len() as u64;
+        let consumed = self
+            .header_atomic(OFF_REQUEST_CONSUMED)
+            .load(Ordering::Acquire);
+        anyhow::ensure!(
+            consumed <= produced,
+            "walredo process reported bogus request ring position {consumed}, produced {produced}"
+        );
+
+        let mut pos = produced.next_multiple_of(RING_ALIGN);
+        let mut off = pos % size;
+        if off + len > size {
+            // doesn't fit at the end, wrap around
+            pos += size - off;
+            off = 0;
+        }
+        if len > size || pos + len - consumed > size {
+            return Ok(None);
+        }
+        // SAFETY: bounds checked above, and the walredo process is done with this part
+        // of the ring.
+        unsafe {
+            std::ptr::copy_nonoverlapping(
+                payload.as_ptr(),
+                self.base.add(RING_HEADER_SIZE + off as usize),
+                payload.len(),
+            );
+        }
+        Ok(Some(pos))
+    }
+
+    /// Copy a response of `len` bytes out of the response ring, and release the space.
+    ///
+    /// Responses must be taken in the order they were produced.
+    pub(crate) fn take_response(&self, pos: u64, len: usize) -> anyhow::Result<Bytes> {
+        let size = self.response_size as u64;
+        let off = pos % size;
+        anyhow::ensure!(
+            off + len as u64 <= size,
+            "walredo process reported bogus response ring position {pos}, length {len}"
+        );
+        let mut buf = vec![0; len];
+        // SAFETY: bounds checked above. The walredo process won't write to this part
+        // of the ring until we advance response_consumed.
+        unsafe {
+            std::ptr::copy_nonoverlapping(
+                self.base
+                    .add(RING_HEADER_SIZE + self.request_size + off as usize),
+                buf.as_mut_ptr(),
+                len,
+            );
+        }
+        self.header_atomic(OFF_RESPONSE_CONSUMED)
+            .store(pos + len as u64, Ordering::Release);
+        Ok(Bytes::from(buf))
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn create_memfd() -> anyhow::Result<OwnedFd> {
+    // SAFETY: plain FFI call, the result is checked
+    unsafe {
+        let fd = libc::memfd_create(c"neon-walredo-ring".as_ptr(), libc::MFD_CLOEXEC);
+        if fd < 0 {
+            return Err(std::io::Error::last_os_error()).context("memfd_create");
+        }
+        Ok(OwnedFd::from_raw_fd(fd))
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+fn create_memfd() -> anyhow::Result<OwnedFd> {
+    anyhow::bail!("the walredo shared memory ring is only supported on Linux")
+}
+
+impl Drop for ShmemRing {
+    fn drop(&mut self) {
+        // SAFETY: we mapped it in create(), and no references into it outlive `self`
+        unsafe {
+            libc::munmap(self.base as *mut libc::c_void, self.mapped_len);
+        }
+    }
+}
+
+#[cfg(all(test, target_os = "linux"))]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn request_ring_wraps_and_fills_up() {
+        let ring = ShmemRing::create(64).unwrap();
+
+        let pos = ring.put_request(0, &[1; 20]).unwrap().unwrap();
+        assert_eq!(pos, 0);
+        // aligned up to 24, and fits before the end
+        let pos = ring.put_request(20, &[2; 30]).unwrap().unwrap();
+        assert_eq!(pos, 24);
+        // the walredo process hasn't consumed anything, so there's no room
+        assert_eq!(ring.put_request(54, &[3; 30]).unwrap(), None);
+
+        // once it has, the next one wraps around to the beginning
+        ring.header_atomic(OFF_REQUEST_CONSUMED)
+            .store(54, Ordering::Release);
+        let pos = ring.put_request(54, &[3; 30]).unwrap().unwrap();
+        assert_eq!(pos, 64);
+
+        // too large to ever fit
+        assert_eq!(ring.put_request(94, &[4; 65]).unwrap(), None);
+    }
+
+    #[test]
+    fn bogus_positions_are_rejected() {
+        let ring = ShmemRing::create(64).unwrap();
+
+        ring.header_atomic(OFF_REQUEST_CONSUMED)
+            .store(1000, Ordering::Release);
+        assert!(ring.put_request(0, &[1; 8]).is_err());
+        assert!(ring.take_response(60, 8).is_err());
+    }
+}
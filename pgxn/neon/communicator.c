@@ -0,0 +1,1346 @@
+/*-------------------------------------------------------------------------
+ *
+ * communicator.c
+ *	  Shared communicator process, which multiplexes the pageserver
+ *	  requests of all backends over one set of connections.
+ *
+ * Normally, each backend opens its own connection to every pageserver shard
+ * it needs to talk to. With many backends and many shards, that adds up to
+ * a lot of connections, each carrying only a trickle of requests. When
+ * neon.use_communicator is enabled, a background worker owns the pageserver
+ * connections instead, and backends hand their requests to it through
+ * shared memory.
+ *
+ * Each backend (or rather, each PGPROC slot) has a channel in shared memory
+ * with neon.communicator_queue_depth entries. To send a request, a backend
+ * copies it into a free entry and marks it SUBMITTED; flushing wakes up the
+ * communicator. The communicator sends all submitted requests, flushing each
+ * connection once per round, and copies each response, still in its wire
+ * format, into the entry. It marks the entry DONE and sets the owner's latch.
+ * The backend unpacks the response itself, so that responses are parsed and
+ * allocated exactly as with a direct connection.
+ *
+ * If several backends request the same page version at the same time, only
+ * one GetPage request is sent to the pageserver, and the response is copied
+ * to all of them.
+ *
+ * The communicator is a page_server_api implementation, so the prefetching
+ * code in pagestore_smgr.c works unchanged on top of it. Requests with
+ * responses that don't fit in an entry (SLRU segment downloads), requests
+ * sent before the communicator has started, and requests from sessions with
+ * a different neon.protocol_version than the communicator are sent over a
+ * direct connection as before. Responses are handed out per shard in the
+ * order the requests were sent, whichever way they went.
+ *
+ * Entry state transitions, all protected by the channel's spinlock:
+ *
+ *	FREE -> SUBMITTED			backend, when sending a request
+ *	SUBMITTED -> INFLIGHT		communicator, when it picks up the request
+ *	INFLIGHT -> DONE			communicator, when the response has arrived
+ *	DONE -> FREE				backend, after reading the response
+ *
+ * When a backend gives up on a request, e.g. because it was canceled or it
+ * exits, a SUBMITTED entry becomes FREE again, and an INFLIGHT entry becomes
+ * ABANDONED; the communicator frees it when the response arrives.
+ *
+ * IDENTIFICATION
+ *	 contrib/neon/communicator.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "port/pg_bswap.h"
+#include "portability/instr_time.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/pg_shmem.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+#include "bitmap.h"
+#include "communicator.h"
+#include "neon.h"
+#include "neon_perf_counters.h"
+#include "pagestore_client.h"
+
+/*
+ * Large enough for a GetPage response, header included. Error messages that
+ * don't fit are truncated.
+ */
+#define COMMUNICATOR_MAX_RESPONSE_SIZE	(BLCKSZ + 128)
+
+/* Interval between "still waiting" messages while waiting for a response */
+#define COMMUNICATOR_LOG_INTERVAL_MS	INT64CONST(10 * 1000)
+
+/* One for each backend and aux process, like the perf counter slots */
+#define NUM_COMMUNICATOR_CHANNELS (NEON_MAX_BACKENDS + NUM_AUXILIARY_PROCS)
+
+#if PG_VERSION_NUM >= 170000
+#define MyChannelIndex MyProcNumber
+#else
+#define MyChannelIndex (MyProc->pgprocno)
+#endif
+
+/* GUCs */
+bool		neon_use_communicator = false;
+static int	communicator_queue_depth = 16;
+
+/* Requests that are passed through the communicator */
+typedef union
+{
+	NeonRequest hdr;
+	NeonExistsRequest exists;
+	NeonNblocksRequest nblocks;
+	NeonGetPageRequest getpage;
+	NeonGetPageIfModifiedRequest getpage_if_modified;
+	NeonDbSizeRequest dbsize;
+} CommunicatorRequest;
+
+typedef enum
+{
+	CE_FREE = 0,
+	CE_SUBMITTED,
+	CE_INFLIGHT,
+	CE_DONE,
+	CE_ABANDONED,
+} CommunicatorEntryState;
+
+typedef struct
+{
+	CommunicatorEntryState state;
+	shardno_t	shard_no;
+
+	/*
+	 * Set together with DONE if the connection was lost before the response
+	 * arrived. The backend handles that like a lost connection of its own.
+	 */
+	bool		failed;
+
+	CommunicatorRequest request;
+
+	int			response_len;
+	char		response[COMMUNICATOR_MAX_RESPONSE_SIZE];
+} CommunicatorEntry;
+
+typedef struct
+{
+	slock_t		mutex;
+	Latch	   *latch;			/* owning backend's latch, or NULL */
+	bool		has_submissions;	/* any entries in SUBMITTED state? */
+	CommunicatorEntry entries[FLEXIBLE_ARRAY_MEMBER];
+} CommunicatorChannel;
+
+typedef struct
+{
+	slock_t		mutex;
+
+	/*
+	 * PID and latch of the communicator, and the protocol version it speaks
+	 * to the pageservers. 'pid' is 0 when the communicator is not running.
+	 */
+	pid_t		pid;
+	Latch	   *latch;
+	int			protocol_version;
+
+	/*
+	 * Followed by an array of NUM_COMMUNICATOR_CHANNELS channels, of
+	 * ChannelSize() bytes each.
+	 */
+} CommunicatorShmemState;
+
+static CommunicatorShmemState *communicator_shared;
+static page_server_api *direct_api;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook;
+
+/*
+ * Backend-local state.
+ *
+ * For each shard, a FIFO of the requests that we have sent and not received
+ * the response for yet. If the communicator's queue fills up with responses
+ * that we haven't read yet, responses are moved to local memory ('spilled')
+ * to make room.
+ */
+typedef struct
+{
+	int			entry;			/* entry in our channel, or -1 */
+	bool		direct;			/* sent over our own connection */
+	bool		failed;			/* spilled entry had 'failed' set */
+	char	   *spilled;		/* response moved out of the channel */
+	int			spilled_len;
+} CommunicatorPending;
+
+static CommunicatorChannel *MyChannel;
+static List *pending_requests[MAX_SHARDS];
+static List *free_pending;		/* recycled CommunicatorPending structs */
+static bool direct_unflushed[MAX_SHARDS];
+static int	next_free_entry;
+
+/*
+ * Communicator process state.
+ *
+ * Requests in flight are tracked as "ops". An op is one request sent to the
+ * pageserver, with the list of channel entries waiting for its response.
+ * Normally there is one waiter, but identical GetPage requests from
+ * different backends are folded into one op, found through 'op_hash'.
+ */
+typedef struct
+{
+	int			channel;
+	int			entry;
+	NeonRequestId reqid;
+} CommunicatorWaiter;
+
+typedef struct
+{
+	BufferTag	tag;
+	XLogRecPtr	lsn;
+	XLogRecPtr	not_modified_since;
+} CommunicatorOpKey;
+
+typedef struct
+{
+	CommunicatorRequest request;
+	shardno_t	shard_no;
+	uint64		generation;		/* connection the request was sent on */
+	bool		hashed;
+	CommunicatorOpKey key;
+	List	   *waiters;
+} CommunicatorOp;
+
+typedef struct
+{
+	CommunicatorOpKey key;
+	CommunicatorOp *op;
+} CommunicatorOpEntry;
+
+static MemoryContext communicator_ctx;
+static HTAB *op_hash;
+static List *inflight_ops[MAX_SHARDS];
+static bool unflushed[MAX_SHARDS];
+
+static WaitEventSet *communicator_wes;
+static pgsocket wes_sockets[MAX_SHARDS];
+static uint64 wes_generations[MAX_SHARDS];
+
+static void communicator_disconnect(shardno_t shard_no);
+
+static Size
+ChannelSize(void)
+{
+	return MAXALIGN(add_size(offsetof(CommunicatorChannel, entries),
+							 mul_size(communicator_queue_depth,
+									  sizeof(CommunicatorEntry))));
+}
+
+static inline CommunicatorChannel *
+GetChannel(int channel)
+{
+	return (CommunicatorChannel *)
+		((char *) communicator_shared + MAXALIGN(sizeof(CommunicatorShmemState)) +
+		 channel * ChannelSize());
+}
+
+static Size
+CommunicatorShmemSize(void)
+{
+	return add_size(MAXALIGN(sizeof(CommunicatorShmemState)),
+					mul_size(NUM_COMMUNICATOR_CHANNELS, ChannelSize()));
+}
+
+static void
+communicator_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	communicator_shared = ShmemInitStruct("neon communicator",
+										  CommunicatorShmemSize(),
+										  &found);
+	if (!found)
+	{
+		SpinLockInit(&communicator_shared->mutex);
+		communicator_shared->pid = 0;
+		communicator_shared->latch = NULL;
+		communicator_shared->protocol_version = 0;
+
+		for (int i = 0; i < NUM_COMMUNICATOR_CHANNELS; i++)
+		{
+			CommunicatorChannel *chan = GetChannel(i);
+
+			SpinLockInit(&chan->mutex);
+			chan->latch = NULL;
+			chan->has_submissions = false;
+			for (int j = 0; j < communicator_queue_depth; j++)
+				chan->entries[j].state = CE_FREE;
+		}
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+#if PG_VERSION_NUM >= 150000
+static void
+communicator_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(CommunicatorShmemSize());
+}
+#endif
+
+/*
+ * Size of the request struct, or 0 if requests of this type are not passed
+ * through the communicator.
+ */
+static Size
+communicator_request_size(NeonMessageTag tag)
+{
+	switch (tag)
+	{
+		case T_NeonExistsRequest:
+			return sizeof(NeonExistsRequest);
+		case T_NeonNblocksRequest:
+			return sizeof(NeonNblocksRequest);
+		case T_NeonGetPageRequest:
+			return sizeof(NeonGetPageRequest);
+		case T_NeonGetPageIfModifiedRequest:
+			return sizeof(NeonGetPageIfModifiedRequest);
+		case T_NeonDbSizeRequest:
+			return sizeof(NeonDbSizeRequest);
+		default:
+			/* SLRU segments and page ranges don't fit in an entry */
+			return 0;
+	}
+}
+
+static void
+communicator_wakeup(void)
+{
+	Latch	   *latch;
+
+	SpinLockAcquire(&communicator_shared->mutex);
+	latch = communicator_shared->latch;
+	SpinLockRelease(&communicator_shared->mutex);
+
+	if (latch)
+		SetLatch(latch);
+}
+
+/* ----------------------------------------------------------------
+ * Backend side
+ * ----------------------------------------------------------------
+ */
+
+static void
+communicator_detach(int code, Datum arg)
+{
+	CommunicatorChannel *chan = MyChannel;
+
+	SpinLockAcquire(&chan->mutex);
+	for (int i = 0; i < communicator_queue_depth; i++)
+	{
+		CommunicatorEntry *entry = &chan->entries[i];
+
+		if (entry->state == CE_INFLIGHT)
+			entry->state = CE_ABANDONED;
+		else if (entry->state != CE_ABANDONED)
+			entry->state = CE_FREE;
+	}
+	chan->latch = NULL;
+	chan->has_submissions = false;
+	SpinLockRelease(&chan->mutex);
+
+	MyChannel = NULL;
+}
+
+/*
+ * Can this request be passed through the communicator?
+ */
+static bool
+communicator_accepts(NeonRequest *request)
+{
+	if (communicator_shared == NULL || MyProc == NULL)
+		return false;
+	if (communicator_request_size(request->tag) == 0)
+		return false;
+
+	/*
+	 * Unlocked reads are good enough here: if the communicator just exited,
+	 * the request will wait for the restarted one.
+	 */
+	if (communicator_shared->pid == 0 ||
+		communicator_shared->protocol_version != neon_protocol_version)
+		return false;
+
+	if (MyChannel == NULL)
+	{
+		MyChannel = GetChannel(MyChannelIndex);
+		SpinLockAcquire(&MyChannel->mutex);
+		MyChannel->latch = MyLatch;
+		SpinLockRelease(&MyChannel->mutex);
+		on_shmem_exit(communicator_detach, 0);
+	}
+	return true;
+}
+
+static CommunicatorPending *
+pending_alloc(void)
+{
+	CommunicatorPending *p;
+
+	if (free_pending != NIL)
+	{
+		p = llast(free_pending);
+		free_pending = list_delete_last(free_pending);
+	}
+	else
+		p = MemoryContextAlloc(TopMemoryContext, sizeof(CommunicatorPending));
+
+	p->entry = -1;
+	p->direct = false;
+	p->failed = false;
+	p->spilled = NULL;
+	p->spilled_len = 0;
+	return p;
+}
+
+static void
+pending_release(CommunicatorPending *p)
+{
+	if (p->spilled)
+		pfree(p->spilled);
+	p->spilled = NULL;
+
+	if (p->entry >= 0)
+	{
+		CommunicatorEntry *entry = &MyChannel->entries[p->entry];
+
+		SpinLockAcquire(&MyChannel->mutex);
+		if (entry->state == CE_INFLIGHT)
+			entry->state = CE_ABANDONED;
+		else
+		{
+			Assert(entry->state == CE_SUBMITTED || entry->state == CE_DONE);
+			entry->state = CE_FREE;
+		}
+		SpinLockRelease(&MyChannel->mutex);
+		p->entry = -1;
+	}
+
+	free_pending = lappend(free_pending, p);
+}
+
+static CommunicatorEntryState
+entry_state(int i)
+{
+	CommunicatorEntryState state;
+
+	SpinLockAcquire(&MyChannel->mutex);
+	state = MyChannel->entries[i].state;
+	SpinLockRelease(&MyChannel->mutex);
+
+	return state;
+}
+
+/*
+ * Move one received response from the channel to local memory, to free up
+ * its entry. Returns false if none of our responses has arrived yet.
+ */
+static bool
+communicator_spill_one(void)
+{
+	for (int shard_no = 0; shard_no < MAX_SHARDS; shard_no++)
+	{
+		ListCell   *lc;
+
+		foreach(lc, pending_requests[shard_no])
+		{
+			CommunicatorPending *p = lfirst(lc);
+			CommunicatorEntry *entry;
+
+			if (p->entry < 0 || entry_state(p->entry) != CE_DONE)
+				continue;
+
+			entry = &MyChannel->entries[p->entry];
+			p->failed = entry->failed;
+			p->spilled_len = entry->response_len;
+			p->spilled = MemoryContextAlloc(TopMemoryContext,
+											Max(entry->response_len, 1));
+			memcpy(p->spilled, entry->response, entry->response_len);
+
+			SpinLockAcquire(&MyChannel->mutex);
+			entry->state = CE_FREE;
+			SpinLockRelease(&MyChannel->mutex);
+			p->entry = -1;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Find a free entry in our channel, waiting for one if necessary.
+ */
+static int
+communicator_get_free_entry(void)
+{
+	for (;;)
+	{
+		for (int n = 0; n < communicator_queue_depth; n++)
+		{
+			int			i = (next_free_entry + n) % communicator_queue_depth;
+
+			/*
+			 * Only we move entries out of FREE state, so if it's free, it
+			 * stays free.
+			 */
+			if (entry_state(i) == CE_FREE)
+			{
+				next_free_entry = (i + 1) % communicator_queue_depth;
+				return i;
+			}
+		}
+
+		if (communicator_spill_one())
+			continue;
+
+		/*
+		 * All entries hold requests that are still being processed. Make sure
+		 * the communicator has seen them, and wait.
+		 */
+		communicator_wakeup();
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_EXIT_ON_PM_DEATH | WL_TIMEOUT,
+						 1000,
+						 WAIT_EVENT_NEON_PS_SEND);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+static bool
+communicator_send(shardno_t shard_no, NeonRequest *request)
+{
+	CommunicatorPending *p;
+	CommunicatorEntry *entry;
+	int			i;
+
+	if (!communicator_accepts(request))
+	{
+		if (!direct_api->send(shard_no, request))
+			return false;
+
+		p = pending_alloc();
+		p->direct = true;
+		pending_requests[shard_no] = lappend(pending_requests[shard_no], p);
+		direct_unflushed[shard_no] = true;
+		return true;
+	}
+
+	i = communicator_get_free_entry();
+	entry = &MyChannel->entries[i];
+	memcpy(&entry->request, request, communicator_request_size(request->tag));
+	entry->shard_no = shard_no;
+	entry->failed = false;
+	entry->response_len = 0;
+
+	SpinLockAcquire(&MyChannel->mutex);
+	entry->state = CE_SUBMITTED;
+	MyChannel->has_submissions = true;
+	SpinLockRelease(&MyChannel->mutex);
+
+	p = pending_alloc();
+	p->entry = i;
+	pending_requests[shard_no] = lappend(pending_requests[shard_no], p);
+
+	MyNeonCounters->communicator_requests_total++;
+
+	return true;
+}
+
+static bool
+communicator_flush(shardno_t shard_no)
+{
+	if (direct_unflushed[shard_no])
+	{
+		direct_unflushed[shard_no] = false;
+		if (!direct_api->flush(shard_no))
+			return false;
+	}
+
+	if (MyChannel != NULL && MyChannel->has_submissions)
+		communicator_wakeup();
+
+	return true;
+}
+
+/*
+ * Unpack a response received through the communicator.
+ */
+static NeonResponse *
+communicator_unpack(shardno_t shard_no, char *data, int len)
+{
+	StringInfoData s;
+	NeonResponse *resp;
+
+	s.data = data;
+	s.len = len;
+	s.maxlen = len;
+	s.cursor = 0;
+
+	PG_TRY();
+	{
+		resp = nm_unpack_response(&s);
+	}
+	PG_CATCH();
+	{
+		neon_shard_log(shard_no, LOG, "communicator: disconnect due to failure while parsing response");
+		communicator_disconnect(shard_no);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	return resp;
+}
+
+static NeonResponse *
+communicator_receive_internal(shardno_t shard_no, bool nowait)
+{
+	CommunicatorPending *p;
+	NeonResponse *resp;
+	instr_time	start_ts,
+				now;
+	bool		logged = false;
+
+	if (pending_requests[shard_no] == NIL)
+	{
+		neon_shard_log(shard_no, LOG, "communicator: no request in flight");
+		return NULL;
+	}
+
+	p = linitial(pending_requests[shard_no]);
+
+	if (p->direct)
+	{
+		if (nowait)
+		{
+			resp = direct_api->try_receive(shard_no);
+			if (resp != NULL)
+			{
+				pending_requests[shard_no] = list_delete_first(pending_requests[shard_no]);
+				pending_release(p);
+			}
+		}
+		else
+		{
+			pending_requests[shard_no] = list_delete_first(pending_requests[shard_no]);
+			pending_release(p);
+			resp = direct_api->receive(shard_no);
+		}
+		return resp;
+	}
+
+	if (p->spilled == NULL)
+	{
+		INSTR_TIME_SET_CURRENT(start_ts);
+		for (;;)
+		{
+			CommunicatorEntryState state = entry_state(p->entry);
+
+			if (state == CE_DONE)
+				break;
+			if (nowait)
+				return NULL;
+
+			if (state == CE_SUBMITTED)
+				communicator_wakeup();
+
+			(void) WaitLatch(MyLatch,
+							 WL_LATCH_SET | WL_EXIT_ON_PM_DEATH | WL_TIMEOUT,
+							 1000,
+							 WAIT_EVENT_NEON_PS_READ);
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+
+			INSTR_TIME_SET_CURRENT(now);
+			INSTR_TIME_SUBTRACT(now, start_ts);
+			if (!logged && INSTR_TIME_GET_MILLISEC(now) >= COMMUNICATOR_LOG_INTERVAL_MS)
+			{
+				neon_shard_log(shard_no, LOG, "no response received from communicator for %0.3f s, still waiting",
+							   INSTR_TIME_GET_DOUBLE(now));
+				logged = true;
+			}
+		}
+		if (logged)
+		{
+			INSTR_TIME_SET_CURRENT(now);
+			INSTR_TIME_SUBTRACT(now, start_ts);
+			neon_shard_log(shard_no, LOG, "received response from communicator after %0.3f s",
+						   INSTR_TIME_GET_DOUBLE(now));
+		}
+	}
+
+	pending_requests[shard_no] = list_delete_first(pending_requests[shard_no]);
+
+	if (p->spilled != NULL)
+	{
+		resp = p->failed ? NULL : communicator_unpack(shard_no, p->spilled, p->spilled_len);
+	}
+	else
+	{
+		CommunicatorEntry *entry = &MyChannel->entries[p->entry];
+
+		resp = entry->failed ? NULL : communicator_unpack(shard_no, entry->response, entry->response_len);
+	}
+	pending_release(p);
+
+	if (resp == NULL)
+	{
+		/* Same as losing our own connection to the pageserver */
+		neon_shard_log(shard_no, LOG, "communicator lost connection to pageserver");
+		prefetch_on_ps_disconnect();
+		communicator_disconnect(shard_no);
+	}
+
+	return resp;
+}
+
+static NeonResponse *
+communicator_receive(shardno_t shard_no)
+{
+	return communicator_receive_internal(shard_no, false);
+}
+
+static NeonResponse *
+communicator_try_receive(shardno_t shard_no)
+{
+	return communicator_receive_internal(shard_no, true);
+}
+
+/*
+ * Wait until the oldest request to any of the given shards may have been
+ * answered. Shards whose oldest request went over our own connection are
+ * waited on through the direct API, which also wakes up when the
+ * communicator sets our latch.
+ */
+static bool
+communicator_wait_any(const uint8 *shard_bitmap, shardno_t max_shard_no, long timeout)
+{
+	uint8		direct_shards[(MAX_SHARDS + 7) / 8] = {0};
+	shardno_t	max_direct_shard_no = 0;
+
+	for (shardno_t shard_no = 0; shard_no < max_shard_no; shard_no++)
+	{
+		CommunicatorPending *p;
+		CommunicatorEntryState state;
+
+		if (!BITMAP_ISSET(shard_bitmap, shard_no) || pending_requests[shard_no] == NIL)
+			continue;
+
+		p = linitial(pending_requests[shard_no]);
+		if (p->direct)
+		{
+			BITMAP_SET(direct_shards, shard_no);
+			max_direct_shard_no = shard_no + 1;
+			continue;
+		}
+		if (p->spilled != NULL)
+			return true;
+
+		state = entry_state(p->entry);
+		if (state == CE_DONE)
+			return true;
+		if (state == CE_SUBMITTED)
+			communicator_wakeup();
+	}
+
+	if (max_direct_shard_no > 0)
+		return direct_api->wait_any(direct_shards, max_direct_shard_no, timeout);
+
+	/* Don't sleep for too long, in case the communicator was restarted */
+	if (timeout < 0 || timeout > 1000)
+		timeout = 1000;
+
+	(void) WaitLatch(MyLatch,
+					 WL_LATCH_SET | WL_EXIT_ON_PM_DEATH | WL_TIMEOUT,
+					 timeout,
+					 WAIT_EVENT_NEON_PS_READ);
+	ResetLatch(MyLatch);
+	CHECK_FOR_INTERRUPTS();
+
+	return true;
+}
+
+/*
+ * Forget all requests to the shard that are in progress, and drop our own
+ * connection to it, if any.
+ */
+static void
+communicator_disconnect(shardno_t shard_no)
+{
+	ListCell   *lc;
+
+	foreach(lc, pending_requests[shard_no])
+		pending_release(lfirst(lc));
+	list_free(pending_requests[shard_no]);
+	pending_requests[shard_no] = NIL;
+	direct_unflushed[shard_no] = false;
+
+	direct_api->disconnect(shard_no);
+}
+
+static page_server_api communicator_api =
+{
+	.send = communicator_send,
+	.flush = communicator_flush,
+	.receive = communicator_receive,
+	.try_receive = communicator_try_receive,
+	.wait_any = communicator_wait_any,
+	.disconnect = communicator_disconnect
+};
+
+/* ----------------------------------------------------------------
+ * Communicator process
+ * ----------------------------------------------------------------
+ */
+
+/*
+ * Hand a response, or a failure if 'msg' is NULL, to all waiters of an op,
+ * and free the op.
+ */
+static void
+communicator_complete(CommunicatorOp *op, const char *msg, int len)
+{
+	ListCell   *lc;
+
+	if (msg != NULL && len > COMMUNICATOR_MAX_RESPONSE_SIZE)
+	{
+		if (msg[0] != T_NeonErrorResponse)
+		{
+			neon_shard_log(op->shard_no, WARNING, "communicator: response of %d bytes does not fit in queue entry", len);
+			msg = NULL;
+		}
+	}
+
+	foreach(lc, op->waiters)
+	{
+		CommunicatorWaiter *w = lfirst(lc);
+		CommunicatorChannel *chan = GetChannel(w->channel);
+		CommunicatorEntry *entry = &chan->entries[w->entry];
+		Latch	   *latch = NULL;
+
+		/*
+		 * The backend doesn't touch the response while the entry is INFLIGHT
+		 * or ABANDONED, so it's safe to fill it in without the lock.
+		 */
+		if (msg != NULL)
+		{
+			if (len > COMMUNICATOR_MAX_RESPONSE_SIZE)
+			{
+				/* truncate the error message, keeping it null-terminated */
+				memcpy(entry->response, msg, COMMUNICATOR_MAX_RESPONSE_SIZE - 1);
+				entry->response[COMMUNICATOR_MAX_RESPONSE_SIZE - 1] = '\0';
+				entry->response_len = COMMUNICATOR_MAX_RESPONSE_SIZE;
+			}
+			else
+			{
+				memcpy(entry->response, msg, len);
+				entry->response_len = len;
+			}
+
+			/* The response must carry the waiter's own request ID */
+			if (neon_protocol_version >= 3 && entry->response_len >= 1 + sizeof(uint64))
+			{
+				uint64		reqid = pg_hton64(w->reqid);
+
+				memcpy(entry->response + 1, &reqid, sizeof(uint64));
+			}
+		}
+
+		SpinLockAcquire(&chan->mutex);
+		if (entry->state == CE_INFLIGHT)
+		{
+			entry->failed = (msg == NULL);
+			entry->state = CE_DONE;
+			latch = chan->latch;
+		}
+		else
+		{
+			Assert(entry->state == CE_ABANDONED);
+			entry->state = CE_FREE;
+		}
+		SpinLockRelease(&chan->mutex);
+
+		if (latch)
+			SetLatch(latch);
+	}
+
+	if (op->hashed)
+		(void) hash_search(op_hash, &op->key, HASH_REMOVE, NULL);
+	list_free_deep(op->waiters);
+	pfree(op);
+}
+
+/*
+ * Complete an op with an error response carrying 'message', like the
+ * pageserver would send.
+ */
+static void
+communicator_complete_with_error(CommunicatorOp *op, const char *message)
+{
+	StringInfoData s;
+
+	initStringInfo(&s);
+	pq_sendbyte(&s, T_NeonErrorResponse);
+	if (neon_protocol_version >= 3)
+	{
+		pq_sendint64(&s, op->request.hdr.reqid);
+		pq_sendint64(&s, op->request.hdr.lsn);
+		pq_sendint64(&s, op->request.hdr.not_modified_since);
+	}
+	pq_sendbytes(&s, message, strlen(message) + 1);
+
+	communicator_complete(op, s.data, s.len);
+	pfree(s.data);
+}
+
+static void
+communicator_fail_shard(shardno_t shard_no)
+{
+	while (inflight_ops[shard_no] != NIL)
+	{
+		CommunicatorOp *op = linitial(inflight_ops[shard_no]);
+
+		inflight_ops[shard_no] = list_delete_first(inflight_ops[shard_no]);
+		communicator_complete(op, NULL, 0);
+	}
+	unflushed[shard_no] = false;
+}
+
+/*
+ * Send a request that was picked up from a channel entry, or attach it to an
+ * identical request that is already in flight.
+ */
+static void
+communicator_submit(int channel, int entry_no, CommunicatorEntry *entry)
+{
+	CommunicatorWaiter *waiter;
+	CommunicatorOp *op;
+	CommunicatorOpEntry *hentry = NULL;
+	MemoryContext oldcxt;
+	bool		sent = false;
+
+	waiter = palloc(sizeof(CommunicatorWaiter));
+	waiter->channel = channel;
+	waiter->entry = entry_no;
+	waiter->reqid = entry->request.hdr.reqid;
+
+	op = palloc0(sizeof(CommunicatorOp));
+	memcpy(&op->request, &entry->request, communicator_request_size(entry->request.hdr.tag));
+	op->shard_no = entry->shard_no;
+	op->waiters = list_make1(waiter);
+
+	if (op->request.hdr.tag == T_NeonGetPageRequest)
+	{
+		bool		found;
+
+		memset(&op->key, 0, sizeof(op->key));
+		CopyNRelFileInfoToBufTag(op->key.tag, op->request.getpage.rinfo);
+		op->key.tag.forkNum = op->request.getpage.forknum;
+		op->key.tag.blockNum = op->request.getpage.blkno;
+		op->key.lsn = op->request.hdr.lsn;
+		op->key.not_modified_since = op->request.hdr.not_modified_since;
+
+		hentry = hash_search(op_hash, &op->key, HASH_ENTER, &found);
+		if (found)
+		{
+			hentry->op->waiters = lappend(hentry->op->waiters, waiter);
+			list_free(op->waiters);
+			pfree(op);
+			MyNeonCounters->communicator_coalesced_requests_total++;
+			return;
+		}
+		hentry->op = op;
+		op->hashed = true;
+	}
+
+	oldcxt = CurrentMemoryContext;
+	PG_TRY();
+	{
+		sent = page_server->send(op->shard_no, &op->request.hdr);
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		/*
+		 * Most likely we could not connect. Pass the error on to the
+		 * backends waiting for this request, like they would have gotten it
+		 * if they had tried to connect themselves.
+		 */
+		MemoryContextSwitchTo(oldcxt);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		communicator_complete_with_error(op, edata->message);
+		FreeErrorData(edata);
+		return;
+	}
+	PG_END_TRY();
+
+	if (!sent)
+	{
+		communicator_complete(op, NULL, 0);
+		return;
+	}
+
+	op->generation = pageserver_generation(op->shard_no);
+	inflight_ops[op->shard_no] = lappend(inflight_ops[op->shard_no], op);
+	unflushed[op->shard_no] = true;
+}
+
+/*
+ * Pick up all newly submitted requests from the backends.
+ */
+static void
+communicator_collect_requests(void)
+{
+	for (int c = 0; c < NUM_COMMUNICATOR_CHANNELS; c++)
+	{
+		CommunicatorChannel *chan = GetChannel(c);
+
+		/* unlocked check first, to skip idle channels cheaply */
+		if (!chan->has_submissions)
+			continue;
+
+		SpinLockAcquire(&chan->mutex);
+		chan->has_submissions = false;
+		SpinLockRelease(&chan->mutex);
+
+		for (int i = 0; i < communicator_queue_depth; i++)
+		{
+			CommunicatorEntry *entry = &chan->entries[i];
+			bool		picked = false;
+
+			SpinLockAcquire(&chan->mutex);
+			if (entry->state == CE_SUBMITTED)
+			{
+				entry->state = CE_INFLIGHT;
+				picked = true;
+			}
+			SpinLockRelease(&chan->mutex);
+
+			if (picked)
+				communicator_submit(c, i, entry);
+		}
+	}
+
+	for (shardno_t shard_no = 0; shard_no < MAX_SHARDS; shard_no++)
+	{
+		if (unflushed[shard_no])
+		{
+			unflushed[shard_no] = false;
+			if (!page_server->flush(shard_no))
+				communicator_fail_shard(shard_no);
+		}
+	}
+}
+
+/*
+ * Read all responses that have arrived, and hand them to the backends.
+ */
+static void
+communicator_collect_responses(void)
+{
+	for (shardno_t shard_no = 0; shard_no < MAX_SHARDS; shard_no++)
+	{
+		uint64		generation;
+
+		if (inflight_ops[shard_no] == NIL)
+		{
+			char	   *buf;
+			int			rc;
+
+			/*
+			 * Nothing is expected on an idle connection, but we need to
+			 * notice if the pageserver closed it, or we'd keep waking up for
+			 * the readable socket.
+			 */
+			if (pageserver_socket(shard_no) == PGINVALID_SOCKET)
+				continue;
+			rc = pageserver_receive_raw(shard_no, &buf);
+			if (rc > 0)
+			{
+				neon_shard_log(shard_no, LOG, "communicator: unexpected message on idle connection, disconnecting");
+				pageserver_free_raw(shard_no, buf);
+				direct_api->disconnect(shard_no);
+			}
+			continue;
+		}
+
+		/*
+		 * If the connection was closed after a request was sent on it, its
+		 * response will never come.
+		 */
+		generation = pageserver_generation(shard_no);
+		while (inflight_ops[shard_no] != NIL &&
+			   ((CommunicatorOp *) linitial(inflight_ops[shard_no]))->generation != generation)
+		{
+			CommunicatorOp *op = linitial(inflight_ops[shard_no]);
+
+			inflight_ops[shard_no] = list_delete_first(inflight_ops[shard_no]);
+			communicator_complete(op, NULL, 0);
+		}
+
+		while (inflight_ops[shard_no] != NIL)
+		{
+			CommunicatorOp *op;
+			char	   *buf;
+			int			rc;
+
+			rc = pageserver_receive_raw(shard_no, &buf);
+			if (rc == 0)
+				break;
+			if (rc < 0)
+			{
+				communicator_fail_shard(shard_no);
+				break;
+			}
+
+			op = linitial(inflight_ops[shard_no]);
+			inflight_ops[shard_no] = list_delete_first(inflight_ops[shard_no]);
+			communicator_complete(op, buf, rc);
+			pageserver_free_raw(shard_no, buf);
+		}
+	}
+}
+
+/*
+ * Sleep until a backend submits requests, or a response arrives.
+ */
+static void
+communicator_wait(void)
+{
+	WaitEvent	event;
+	bool		rebuild = (communicator_wes == NULL);
+
+	for (shardno_t shard_no = 0; shard_no < MAX_SHARDS; shard_no++)
+	{
+		if (wes_sockets[shard_no] != pageserver_socket(shard_no) ||
+			wes_generations[shard_no] != pageserver_generation(shard_no))
+		{
+			rebuild = true;
+			break;
+		}
+	}
+
+	if (rebuild)
+	{
+		int			nsockets = 0;
+
+		if (communicator_wes)
+			FreeWaitEventSet(communicator_wes);
+
+		for (shardno_t shard_no = 0; shard_no < MAX_SHARDS; shard_no++)
+		{
+			wes_sockets[shard_no] = pageserver_socket(shard_no);
+			wes_generations[shard_no] = pageserver_generation(shard_no);
+			if (wes_sockets[shard_no] != PGINVALID_SOCKET)
+				nsockets++;
+		}
+
+#if PG_MAJORVERSION_NUM >= 17
+		communicator_wes = CreateWaitEventSet(NULL, nsockets + 2);
+#else
+		communicator_wes = CreateWaitEventSet(TopMemoryContext, nsockets + 2);
+#endif
+		AddWaitEventToSet(communicator_wes, WL_LATCH_SET, PGINVALID_SOCKET,
+						  MyLatch, NULL);
+		AddWaitEventToSet(communicator_wes, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET,
+						  NULL, NULL);
+		for (shardno_t shard_no = 0; shard_no < MAX_SHARDS; shard_no++)
+		{
+			if (wes_sockets[shard_no] != PGINVALID_SOCKET)
+				AddWaitEventToSet(communicator_wes, WL_SOCKET_READABLE,
+								  wes_sockets[shard_no], NULL, NULL);
+		}
+	}
+
+	(void) WaitEventSetWait(communicator_wes, 1000, &event, 1,
+							WAIT_EVENT_NEON_COMMUNICATOR_MAIN);
+}
+
+static void
+communicator_shmem_exit(int code, Datum arg)
+{
+	SpinLockAcquire(&communicator_shared->mutex);
+	communicator_shared->pid = 0;
+	communicator_shared->latch = NULL;
+	SpinLockRelease(&communicator_shared->mutex);
+}
+
+void
+CommunicatorMain(Datum main_arg)
+{
+	HASHCTL		ctl;
+
+	/* Establish signal handlers. */
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+
+	BackgroundWorkerUnblockSignals();
+
+	/* This process talks to the pageservers itself */
+	page_server = direct_api;
+
+	communicator_ctx = AllocSetContextCreate(TopMemoryContext,
+											 "communicator",
+											 ALLOCSET_DEFAULT_SIZES);
+	MemoryContextSwitchTo(communicator_ctx);
+
+	ctl.keysize = sizeof(CommunicatorOpKey);
+	ctl.entrysize = sizeof(CommunicatorOpEntry);
+	ctl.hcxt = communicator_ctx;
+	op_hash = hash_create("communicator in-flight GetPage requests", 1024,
+						  &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	for (shardno_t shard_no = 0; shard_no < MAX_SHARDS; shard_no++)
+		wes_sockets[shard_no] = PGINVALID_SOCKET;
+
+	/*
+	 * If we're restarting after a failure, the requests that the previous
+	 * communicator had picked up are lost. Fail them, so that the backends
+	 * retry.
+	 */
+	for (int c = 0; c < NUM_COMMUNICATOR_CHANNELS; c++)
+	{
+		CommunicatorChannel *chan = GetChannel(c);
+		Latch	   *latch = NULL;
+
+		SpinLockAcquire(&chan->mutex);
+		for (int i = 0; i < communicator_queue_depth; i++)
+		{
+			CommunicatorEntry *entry = &chan->entries[i];
+
+			if (entry->state == CE_INFLIGHT)
+			{
+				entry->failed = true;
+				entry->state = CE_DONE;
+				latch = chan->latch;
+			}
+			else if (entry->state == CE_ABANDONED)
+				entry->state = CE_FREE;
+		}
+		SpinLockRelease(&chan->mutex);
+
+		if (latch)
+			SetLatch(latch);
+	}
+
+	SpinLockAcquire(&communicator_shared->mutex);
+	communicator_shared->latch = MyLatch;
+	communicator_shared->protocol_version = neon_protocol_version;
+	communicator_shared->pid = MyProcPid;
+	SpinLockRelease(&communicator_shared->mutex);
+	on_shmem_exit(communicator_shmem_exit, 0);
+
+	neon_log(LOG, "communicator started with protocol version %d", neon_protocol_version);
+
+	for (;;)
+	{
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		/* In case of a SIGHUP, just reload the configuration. */
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		communicator_collect_requests();
+		communicator_collect_responses();
+		communicator_wait();
+	}
+}
+
+/*
+ * Module initialization. 'api' is the regular, direct-connection
+ * implementation, which the communicator itself and the requests that
+ * bypass it use.
+ */
+void
+pg_init_communicator(page_server_api *api)
+{
+	BackgroundWorker bgw;
+
+	DefineCustomBoolVariable("neon.use_communicator",
+							 "Send pageserver requests through a shared communicator process",
+							 "When enabled, a background worker holds the connections "
+							 "to the pageservers, and backends pass their requests to it "
+							 "instead of opening connections of their own.",
+							 &neon_use_communicator,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("neon.communicator_queue_depth",
+							"Number of requests each backend can have queued in the communicator",
+							"Each queue entry takes about one page of shared memory "
+							"per backend.",
+							&communicator_queue_depth,
+							16, 1, 1024,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	direct_api = api;
+
+	if (!neon_use_communicator || !page_server_connstring || !page_server_connstring[0])
+	{
+		neon_use_communicator = false;
+		return;
+	}
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = communicator_shmem_request;
+#else
+	RequestAddinShmemSpace(CommunicatorShmemSize());
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = communicator_shmem_startup;
+
+	memset(&bgw, 0, sizeof(bgw));
+	bgw.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	bgw.bgw_start_time = BgWorkerStart_PostmasterStart;
+	snprintf(bgw.bgw_library_name, BGW_MAXLEN, "neon");
+	snprintf(bgw.bgw_function_name, BGW_MAXLEN, "CommunicatorMain");
+	snprintf(bgw.bgw_name, BGW_MAXLEN, "Neon communicator");
+	snprintf(bgw.bgw_type, BGW_MAXLEN, "Neon communicator");
+	bgw.bgw_restart_time = 1;
+	bgw.bgw_notify_pid = 0;
+	bgw.bgw_main_arg = (Datum) 0;
+
+	RegisterBackgroundWorker(&bgw);
+
+	page_server = &communicator_api;
+}
@@ -0,0 +1,24 @@
+/*-------------------------------------------------------------------------
+ *
+ * communicator.h
+ *	  Shared communicator process, which multiplexes the pageserver
+ *	  requests of all backends over one set of connections.
+ *
+ * IDENTIFICATION
+ *	 contrib/neon/communicator.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef COMMUNICATOR_H
+#define COMMUNICATOR_H
+
+#include "pagestore_client.h"
+
+/* GUCs */
+extern bool neon_use_communicator;
+
+extern void pg_init_communicator(page_server_api *direct_api);
+
+extern PGDLLEXPORT void CommunicatorMain(Datum main_arg);
+
+#endif							/* COMMUNICATOR_H */
@@ -14,22 +14,29 @@
  */
 #include "postgres.h"
 
+#include <sys/socket.h>
+
 #include "access/xlog.h"
 #include "common/hashfn.h"
 #include "fmgr.h"
 #include "libpq-fe.h"
+#include "libpq/auth.h"
 #include "libpq/libpq.h"
 #include "libpq/pqformat.h"
 #include "miscadmin.h"
 #include "pgstat.h"
+#include "port/pg_bswap.h"
 #include "portability/instr_time.h"
 #include "postmaster/interrupt.h"
+#include "replication/walsender.h"
 #include "storage/buf_internals.h"
 #include "storage/ipc.h"
 #include "storage/lwlock.h"
 #include "storage/pg_shmem.h"
 #include "utils/guc.h"
 
+#include "bitmap.h"
+#include "communicator.h"
 #include "neon.h"
 #include "neon_perf_counters.h"
 #include "neon_utils.h"
@@ -41,6 +48,10 @@
 #define MIN_RECONNECT_INTERVAL_USEC 1000
 #define MAX_RECONNECT_INTERVAL_USEC 1000000
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 /* GUCs */
 char	   *neon_timeline;
 char	   *neon_tenant;
@@ -52,13 +63,35 @@ int			readahead_buffer_size = 128;
 int			flush_every_n_requests = 8;
 
 int         neon_protocol_version = 2;
+int         neon_pageserver_compression = PAGESTREAM_COMPRESSION_NONE;
 
 static int	max_reconnect_attempts = 60;
 static int	stripe_size;
+static int	pageserver_hedge_percentile = 0;
+static int	pageserver_hedge_min_delay = 1;
+static bool pageserver_eager_connect = false;
+static int	pageserver_send_queue_size = 1024;
+static bool pageserver_raw_framing = false;
+
+static const struct config_enum_entry pageserver_compression_options[] = {
+	{"none", PAGESTREAM_COMPRESSION_NONE, false},
+#ifdef USE_ZSTD
+	{"zstd", PAGESTREAM_COMPRESSION_ZSTD, false},
+#endif
+	{NULL, 0, false}
+};
+
+/*
+ * Each shard has a primary endpoint, and optionally secondary endpoints that
+ * can serve the same pages. Secondaries are only used for hedged requests,
+ * see neon.pageserver_hedge_percentile.
+ */
+#define MAX_SHARD_ENDPOINTS 3
 
 typedef struct
 {
-	char		connstring[MAX_SHARDS][MAX_PAGESERVER_CONNSTRING_SIZE];
+	/* endpoint 0 is the primary; unused endpoints are empty strings */
+	char		connstring[MAX_SHARDS][MAX_SHARD_ENDPOINTS][MAX_PAGESERVER_CONNSTRING_SIZE];
 	size_t		num_shards;
 } ShardMap;
 
@@ -102,6 +135,17 @@ typedef enum PSConnectionState {
 	PS_Connected,				/* connected, pagestream established */
 } PSConnectionState;
 
+/* Buffer for the raw pagestream framing, see ps_put_request() etc. */
+typedef struct
+{
+	char	   *data;
+	int			start;			/* first byte not yet consumed */
+	int			end;			/* end of valid data */
+	int			size;			/* allocated size of 'data' */
+} RawBuffer;
+
+#define RAW_BUFFER_SIZE		(64 * 1024)
+
 /* This backend's per-shard connections */
 typedef struct
 {
@@ -110,6 +154,9 @@ typedef struct
 	uint32			delay_us;
 	int				n_reconnect_attempts;
 
+	/* when the current connection attempt was started, for the metrics */
+	instr_time		connect_start;
+
 	/*---
 	 * Pageserver connection state, i.e.
 	 *	disconnected: conn == NULL, wes == NULL;
@@ -124,6 +171,9 @@ typedef struct
 	uint64			nrequests_sent;
 	uint64			nresponses_received;
 
+	/* incremented every time the connection is closed */
+	uint64			generation;
+
 	/*---
 	 * WaitEventSet containing:
 	 *	- WL_SOCKET_READABLE on 'conn'
@@ -131,13 +181,117 @@ typedef struct
 	 *	- WL_EXIT_ON_PM_DEATH.
 	 */
 	WaitEventSet   *wes_read;
+
+	/*
+	 * Like wes_read, but waits for 'conn' to become writeable too. Used to
+	 * drain the send queue.
+	 */
+	WaitEventSet   *wes_write;
+
+	/*
+	 * The connection is in non-blocking mode, so requests are queued in
+	 * libpq's output buffer until the socket accepts them. This is the
+	 * number of bytes queued since the output buffer was last empty.
+	 */
+	uint64			send_queue_bytes;
+
+	/*
+	 * With neon.pageserver_raw_framing, once the pagestream has been
+	 * established, the CopyData messages are written to and read from the
+	 * socket directly, through these preallocated buffers, bypassing libpq.
+	 * 'raw_error' holds the reason if the connection has failed.
+	 */
+	bool			raw;
+	bool			raw_failed;
+	RawBuffer		raw_in;
+	RawBuffer		raw_out;
+	char			raw_error[256];
 } PageServer;
 
 static PageServer page_servers[MAX_SHARDS];
 
+/*
+ * WaitEventSet over the sockets of several shards, for pageserver_wait_any().
+ * It is rebuilt when the set of shards changes, or when the connection to
+ * any of them, or to the secondary used for hedging, has changed.
+ */
+static WaitEventSet *wes_any;
+static uint8 wes_any_shards[(MAX_SHARDS + 7) / 8];
+static uint64 wes_any_generations[MAX_SHARDS];
+static uint64 wes_any_secondary_keys[MAX_SHARDS];
+
+/* marks the sockets of secondaries in the user_data of wes_any's events */
+#define WES_ANY_SECONDARY	0x10000
+
+/* WaitEventSet over the connections being established by pageserver_connect_all() */
+static WaitEventSet *wes_connect;
+
+static ClientAuthentication_hook_type prev_client_auth_hook;
+
+/*
+ * Hedged requests.
+ *
+ * If a shard has secondary endpoints and neon.pageserver_hedge_percentile is
+ * set, we remember the requests sent to the shard's primary until their
+ * responses arrive. When the oldest of them is a GetPage request that has
+ * taken longer than that percentile of recent response times, a copy of it
+ * is sent to a secondary, over a separate connection, and whichever response
+ * arrives first is used. Both connections answer their requests in order, so
+ * to discard the other response when it arrives, it's enough to count the
+ * responses to skip on each connection.
+ *
+ * Only the oldest request is ever hedged, so apart from the responses to
+ * skip, the secondary has at most one request in flight.
+ */
+typedef struct
+{
+	NeonGetPageRequest request; /* copy of the request, if 'hedgeable' */
+	bool		hedgeable;
+	instr_time	sent_at;
+} HedgeSentRequest;
+
+typedef struct
+{
+	bool		enabled;		/* are the requests to this shard tracked? */
+	int			endpoint;		/* the secondary endpoint we use */
+	PageServer	secondary;		/* connection to the secondary */
+	List	   *sent;			/* HedgeSentRequests, oldest first */
+	bool		head_hedged;	/* oldest request was sent to the secondary */
+	int			primary_skip;	/* responses to discard on the primary */
+	int			secondary_skip; /* responses to discard on the secondary */
+
+	/* WaitEventSet on the latch and the sockets of both connections */
+	WaitEventSet *wes;
+	uint64		wes_primary_key;
+	uint64		wes_secondary_key;
+} ShardHedgeState;
+
+static ShardHedgeState shard_hedges[MAX_SHARDS];
+static List *free_hedge_requests;	/* recycled HedgeSentRequests */
+
+/*
+ * Response times of recent hedgeable requests, in the buckets of the I/O
+ * wait histograms. Halved whenever it reaches HEDGE_MAX_SAMPLES, so that it
+ * follows changes in the response times.
+ */
+static uint64 hedge_latency_buckets[NUM_IO_WAIT_BUCKETS];
+static uint64 hedge_latency_count;
+
+#define HEDGE_MIN_SAMPLES	100
+#define HEDGE_MAX_SAMPLES	10000
+
+/* identifies a connection (generation) and whether it is open, for the WESes */
+#define CONNECTION_KEY(shard) \
+	((shard)->generation * 2 + ((shard)->state == PS_Connected ? 1 : 0))
+
+static bool pageserver_connect_endpoint(PageServer *shard, shardno_t shard_no,
+										const char *connstr, int elevel);
 static bool pageserver_flush(shardno_t shard_no);
+static bool pageserver_drain(shardno_t shard_no, const char *caller);
 static void pageserver_disconnect(shardno_t shard_no);
 static void pageserver_disconnect_shard(shardno_t shard_no);
+static void hedge_init(shardno_t shard_no);
+static void hedge_reset(shardno_t shard_no);
 
 static bool
 PagestoreShmemIsValid(void)
@@ -148,6 +302,9 @@ PagestoreShmemIsValid(void)
 /*
  * Parse a comma-separated list of connection strings into a ShardMap.
  *
+ * The entry of each shard can list several endpoints separated by '|': the
+ * primary first, followed by its secondaries.
+ *
  * If 'result' is NULL, just checks that the input is valid. If the input is
  * not valid, returns false. The contents of *result are undefined in
  * that case, and must not be relied on.
@@ -167,6 +324,8 @@ ParseShardMap(const char *connstr, ShardMap *result)
 	{
 		const char *sep;
 		size_t		connstr_len;
+		const char *endpoint;
+		int			nendpoints = 0;
 
 		sep = strchr(p, ',');
 		connstr_len = sep != NULL ? sep - p : strlen(p);
@@ -179,15 +338,39 @@ ParseShardMap(const char *connstr, ShardMap *result)
 			neon_log(LOG, "Too many shards");
 			return false;
 		}
-		if (connstr_len >= MAX_PAGESERVER_CONNSTRING_SIZE)
-		{
-			neon_log(LOG, "Connection string too long");
-			return false;
-		}
-		if (result)
+
+		endpoint = p;
+		while (endpoint <= p + connstr_len)
 		{
-			memcpy(result->connstring[nshards], p, connstr_len);
-			result->connstring[nshards][connstr_len] = '\0';
+			const char *endpoint_end = memchr(endpoint, '|', p + connstr_len - endpoint);
+			size_t		endpoint_len;
+
+			if (endpoint_end == NULL)
+				endpoint_end = p + connstr_len;
+			endpoint_len = endpoint_end - endpoint;
+
+			if (nendpoints >= MAX_SHARD_ENDPOINTS)
+			{
+				neon_log(LOG, "Too many endpoints for shard %d", nshards);
+				return false;
+			}
+			if (endpoint_len >= MAX_PAGESERVER_CONNSTRING_SIZE)
+			{
+				neon_log(LOG, "Connection string too long");
+				return false;
+			}
+			if (endpoint_len == 0 && nendpoints > 0)
+			{
+				neon_log(LOG, "Empty secondary endpoint for shard %d", nshards);
+				return false;
+			}
+			if (result)
+			{
+				memcpy(result->connstring[nshards][nendpoints], endpoint, endpoint_len);
+				result->connstring[nshards][nendpoints][endpoint_len] = '\0';
+			}
+			nendpoints++;
+			endpoint = endpoint_end + 1;
 		}
 		nshards++;
 
@@ -249,15 +432,18 @@ AssignPageserverConnstring(const char *newval, void *extra)
  *
  * If num_shards_p is not NULL, it is set to the current number of shards.
  *
- * If connstr_p is not NULL, the connection string for 'shard_no' is copied to
- * it. It must point to a buffer at least MAX_PAGESERVER_CONNSTRING_SIZE bytes
+ * If connstr_p is not NULL, the connection string of endpoint 'endpoint' of
+ * 'shard_no' is copied to it: 0 is the primary, and higher numbers are the
+ * secondaries, which are empty strings if the shard has fewer secondaries.
+ * It must point to a buffer at least MAX_PAGESERVER_CONNSTRING_SIZE bytes
  * long.
  *
  * As a side-effect, if the shard map in shared memory had changed since the
  * last call, terminates all existing connections to all pageservers.
  */
 static void
-load_shard_map(shardno_t shard_no, char *connstr_p, shardno_t *num_shards_p)
+load_shard_map(shardno_t shard_no, int endpoint, char *connstr_p,
+			   shardno_t *num_shards_p)
 {
 	uint64		begin_update_counter;
 	uint64		end_update_counter;
@@ -278,7 +464,7 @@ load_shard_map(shardno_t shard_no, char *connstr_p, shardno_t *num_shards_p)
 
 		num_shards = shard_map->num_shards;
 		if (connstr_p && shard_no < MAX_SHARDS)
-			strlcpy(connstr_p, shard_map->connstring[shard_no], MAX_PAGESERVER_CONNSTRING_SIZE);
+			strlcpy(connstr_p, shard_map->connstring[shard_no][endpoint], MAX_PAGESERVER_CONNSTRING_SIZE);
 		pg_memory_barrier();
 	}
 	while (begin_update_counter != end_update_counter
@@ -314,7 +500,7 @@ get_shard_number(BufferTag *tag)
 	shardno_t	n_shards;
 	uint32		hash;
 
-	load_shard_map(0, NULL, &n_shards);
+	load_shard_map(0, 0, NULL, &n_shards);
 
 #if PG_MAJORVERSION_NUM < 16
 	hash = murmurhash32(tag->rnode.relNode);
@@ -335,262 +521,687 @@ CLEANUP_AND_DISCONNECT(PageServer *shard)
 		FreeWaitEventSet(shard->wes_read);
 		shard->wes_read = NULL;
 	}
+	if (shard->wes_write)
+	{
+		FreeWaitEventSet(shard->wes_write);
+		shard->wes_write = NULL;
+	}
+	shard->send_queue_bytes = 0;
+	if (shard->raw)
+	{
+		pfree(shard->raw_in.data);
+		pfree(shard->raw_out.data);
+		memset(&shard->raw_in, 0, sizeof(RawBuffer));
+		memset(&shard->raw_out, 0, sizeof(RawBuffer));
+		shard->raw = false;
+	}
 	if (shard->conn)
 	{
 		MyNeonCounters->pageserver_disconnects_total++;
 		PQfinish(shard->conn);
 		shard->conn = NULL;
+		shard->generation++;
 	}
 
 	shard->state = PS_Disconnected;
 }
 
 /*
- * Connect to a pageserver, or continue to try to connect if we're yet to
- * complete the connection (e.g. due to receiving an earlier cancellation
- * during connection start).
- * Returns true if successfully connected; false if the connection failed.
- * 
- * Throws errors in unrecoverable situations, or when this backend's query
- * is canceled.
+ * Raw pagestream framing.
+ *
+ * Once the pagestream has been established, the pageserver and compute only
+ * exchange CopyData messages, each with a 1-byte type and 4-byte length
+ * header. libpq mallocs and copies every message it receives, and buffers
+ * everything twice. With neon.pageserver_raw_framing, we instead read and
+ * write the same messages on the socket ourselves: requests are framed
+ * straight into an output buffer, and responses are handed out from the
+ * input buffer they were received into. The bytes on the wire are the same,
+ * so the pageserver needs no changes. This is not possible if the connection
+ * uses TLS, because libpq owns the TLS session.
+ *
+ * The ps_* functions below have the same semantics as the libpq functions
+ * they replace, and fall back to them if the connection doesn't use the raw
+ * framing.
  */
-static bool
-pageserver_connect(shardno_t shard_no, int elevel)
+static void
+ps_start_raw_framing(PageServer *shard)
 {
-	PageServer *shard = &page_servers[shard_no];
-	char		connstr[MAX_PAGESERVER_CONNSTRING_SIZE];
+	shard->raw = true;
+	shard->raw_failed = false;
+	shard->raw_in.data = MemoryContextAlloc(TopMemoryContext, RAW_BUFFER_SIZE);
+	shard->raw_in.size = RAW_BUFFER_SIZE;
+	shard->raw_in.start = shard->raw_in.end = 0;
+	shard->raw_out.data = MemoryContextAlloc(TopMemoryContext, RAW_BUFFER_SIZE);
+	shard->raw_out.size = RAW_BUFFER_SIZE;
+	shard->raw_out.start = shard->raw_out.end = 0;
+
+	MyNeonCounters->pageserver_raw_framing_connections_total++;
+}
 
-	/*
-	 * Get the connection string for this shard. If the shard map has been
-	 * updated since we last looked, this will also disconnect any existing
-	 * pageserver connections as a side effect.
-	 * Note that connstr is used both during connection start, and when we
-	 * log the successful connection.
-	 */
-	load_shard_map(shard_no, connstr, NULL);
+static void ps_raw_fail(PageServer *shard, const char *fmt,...) pg_attribute_printf(2, 3);
 
-	switch (shard->state)
-	{
-	case PS_Disconnected:
-	{
-		const char *keywords[3];
-		const char *values[3];
-		int			n_pgsql_params;
-		TimestampTz	now;
-		int64		us_since_last_attempt;
+static void
+ps_raw_fail(PageServer *shard, const char *fmt,...)
+{
+	va_list		args;
 
-		/* Make sure we start with a clean slate */
-		CLEANUP_AND_DISCONNECT(shard);
+	/* keep the first error, it's the interesting one */
+	if (shard->raw_failed)
+		return;
 
-		neon_shard_log(shard_no, DEBUG5, "Connection state: Disconnected");
+	va_start(args, fmt);
+	vsnprintf(shard->raw_error, sizeof(shard->raw_error), fmt, args);
+	va_end(args);
+	shard->raw_failed = true;
+}
 
-		now = GetCurrentTimestamp();
-		us_since_last_attempt = (int64) (now - shard->last_reconnect_time);
-		shard->last_reconnect_time = now;
+/* Make room for at least 'needed' more bytes at the end of the buffer */
+static void
+ps_raw_reserve(RawBuffer *buf, int needed)
+{
+	if (buf->start > 0 && buf->size - buf->end < needed)
+	{
+		memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+		buf->end -= buf->start;
+		buf->start = 0;
+	}
+	if (buf->size - buf->end < needed)
+	{
+		while (buf->size - buf->end < needed)
+			buf->size *= 2;
+		buf->data = repalloc(buf->data, buf->size);
+	}
+}
 
-		/*
-		 * Make sure we don't do exponential backoff with a constant multiplier
-		 * of 0 us, as that doesn't really do much for timeouts...
-		 *
-		 * cf. https://github.com/neondatabase/neon/issues/7897
-		 */
-		if (shard->delay_us == 0)
-			shard->delay_us = MIN_RECONNECT_INTERVAL_USEC;
+/*
+ * Write out as much of the output buffer as the socket accepts. Returns 0 if
+ * everything was sent, 1 if some is left, or -1 on failure, like PQflush().
+ */
+static int
+ps_raw_send(PageServer *shard)
+{
+	RawBuffer  *out = &shard->raw_out;
 
-		/*
-		 * If we did other tasks between reconnect attempts, then we won't
-		 * need to wait as long as a full delay.
-		 */
-		if (us_since_last_attempt < shard->delay_us)
+	while (out->start < out->end)
+	{
+		ssize_t		n;
+
+		n = send(PQsocket(shard->conn), out->data + out->start,
+				 out->end - out->start, MSG_NOSIGNAL);
+		if (n < 0)
 		{
-			pg_usleep(shard->delay_us - us_since_last_attempt);
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			ps_raw_fail(shard, "could not send data to pageserver: %m");
+			return -1;
 		}
+		out->start += n;
+	}
+	out->start = out->end = 0;
+	return 0;
+}
 
-		/* update the delay metric */
-		shard->delay_us = Min(shard->delay_us * 2, MAX_RECONNECT_INTERVAL_USEC);
+/*
+ * Queue one request to the pageserver, like PQputCopyData(). With the raw
+ * framing, the request is encoded straight into the output buffer, so that a
+ * batch of requests ends up back to back in one buffer and goes out with a
+ * single send(). Returns the encoded length of the request, or -1 on failure.
+ */
+static int
+ps_put_request(PageServer *shard, NeonRequest *request)
+{
+	RawBuffer  *out = &shard->raw_out;
+	int			len;
+	uint32		n32;
 
-		/*
-		 * Connect using the connection string we got from the
-		 * neon.pageserver_connstring GUC. If the NEON_AUTH_TOKEN environment
-		 * variable was set, use that as the password.
-		 *
-		 * The connection options are parsed in the order they're given, so when
-		 * we set the password before the connection string, the connection string
-		 * can override the password from the env variable. Seems useful, although
-		 * we don't currently use that capability anywhere.
-		 */
-		keywords[0] = "dbname";
-		values[0] = connstr;
-		n_pgsql_params = 1;
+	if (!shard->raw)
+	{
+		char		buf[NM_MAX_REQUEST_SIZE];
 
-		if (neon_auth_token)
-		{
-			keywords[1] = "password";
-			values[1] = neon_auth_token;
-			n_pgsql_params++;
-		}
+		/* libpq copies the message into its own output buffer */
+		len = nm_encode_request(request, buf);
+		if (PQputCopyData(shard->conn, buf, len) <= 0)
+			return -1;
+		return len;
+	}
+	if (shard->raw_failed)
+		return -1;
+
+	ps_raw_reserve(out, 5 + nm_request_size(request));
+	len = nm_encode_request(request, out->data + out->end + 5);
+	out->data[out->end] = 'd';
+	n32 = pg_hton32((uint32) len + 4);
+	memcpy(out->data + out->end + 1, &n32, 4);
+	out->end += 5 + len;
+
+	if (out->end - out->start >= 8192 && ps_raw_send(shard) < 0)
+		return -1;
+	return len;
+}
 
-		keywords[n_pgsql_params] = NULL;
-		values[n_pgsql_params] = NULL;
+/* PQflush() */
+static int
+ps_flush(PageServer *shard)
+{
+	if (!shard->raw)
+		return PQflush(shard->conn);
+	if (shard->raw_failed)
+		return -1;
+	return ps_raw_send(shard);
+}
 
-		shard->conn = PQconnectStartParams(keywords, values, 1);
-		if (PQstatus(shard->conn) == CONNECTION_BAD)
+/* PQconsumeInput(), for a connection in non-blocking mode */
+static bool
+ps_consume_input(PageServer *shard)
+{
+	RawBuffer  *in = &shard->raw_in;
+	int			needed = 8192;
+	ssize_t		n;
+
+	if (!shard->raw)
+		return PQconsumeInput(shard->conn);
+	if (shard->raw_failed)
+		return false;
+
+	/* Push out pending requests first, or their responses might never come */
+	if (ps_raw_send(shard) < 0)
+		return false;
+
+	/*
+	 * Make room for the rest of a partially received message, or at least a
+	 * reasonable amount of data. This can move the unconsumed data to the
+	 * beginning of the buffer, so any message previously returned by
+	 * ps_get_message() becomes invalid.
+	 */
+	if (in->end - in->start >= 5)
+	{
+		uint32		n32;
+
+		memcpy(&n32, in->data + in->start + 1, 4);
+		n32 = pg_ntoh32(n32);
+		if (n32 <= MaxAllocSize)
+			needed = Max(needed, (int) n32 + 1 - (in->end - in->start));
+	}
+	ps_raw_reserve(in, needed);
+
+	for (;;)
+	{
+		n = recv(PQsocket(shard->conn), in->data + in->end, in->size - in->end, 0);
+		if (n > 0)
 		{
-			char	   *msg = pchomp(PQerrorMessage(shard->conn));
-			CLEANUP_AND_DISCONNECT(shard);
-			ereport(elevel,
-					(errcode(ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION),
-						errmsg(NEON_TAG "[shard %d] could not establish connection to pageserver", shard_no),
-						errdetail_internal("%s", msg)));
-			pfree(msg);
+			in->end += n;
+			return true;
+		}
+		if (n == 0)
+		{
+			ps_raw_fail(shard, "server closed the connection unexpectedly");
 			return false;
 		}
-		shard->state = PS_Connecting_Startup;
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return true;
+		ps_raw_fail(shard, "could not receive data from pageserver: %m");
+		return false;
 	}
-	/* FALLTHROUGH */
-	case PS_Connecting_Startup:
-	{
-		char	   *pagestream_query;
-		int			ps_send_query_ret;
-		bool		connected = false;
-		int poll_result = PGRES_POLLING_WRITING;
-		neon_shard_log(shard_no, DEBUG5, "Connection state: Connecting_Startup");
+}
 
-		do
-		{
-			switch (poll_result)
-			{
-			default: /* unknown/unused states are handled as a failed connection */
-			case PGRES_POLLING_FAILED:
-				{
-					char	   *pqerr = PQerrorMessage(shard->conn);
-					char	   *msg = NULL;
-					neon_shard_log(shard_no, DEBUG5, "POLLING_FAILED");
+/*
+ * PQgetCopyData() in async mode. The returned message points into the
+ * input buffer, and stays valid until the next call to ps_consume_input().
+ */
+static int
+ps_get_message(PageServer *shard, char **buffer)
+{
+	RawBuffer  *in = &shard->raw_in;
 
-					if (pqerr)
-						msg = pchomp(pqerr);
+	if (!shard->raw)
+		return PQgetCopyData(shard->conn, buffer, 1 /* async */ );
 
-					CLEANUP_AND_DISCONNECT(shard);
+	for (;;)
+	{
+		int			avail = in->end - in->start;
+		char		type;
+		uint32		n32;
+		int			len;
+		char	   *body;
+
+		if (avail < 5)
+			return shard->raw_failed ? -2 : 0;
+
+		type = in->data[in->start];
+		memcpy(&n32, in->data + in->start + 1, 4);
+		n32 = pg_ntoh32(n32);
+		if (n32 < 4 || n32 > MaxAllocSize)
+		{
+			ps_raw_fail(shard, "invalid message length %u from pageserver", n32);
+			return -2;
+		}
+		len = (int) n32 - 4;
 
-					if (msg)
-					{
-						neon_shard_log(shard_no, elevel,
-									   "could not connect to pageserver: %s",
-									   msg);
-						pfree(msg);
-					}
-					else
-						neon_shard_log(shard_no, elevel,
-									   "could not connect to pageserver");
+		/* Wait for the rest of the message. ps_consume_input() makes room */
+		if (avail < 5 + len)
+			return shard->raw_failed ? -2 : 0;
 
-					return false;
-				}
-			case PGRES_POLLING_READING:
-				/* Sleep until there's something to do */
-				while (true)
-				{
-					int rc = WaitLatchOrSocket(MyLatch,
-											   WL_EXIT_ON_PM_DEATH | WL_LATCH_SET | WL_SOCKET_READABLE,
-											   PQsocket(shard->conn),
-											   0,
-											   WAIT_EVENT_NEON_PS_STARTING);
-					elog(DEBUG5, "PGRES_POLLING_READING=>%d", rc);
-					if (rc & WL_LATCH_SET)
-					{
-						ResetLatch(MyLatch);
-						/* query cancellation, backend shutdown */
-						CHECK_FOR_INTERRUPTS();
-					}
-					if (rc & WL_SOCKET_READABLE)
-						break;
-				}
-				/* PQconnectPoll() handles the socket polling state updates */
+		body = in->data + in->start + 5;
+		in->start += 5 + len;
 
-				break;
-			case PGRES_POLLING_WRITING:
-				/* Sleep until there's something to do */
-				while (true)
+		switch (type)
+		{
+			case 'd':			/* CopyData */
+				*buffer = body;
+				return len;
+			case 'c':			/* CopyDone */
+				return -1;
+			case 'A':			/* NotificationResponse */
+			case 'N':			/* NoticeResponse */
+			case 'S':			/* ParameterStatus */
+				/* asynchronous messages, ignored like libpq does */
+				continue;
+			case 'E':			/* ErrorResponse */
 				{
-					int rc = WaitLatchOrSocket(MyLatch,
-											   WL_EXIT_ON_PM_DEATH | WL_LATCH_SET | WL_SOCKET_WRITEABLE,
-											   PQsocket(shard->conn),
-											   0,
-											   WAIT_EVENT_NEON_PS_STARTING);
-					elog(DEBUG5, "PGRES_POLLING_WRITING=>%d", rc);
-					if (rc & WL_LATCH_SET)
+					const char *msg = "unknown error";
+					char	   *p = body;
+
+					/* find the message field */
+					while (p < body + len && *p != '\0')
 					{
-						ResetLatch(MyLatch);
-						/* query cancellation, backend shutdown */
-						CHECK_FOR_INTERRUPTS();
+						if (*p == 'M')
+						{
+							msg = p + 1;
+							break;
+						}
+						p += strnlen(p + 1, body + len - p - 1) + 2;
 					}
-					if (rc & WL_SOCKET_WRITEABLE)
-						break;
+					ps_raw_fail(shard, "ERROR:  %.*s", (int) strnlen(msg, body + len - msg), msg);
+					return -2;
 				}
-				/* PQconnectPoll() handles the socket polling state updates */
+			default:
+				ps_raw_fail(shard, "unexpected message type 0x%02x from pageserver", (unsigned char) type);
+				return -2;
+		}
+	}
+}
 
-				break;
-			case PGRES_POLLING_OK:
-				neon_shard_log(shard_no, DEBUG5, "POLLING_OK");
-				connected = true;
-				break;
-			}
-			poll_result = PQconnectPoll(shard->conn);
-			elog(DEBUG5, "PQconnectPoll=>%d", poll_result);
-		}
-		while (!connected);
+/* PQfreemem() for messages returned by ps_get_message() */
+static void
+ps_free_message(PageServer *shard, char *buffer)
+{
+	if (!shard->raw)
+		PQfreemem(buffer);
+}
+
+/* PQerrorMessage() */
+static const char *
+ps_error_message(PageServer *shard)
+{
+	if (shard->raw && shard->raw_failed)
+		return shard->raw_error;
+	return PQerrorMessage(shard->conn);
+}
+
+/* PQstatus(conn) == CONNECTION_BAD */
+static bool
+ps_connection_bad(PageServer *shard)
+{
+	if (shard->raw && shard->raw_failed)
+		return true;
+	return PQstatus(shard->conn) == CONNECTION_BAD;
+}
+
+/*
+ * Start a non-blocking connection attempt to a pageserver. On success, the
+ * connection is in PS_Connecting_Startup state, and must be driven forward
+ * with PQconnectPoll(), starting by waiting for the socket to become
+ * writeable.
+ */
+static bool
+pageserver_start_connection(PageServer *shard, shardno_t shard_no,
+							const char *connstr, int elevel)
+{
+	const char *keywords[3];
+	const char *values[3];
+	int			n_pgsql_params;
+
+	/*
+	 * Connect using the connection string we got from the
+	 * neon.pageserver_connstring GUC. If the NEON_AUTH_TOKEN environment
+	 * variable was set, use that as the password.
+	 *
+	 * The connection options are parsed in the order they're given, so when
+	 * we set the password before the connection string, the connection string
+	 * can override the password from the env variable. Seems useful, although
+	 * we don't currently use that capability anywhere.
+	 */
+	keywords[0] = "dbname";
+	values[0] = connstr;
+	n_pgsql_params = 1;
+
+	if (neon_auth_token)
+	{
+		keywords[1] = "password";
+		values[1] = neon_auth_token;
+		n_pgsql_params++;
+	}
+
+	keywords[n_pgsql_params] = NULL;
+	values[n_pgsql_params] = NULL;
+
+	INSTR_TIME_SET_CURRENT(shard->connect_start);
+	shard->conn = PQconnectStartParams(keywords, values, 1);
+	if (PQstatus(shard->conn) == CONNECTION_BAD)
+	{
+		char	   *msg = pchomp(PQerrorMessage(shard->conn));
+		CLEANUP_AND_DISCONNECT(shard);
+		ereport(elevel,
+				(errcode(ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION),
+					errmsg(NEON_TAG "[shard %d] could not establish connection to pageserver", shard_no),
+					errdetail_internal("%s", msg)));
+		pfree(msg);
+		return false;
+	}
+	shard->state = PS_Connecting_Startup;
+	return true;
+}
+
+/*
+ * Once the libpq connection has been established, send the pagestream
+ * command, moving the connection to PS_Connecting_PageStream state.
+ */
+static bool
+pageserver_start_pagestream(PageServer *shard, shardno_t shard_no, int elevel)
+{
+	char	   *pagestream_query;
+	int			ps_send_query_ret;
 
-		/* No more polling needed; connection succeeded */
-		shard->last_connect_time = GetCurrentTimestamp();
+	shard->last_connect_time = GetCurrentTimestamp();
 
 #if PG_MAJORVERSION_NUM >= 17
-		shard->wes_read = CreateWaitEventSet(NULL, 3);
+	shard->wes_read = CreateWaitEventSet(NULL, 3);
 #else
-		shard->wes_read = CreateWaitEventSet(TopMemoryContext, 3);
+	shard->wes_read = CreateWaitEventSet(TopMemoryContext, 3);
 #endif
-		AddWaitEventToSet(shard->wes_read, WL_LATCH_SET, PGINVALID_SOCKET,
-						  MyLatch, NULL);
-		AddWaitEventToSet(shard->wes_read, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET,
-						  NULL, NULL);
-		AddWaitEventToSet(shard->wes_read, WL_SOCKET_READABLE, PQsocket(shard->conn), NULL, NULL);
+	AddWaitEventToSet(shard->wes_read, WL_LATCH_SET, PGINVALID_SOCKET,
+					  MyLatch, NULL);
+	AddWaitEventToSet(shard->wes_read, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET,
+					  NULL, NULL);
+	AddWaitEventToSet(shard->wes_read, WL_SOCKET_READABLE, PQsocket(shard->conn), NULL, NULL);
 
+#if PG_MAJORVERSION_NUM >= 17
+	shard->wes_write = CreateWaitEventSet(NULL, 3);
+#else
+	shard->wes_write = CreateWaitEventSet(TopMemoryContext, 3);
+#endif
+	AddWaitEventToSet(shard->wes_write, WL_LATCH_SET, PGINVALID_SOCKET,
+					  MyLatch, NULL);
+	AddWaitEventToSet(shard->wes_write, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET,
+					  NULL, NULL);
+	AddWaitEventToSet(shard->wes_write, WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE,
+					  PQsocket(shard->conn), NULL, NULL);
+
+	switch (neon_protocol_version)
+	{
+	case 4:
+		pagestream_query = psprintf("pagestream_v4 %s %s", neon_tenant, neon_timeline);
+		break;
+	case 3:
+		pagestream_query = psprintf("pagestream_v3 %s %s", neon_tenant, neon_timeline);
+		break;
+	case 2:
+		pagestream_query = psprintf("pagestream_v2 %s %s", neon_tenant, neon_timeline);
+		break;
+	default:
+		elog(ERROR, "unexpected neon_protocol_version %d", neon_protocol_version);
+	}
 
-		switch (neon_protocol_version)
-		{
-		case 3:
-			pagestream_query = psprintf("pagestream_v3 %s %s", neon_tenant, neon_timeline);
-			break;
-		case 2:
-			pagestream_query = psprintf("pagestream_v2 %s %s", neon_tenant, neon_timeline);
-			break;
-		default:
-			elog(ERROR, "unexpected neon_protocol_version %d", neon_protocol_version);
-		}
+	/*
+	 * Ask for compressed GetPage responses. The compressed responses
+	 * carry the V3 header, so this is not supported with protocol
+	 * version 2.
+	 */
+	if (neon_pageserver_compression == PAGESTREAM_COMPRESSION_ZSTD &&
+		neon_protocol_version >= 3)
+	{
+		char	   *query = psprintf("%s --compression=zstd", pagestream_query);
 
-		if (PQstatus(shard->conn) == CONNECTION_BAD)
+		pfree(pagestream_query);
+		pagestream_query = query;
+	}
+
+	if (PQstatus(shard->conn) == CONNECTION_BAD)
+	{
+		char	   *msg = pchomp(PQerrorMessage(shard->conn));
+
+		CLEANUP_AND_DISCONNECT(shard);
+
+		ereport(elevel,
+				(errcode(ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION),
+					errmsg(NEON_TAG "[shard %d] could not establish connection to pageserver", shard_no),
+					errdetail_internal("%s", msg)));
+		pfree(msg);
+		return false;
+	}
+
+	ps_send_query_ret = PQsendQuery(shard->conn, pagestream_query);
+	pfree(pagestream_query);
+	if (ps_send_query_ret != 1)
+	{
+		CLEANUP_AND_DISCONNECT(shard);
+
+		neon_shard_log(shard_no, elevel, "could not send pagestream command to pageserver");
+		return false;
+	}
+
+	/* From now on, requests are queued and sent without blocking */
+	if (PQsetnonblocking(shard->conn, 1) != 0)
+	{
+		char	   *msg = pchomp(PQerrorMessage(shard->conn));
+
+		CLEANUP_AND_DISCONNECT(shard);
+		neon_shard_log(shard_no, elevel, "could not switch pageserver connection to non-blocking mode: %s", msg);
+		pfree(msg);
+		return false;
+	}
+
+	shard->state = PS_Connecting_PageStream;
+	return true;
+}
+
+/*
+ * The pageserver has accepted the pagestream command; the connection is
+ * ready for requests.
+ */
+static void
+pageserver_connection_established(PageServer *shard)
+{
+	instr_time	elapsed;
+
+	shard->state = PS_Connected;
+	shard->nrequests_sent = 0;
+	shard->nresponses_received = 0;
+
+	if (pageserver_raw_framing && !PQsslInUse(shard->conn))
+		ps_start_raw_framing(shard);
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, shard->connect_start);
+	inc_pageserver_connect_wait(INSTR_TIME_GET_MICROSEC(elapsed));
+}
+
+/*
+ * Connect to a pageserver, or continue to try to connect if we're yet to
+ * complete the connection (e.g. due to receiving an earlier cancellation
+ * during connection start).
+ * Returns true if successfully connected; false if the connection failed.
+ * 
+ * Throws errors in unrecoverable situations, or when this backend's query
+ * is canceled.
+ */
+static bool
+pageserver_connect(shardno_t shard_no, int elevel)
+{
+	char		connstr[MAX_PAGESERVER_CONNSTRING_SIZE];
+	bool		was_connected;
+
+	/*
+	 * Get the connection string for this shard. If the shard map has been
+	 * updated since we last looked, this will also disconnect any existing
+	 * pageserver connections as a side effect.
+	 * Note that connstr is used both during connection start, and when we
+	 * log the successful connection.
+	 */
+	load_shard_map(shard_no, 0, connstr, NULL);
+
+	was_connected = page_servers[shard_no].state == PS_Connected;
+	if (!pageserver_connect_endpoint(&page_servers[shard_no], shard_no, connstr, elevel))
+		return false;
+
+	if (!was_connected)
+		hedge_init(shard_no);
+	return true;
+}
+
+/*
+ * Connect to one endpoint of a shard, the primary or a secondary.
+ */
+static bool
+pageserver_connect_endpoint(PageServer *shard, shardno_t shard_no,
+							const char *connstr, int elevel)
+{
+	switch (shard->state)
+	{
+	case PS_Disconnected:
+	{
+		TimestampTz	now;
+		int64		us_since_last_attempt;
+
+		/* Make sure we start with a clean slate */
+		CLEANUP_AND_DISCONNECT(shard);
+
+		neon_shard_log(shard_no, DEBUG5, "Connection state: Disconnected");
+
+		now = GetCurrentTimestamp();
+		us_since_last_attempt = (int64) (now - shard->last_reconnect_time);
+		shard->last_reconnect_time = now;
+
+		/*
+		 * Make sure we don't do exponential backoff with a constant multiplier
+		 * of 0 us, as that doesn't really do much for timeouts...
+		 *
+		 * cf. https://github.com/neondatabase/neon/issues/7897
+		 */
+		if (shard->delay_us == 0)
+			shard->delay_us = MIN_RECONNECT_INTERVAL_USEC;
+
+		/*
+		 * If we did other tasks between reconnect attempts, then we won't
+		 * need to wait as long as a full delay.
+		 */
+		if (us_since_last_attempt < shard->delay_us)
 		{
-			char	   *msg = pchomp(PQerrorMessage(shard->conn));
+			pg_usleep(shard->delay_us - us_since_last_attempt);
+		}
 
-			CLEANUP_AND_DISCONNECT(shard);
+		/* update the delay metric */
+		shard->delay_us = Min(shard->delay_us * 2, MAX_RECONNECT_INTERVAL_USEC);
 
-			ereport(elevel,
-					(errcode(ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION),
-						errmsg(NEON_TAG "[shard %d] could not establish connection to pageserver", shard_no),
-						errdetail_internal("%s", msg)));
-			pfree(msg);
+		if (!pageserver_start_connection(shard, shard_no, connstr, elevel))
 			return false;
-		}
+	}
+	/* FALLTHROUGH */
+	case PS_Connecting_Startup:
+	{
+		bool		connected = false;
+		int poll_result = PGRES_POLLING_WRITING;
+		neon_shard_log(shard_no, DEBUG5, "Connection state: Connecting_Startup");
 
-		ps_send_query_ret = PQsendQuery(shard->conn, pagestream_query);
-		pfree(pagestream_query);
-		if (ps_send_query_ret != 1)
+		do
 		{
-			CLEANUP_AND_DISCONNECT(shard);
+			switch (poll_result)
+			{
+			default: /* unknown/unused states are handled as a failed connection */
+			case PGRES_POLLING_FAILED:
+				{
+					char	   *pqerr = PQerrorMessage(shard->conn);
+					char	   *msg = NULL;
+					neon_shard_log(shard_no, DEBUG5, "POLLING_FAILED");
 
-			neon_shard_log(shard_no, elevel, "could not send pagestream command to pageserver");
-			return false;
+					if (pqerr)
+						msg = pchomp(pqerr);
+
+					CLEANUP_AND_DISCONNECT(shard);
+
+					if (msg)
+					{
+						neon_shard_log(shard_no, elevel,
+									   "could not connect to pageserver: %s",
+									   msg);
+						pfree(msg);
+					}
+					else
+						neon_shard_log(shard_no, elevel,
+									   "could not connect to pageserver");
+
+					return false;
+				}
+			case PGRES_POLLING_READING:
+				/* Sleep until there's something to do */
+				while (true)
+				{
+					int rc = WaitLatchOrSocket(MyLatch,
+											   WL_EXIT_ON_PM_DEATH | WL_LATCH_SET | WL_SOCKET_READABLE,
+											   PQsocket(shard->conn),
+											   0,
+											   WAIT_EVENT_NEON_PS_STARTING);
+					elog(DEBUG5, "PGRES_POLLING_READING=>%d", rc);
+					if (rc & WL_LATCH_SET)
+					{
+						ResetLatch(MyLatch);
+						/* query cancellation, backend shutdown */
+						CHECK_FOR_INTERRUPTS();
+					}
+					if (rc & WL_SOCKET_READABLE)
+						break;
+				}
+				/* PQconnectPoll() handles the socket polling state updates */
+
+				break;
+			case PGRES_POLLING_WRITING:
+				/* Sleep until there's something to do */
+				while (true)
+				{
+					int rc = WaitLatchOrSocket(MyLatch,
+											   WL_EXIT_ON_PM_DEATH | WL_LATCH_SET | WL_SOCKET_WRITEABLE,
+											   PQsocket(shard->conn),
+											   0,
+											   WAIT_EVENT_NEON_PS_STARTING);
+					elog(DEBUG5, "PGRES_POLLING_WRITING=>%d", rc);
+					if (rc & WL_LATCH_SET)
+					{
+						ResetLatch(MyLatch);
+						/* query cancellation, backend shutdown */
+						CHECK_FOR_INTERRUPTS();
+					}
+					if (rc & WL_SOCKET_WRITEABLE)
+						break;
+				}
+				/* PQconnectPoll() handles the socket polling state updates */
+
+				break;
+			case PGRES_POLLING_OK:
+				neon_shard_log(shard_no, DEBUG5, "POLLING_OK");
+				connected = true;
+				break;
+			}
+			poll_result = PQconnectPoll(shard->conn);
+			elog(DEBUG5, "PQconnectPoll=>%d", poll_result);
 		}
+		while (!connected);
 
-		shard->state = PS_Connecting_PageStream;
+		if (!pageserver_start_pagestream(shard, shard_no, elevel))
+			return false;
 	}
 	/* FALLTHROUGH */
 	case PS_Connecting_PageStream:
@@ -636,9 +1247,7 @@ pageserver_connect(shardno_t shard_no, int elevel)
 			}
 		}
 
-		shard->state = PS_Connected;
-		shard->nrequests_sent = 0;
-		shard->nresponses_received = 0;
+		pageserver_connection_established(shard);
 	}
 	/* FALLTHROUGH */
 	case PS_Connected:
@@ -658,6 +1267,206 @@ pageserver_connect(shardno_t shard_no, int elevel)
 	Assert(false);
 }
 
+/*
+ * Advance a non-blocking connection attempt, started by
+ * pageserver_connect_all(), after its socket has become ready.
+ *
+ * Returns the socket event to wait for before the next step, or 0 if the
+ * attempt has finished, successfully or not.
+ */
+static int
+pageserver_connect_step(shardno_t shard_no, int elevel)
+{
+	PageServer *shard = &page_servers[shard_no];
+
+	if (shard->state == PS_Connecting_Startup)
+	{
+		switch (PQconnectPoll(shard->conn))
+		{
+			case PGRES_POLLING_READING:
+				return WL_SOCKET_READABLE;
+			case PGRES_POLLING_WRITING:
+				return WL_SOCKET_WRITEABLE;
+			case PGRES_POLLING_OK:
+				if (!pageserver_start_pagestream(shard, shard_no, elevel))
+					return 0;
+				break;
+			default:
+				{
+					char	   *msg = pchomp(PQerrorMessage(shard->conn));
+
+					CLEANUP_AND_DISCONNECT(shard);
+					neon_shard_log(shard_no, elevel, "could not connect to pageserver: %s", msg);
+					pfree(msg);
+					return 0;
+				}
+		}
+	}
+
+	Assert(shard->state == PS_Connecting_PageStream);
+	if (!PQconsumeInput(shard->conn))
+	{
+		char	   *msg = pchomp(PQerrorMessage(shard->conn));
+
+		CLEANUP_AND_DISCONNECT(shard);
+		neon_shard_log(shard_no, elevel, "could not complete handshake with pageserver: %s", msg);
+		pfree(msg);
+		return 0;
+	}
+	if (PQisBusy(shard->conn))
+		return WL_SOCKET_READABLE;
+
+	pageserver_connection_established(shard);
+	shard->delay_us = MIN_RECONNECT_INTERVAL_USEC;
+	neon_shard_log(shard_no, LOG, "libpagestore: connected to pageserver with protocol version %d", neon_protocol_version);
+
+	hedge_init(shard_no);
+	return 0;
+}
+
+/*
+ * Connect to all the shards that we're not connected to, in parallel.
+ *
+ * pageserver_connect() establishes one connection at a time, and only when
+ * the first request to the shard is sent, so a backend's first query pays
+ * for the connection setup of every shard it touches, one after another.
+ * This starts non-blocking connection attempts to all the shards at once, and
+ * drives them through the libpq startup and the pagestream handshake by
+ * waiting on all of their sockets in one WaitEventSet.
+ *
+ * Failures are reported at 'elevel', and leave the shard disconnected, to be
+ * retried by pageserver_connect() when it is needed. Shards that are still
+ * within their reconnection backoff period are skipped, rather than waited
+ * for.
+ */
+static void
+pageserver_connect_all(int elevel)
+{
+	int			want[MAX_SHARDS];
+	WaitEvent	events[MAX_SHARDS + 2];
+	shardno_t	num_shards;
+	int			npending = 0;
+	bool		rebuild = true;
+	TimestampTz now;
+
+	if (neon_tenant[0] == '\0' || neon_timeline[0] == '\0')
+		return;
+
+	/* Left behind if we errored out in the middle of the previous call */
+	if (wes_connect)
+	{
+		FreeWaitEventSet(wes_connect);
+		wes_connect = NULL;
+	}
+
+	/* This will close all connections if the shard map has changed */
+	load_shard_map(0, 0, NULL, &num_shards);
+
+	now = GetCurrentTimestamp();
+	for (shardno_t shard_no = 0; shard_no < num_shards; shard_no++)
+	{
+		PageServer *shard = &page_servers[shard_no];
+		char		connstr[MAX_PAGESERVER_CONNSTRING_SIZE];
+
+		want[shard_no] = 0;
+		if (shard->state != PS_Disconnected)
+			continue;
+
+		if (shard->delay_us == 0)
+			shard->delay_us = MIN_RECONNECT_INTERVAL_USEC;
+		if ((int64) (now - shard->last_reconnect_time) < shard->delay_us)
+			continue;
+		shard->last_reconnect_time = now;
+		shard->delay_us = Min(shard->delay_us * 2, MAX_RECONNECT_INTERVAL_USEC);
+
+		load_shard_map(shard_no, 0, connstr, NULL);
+		if (!pageserver_start_connection(shard, shard_no, connstr, elevel))
+			continue;
+
+		/* PQconnectPoll() must not be called until the socket is writeable */
+		want[shard_no] = WL_SOCKET_WRITEABLE;
+		npending++;
+	}
+
+	for (;;)
+	{
+		int			nevents;
+
+		/*
+		 * Loading the shard map, in pageserver_connect_step() or above,
+		 * closes all connections if the map has changed. Give up on those.
+		 */
+		for (shardno_t shard_no = 0; shard_no < num_shards; shard_no++)
+		{
+			if (want[shard_no] != 0 && page_servers[shard_no].state == PS_Disconnected)
+			{
+				want[shard_no] = 0;
+				npending--;
+				rebuild = true;
+			}
+		}
+		if (npending == 0)
+			break;
+
+		/*
+		 * The socket of a connection can change while it's being
+		 * established, when libpq moves on to the next address or retries
+		 * without SSL, so rebuild the set whenever a connection progressed.
+		 */
+		if (rebuild)
+		{
+			if (wes_connect)
+				FreeWaitEventSet(wes_connect);
+#if PG_MAJORVERSION_NUM >= 17
+			wes_connect = CreateWaitEventSet(NULL, num_shards + 2);
+#else
+			wes_connect = CreateWaitEventSet(TopMemoryContext, num_shards + 2);
+#endif
+			AddWaitEventToSet(wes_connect, WL_LATCH_SET, PGINVALID_SOCKET,
+							  MyLatch, NULL);
+			AddWaitEventToSet(wes_connect, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET,
+							  NULL, NULL);
+			for (shardno_t shard_no = 0; shard_no < num_shards; shard_no++)
+			{
+				if (want[shard_no] != 0)
+					AddWaitEventToSet(wes_connect, want[shard_no],
+									  PQsocket(page_servers[shard_no].conn),
+									  NULL, (void *) (intptr_t) shard_no);
+			}
+			rebuild = false;
+		}
+
+		nevents = WaitEventSetWait(wes_connect, -1L, events, lengthof(events),
+								   WAIT_EVENT_NEON_PS_STARTING);
+
+		for (int i = 0; i < nevents; i++)
+		{
+			shardno_t	shard_no = (shardno_t) (intptr_t) events[i].user_data;
+
+			if (events[i].events & WL_LATCH_SET)
+			{
+				ResetLatch(MyLatch);
+				/* query cancellation, backend shutdown */
+				CHECK_FOR_INTERRUPTS();
+				continue;
+			}
+			if ((events[i].events & (WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE)) == 0)
+				continue;
+
+			want[shard_no] = pageserver_connect_step(shard_no, elevel);
+			if (want[shard_no] == 0)
+				npending--;
+			rebuild = true;
+		}
+	}
+
+	if (wes_connect)
+	{
+		FreeWaitEventSet(wes_connect);
+		wes_connect = NULL;
+	}
+}
+
 /*
  * A wrapper around PQgetCopyData that checks for interrupts while sleeping.
  */
@@ -666,7 +1475,6 @@ call_PQgetCopyData(shardno_t shard_no, char **buffer)
 {
 	int			ret;
 	PageServer *shard = &page_servers[shard_no];
-	PGconn	   *pageserver_conn = shard->conn;
 	instr_time	now,
 				start_ts,
 				since_start,
@@ -690,7 +1498,7 @@ call_PQgetCopyData(shardno_t shard_no, char **buffer)
 	INSTR_TIME_SET_ZERO(since_last_log);
 
 retry:
-	ret = PQgetCopyData(pageserver_conn, buffer, 1 /* async */ );
+	ret = ps_get_message(shard, buffer);
 
 	if (ret == 0)
 	{
@@ -709,9 +1517,9 @@ retry:
 		/* Data available in socket? */
 		if (event.events & WL_SOCKET_READABLE)
 		{
-			if (!PQconsumeInput(pageserver_conn))
+			if (!ps_consume_input(shard))
 			{
-				char	   *msg = pchomp(PQerrorMessage(pageserver_conn));
+				char	   *msg = pchomp(ps_error_message(shard));
 
 				neon_shard_log(shard_no, LOG, "could not get response from pageserver: %s", msg);
 				pfree(msg);
@@ -746,77 +1554,506 @@ retry:
 	 */
 	if (logged)
 	{
-		INSTR_TIME_SET_CURRENT(now);
-		since_start = now;
-		INSTR_TIME_SUBTRACT(since_start, start_ts);
-		neon_shard_log(shard_no, LOG, "received response from pageserver after %0.3f s",
-					   INSTR_TIME_GET_DOUBLE(since_start));
+		INSTR_TIME_SET_CURRENT(now);
+		since_start = now;
+		INSTR_TIME_SUBTRACT(since_start, start_ts);
+		neon_shard_log(shard_no, LOG, "received response from pageserver after %0.3f s",
+					   INSTR_TIME_GET_DOUBLE(since_start));
+	}
+
+	return ret;
+}
+
+/*
+ * Reset prefetch and drop connection to the shard.
+ * It also drops connection to all other shards involved in prefetch, through
+ * prefetch_on_ps_disconnect().
+ */
+static void
+pageserver_disconnect(shardno_t shard_no)
+{
+	/*
+	 * If the connection to any pageserver is lost, we throw away the
+	 * whole prefetch queue, even for other pageservers. It should not
+	 * cause big problems, because connection loss is supposed to be a
+	 * rare event.
+	 */
+	prefetch_on_ps_disconnect();
+
+	pageserver_disconnect_shard(shard_no);
+}
+
+/*
+ * Disconnect from specified shard
+ */
+static void
+pageserver_disconnect_shard(shardno_t shard_no)
+{
+	PageServer *shard = &page_servers[shard_no];
+	/*
+	 * If anything goes wrong while we were sending a request, it's not clear
+	 * what state the connection is in. For example, if we sent the request
+	 * but didn't receive a response yet, we might receive the response some
+	 * time later after we have already sent a new unrelated request. Close
+	 * the connection to avoid getting confused.
+	 * Similarly, even when we're in PS_DISCONNECTED, we may have junk to
+	 * clean up: It is possible that we encountered an error allocating any
+	 * of the wait event sets or the psql connection, or failed when we tried
+	 * to attach wait events to the WaitEventSets.
+	 */
+	CLEANUP_AND_DISCONNECT(shard);
+
+	shard->state = PS_Disconnected;
+
+	hedge_reset(shard_no);
+}
+
+/*
+ * Forget the requests that were tracked for hedging, and close the
+ * connection to the secondary.
+ */
+static void
+hedge_reset(shardno_t shard_no)
+{
+	ShardHedgeState *hedge = &shard_hedges[shard_no];
+	MemoryContext old = MemoryContextSwitchTo(TopMemoryContext);
+	ListCell   *lc;
+
+	foreach(lc, hedge->sent)
+		free_hedge_requests = lappend(free_hedge_requests, lfirst(lc));
+	list_free(hedge->sent);
+	MemoryContextSwitchTo(old);
+
+	hedge->sent = NIL;
+	hedge->enabled = false;
+	hedge->head_hedged = false;
+	hedge->primary_skip = 0;
+	hedge->secondary_skip = 0;
+
+	if (hedge->wes)
+	{
+		FreeWaitEventSet(hedge->wes);
+		hedge->wes = NULL;
+	}
+	CLEANUP_AND_DISCONNECT(&hedge->secondary);
+}
+
+/*
+ * Set up hedging for a new connection to the primary of the shard.
+ */
+static void
+hedge_init(shardno_t shard_no)
+{
+	ShardHedgeState *hedge = &shard_hedges[shard_no];
+	char		connstr[MAX_PAGESERVER_CONNSTRING_SIZE];
+	int			nsecondaries = 0;
+
+	hedge_reset(shard_no);
+
+	if (pageserver_hedge_percentile == 0)
+		return;
+
+	for (int endpoint = 1; endpoint < MAX_SHARD_ENDPOINTS; endpoint++)
+	{
+		load_shard_map(shard_no, endpoint, connstr, NULL);
+		if (connstr[0] == '\0')
+			break;
+		nsecondaries++;
+	}
+
+	/* loading the shard map may have closed all connections */
+	if (nsecondaries == 0 || page_servers[shard_no].state != PS_Connected)
+		return;
+
+	/* spread the backends over the secondaries */
+	hedge->endpoint = 1 + MyProcPid % nsecondaries;
+	hedge->enabled = true;
+}
+
+/*
+ * Remember a request sent to the primary, until its response arrives.
+ */
+static void
+hedge_track_request(shardno_t shard_no, NeonRequest *request)
+{
+	ShardHedgeState *hedge = &shard_hedges[shard_no];
+	MemoryContext old = MemoryContextSwitchTo(TopMemoryContext);
+	HedgeSentRequest *sent;
+
+	if (free_hedge_requests != NIL)
+	{
+		sent = llast(free_hedge_requests);
+		free_hedge_requests = list_delete_last(free_hedge_requests);
+	}
+	else
+		sent = palloc(sizeof(HedgeSentRequest));
+
+	sent->hedgeable = (request->tag == T_NeonGetPageRequest);
+	if (sent->hedgeable)
+		sent->request = *(NeonGetPageRequest *) request;
+	INSTR_TIME_SET_CURRENT(sent->sent_at);
+
+	hedge->sent = lappend(hedge->sent, sent);
+	MemoryContextSwitchTo(old);
+}
+
+/*
+ * Forget the oldest request sent to the shard, whose response has arrived,
+ * and add its response time to the statistics.
+ */
+static void
+hedge_pop_request(shardno_t shard_no)
+{
+	ShardHedgeState *hedge = &shard_hedges[shard_no];
+	HedgeSentRequest *sent = linitial(hedge->sent);
+	MemoryContext old;
+
+	if (sent->hedgeable)
+	{
+		instr_time	elapsed;
+		uint64		latency_us;
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, sent->sent_at);
+		latency_us = INSTR_TIME_GET_MICROSEC(elapsed);
+
+		if (hedge_latency_count >= HEDGE_MAX_SAMPLES)
+		{
+			hedge_latency_count = 0;
+			for (int i = 0; i < NUM_IO_WAIT_BUCKETS; i++)
+			{
+				hedge_latency_buckets[i] /= 2;
+				hedge_latency_count += hedge_latency_buckets[i];
+			}
+		}
+		hedge_latency_buckets[io_wait_bucket(latency_us)]++;
+		hedge_latency_count++;
+	}
+
+	hedge->sent = list_delete_first(hedge->sent);
+	hedge->head_hedged = false;
+
+	old = MemoryContextSwitchTo(TopMemoryContext);
+	free_hedge_requests = lappend(free_hedge_requests, sent);
+	MemoryContextSwitchTo(old);
+}
+
+/*
+ * How long to wait for the response to a GetPage request before hedging it,
+ * in microseconds, or -1 if we don't know enough about recent response times
+ * yet.
+ */
+static int64
+hedge_delay_us(void)
+{
+	uint64		target;
+	uint64		accum = 0;
+
+	if (hedge_latency_count < HEDGE_MIN_SAMPLES)
+		return -1;
+
+	target = (hedge_latency_count * pageserver_hedge_percentile + 99) / 100;
+	for (int bucketno = 0; bucketno < NUM_IO_WAIT_BUCKETS; bucketno++)
+	{
+		accum += hedge_latency_buckets[bucketno];
+		if (accum >= target)
+		{
+			if (io_wait_bucket_upper(bucketno) == UINT64_MAX)
+				return -1;
+			return Max((int64) io_wait_bucket_upper(bucketno),
+					   (int64) pageserver_hedge_min_delay * 1000);
+		}
+	}
+	return -1;
+}
+
+static void
+hedge_secondary_failed(shardno_t shard_no)
+{
+	ShardHedgeState *hedge = &shard_hedges[shard_no];
+	char	   *msg = pchomp(ps_error_message(&hedge->secondary));
+
+	neon_shard_log(shard_no, LOG, "lost connection to secondary pageserver: %s", msg);
+	pfree(msg);
+
+	/* the primary will answer the request */
+	CLEANUP_AND_DISCONNECT(&hedge->secondary);
+	hedge->secondary_skip = 0;
+	hedge->head_hedged = false;
+}
+
+/*
+ * Send a copy of the oldest request to the shard to the secondary, if it
+ * has been waiting for longer than the hedge delay.
+ *
+ * Returns the time in ms until the request should be hedged, or -1 if there
+ * is nothing to hedge.
+ */
+static long
+hedge_maybe_send(shardno_t shard_no)
+{
+	ShardHedgeState *hedge = &shard_hedges[shard_no];
+	PageServer *secondary = &hedge->secondary;
+	HedgeSentRequest *head;
+	int64		delay_us;
+	instr_time	elapsed;
+	int64		elapsed_us;
+
+	if (!hedge->enabled || hedge->sent == NIL || hedge->head_hedged ||
+		pageserver_hedge_percentile == 0)
+		return -1;
+
+	head = linitial(hedge->sent);
+	if (!head->hedgeable)
+		return -1;
+
+	delay_us = hedge_delay_us();
+	if (delay_us < 0)
+		return -1;
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, head->sent_at);
+	elapsed_us = INSTR_TIME_GET_MICROSEC(elapsed);
+	if (elapsed_us < delay_us)
+		return (long) ((delay_us - elapsed_us + 999) / 1000);
+
+	if (secondary->state != PS_Connected)
+	{
+		char		connstr[MAX_PAGESERVER_CONNSTRING_SIZE];
+
+		/*
+		 * Back off after failed connection attempts, but don't sleep like
+		 * pageserver_connect_endpoint() would: the primary may still answer.
+		 */
+		if (GetCurrentTimestamp() - secondary->last_reconnect_time < secondary->delay_us)
+			return -1;
+
+		/* this can close all connections, if the shard map has changed */
+		load_shard_map(shard_no, hedge->endpoint, connstr, NULL);
+		if (!hedge->enabled)
+			return -1;
+
+		if (!pageserver_connect_endpoint(secondary, shard_no, connstr, LOG))
+			return -1;
+	}
+
+	if (ps_put_request(secondary, (NeonRequest *) &head->request) < 0 ||
+		ps_flush(secondary) < 0)
+	{
+		hedge_secondary_failed(shard_no);
+		return -1;
+	}
+
+	secondary->nrequests_sent++;
+	hedge->head_hedged = true;
+	MyNeonCounters->pageserver_hedged_requests_total++;
+
+	return -1;
+}
+
+/*
+ * Non-blocking read of the next message from one of the connections of a
+ * shard. Returns its length, 0 if no complete message has arrived yet, or
+ * -1 if the connection is broken.
+ */
+static int
+hedge_read_message(PageServer *shard, char **buffer)
+{
+	int			rc;
+
+	if (shard->state != PS_Connected || !ps_consume_input(shard))
+		return -1;
+
+	rc = ps_get_message(shard, buffer);
+	if (rc > 0)
+		shard->nresponses_received++;
+	return rc >= 0 ? rc : -1;
+}
+
+/*
+ * Wait until either connection of the shard has data to read, or until the
+ * timeout (in ms) expires.
+ */
+static void
+hedge_wait(shardno_t shard_no, long timeout)
+{
+	ShardHedgeState *hedge = &shard_hedges[shard_no];
+	PageServer *primary = &page_servers[shard_no];
+	WaitEvent	event;
+
+	if (hedge->wes == NULL ||
+		hedge->wes_primary_key != CONNECTION_KEY(primary) ||
+		hedge->wes_secondary_key != CONNECTION_KEY(&hedge->secondary))
+	{
+		if (hedge->wes)
+			FreeWaitEventSet(hedge->wes);
+#if PG_MAJORVERSION_NUM >= 17
+		hedge->wes = CreateWaitEventSet(NULL, 4);
+#else
+		hedge->wes = CreateWaitEventSet(TopMemoryContext, 4);
+#endif
+		AddWaitEventToSet(hedge->wes, WL_LATCH_SET, PGINVALID_SOCKET,
+						  MyLatch, NULL);
+		AddWaitEventToSet(hedge->wes, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET,
+						  NULL, NULL);
+		AddWaitEventToSet(hedge->wes, WL_SOCKET_READABLE, PQsocket(primary->conn),
+						  NULL, NULL);
+		if (hedge->secondary.state == PS_Connected)
+			AddWaitEventToSet(hedge->wes, WL_SOCKET_READABLE,
+							  PQsocket(hedge->secondary.conn), NULL, NULL);
+		hedge->wes_primary_key = CONNECTION_KEY(primary);
+		hedge->wes_secondary_key = CONNECTION_KEY(&hedge->secondary);
 	}
 
-	return ret;
+	(void) WaitEventSetWait(hedge->wes, timeout, &event, 1,
+							WAIT_EVENT_NEON_PS_READ);
+	ResetLatch(MyLatch);
+
+	CHECK_FOR_INTERRUPTS();
 }
 
 /*
- * Reset prefetch and drop connection to the shard.
- * It also drops connection to all other shards involved in prefetch, through
- * prefetch_on_ps_disconnect().
+ * Unpack the response to the oldest request sent to the shard, received on
+ * connection 'from'.
  */
-static void
-pageserver_disconnect(shardno_t shard_no)
+static NeonResponse *
+hedge_unpack_response(shardno_t shard_no, PageServer *from, char *data, int len)
 {
-	/*
-	 * If the connection to any pageserver is lost, we throw away the
-	 * whole prefetch queue, even for other pageservers. It should not
-	 * cause big problems, because connection loss is supposed to be a
-	 * rare event.
-	 */
-	prefetch_on_ps_disconnect();
+	StringInfoData resp_buff;
+	NeonResponse *resp;
 
-	pageserver_disconnect_shard(shard_no);
+	hedge_pop_request(shard_no);
+
+	PG_TRY();
+	{
+		resp_buff.data = data;
+		resp_buff.len = len;
+		resp_buff.cursor = 0;
+		resp = nm_unpack_response(&resp_buff);
+		ps_free_message(from, data);
+	}
+	PG_CATCH();
+	{
+		neon_shard_log(shard_no, LOG, "pageserver_receive: disconnect due to failure while parsing response");
+		pageserver_disconnect(shard_no);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (message_level_is_interesting(PageStoreTrace))
+	{
+		char	   *msg = nm_to_string((NeonMessage *) resp);
+
+		neon_shard_log(shard_no, PageStoreTrace, "got response: %s", msg);
+		pfree(msg);
+	}
+
+	return resp;
 }
 
 /*
- * Disconnect from specified shard
+ * Receive the response to the oldest request sent to a shard that has
+ * hedging enabled, from whichever connection delivers it first.
+ *
+ * Returns NULL if 'nowait' is set and the response hasn't arrived yet, or if
+ * the connection to the primary was lost.
  */
-static void
-pageserver_disconnect_shard(shardno_t shard_no)
+static NeonResponse *
+pageserver_receive_hedged(shardno_t shard_no, bool nowait)
 {
-	PageServer *shard = &page_servers[shard_no];
-	/*
-	 * If anything goes wrong while we were sending a request, it's not clear
-	 * what state the connection is in. For example, if we sent the request
-	 * but didn't receive a response yet, we might receive the response some
-	 * time later after we have already sent a new unrelated request. Close
-	 * the connection to avoid getting confused.
-	 * Similarly, even when we're in PS_DISCONNECTED, we may have junk to
-	 * clean up: It is possible that we encountered an error allocating any
-	 * of the wait event sets or the psql connection, or failed when we tried
-	 * to attach wait events to the WaitEventSets.
-	 */
-	CLEANUP_AND_DISCONNECT(shard);
+	ShardHedgeState *hedge = &shard_hedges[shard_no];
+	PageServer *primary = &page_servers[shard_no];
+	uint64		generation = primary->generation;
 
-	shard->state = PS_Disconnected;
+	for (;;)
+	{
+		char	   *data;
+		int			rc;
+		long		timeout;
+
+		if (hedge->sent == NIL)
+		{
+			neon_shard_log(shard_no, LOG, "pageserver_receive: no request in flight");
+			return NULL;
+		}
+
+		while ((rc = hedge_read_message(primary, &data)) > 0)
+		{
+			if (hedge->primary_skip > 0)
+			{
+				/* the secondary already answered this one */
+				hedge->primary_skip--;
+				ps_free_message(primary, data);
+				continue;
+			}
+			if (hedge->head_hedged)
+				hedge->secondary_skip++;
+			return hedge_unpack_response(shard_no, primary, data, rc);
+		}
+		if (rc < 0)
+		{
+			char	   *msg = pchomp(ps_error_message(primary));
+
+			pageserver_disconnect(shard_no);
+			neon_shard_log(shard_no, LOG, "pageserver_receive disconnect: could not read COPY data: %s", msg);
+			pfree(msg);
+			return NULL;
+		}
+
+		if (hedge->secondary.state == PS_Connected)
+		{
+			while ((rc = hedge_read_message(&hedge->secondary, &data)) > 0)
+			{
+				if (hedge->secondary_skip > 0)
+				{
+					/* the primary already answered this one */
+					hedge->secondary_skip--;
+					ps_free_message(&hedge->secondary, data);
+					continue;
+				}
+				if (!hedge->head_hedged)
+				{
+					/* we didn't ask the secondary anything */
+					ps_free_message(&hedge->secondary, data);
+					rc = -1;
+					break;
+				}
+				hedge->primary_skip++;
+				MyNeonCounters->pageserver_hedge_wins_total++;
+				return hedge_unpack_response(shard_no, &hedge->secondary, data, rc);
+			}
+			if (rc < 0)
+				hedge_secondary_failed(shard_no);
+		}
+
+		if (nowait)
+			return NULL;
+
+		timeout = hedge_maybe_send(shard_no);
+
+		/* the shard map may have changed while connecting to the secondary */
+		if (primary->generation != generation)
+			return NULL;
+
+		hedge_wait(shard_no, timeout);
+	}
 }
 
 static bool
 pageserver_send(shardno_t shard_no, NeonRequest *request)
 {
-	StringInfoData req_buff;
+	int			len;
 	PageServer *shard = &page_servers[shard_no];
-	PGconn	   *pageserver_conn;
 
 	MyNeonCounters->pageserver_requests_sent_total++;
 
 	/* If the connection was lost for some reason, reconnect */
-	if (shard->state == PS_Connected && PQstatus(shard->conn) == CONNECTION_BAD)
+	if (shard->state == PS_Connected && ps_connection_bad(shard))
 	{
 		neon_shard_log(shard_no, LOG, "pageserver_send disconnect bad connection");
 		pageserver_disconnect(shard_no);
-		pageserver_conn = NULL;
 	}
 
-	req_buff = nm_pack_request(request);
-
 	/*
 	 * If pageserver is stopped, the connections from compute node are broken.
 	 * The compute node doesn't notice that immediately, but it will cause the
@@ -828,6 +2065,10 @@ pageserver_send(shardno_t shard_no, NeonRequest *request)
 	 */
 	if (shard->state != PS_Connected)
 	{
+		/* Reconnect to the other shards at the same time */
+		if (pageserver_eager_connect && shard->state == PS_Disconnected)
+			pageserver_connect_all(LOG);
+
 		while (!pageserver_connect(shard_no, shard->n_reconnect_attempts < max_reconnect_attempts ? LOG : ERROR))
 		{
 			shard->n_reconnect_attempts += 1;
@@ -837,35 +2078,43 @@ pageserver_send(shardno_t shard_no, NeonRequest *request)
 		Assert(shard->conn != NULL);
 	}
 
-	pageserver_conn = shard->conn;
+	/*
+	 * If a lot of requests are still waiting to be sent, because the
+	 * pageserver isn't keeping up with them, wait until they have been sent
+	 * before queueing more. This applies backpressure to deep prefetch
+	 * pipelines and large vectored requests, instead of growing the output
+	 * buffer without limit.
+	 */
+	if (shard->send_queue_bytes >= (uint64) pageserver_send_queue_size * 1024)
+	{
+		MyNeonCounters->pageserver_send_queue_drains_total++;
+		if (!pageserver_drain(shard_no, "pageserver_send"))
+			return false;
+	}
 
 	/*
-	 * Send request.
-	 *
-	 * In principle, this could block if the output buffer is full, and we
-	 * should use async mode and check for interrupts while waiting. In
-	 * practice, our requests are small enough to always fit in the output and
-	 * TCP buffer.
-	 *
-	 * Note that this also will fail when the connection is in the
-	 * PGRES_POLLING_WRITING state. It's kinda dirty to disconnect at this
-	 * point, but on the grand scheme of things it's only a small issue.
+	 * Queue the request. The connection is in non-blocking mode, so this
+	 * doesn't wait for the socket; libpq sends what it can, and keeps the
+	 * rest in its output buffer until the next flush.
 	 */
 	shard->nrequests_sent++;
-	if (PQputCopyData(pageserver_conn, req_buff.data, req_buff.len) <= 0)
+	len = ps_put_request(shard, request);
+	if (len < 0)
 	{
-		char	   *msg = pchomp(PQerrorMessage(pageserver_conn));
+		char	   *msg = pchomp(ps_error_message(shard));
 
 		pageserver_disconnect(shard_no);
 		neon_shard_log(shard_no, LOG, "pageserver_send disconnected: failed to send page request (try to reconnect): %s", msg);
 		pfree(msg);
-		pfree(req_buff.data);
 		return false;
 	}
 
-	pfree(req_buff.data);
+	shard->send_queue_bytes += len;
 
-	if (message_level_is_interesting(PageStoreTrace))
+	if (shard_hedges[shard_no].enabled)
+		hedge_track_request(shard_no, request);
+
+	if (unlikely(message_level_is_interesting(PageStoreTrace)))
 	{
 		char	   *msg = nm_to_string((NeonMessage *) request);
 
@@ -876,13 +2125,62 @@ pageserver_send(shardno_t shard_no, NeonRequest *request)
 	return true;
 }
 
+/*
+ * Send everything queued on the connection to the shard, waiting for the
+ * socket to become writeable as needed.
+ *
+ * While we wait, responses that arrive are read into libpq's input buffer.
+ * Otherwise the pageserver could get stuck sending us responses, and stop
+ * reading our requests, while we're stuck sending requests.
+ *
+ * On failure, disconnects and returns false. 'caller' is used in the log
+ * message.
+ */
+static bool
+pageserver_drain(shardno_t shard_no, const char *caller)
+{
+	PageServer *shard = &page_servers[shard_no];
+
+	for (;;)
+	{
+		WaitEvent	event;
+		int			rc = ps_flush(shard);
+
+		if (rc == 0)
+		{
+			shard->send_queue_bytes = 0;
+			return true;
+		}
+		if (rc < 0)
+			break;
+
+		/* Sleep until there's something to do */
+		(void) WaitEventSetWait(shard->wes_write, -1L, &event, 1,
+								WAIT_EVENT_NEON_PS_SEND);
+		ResetLatch(MyLatch);
+
+		CHECK_FOR_INTERRUPTS();
+
+		if ((event.events & WL_SOCKET_READABLE) && !ps_consume_input(shard))
+			break;
+	}
+
+	{
+		char	   *msg = pchomp(ps_error_message(shard));
+
+		pageserver_disconnect(shard_no);
+		neon_shard_log(shard_no, LOG, "%s disconnect because failed to flush page requests: %s", caller, msg);
+		pfree(msg);
+	}
+	return false;
+}
+
 static NeonResponse *
 pageserver_receive(shardno_t shard_no)
 {
 	StringInfoData resp_buff;
 	NeonResponse *resp;
 	PageServer *shard = &page_servers[shard_no];
-	PGconn	   *pageserver_conn = shard->conn;
 	/* read response */
 	int			rc;
 
@@ -894,7 +2192,10 @@ pageserver_receive(shardno_t shard_no)
 		return NULL;
 	}
 
-	Assert(pageserver_conn);
+	Assert(shard->conn);
+
+	if (shard_hedges[shard_no].enabled)
+		return pageserver_receive_hedged(shard_no, false);
 
 	rc = call_PQgetCopyData(shard_no, &resp_buff.data);
 	if (rc >= 0)
@@ -907,7 +2208,7 @@ pageserver_receive(shardno_t shard_no)
 			resp_buff.len = rc;
 			resp_buff.cursor = 0;
 			resp = nm_unpack_response(&resp_buff);
-			PQfreemem(resp_buff.data);
+			ps_free_message(shard, resp_buff.data);
 		}
 		PG_CATCH();
 		{
@@ -927,13 +2228,13 @@ pageserver_receive(shardno_t shard_no)
 	}
 	else if (rc == -1)
 	{
-		neon_shard_log(shard_no, LOG, "pageserver_receive disconnect: psql end of copy data: %s", pchomp(PQerrorMessage(pageserver_conn)));
+		neon_shard_log(shard_no, LOG, "pageserver_receive disconnect: psql end of copy data: %s", pchomp(ps_error_message(shard)));
 		pageserver_disconnect(shard_no);
 		resp = NULL;
 	}
 	else if (rc == -2)
 	{
-		char	   *msg = pchomp(PQerrorMessage(pageserver_conn));
+		char	   *msg = pchomp(ps_error_message(shard));
 
 		pageserver_disconnect(shard_no);
 		neon_shard_log(shard_no, ERROR, "pageserver_receive disconnect: could not read COPY data: %s", msg);
@@ -954,16 +2255,18 @@ pageserver_try_receive(shardno_t shard_no)
 	StringInfoData resp_buff;
 	NeonResponse *resp;
 	PageServer *shard = &page_servers[shard_no];
-	PGconn	   *pageserver_conn = shard->conn;
 	/* read response */
 	int			rc;
 
 	if (shard->state != PS_Connected)
 		return NULL;
 
-	Assert(pageserver_conn);
+	Assert(shard->conn);
 
-	rc = PQgetCopyData(shard->conn, &resp_buff.data, 1 /* async = true */);
+	if (shard_hedges[shard_no].enabled)
+		return pageserver_receive_hedged(shard_no, true);
+
+	rc = ps_get_message(shard, &resp_buff.data);
 
 	if (rc == 0)
 		return NULL;
@@ -974,7 +2277,7 @@ pageserver_try_receive(shardno_t shard_no)
 			resp_buff.len = rc;
 			resp_buff.cursor = 0;
 			resp = nm_unpack_response(&resp_buff);
-			PQfreemem(resp_buff.data);
+			ps_free_message(shard, resp_buff.data);
 		}
 		PG_CATCH();
 		{
@@ -994,13 +2297,13 @@ pageserver_try_receive(shardno_t shard_no)
 	}
 	else if (rc == -1)
 	{
-		neon_shard_log(shard_no, LOG, "pageserver_receive disconnect: psql end of copy data: %s", pchomp(PQerrorMessage(pageserver_conn)));
+		neon_shard_log(shard_no, LOG, "pageserver_receive disconnect: psql end of copy data: %s", pchomp(ps_error_message(shard)));
 		pageserver_disconnect(shard_no);
 		resp = NULL;
 	}
 	else if (rc == -2)
 	{
-		char	   *msg = pchomp(PQerrorMessage(pageserver_conn));
+		char	   *msg = pchomp(ps_error_message(shard));
 
 		pageserver_disconnect(shard_no);
 		neon_shard_log(shard_no, ERROR, "pageserver_receive disconnect: could not read COPY data: %s", msg);
@@ -1019,8 +2322,6 @@ pageserver_try_receive(shardno_t shard_no)
 static bool
 pageserver_flush(shardno_t shard_no)
 {
-	PGconn	   *pageserver_conn = page_servers[shard_no].conn;
-
 	if (page_servers[shard_no].state != PS_Connected)
 	{
 		neon_shard_log(shard_no, WARNING, "Tried to flush while disconnected");
@@ -1028,12 +2329,123 @@ pageserver_flush(shardno_t shard_no)
 	else
 	{
 		MyNeonCounters->pageserver_send_flushes_total++;
-		if (PQflush(pageserver_conn))
+		if (!pageserver_drain(shard_no, "pageserver_flush"))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Wait on the connections of several shards at once, and read whatever
+ * arrives into their input buffers.
+ */
+static bool
+pageserver_wait_any(const uint8 *shard_bitmap, shardno_t max_shard_no, long timeout)
+{
+	WaitEvent	events[MAX_SHARDS * 2 + 2];
+	int			nevents;
+	bool		rebuild = (wes_any == NULL);
+
+	/* Hedge the requests that have waited too long, and wake up for the next */
+	for (shardno_t shard_no = 0; shard_no < max_shard_no; shard_no++)
+	{
+		long		hedge_timeout;
+
+		if (!BITMAP_ISSET(shard_bitmap, shard_no) || !shard_hedges[shard_no].enabled)
+			continue;
+
+		hedge_timeout = hedge_maybe_send(shard_no);
+		if (hedge_timeout >= 0 && (timeout < 0 || hedge_timeout < timeout))
+			timeout = hedge_timeout;
+	}
+
+	for (shardno_t shard_no = 0; shard_no < MAX_SHARDS; shard_no++)
+	{
+		bool		wanted = shard_no < max_shard_no &&
+			BITMAP_ISSET(shard_bitmap, shard_no);
+
+		if (wanted && page_servers[shard_no].state != PS_Connected)
+		{
+			/*
+			 * Responses to the requests we sent on a closed connection will
+			 * never arrive.
+			 */
+			neon_shard_log(shard_no, LOG, "pageserver_wait_any: shard is not connected");
+			pageserver_disconnect(shard_no);
+			return false;
+		}
+
+		if (wanted != (BITMAP_ISSET(wes_any_shards, shard_no) != 0) ||
+			(wanted && wes_any_generations[shard_no] != page_servers[shard_no].generation) ||
+			(wanted && wes_any_secondary_keys[shard_no] != CONNECTION_KEY(&shard_hedges[shard_no].secondary)))
+			rebuild = true;
+	}
+
+	if (rebuild)
+	{
+		WaitEventSet *wes;
+
+		if (wes_any)
+		{
+			FreeWaitEventSet(wes_any);
+			wes_any = NULL;
+		}
+		memset(wes_any_shards, 0, sizeof(wes_any_shards));
+
+#if PG_MAJORVERSION_NUM >= 17
+		wes = CreateWaitEventSet(NULL, MAX_SHARDS * 2 + 2);
+#else
+		wes = CreateWaitEventSet(TopMemoryContext, MAX_SHARDS * 2 + 2);
+#endif
+		AddWaitEventToSet(wes, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+		AddWaitEventToSet(wes, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET, NULL, NULL);
+		for (shardno_t shard_no = 0; shard_no < max_shard_no; shard_no++)
+		{
+			if (!BITMAP_ISSET(shard_bitmap, shard_no))
+				continue;
+			AddWaitEventToSet(wes, WL_SOCKET_READABLE, PQsocket(page_servers[shard_no].conn),
+							  NULL, (void *) (uintptr_t) shard_no);
+			if (shard_hedges[shard_no].secondary.state == PS_Connected)
+				AddWaitEventToSet(wes, WL_SOCKET_READABLE,
+								  PQsocket(shard_hedges[shard_no].secondary.conn),
+								  NULL, (void *) (uintptr_t) (shard_no | WES_ANY_SECONDARY));
+			BITMAP_SET(wes_any_shards, shard_no);
+			wes_any_generations[shard_no] = page_servers[shard_no].generation;
+			wes_any_secondary_keys[shard_no] = CONNECTION_KEY(&shard_hedges[shard_no].secondary);
+		}
+		wes_any = wes;
+	}
+
+	nevents = WaitEventSetWait(wes_any, timeout, events, lengthof(events),
+							   WAIT_EVENT_NEON_PS_READ);
+	ResetLatch(MyLatch);
+
+	CHECK_FOR_INTERRUPTS();
+
+	for (int i = 0; i < nevents; i++)
+	{
+		shardno_t	shard_no;
+
+		if (!(events[i].events & WL_SOCKET_READABLE))
+			continue;
+
+		if ((uintptr_t) events[i].user_data & WES_ANY_SECONDARY)
+		{
+			/* the response will be picked up by pageserver_try_receive() */
+			shard_no = (shardno_t) ((uintptr_t) events[i].user_data & ~WES_ANY_SECONDARY);
+			if (!ps_consume_input(&shard_hedges[shard_no].secondary))
+				hedge_secondary_failed(shard_no);
+			continue;
+		}
+
+		shard_no = (shardno_t) (uintptr_t) events[i].user_data;
+		if (!ps_consume_input(&page_servers[shard_no]))
 		{
-			char	   *msg = pchomp(PQerrorMessage(pageserver_conn));
+			char	   *msg = pchomp(ps_error_message(&page_servers[shard_no]));
 
 			pageserver_disconnect(shard_no);
-			neon_shard_log(shard_no, LOG, "pageserver_flush disconnect because failed to flush page requests: %s", msg);
+			neon_shard_log(shard_no, LOG, "pageserver_wait_any disconnect: could not get response from pageserver: %s", msg);
 			pfree(msg);
 			return false;
 		}
@@ -1042,15 +2454,116 @@ pageserver_flush(shardno_t shard_no)
 	return true;
 }
 
+/*
+ * Non-blocking read of the next raw pagestream message from the shard's
+ * connection, for the communicator process, which passes responses on to
+ * the backends without unpacking them.
+ *
+ * Returns the length of the message, 0 if no complete message has arrived
+ * yet, or -1 if the connection was lost. The caller must release the
+ * returned buffer with pageserver_free_raw(), before the next call.
+ */
+int
+pageserver_receive_raw(shardno_t shard_no, char **buffer)
+{
+	PageServer *shard = &page_servers[shard_no];
+	int			rc;
+
+	if (shard->state != PS_Connected)
+		return -1;
+
+	if (!ps_consume_input(shard))
+	{
+		char	   *msg = pchomp(ps_error_message(shard));
+
+		pageserver_disconnect(shard_no);
+		neon_shard_log(shard_no, LOG, "pageserver_receive_raw disconnect: could not get response from pageserver: %s", msg);
+		pfree(msg);
+		return -1;
+	}
+
+	rc = ps_get_message(shard, buffer);
+	if (rc == 0)
+		return 0;
+	else if (rc > 0)
+	{
+		shard->nresponses_received++;
+		/* the communicator doesn't hedge, but keep the bookkeeping straight */
+		if (shard_hedges[shard_no].enabled)
+			hedge_pop_request(shard_no);
+		return rc;
+	}
+	else
+	{
+		char	   *msg = pchomp(ps_error_message(shard));
+
+		pageserver_disconnect(shard_no);
+		neon_shard_log(shard_no, LOG, "pageserver_receive_raw disconnect: could not read COPY data: %s", msg);
+		pfree(msg);
+		return -1;
+	}
+}
+
+/*
+ * Release a message returned by pageserver_receive_raw().
+ */
+void
+pageserver_free_raw(shardno_t shard_no, char *buffer)
+{
+	ps_free_message(&page_servers[shard_no], buffer);
+}
+
+/*
+ * Socket of the shard's connection, or PGINVALID_SOCKET if not connected.
+ */
+pgsocket
+pageserver_socket(shardno_t shard_no)
+{
+	PageServer *shard = &page_servers[shard_no];
+
+	if (shard->state != PS_Connected)
+		return PGINVALID_SOCKET;
+
+	return PQsocket(shard->conn);
+}
+
+/*
+ * Returns a counter that changes every time the connection to the shard is
+ * closed. Responses to requests sent before a change will never arrive.
+ */
+uint64
+pageserver_generation(shardno_t shard_no)
+{
+	return page_servers[shard_no].generation;
+}
+
 page_server_api api =
 {
 	.send = pageserver_send,
 	.flush = pageserver_flush,
 	.receive = pageserver_receive,
 	.try_receive = pageserver_try_receive,
+	.wait_any = pageserver_wait_any,
 	.disconnect = pageserver_disconnect_shard
 };
 
+/*
+ * With neon.pageserver_eager_connect, connect to all the shards as soon as
+ * the client has been authenticated, rather than on the first request to
+ * each shard.
+ */
+static void
+pagestore_client_auth_hook(Port *port, int status)
+{
+	if (prev_client_auth_hook)
+		prev_client_auth_hook(port, status);
+
+	/* With the communicator, this backend doesn't connect to pageservers */
+	if (status == STATUS_OK && pageserver_eager_connect && !am_walsender &&
+		!neon_use_communicator)
+		pageserver_connect_all(LOG);
+}
+
 static bool
 check_neon_id(char **newval, void **extra, GucSource source)
 {
@@ -1127,8 +2640,6 @@ pagestore_prepare_shmem(void)
 void
 pg_init_libpagestore(void)
 {
-	pagestore_prepare_shmem();
-
 	DefineCustomStringVariable("neon.pageserver_connstring",
 							   "connection string to the page server",
 							   NULL,
@@ -1208,19 +2719,98 @@ pg_init_libpagestore(void)
 							&neon_protocol_version,
 							2,	/* use protocol version 2 */
 							2,	/* min */
-							3,	/* max */
+							4,	/* max */
 							PGC_SU_BACKEND,
 							0,	/* no flags required */
 							NULL, NULL, NULL);
+	DefineCustomEnumVariable("neon.pageserver_compression",
+							 "Compression of page images sent by the page server",
+							 "Requires neon.protocol_version 3 or higher, ignored otherwise.",
+							 &neon_pageserver_compression,
+							 PAGESTREAM_COMPRESSION_NONE,
+							 pageserver_compression_options,
+							 PGC_SU_BACKEND,
+							 0,	/* no flags required */
+							 NULL, NULL, NULL);
+	DefineCustomIntVariable("neon.pageserver_hedge_percentile",
+							"Percentile of recent response times after which a GetPage request is also sent to a secondary pageserver",
+							"Only applies to shards that have secondary endpoints in neon.pageserver_connstring, "
+							"and to connections opened after the setting was changed. 0 disables hedging.",
+							&pageserver_hedge_percentile,
+							0, 0, 100,
+							PGC_USERSET,
+							0,	/* no flags required */
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("neon.pageserver_hedge_min_delay",
+							"Minimum time to wait for the primary pageserver before hedging a GetPage request",
+							NULL,
+							&pageserver_hedge_min_delay,
+							1, 0, INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("neon.pageserver_send_queue_size",
+							"Amount of requests that can be queued for sending to a pageserver shard",
+							"When more requests than this are waiting to be sent to a shard, "
+							"the backend waits for them to be sent before queueing more.",
+							&pageserver_send_queue_size,
+							1024, 8, INT_MAX / 1024,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+	DefineCustomBoolVariable("neon.pageserver_raw_framing",
+							 "Exchange pagestream messages with the page server without going through libpq",
+							 "Only applies to connections that don't use TLS, and that are opened after the setting "
+							 "was changed.",
+							 &pageserver_raw_framing,
+							 false,
+							 PGC_USERSET,
+							 0,	/* no flags required */
+							 NULL, NULL, NULL);
+	DefineCustomBoolVariable("neon.pageserver_eager_connect",
+							 "Connect to all pageserver shards in parallel at backend start",
+							 "Also, when the connection to one shard needs to be reestablished, "
+							 "reconnect to all the other disconnected shards at the same time.",
+							 &pageserver_eager_connect,
+							 false,
+							 PGC_SIGHUP,
+							 0,	/* no flags required */
+							 NULL, NULL, NULL);
+	DefineCustomIntVariable("neon.slow_request_log_size",
+							"Number of slow pageserver requests to remember in each backend",
+							"The requests are shown in the neon_slow_requests view. 0 disables the log.",
+							&neon_slow_request_log_size,
+							32, 0, 1024,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("neon.slow_request_threshold",
+							"Pageserver requests that take at least this long are logged in neon_slow_requests",
+							NULL,
+							&neon_slow_request_threshold,
+							100, 0, INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
 
 	relsize_hash_init();
 
+	/*
+	 * The size of the shared memory depends on the GUCs above, so this needs
+	 * to come after them. On v14, it makes the shared memory request right
+	 * away.
+	 */
+	pagestore_prepare_shmem();
+
 	if (page_server != NULL)
 		neon_log(ERROR, "libpagestore already loaded");
 
 	neon_log(PageStoreTrace, "libpagestore already loaded");
 	page_server = &api;
 
+	prev_client_auth_hook = ClientAuthentication_hook;
+	ClientAuthentication_hook = pagestore_client_auth_hook;
+
 	/*
 	 * Retrieve the auth token to use when connecting to pageserver and
 	 * safekeepers
@@ -1239,5 +2829,7 @@ pg_init_libpagestore(void)
 
 	memset(page_servers, 0, sizeof(page_servers));
 
+	pg_init_communicator(&api);
+
 	lfc_init();
 }
@@ -0,0 +1,20 @@
+\echo Use "ALTER EXTENSION neon UPDATE TO '1.6'" to load this file. \quit
+
+CREATE FUNCTION get_shard_perf_counters()
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME', 'neon_get_shard_perf_counters'
+LANGUAGE C PARALLEL SAFE;
+
+-- Metrics that are collected for each pageserver shard, summed across all
+-- backends. Shards that this compute has not sent any requests to are
+-- omitted.
+--
+-- For histograms, 'bucket_le' is the upper bound of the histogram bucket.
+CREATE VIEW neon_shard_perf_counters AS
+  SELECT P.shard, P.metric, P.bucket_le, P.value
+  FROM get_shard_perf_counters() AS P (
+    shard integer,
+    metric text,
+    bucket_le float8,
+    value float8
+  );
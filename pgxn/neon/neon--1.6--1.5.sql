@@ -0,0 +1,2 @@
+DROP VIEW IF EXISTS neon_shard_perf_counters;
+DROP FUNCTION IF EXISTS get_shard_perf_counters();
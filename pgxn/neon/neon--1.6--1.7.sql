@@ -0,0 +1,40 @@
+\echo Use "ALTER EXTENSION neon UPDATE TO '1.7'" to load this file. \quit
+
+-- Snapshot of a histogram from neon_perf_counters, e.g. 'getpage_wait_seconds',
+-- as an int8 array: the count, the sum in microseconds, and the number of
+-- values in each bucket. If 'pid' is given, only that backend's values are
+-- included.
+CREATE FUNCTION neon_histogram(metric text, pid integer DEFAULT NULL)
+RETURNS int8[]
+AS 'MODULE_PATHNAME', 'neon_get_histogram'
+LANGUAGE C PARALLEL SAFE;
+
+-- Estimate a percentile of a histogram snapshot, in seconds. 'fraction' is
+-- between 0 and 1, e.g. 0.99 for the p99 latency.
+CREATE FUNCTION neon_histogram_percentile(hist int8[], fraction float8)
+RETURNS float8
+AS 'MODULE_PATHNAME', 'neon_histogram_percentile'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+-- Difference between two snapshots of the same histogram, taken at different
+-- times, for computing percentiles over an interval:
+--
+--   SELECT neon_histogram_percentile(
+--     neon_histogram_sub(neon_histogram('getpage_wait_seconds'), :before), 0.99);
+CREATE FUNCTION neon_histogram_sub(a int8[], b int8[])
+RETURNS int8[]
+AS 'MODULE_PATHNAME', 'neon_histogram_sub'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION neon_histogram_add(a int8[], b int8[])
+RETURNS int8[]
+AS 'MODULE_PATHNAME', 'neon_histogram_add'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+-- Merge snapshots, e.g. of the same histogram taken from several computes
+CREATE AGGREGATE neon_histogram_sum(int8[]) (
+  SFUNC = neon_histogram_add,
+  STYPE = int8[],
+  COMBINEFUNC = neon_histogram_add,
+  PARALLEL = SAFE
+);
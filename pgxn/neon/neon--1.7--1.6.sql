@@ -0,0 +1,5 @@
+DROP AGGREGATE IF EXISTS neon_histogram_sum(int8[]);
+DROP FUNCTION IF EXISTS neon_histogram_add(int8[], int8[]);
+DROP FUNCTION IF EXISTS neon_histogram_sub(int8[], int8[]);
+DROP FUNCTION IF EXISTS neon_histogram_percentile(int8[], float8);
+DROP FUNCTION IF EXISTS neon_histogram(text, integer);
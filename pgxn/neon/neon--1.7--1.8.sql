@@ -0,0 +1,37 @@
+\echo Use "ALTER EXTENSION neon UPDATE TO '1.8'" to load this file. \quit
+
+CREATE FUNCTION get_slow_requests()
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME', 'neon_get_slow_requests'
+LANGUAGE C PARALLEL SAFE;
+
+-- The last neon.slow_request_log_size pageserver requests of each backend
+-- that took longer than neon.slow_request_threshold.
+--
+-- 'prefetch' tells whether a GetPage request had been prefetched, and if so,
+-- whether the response had arrived before the page was needed. It is NULL for
+-- other request types. The 'queue', 'send', 'network' and 'consume' phases of
+-- GetPage requests are explained in neon_perf_counters.h. All times are in
+-- seconds.
+CREATE VIEW neon_slow_requests AS
+  SELECT P.*
+  FROM get_slow_requests() AS P (
+    procno integer,
+    pid integer,
+    end_time timestamptz,
+    request text,
+    shard integer,
+    spcoid oid,
+    dboid oid,
+    relnumber oid,
+    forknum integer,
+    blkno bigint,
+    request_lsn pg_lsn,
+    not_modified_since pg_lsn,
+    prefetch text,
+    latency float8,
+    queue float8,
+    send float8,
+    network float8,
+    consume float8
+  );
@@ -0,0 +1,2 @@
+DROP VIEW IF EXISTS neon_slow_requests;
+DROP FUNCTION IF EXISTS get_slow_requests();
@@ -34,6 +34,7 @@
 #include "neon.h"
 #include "control_plane_connector.h"
 #include "logical_replication_monitor.h"
+#include "neon_explain.h"
 #include "unstable_extensions.h"
 #include "walsender_hooks.h"
 #if PG_MAJORVERSION_NUM >= 16
@@ -61,6 +62,7 @@ uint32		WAIT_EVENT_NEON_PS_CONFIGURING;
 uint32		WAIT_EVENT_NEON_PS_SEND;
 uint32		WAIT_EVENT_NEON_PS_READ;
 uint32		WAIT_EVENT_NEON_WAL_DL;
+uint32		WAIT_EVENT_NEON_COMMUNICATOR_MAIN;
 #endif
 
 enum RunningXactsOverflowPolicies {
@@ -430,6 +432,7 @@ _PG_init(void)
 	InitUnstableExtensionsSupport();
 	InitLogicalReplicationMonitor();
 	InitControlPlaneConnector();
+	InitExplainInstrumentation();
 
 	pg_init_extension_server();
 
@@ -543,6 +546,7 @@ neon_shmem_startup_hook(void)
 	WAIT_EVENT_NEON_PS_SEND = WaitEventExtensionNew("Neon/PS_SendIO");
 	WAIT_EVENT_NEON_PS_READ = WaitEventExtensionNew("Neon/PS_ReadIO");
 	WAIT_EVENT_NEON_WAL_DL = WaitEventExtensionNew("Neon/WAL_Download");
+	WAIT_EVENT_NEON_COMMUNICATOR_MAIN = WaitEventExtensionNew("Neon/Communicator_Main");
 #endif
 }
 #endif
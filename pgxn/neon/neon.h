@@ -33,6 +33,7 @@ extern uint32		WAIT_EVENT_NEON_PS_CONFIGURING;
 extern uint32		WAIT_EVENT_NEON_PS_SEND;
 extern uint32		WAIT_EVENT_NEON_PS_READ;
 extern uint32		WAIT_EVENT_NEON_WAL_DL;
+extern uint32		WAIT_EVENT_NEON_COMMUNICATOR_MAIN;
 #else
 #define WAIT_EVENT_NEON_LFC_MAINTENANCE	PG_WAIT_EXTENSION
 #define WAIT_EVENT_NEON_LFC_READ		WAIT_EVENT_BUFFILE_READ
@@ -43,6 +44,7 @@ extern uint32		WAIT_EVENT_NEON_WAL_DL;
 #define WAIT_EVENT_NEON_PS_SEND			PG_WAIT_EXTENSION
 #define WAIT_EVENT_NEON_PS_READ			PG_WAIT_EXTENSION
 #define WAIT_EVENT_NEON_WAL_DL			WAIT_EVENT_WAL_READ
+#define WAIT_EVENT_NEON_COMMUNICATOR_MAIN	PG_WAIT_EXTENSION
 #endif
 
 extern void pg_init_libpagestore(void);
@@ -0,0 +1,483 @@
+/*-------------------------------------------------------------------------
+ *
+ * neon_explain.c
+ *	  Per plan node pageserver and LFC statistics for EXPLAIN (ANALYZE, BUFFERS)
+ *
+ * The per-node Instrumentation only tracks the fields of BufferUsage and
+ * WalUsage, so we cannot add our own counters to it. Instead, when a query
+ * is run under EXPLAIN (ANALYZE, BUFFERS), we wrap the ExecProcNode function
+ * of every plan node, and take the difference of this backend's GetPage wait
+ * time, LFC read time and prefetch counters around each call. The results are
+ * inclusive of child nodes, like the rest of the per-node statistics, and
+ * printed as a separate "Neon I/O" section at the end of the plan.
+ *
+ * Nodes that are executed through MultiExecProcNode (Hash, Bitmap Index Scan)
+ * are accounted to their parent. I/O done by parallel workers is not included.
+ *
+ * IDENTIFICATION
+ *	 contrib/neon/neon_explain.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/parallel.h"
+#include "commands/explain.h"
+#include "executor/executor.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/planner.h"
+#include "parser/parsetree.h"
+#include "storage/proc.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+
+#include "neon_explain.h"
+#include "neon_perf_counters.h"
+
+static bool neon_explain_io = true;
+
+static ExplainOneQuery_hook_type prev_ExplainOneQuery = NULL;
+static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+
+typedef struct NeonIOUsage
+{
+	uint64		getpage_wait_us;
+	uint64		file_cache_read_us;
+	int64		prefetch_hits;
+	int64		prefetch_misses;
+	int64		prefetch_expired;
+} NeonIOUsage;
+
+typedef struct NeonExplainNode
+{
+	PlanState  *planstate;
+	ExecProcNodeMtd real_exec_proc_node;
+	NeonIOUsage usage;
+} NeonExplainNode;
+
+typedef struct NeonExplainState
+{
+	QueryDesc  *queryDesc;
+	ExplainState *es;
+	int			n_nodes;		/* indexed by plan_node_id */
+	NeonExplainNode *nodes;
+} NeonExplainState;
+
+/* The EXPLAIN that is currently running in this backend, if any */
+static ExplainState *current_explain = NULL;
+
+/* The query whose nodes are instrumented, if any */
+static NeonExplainState *explain_state = NULL;
+
+static void
+neon_io_usage_snapshot(NeonIOUsage *usage)
+{
+	usage->getpage_wait_us = MyNeonCounters->getpage_hist.wait_us_sum;
+	usage->file_cache_read_us = MyNeonCounters->file_cache_read_hist.wait_us_sum;
+	usage->prefetch_hits = pgBufferUsage.prefetch.hits;
+	usage->prefetch_misses = pgBufferUsage.prefetch.misses;
+	usage->prefetch_expired = pgBufferUsage.prefetch.expired;
+}
+
+static void
+neon_io_usage_accum_diff(NeonIOUsage *dst, const NeonIOUsage *start)
+{
+	NeonIOUsage now;
+
+	neon_io_usage_snapshot(&now);
+	dst->getpage_wait_us += now.getpage_wait_us - start->getpage_wait_us;
+	dst->file_cache_read_us += now.file_cache_read_us - start->file_cache_read_us;
+	dst->prefetch_hits += now.prefetch_hits - start->prefetch_hits;
+	dst->prefetch_misses += now.prefetch_misses - start->prefetch_misses;
+	dst->prefetch_expired += now.prefetch_expired - start->prefetch_expired;
+}
+
+static bool
+neon_io_usage_is_zero(const NeonIOUsage *usage)
+{
+	return usage->getpage_wait_us == 0 &&
+		usage->file_cache_read_us == 0 &&
+		usage->prefetch_hits == 0 &&
+		usage->prefetch_misses == 0 &&
+		usage->prefetch_expired == 0;
+}
+
+static TupleTableSlot *
+neon_explain_exec_node(PlanState *node)
+{
+	NeonExplainNode *enode = &explain_state->nodes[node->plan->plan_node_id];
+	NeonIOUsage start;
+	TupleTableSlot *result;
+
+	neon_io_usage_snapshot(&start);
+	result = enode->real_exec_proc_node(node);
+	neon_io_usage_accum_diff(&enode->usage, &start);
+
+	return result;
+}
+
+static bool
+neon_explain_collect_nodes(PlanState *planstate, void *context)
+{
+	List	  **nodes = (List **) context;
+
+	*nodes = lappend(*nodes, planstate);
+
+	return planstate_tree_walker(planstate, neon_explain_collect_nodes, context);
+}
+
+/*
+ * Wrap ExecProcNode of all the nodes in the plan tree. The nodes have not been
+ * run yet, so ExecProcNode still points to ExecProcNodeFirst, which will call
+ * our wrapper through ExecProcNodeReal (and the instrumentation wrapper).
+ */
+static void
+neon_explain_instrument(QueryDesc *queryDesc, ExplainState *es)
+{
+	NeonExplainState *state;
+	List	   *planstates = NIL;
+	ListCell   *lc;
+	int			max_id = -1;
+
+	neon_explain_collect_nodes(queryDesc->planstate, &planstates);
+	foreach(lc, planstates)
+		max_id = Max(max_id, ((PlanState *) lfirst(lc))->plan->plan_node_id);
+
+	state = palloc0(sizeof(NeonExplainState));
+	state->queryDesc = queryDesc;
+	state->es = es;
+	state->n_nodes = max_id + 1;
+	state->nodes = palloc0(sizeof(NeonExplainNode) * state->n_nodes);
+
+	foreach(lc, planstates)
+	{
+		PlanState  *planstate = (PlanState *) lfirst(lc);
+		NeonExplainNode *enode = &state->nodes[planstate->plan->plan_node_id];
+
+		/* EvalPlanQual can't reach here, but be safe with duplicate ids */
+		if (enode->planstate != NULL)
+			continue;
+
+		enode->planstate = planstate;
+		enode->real_exec_proc_node = planstate->ExecProcNodeReal;
+		planstate->ExecProcNodeReal = neon_explain_exec_node;
+	}
+	list_free(planstates);
+
+	explain_state = state;
+}
+
+static const char *
+neon_explain_node_name(Plan *plan)
+{
+	switch (nodeTag(plan))
+	{
+		case T_Result:
+			return "Result";
+		case T_ProjectSet:
+			return "ProjectSet";
+		case T_ModifyTable:
+			return "ModifyTable";
+		case T_Append:
+			return "Append";
+		case T_MergeAppend:
+			return "Merge Append";
+		case T_RecursiveUnion:
+			return "Recursive Union";
+		case T_NestLoop:
+			return "Nested Loop";
+		case T_MergeJoin:
+			return "Merge Join";
+		case T_HashJoin:
+			return "Hash Join";
+		case T_SeqScan:
+			return "Seq Scan";
+		case T_SampleScan:
+			return "Sample Scan";
+		case T_Gather:
+			return "Gather";
+		case T_GatherMerge:
+			return "Gather Merge";
+		case T_IndexScan:
+			return "Index Scan";
+		case T_IndexOnlyScan:
+			return "Index Only Scan";
+		case T_BitmapHeapScan:
+			return "Bitmap Heap Scan";
+		case T_TidScan:
+			return "Tid Scan";
+		case T_TidRangeScan:
+			return "Tid Range Scan";
+		case T_SubqueryScan:
+			return "Subquery Scan";
+		case T_FunctionScan:
+			return "Function Scan";
+		case T_TableFuncScan:
+			return "Table Function Scan";
+		case T_ValuesScan:
+			return "Values Scan";
+		case T_CteScan:
+			return "CTE Scan";
+		case T_NamedTuplestoreScan:
+			return "Named Tuplestore Scan";
+		case T_WorkTableScan:
+			return "WorkTable Scan";
+		case T_ForeignScan:
+			return "Foreign Scan";
+		case T_CustomScan:
+			return "Custom Scan";
+		case T_Material:
+			return "Materialize";
+		case T_Memoize:
+			return "Memoize";
+		case T_Sort:
+			return "Sort";
+		case T_IncrementalSort:
+			return "Incremental Sort";
+		case T_Group:
+			return "Group";
+		case T_Agg:
+			return "Aggregate";
+		case T_WindowAgg:
+			return "WindowAgg";
+		case T_Unique:
+			return "Unique";
+		case T_SetOp:
+			return "SetOp";
+		case T_LockRows:
+			return "LockRows";
+		case T_Limit:
+			return "Limit";
+		case T_Hash:
+			return "Hash";
+		default:
+			return "???";
+	}
+}
+
+/*
+ * Name of the relation scanned by the node, or NULL
+ */
+static char *
+neon_explain_relation_name(Plan *plan, List *rtable)
+{
+	Index		scanrelid;
+
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_IndexScan:
+		case T_IndexOnlyScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+		case T_TidRangeScan:
+			scanrelid = ((Scan *) plan)->scanrelid;
+			break;
+		case T_ModifyTable:
+			scanrelid = ((ModifyTable *) plan)->nominalRelation;
+			break;
+		default:
+			return NULL;
+	}
+
+	if (scanrelid == 0)
+		return NULL;
+	return get_rel_name(rt_fetch(scanrelid, rtable)->relid);
+}
+
+static void
+neon_explain_print(NeonExplainState *state)
+{
+	ExplainState *es = state->es;
+	List	   *rtable = state->queryDesc->plannedstmt->rtable;
+	bool		opened = false;
+
+	for (int i = 0; i < state->n_nodes; i++)
+	{
+		NeonExplainNode *enode = &state->nodes[i];
+		NeonIOUsage *usage = &enode->usage;
+		const char *name;
+		char	   *relname;
+
+		if (enode->planstate == NULL || neon_io_usage_is_zero(usage))
+			continue;
+
+		name = neon_explain_node_name(enode->planstate->plan);
+		relname = neon_explain_relation_name(enode->planstate->plan, rtable);
+
+		if (es->format == EXPLAIN_FORMAT_TEXT)
+		{
+			if (!opened)
+			{
+				appendStringInfoSpaces(es->str, es->indent * 2);
+				appendStringInfoString(es->str, "Neon I/O:\n");
+				opened = true;
+			}
+			appendStringInfoSpaces(es->str, es->indent * 2 + 2);
+			appendStringInfoString(es->str, name);
+			if (relname)
+				appendStringInfo(es->str, " on %s", quote_identifier(relname));
+			appendStringInfo(es->str,
+							 " (node %d): pageserver wait=%.3f ms, file cache read=%.3f ms, prefetch hits=%lld misses=%lld expired=%lld\n",
+							 i,
+							 (double) usage->getpage_wait_us / 1000.0,
+							 (double) usage->file_cache_read_us / 1000.0,
+							 (long long) usage->prefetch_hits,
+							 (long long) usage->prefetch_misses,
+							 (long long) usage->prefetch_expired);
+		}
+		else
+		{
+			if (!opened)
+			{
+				ExplainOpenGroup("Neon I/O", "Neon I/O", false, es);
+				opened = true;
+			}
+			ExplainOpenGroup("Plan Node", NULL, true, es);
+			ExplainPropertyText("Node Type", name, es);
+			if (relname)
+				ExplainPropertyText("Relation Name", relname, es);
+			ExplainPropertyInteger("Plan Node Id", NULL, i, es);
+			ExplainPropertyFloat("Pageserver Wait Time", "ms",
+								 (double) usage->getpage_wait_us / 1000.0, 3, es);
+			ExplainPropertyFloat("File Cache Read Time", "ms",
+								 (double) usage->file_cache_read_us / 1000.0, 3, es);
+			ExplainPropertyInteger("Prefetch Hits", NULL, usage->prefetch_hits, es);
+			ExplainPropertyInteger("Prefetch Misses", NULL, usage->prefetch_misses, es);
+			ExplainPropertyInteger("Prefetch Expired", NULL, usage->prefetch_expired, es);
+			ExplainCloseGroup("Plan Node", NULL, true, es);
+		}
+	}
+
+	if (opened && es->format != EXPLAIN_FORMAT_TEXT)
+		ExplainCloseGroup("Neon I/O", "Neon I/O", false, es);
+}
+
+/*
+ * The standard ExplainOneQuery is only exported since v17. Before that, we
+ * have to plan the query ourselves, the same way it does.
+ */
+static void
+neon_ExplainOneQuery(Query *query, int cursorOptions, IntoClause *into,
+					 ExplainState *es, const char *queryString,
+					 ParamListInfo params, QueryEnvironment *queryEnv)
+{
+	ExplainState *save_explain = current_explain;
+	NeonExplainState *save_state = explain_state;
+
+	current_explain = es;
+	PG_TRY();
+	{
+		if (prev_ExplainOneQuery)
+			prev_ExplainOneQuery(query, cursorOptions, into, es,
+								 queryString, params, queryEnv);
+		else
+		{
+#if PG_MAJORVERSION_NUM >= 17
+			standard_ExplainOneQuery(query, cursorOptions, into, es,
+									 queryString, params, queryEnv);
+#else
+			PlannedStmt *plan;
+			instr_time	planstart,
+						planduration;
+			BufferUsage bufusage_start,
+						bufusage;
+
+			if (es->buffers)
+				bufusage_start = pgBufferUsage;
+			INSTR_TIME_SET_CURRENT(planstart);
+
+			plan = pg_plan_query(query, queryString, cursorOptions, params);
+
+			INSTR_TIME_SET_CURRENT(planduration);
+			INSTR_TIME_SUBTRACT(planduration, planstart);
+
+			if (es->buffers)
+			{
+				memset(&bufusage, 0, sizeof(BufferUsage));
+				BufferUsageAccumDiff(&bufusage, &pgBufferUsage, &bufusage_start);
+			}
+
+			ExplainOnePlan(plan, into, es, queryString, params, queryEnv,
+						   &planduration, (es->buffers ? &bufusage : NULL));
+#endif
+		}
+	}
+	PG_FINALLY();
+	{
+		current_explain = save_explain;
+		explain_state = save_state;
+	}
+	PG_END_TRY();
+}
+
+static void
+neon_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	if (prev_ExecutorStart)
+		prev_ExecutorStart(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+
+	/*
+	 * Only instrument the query that the EXPLAIN is running, not the queries
+	 * it runs in turn, e.g. in functions.
+	 */
+	if (neon_explain_io &&
+		current_explain != NULL &&
+		explain_state == NULL &&
+		current_explain->analyze &&
+		current_explain->buffers &&
+		(queryDesc->instrument_options & INSTRUMENT_BUFFERS) != 0 &&
+		(eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0 &&
+		!IsParallelWorker() &&
+		MyProc != NULL)
+	{
+		neon_explain_instrument(queryDesc, current_explain);
+	}
+}
+
+/*
+ * EXPLAIN calls ExecutorEnd after printing the plan but before closing the
+ * output, so this is where we add our section.
+ */
+static void
+neon_ExecutorEnd(QueryDesc *queryDesc)
+{
+	if (explain_state != NULL && explain_state->queryDesc == queryDesc)
+	{
+		NeonExplainState *state = explain_state;
+
+		explain_state = NULL;
+		neon_explain_print(state);
+	}
+
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+}
+
+void
+InitExplainInstrumentation(void)
+{
+	DefineCustomBoolVariable(
+		"neon.explain_io",
+		"Show pageserver wait, LFC read and prefetch statistics per plan node in EXPLAIN (ANALYZE, BUFFERS)",
+		NULL,
+		&neon_explain_io,
+		true,
+		PGC_USERSET,
+		0,
+		NULL, NULL, NULL);
+
+	prev_ExplainOneQuery = ExplainOneQuery_hook;
+	ExplainOneQuery_hook = neon_ExplainOneQuery;
+	prev_ExecutorStart = ExecutorStart_hook;
+	ExecutorStart_hook = neon_ExecutorStart;
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = neon_ExecutorEnd;
+}
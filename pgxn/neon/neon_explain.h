@@ -0,0 +1,6 @@
+#ifndef __NEON_EXPLAIN_H__
+#define __NEON_EXPLAIN_H__
+
+void InitExplainInstrumentation(void);
+
+#endif
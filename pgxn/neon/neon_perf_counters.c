@@ -11,16 +11,99 @@
 
 #include <math.h>
 
+#include "catalog/pg_type_d.h"
 #include "funcapi.h"
 #include "miscadmin.h"
 #include "storage/proc.h"
 #include "storage/shmem.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
 
 #include "neon_perf_counters.h"
 #include "neon_pgversioncompat.h"
+#include "pagestore_client.h"
 
 neon_per_backend_counters *neon_per_backend_counters_shared;
+neon_per_shard_counters *neon_per_shard_counters_shared;
+
+int			neon_slow_request_log_size = 32;
+int			neon_slow_request_threshold = 100;
+
+/*
+ * Slow request log entry in shared memory. Only the owning backend writes
+ * to it, and readers don't take any locks. Instead, the writer increments
+ * 'changecount' before and after updating the entry, so readers can tell
+ * if they saw a torn entry, like with PgBackendStatus.st_changecount.
+ */
+typedef struct
+{
+	uint32		changecount;
+	SlowRequestEntry entry;
+} SlowRequestSlot;
+
+/* Next entry to write in each backend's ring, and the rings themselves */
+static uint32 *slow_request_next;
+static SlowRequestSlot *slow_request_slots;
+
+static const char *const getpage_phase_metric_names[NUM_GETPAGE_PHASES][3] = {
+	[GETPAGE_PHASE_QUEUE] = {
+		"getpage_queue_seconds_count",
+		"getpage_queue_seconds_sum",
+		"getpage_queue_seconds_bucket",
+	},
+	[GETPAGE_PHASE_SEND] = {
+		"getpage_send_seconds_count",
+		"getpage_send_seconds_sum",
+		"getpage_send_seconds_bucket",
+	},
+	[GETPAGE_PHASE_NETWORK] = {
+		"getpage_network_seconds_count",
+		"getpage_network_seconds_sum",
+		"getpage_network_seconds_bucket",
+	},
+	[GETPAGE_PHASE_CONSUME] = {
+		"getpage_consume_seconds_count",
+		"getpage_consume_seconds_sum",
+		"getpage_consume_seconds_bucket",
+	},
+};
+
+static const char *const request_type_metric_names[NUM_NEON_REQUEST_TYPES][6] = {
+	[NEON_REQUEST_EXISTS] = {
+		"exists_wait_seconds_count",
+		"exists_wait_seconds_sum",
+		"exists_wait_seconds_bucket",
+		"exists_requests_total",
+		"exists_request_bytes_total",
+		"exists_response_bytes_total",
+	},
+	[NEON_REQUEST_NBLOCKS] = {
+		"nblocks_wait_seconds_count",
+		"nblocks_wait_seconds_sum",
+		"nblocks_wait_seconds_bucket",
+		"nblocks_requests_total",
+		"nblocks_request_bytes_total",
+		"nblocks_response_bytes_total",
+	},
+	[NEON_REQUEST_DBSIZE] = {
+		"dbsize_wait_seconds_count",
+		"dbsize_wait_seconds_sum",
+		"dbsize_wait_seconds_bucket",
+		"dbsize_requests_total",
+		"dbsize_request_bytes_total",
+		"dbsize_response_bytes_total",
+	},
+	[NEON_REQUEST_SLRU] = {
+		"slru_wait_seconds_count",
+		"slru_wait_seconds_sum",
+		"slru_wait_seconds_bucket",
+		"slru_requests_total",
+		"slru_request_bytes_total",
+		"slru_response_bytes_total",
+	},
+};
 
 Size
 NeonPerfCountersShmemSize(void)
@@ -29,6 +112,13 @@ NeonPerfCountersShmemSize(void)
 
 	size = add_size(size, mul_size(NUM_NEON_PERF_COUNTER_SLOTS,
 								   sizeof(neon_per_backend_counters)));
+	size = add_size(size, mul_size(MAX_SHARDS,
+								   sizeof(neon_per_shard_counters)));
+	size = add_size(size, mul_size(NUM_NEON_PERF_COUNTER_SLOTS,
+								   sizeof(uint32)));
+	size = add_size(size, mul_size(mul_size(NUM_NEON_PERF_COUNTER_SLOTS,
+											neon_slow_request_log_size),
+								   sizeof(SlowRequestSlot)));
 
 	return size;
 }
@@ -48,29 +138,93 @@ NeonPerfCountersShmemInit(void)
 	{
 		/* shared memory is initialized to zeros, so nothing to do here */
 	}
+
+	neon_per_shard_counters_shared =
+		ShmemInitStruct("Neon per-shard perf counters",
+						mul_size(MAX_SHARDS, sizeof(neon_per_shard_counters)),
+						&found);
+	Assert(found == IsUnderPostmaster);
+	if (!found)
+	{
+		for (int shard_no = 0; shard_no < MAX_SHARDS; shard_no++)
+		{
+			for (int phase = 0; phase < NUM_GETPAGE_PHASES; phase++)
+			{
+				IOHistogramAtomicData *hist =
+					&neon_per_shard_counters_shared[shard_no].getpage_phase_hist[phase];
+
+				pg_atomic_init_u64(&hist->wait_us_count, 0);
+				pg_atomic_init_u64(&hist->wait_us_sum, 0);
+				for (int bucketno = 0; bucketno < NUM_IO_WAIT_BUCKETS; bucketno++)
+					pg_atomic_init_u64(&hist->wait_us_bucket[bucketno], 0);
+			}
+		}
+	}
+
+	slow_request_next =
+		ShmemInitStruct("Neon slow request log",
+						mul_size(NUM_NEON_PERF_COUNTER_SLOTS, sizeof(uint32)),
+						&found);
+	Assert(found == IsUnderPostmaster);
+	slow_request_slots =
+		ShmemInitStruct("Neon slow request log entries",
+						mul_size(mul_size(NUM_NEON_PERF_COUNTER_SLOTS,
+										  neon_slow_request_log_size),
+								 sizeof(SlowRequestSlot)),
+						&found);
+	Assert(found == IsUnderPostmaster);
+	/* zeroed shared memory means empty rings, so nothing else to do */
 }
 
-static inline void
-inc_iohist(IOHistogram hist, uint64 latency_us)
+/*
+ * Record a slow request in this backend's ring, overwriting the oldest entry
+ * if it's full.
+ */
+void
+log_slow_request(const SlowRequestEntry *entry)
 {
-	int			lo = 0;
-	int			hi = NUM_IO_WAIT_BUCKETS - 1;
+	int			procno = MyNeonCounters - neon_per_backend_counters_shared;
+	volatile SlowRequestSlot *slot;
+	uint32		next;
 
-	/* Find the right bucket with binary search */
-	while (lo < hi)
-	{
-		int			mid = (lo + hi) / 2;
+	Assert(neon_slow_request_log_size > 0);
 
-		if (latency_us < io_wait_bucket_thresholds[mid])
-			hi = mid;
-		else
-			lo = mid + 1;
-	}
-	hist->wait_us_bucket[lo]++;
+	next = slow_request_next[procno];
+	slot = &slow_request_slots[procno * neon_slow_request_log_size + next];
+	slow_request_next[procno] = (next + 1) % neon_slow_request_log_size;
+
+	slot->changecount++;
+	pg_write_barrier();
+	memcpy((SlowRequestEntry *) &slot->entry, entry, sizeof(SlowRequestEntry));
+	pg_write_barrier();
+	slot->changecount++;
+}
+
+static inline void
+inc_iohist(IOHistogram hist, uint64 latency_us)
+{
+	hist->wait_us_bucket[io_wait_bucket(latency_us)]++;
 	hist->wait_us_sum += latency_us;
 	hist->wait_us_count++;
 }
 
+static inline void
+inc_iohist_atomic(IOHistogramAtomicData *hist, uint64 latency_us)
+{
+	pg_atomic_fetch_add_u64(&hist->wait_us_bucket[io_wait_bucket(latency_us)], 1);
+	pg_atomic_fetch_add_u64(&hist->wait_us_sum, latency_us);
+	pg_atomic_fetch_add_u64(&hist->wait_us_count, 1);
+}
+
+static void
+iohist_atomic_read(IOHistogramAtomicData *hist, IOHistogram into)
+{
+	into->wait_us_count = pg_atomic_read_u64(&hist->wait_us_count);
+	into->wait_us_sum = pg_atomic_read_u64(&hist->wait_us_sum);
+	for (int bucketno = 0; bucketno < NUM_IO_WAIT_BUCKETS; bucketno++)
+		into->wait_us_bucket[bucketno] = pg_atomic_read_u64(&hist->wait_us_bucket[bucketno]);
+}
+
 /*
  * Count a GetPage wait operation.
  */
@@ -98,6 +252,64 @@ inc_page_cache_write_wait(uint64 latency)
 	inc_iohist(&MyNeonCounters->file_cache_write_hist, latency);
 }
 
+/*
+ * Count a completed connection to a pageserver.
+ */
+void
+inc_pageserver_connect_wait(uint64 latency)
+{
+	inc_iohist(&MyNeonCounters->pageserver_connect_hist, latency);
+}
+
+/*
+ * Count one phase of a GetPage request to the given shard.
+ */
+void
+inc_getpage_phase(int shard_no, GetPagePhase phase, uint64 latency)
+{
+	Assert(shard_no >= 0 && shard_no < MAX_SHARDS);
+
+	inc_iohist(&MyNeonCounters->getpage_phase_hist[phase], latency);
+	inc_iohist_atomic(&neon_per_shard_counters_shared[shard_no].getpage_phase_hist[phase],
+					  latency);
+}
+
+/*
+ * Count a completed Exists, Nblocks, DbSize or GetSlruSegment request.
+ */
+void
+inc_request_wait(NeonRequestType type, uint64 latency, uint64 request_bytes)
+{
+	RequestTypeCounters *counters = &MyNeonCounters->request_type_counters[type];
+
+	counters->requests_total++;
+	counters->request_bytes_total += request_bytes;
+	inc_iohist(&counters->wait_hist, latency);
+}
+
+/*
+ * Count a received response to an Exists, Nblocks, DbSize or GetSlruSegment
+ * request.
+ */
+void
+inc_request_response_bytes(NeonRequestType type, uint64 bytes)
+{
+	MyNeonCounters->request_type_counters[type].response_bytes_total += bytes;
+}
+
+/*
+ * Count the decompression of a compressed GetPage response.
+ */
+void
+inc_getpage_decompress(uint64 latency, uint64 compressed_bytes,
+					   uint64 decompressed_bytes)
+{
+	MyNeonCounters->getpage_compressed_responses_total++;
+	MyNeonCounters->getpage_compressed_bytes_total += compressed_bytes;
+	MyNeonCounters->getpage_decompressed_bytes_total += decompressed_bytes;
+	inc_iohist(&MyNeonCounters->getpage_decompress_hist, latency);
+}
+
 /*
  * Support functions for the views, neon_backend_perf_counters and
  * neon_perf_counters.
@@ -111,6 +323,25 @@ typedef struct
 	double		value;
 } metric_t;
 
+/*
+ * The bucket thresholds that the exported views use, in microseconds. These
+ * are the fixed buckets that the histograms had before they were made
+ * log-linear. Keeping them means that the Prometheus *_bucket series and
+ * their le labels stay the same; the finer buckets are only available through
+ * the neon_histogram*() functions.
+ */
+static const uint64 exported_bucket_thresholds[] = {
+	   2,        3,        6,        10,	/* 0 us   - 10 us */
+	  20,       30,       60,       100,	/* 10 us  - 100 us */
+	 200,      300,      600,      1000,	/* 100 us - 1 ms */
+	2000,     3000,     6000,     10000,	/* 1 ms   - 10 ms */
+	20000,    30000,    60000,    100000,	/* 10 ms  - 100 ms */
+	200000,   300000,   600000,   1000000,	/* 100 ms - 1 s */
+	2000000,  3000000,  6000000,  10000000,	/* 1 s - 10 s */
+	UINT64_MAX,
+};
+#define NUM_EXPORTED_BUCKETS lengthof(exported_bucket_thresholds)
+
 static int
 histogram_to_metrics(IOHistogram histogram,
 					 metric_t *metrics,
@@ -119,6 +350,7 @@ histogram_to_metrics(IOHistogram histogram,
 					 const char *bucket)
 {
 	int		i = 0;
+	int		bucketno = 0;
 	uint64	bucket_accum = 0;
 
 	metrics[i].name = count;
@@ -129,16 +361,37 @@ histogram_to_metrics(IOHistogram histogram,
 	metrics[i].is_bucket = false;
 	metrics[i].value = (double) histogram->wait_us_sum / 1000000.0;
 	i++;
-	for (int bucketno = 0; bucketno < NUM_IO_WAIT_BUCKETS; bucketno++)
+	for (int j = 0; j < NUM_EXPORTED_BUCKETS; j++)
 	{
-		uint64		threshold = io_wait_bucket_thresholds[bucketno];
+		uint64		threshold = exported_bucket_thresholds[j];
+		double		value;
+
+		/* Add up the buckets that lie entirely below the threshold */
+		while (bucketno < NUM_IO_WAIT_BUCKETS &&
+			   io_wait_bucket_upper(bucketno) <= threshold)
+			bucket_accum += histogram->wait_us_bucket[bucketno++];
+		value = (double) bucket_accum;
+
+		/*
+		 * If the threshold falls inside a bucket, count the part of it below
+		 * the threshold, assuming that the values are spread evenly across
+		 * the bucket.
+		 */
+		if (bucketno < NUM_IO_WAIT_BUCKETS &&
+			io_wait_bucket_upper(bucketno) != UINT64_MAX &&
+			io_wait_bucket_lower(bucketno) < threshold)
+		{
+			uint64		lower = io_wait_bucket_lower(bucketno);
+			uint64		upper = io_wait_bucket_upper(bucketno);
 
-		bucket_accum += histogram->wait_us_bucket[bucketno];
+			value += (double) histogram->wait_us_bucket[bucketno] *
+				(threshold - lower) / (upper - lower);
+		}
 
 		metrics[i].name = bucket;
 		metrics[i].is_bucket = true;
 		metrics[i].bucket_le = (threshold == UINT64_MAX) ? INFINITY : ((double) threshold) / 1000000.0;
-		metrics[i].value = (double) bucket_accum;
+		metrics[i].value = value;
 		i++;
 	}
 
@@ -148,7 +401,8 @@ histogram_to_metrics(IOHistogram histogram,
 static metric_t *
 neon_perf_counters_to_metrics(neon_per_backend_counters *counters)
 {
-#define NUM_METRICS ((2 + NUM_IO_WAIT_BUCKETS) * 3 + 10)
+#define NUM_METRICS ((2 + NUM_EXPORTED_BUCKETS) * (5 + NUM_GETPAGE_PHASES + NUM_NEON_REQUEST_TYPES) + \
+					 23 + 3 * NUM_NEON_REQUEST_TYPES)
 	metric_t   *metrics = palloc((NUM_METRICS + 1) * sizeof(metric_t));
 	int			i = 0;
 
@@ -166,11 +420,15 @@ neon_perf_counters_to_metrics(neon_per_backend_counters *counters)
 
 	APPEND_METRIC(getpage_prefetch_requests_total);
 	APPEND_METRIC(getpage_sync_requests_total);
+	APPEND_METRIC(getpage_range_requests_total);
 	APPEND_METRIC(getpage_prefetch_misses_total);
 	APPEND_METRIC(getpage_prefetch_discards_total);
+	APPEND_METRIC(getpage_prefetch_out_of_order_total);
 	APPEND_METRIC(pageserver_requests_sent_total);
 	APPEND_METRIC(pageserver_disconnects_total);
 	APPEND_METRIC(pageserver_send_flushes_total);
+	APPEND_METRIC(pageserver_send_queue_drains_total);
+	APPEND_METRIC(pageserver_raw_framing_connections_total);
 	APPEND_METRIC(pageserver_open_requests);
 	APPEND_METRIC(getpage_prefetches_buffered);
 
@@ -185,6 +443,51 @@ neon_perf_counters_to_metrics(neon_per_backend_counters *counters)
 							  "file_cache_write_wait_seconds_sum",
 							  "file_cache_write_wait_seconds_bucket");
 
+	APPEND_METRIC(getpage_compressed_responses_total);
+	APPEND_METRIC(getpage_compressed_bytes_total);
+	APPEND_METRIC(getpage_decompressed_bytes_total);
+	i += histogram_to_metrics(&counters->getpage_decompress_hist, &metrics[i],
+							  "getpage_decompress_seconds_count",
+							  "getpage_decompress_seconds_sum",
+							  "getpage_decompress_seconds_bucket");
+
+	APPEND_METRIC(getpage_revalidate_requests_total);
+	APPEND_METRIC(getpage_not_modified_total);
+	APPEND_METRIC(communicator_requests_total);
+	APPEND_METRIC(communicator_coalesced_requests_total);
+	APPEND_METRIC(pageserver_hedged_requests_total);
+	APPEND_METRIC(pageserver_hedge_wins_total);
+	i += histogram_to_metrics(&counters->pageserver_connect_hist, &metrics[i],
+							  "pageserver_connect_seconds_count",
+							  "pageserver_connect_seconds_sum",
+							  "pageserver_connect_seconds_bucket");
+	for (int phase = 0; phase < NUM_GETPAGE_PHASES; phase++)
+		i += histogram_to_metrics(&counters->getpage_phase_hist[phase], &metrics[i],
+								  getpage_phase_metric_names[phase][0],
+								  getpage_phase_metric_names[phase][1],
+								  getpage_phase_metric_names[phase][2]);
+
+	for (int type = 0; type < NUM_NEON_REQUEST_TYPES; type++)
+	{
+		RequestTypeCounters *rt = &counters->request_type_counters[type];
+		const char *const *names = request_type_metric_names[type];
+
+		i += histogram_to_metrics(&rt->wait_hist, &metrics[i],
+								  names[0], names[1], names[2]);
+		metrics[i].name = names[3];
+		metrics[i].is_bucket = false;
+		metrics[i].value = (double) rt->requests_total;
+		i++;
+		metrics[i].name = names[4];
+		metrics[i].is_bucket = false;
+		metrics[i].value = (double) rt->request_bytes_total;
+		i++;
+		metrics[i].name = names[5];
+		metrics[i].is_bucket = false;
+		metrics[i].value = (double) rt->response_bytes_total;
+		i++;
+	}
+
 	Assert(i == NUM_METRICS);
 
 #undef APPEND_METRIC
@@ -284,16 +587,43 @@ neon_get_perf_counters(PG_FUNCTION_ARGS)
 		histogram_merge_into(&totals.getpage_hist, &counters->getpage_hist);
 		totals.getpage_prefetch_requests_total += counters->getpage_prefetch_requests_total;
 		totals.getpage_sync_requests_total += counters->getpage_sync_requests_total;
+		totals.getpage_range_requests_total += counters->getpage_range_requests_total;
 		totals.getpage_prefetch_misses_total += counters->getpage_prefetch_misses_total;
 		totals.getpage_prefetch_discards_total += counters->getpage_prefetch_discards_total;
+		totals.getpage_prefetch_out_of_order_total += counters->getpage_prefetch_out_of_order_total;
 		totals.pageserver_requests_sent_total += counters->pageserver_requests_sent_total;
 		totals.pageserver_disconnects_total += counters->pageserver_disconnects_total;
 		totals.pageserver_send_flushes_total += counters->pageserver_send_flushes_total;
+		totals.pageserver_send_queue_drains_total += counters->pageserver_send_queue_drains_total;
+		totals.pageserver_raw_framing_connections_total += counters->pageserver_raw_framing_connections_total;
 		totals.pageserver_open_requests += counters->pageserver_open_requests;
 		totals.getpage_prefetches_buffered += counters->getpage_prefetches_buffered;
 		totals.file_cache_hits_total += counters->file_cache_hits_total;
 		histogram_merge_into(&totals.file_cache_read_hist, &counters->file_cache_read_hist);
 		histogram_merge_into(&totals.file_cache_write_hist, &counters->file_cache_write_hist);
+		totals.getpage_compressed_responses_total += counters->getpage_compressed_responses_total;
+		totals.getpage_compressed_bytes_total += counters->getpage_compressed_bytes_total;
+		totals.getpage_decompressed_bytes_total += counters->getpage_decompressed_bytes_total;
+		histogram_merge_into(&totals.getpage_decompress_hist, &counters->getpage_decompress_hist);
+		totals.getpage_revalidate_requests_total += counters->getpage_revalidate_requests_total;
+		totals.getpage_not_modified_total += counters->getpage_not_modified_total;
+		totals.communicator_requests_total += counters->communicator_requests_total;
+		totals.communicator_coalesced_requests_total += counters->communicator_coalesced_requests_total;
+		totals.pageserver_hedged_requests_total += counters->pageserver_hedged_requests_total;
+		totals.pageserver_hedge_wins_total += counters->pageserver_hedge_wins_total;
+		histogram_merge_into(&totals.pageserver_connect_hist, &counters->pageserver_connect_hist);
+		for (int phase = 0; phase < NUM_GETPAGE_PHASES; phase++)
+			histogram_merge_into(&totals.getpage_phase_hist[phase], &counters->getpage_phase_hist[phase]);
+		for (int type = 0; type < NUM_NEON_REQUEST_TYPES; type++)
+		{
+			RequestTypeCounters *into = &totals.request_type_counters[type];
+			RequestTypeCounters *from = &counters->request_type_counters[type];
+
+			histogram_merge_into(&into->wait_hist, &from->wait_hist);
+			into->requests_total += from->requests_total;
+			into->request_bytes_total += from->request_bytes_total;
+			into->response_bytes_total += from->response_bytes_total;
+		}
 	}
 
 	metrics = neon_perf_counters_to_metrics(&totals);
@@ -306,3 +636,440 @@ neon_get_perf_counters(PG_FUNCTION_ARGS)
 
 	return (Datum) 0;
 }
+
+PG_FUNCTION_INFO_V1(neon_get_shard_perf_counters);
+Datum
+neon_get_shard_perf_counters(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum		values[4];
+	bool		nulls[4];
+	metric_t	metrics[2 + NUM_EXPORTED_BUCKETS];
+
+	/* We put all the tuples into a tuplestore in one go. */
+	InitMaterializedSRF(fcinfo, 0);
+
+	for (int shard_no = 0; shard_no < MAX_SHARDS; shard_no++)
+	{
+		neon_per_shard_counters *counters = &neon_per_shard_counters_shared[shard_no];
+		IOHistogramData hists[NUM_GETPAGE_PHASES];
+		bool		any = false;
+
+		for (int phase = 0; phase < NUM_GETPAGE_PHASES; phase++)
+		{
+			iohist_atomic_read(&counters->getpage_phase_hist[phase], &hists[phase]);
+			any |= hists[phase].wait_us_count > 0;
+		}
+
+		/* Skip shards that we have never talked to */
+		if (!any)
+			continue;
+
+		values[0] = Int32GetDatum(shard_no);
+		nulls[0] = false;
+
+		for (int phase = 0; phase < NUM_GETPAGE_PHASES; phase++)
+		{
+			int			n;
+
+			n = histogram_to_metrics(&hists[phase], metrics,
+									 getpage_phase_metric_names[phase][0],
+									 getpage_phase_metric_names[phase][1],
+									 getpage_phase_metric_names[phase][2]);
+			for (int i = 0; i < n; i++)
+			{
+				metric_to_datums(&metrics[i], &values[1], &nulls[1]);
+				tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+			}
+		}
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Name of a request type in the neon_slow_requests view
+ */
+static const char *
+slow_request_tag_name(uint8 tag)
+{
+	switch ((NeonMessageTag) tag)
+	{
+		case T_NeonExistsRequest:
+			return "Exists";
+		case T_NeonNblocksRequest:
+			return "Nblocks";
+		case T_NeonGetPageRequest:
+			return "GetPage";
+		case T_NeonDbSizeRequest:
+			return "DbSize";
+		case T_NeonGetSlruSegmentRequest:
+			return "GetSlruSegment";
+		case T_NeonGetPageRangeRequest:
+			return "GetPageRange";
+		case T_NeonGetPageIfModifiedRequest:
+			return "GetPageIfModified";
+		default:
+			return "unknown";
+	}
+}
+
+static const char *const slow_request_prefetch_names[] = {
+	[SLOW_REQUEST_SYNC] = NULL,
+	[SLOW_REQUEST_PREFETCH_RECEIVED] = "received",
+	[SLOW_REQUEST_PREFETCH_INFLIGHT] = "in flight",
+	[SLOW_REQUEST_PREFETCH_MISS] = "miss",
+};
+
+#define SLOW_REQUEST_COLS 18
+
+static void
+slow_request_to_datums(SlowRequestEntry *e, Datum *values, bool *nulls)
+{
+	bool		has_rel;
+	bool		has_blkno;
+
+	switch ((NeonMessageTag) e->tag)
+	{
+		case T_NeonGetPageRequest:
+		case T_NeonGetPageRangeRequest:
+		case T_NeonGetPageIfModifiedRequest:
+			has_rel = has_blkno = true;
+			break;
+		case T_NeonExistsRequest:
+		case T_NeonNblocksRequest:
+			has_rel = true;
+			has_blkno = false;
+			break;
+		case T_NeonGetSlruSegmentRequest:
+			has_rel = false;
+			has_blkno = true;
+			break;
+		default:
+			has_rel = has_blkno = false;
+			break;
+	}
+
+	memset(nulls, 0, SLOW_REQUEST_COLS * sizeof(bool));
+	values[0] = TimestampTzGetDatum(e->end_time);
+	values[1] = CStringGetTextDatum(slow_request_tag_name(e->tag));
+	values[2] = Int32GetDatum(e->shard_no);
+	values[3] = ObjectIdGetDatum(e->spcOid);
+	nulls[3] = !has_rel;
+	values[4] = ObjectIdGetDatum(e->dbOid);
+	nulls[4] = !has_rel && e->tag != T_NeonDbSizeRequest;
+	values[5] = ObjectIdGetDatum(e->relNumber);
+	nulls[5] = !has_rel;
+	values[6] = Int32GetDatum(e->forknum);
+	nulls[6] = !has_rel;
+	values[7] = Int64GetDatum((int64) e->blkno);
+	nulls[7] = !has_blkno;
+	values[8] = LSNGetDatum(e->request_lsn);
+	values[9] = LSNGetDatum(e->not_modified_since);
+	if (slow_request_prefetch_names[e->prefetch_status] != NULL)
+		values[10] = CStringGetTextDatum(slow_request_prefetch_names[e->prefetch_status]);
+	else
+		nulls[10] = true;
+	values[11] = Float8GetDatum((double) e->latency_us / 1000000.0);
+	for (int phase = 0; phase < NUM_GETPAGE_PHASES; phase++)
+	{
+		values[12 + phase] = Float8GetDatum((double) e->phase_us[phase] / 1000000.0);
+		nulls[12 + phase] = !e->has_phases;
+	}
+}
+
+/*
+ * Dump the slow request logs of all backends
+ */
+PG_FUNCTION_INFO_V1(neon_get_slow_requests);
+Datum
+neon_get_slow_requests(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum		values[2 + SLOW_REQUEST_COLS];
+	bool		nulls[2 + SLOW_REQUEST_COLS];
+
+	StaticAssertStmt(12 + NUM_GETPAGE_PHASES == SLOW_REQUEST_COLS,
+					 "slow request columns don't match phases");
+
+	/* We put all the tuples into a tuplestore in one go. */
+	InitMaterializedSRF(fcinfo, 0);
+
+	for (int procno = 0; procno < NUM_NEON_PERF_COUNTER_SLOTS; procno++)
+	{
+		PGPROC	   *proc = GetPGProcByNumber(procno);
+
+		for (int i = 0; i < neon_slow_request_log_size; i++)
+		{
+			volatile SlowRequestSlot *slot =
+				&slow_request_slots[procno * neon_slow_request_log_size + i];
+			SlowRequestEntry entry;
+			bool		ok = false;
+
+			/*
+			 * Copy the entry, retrying if it's being written concurrently.
+			 * If the owner keeps rewriting it, give up on it; it will show
+			 * up again soon enough.
+			 */
+			for (int attempt = 0; attempt < 10 && !ok; attempt++)
+			{
+				uint32		before = slot->changecount;
+
+				pg_read_barrier();
+				memcpy(&entry, (SlowRequestEntry *) &slot->entry, sizeof(SlowRequestEntry));
+				pg_read_barrier();
+				ok = (before % 2) == 0 && before == slot->changecount;
+			}
+			if (!ok || entry.end_time == 0)
+				continue;
+
+			values[0] = Int32GetDatum(procno);
+			nulls[0] = false;
+			values[1] = Int32GetDatum(proc->pid);
+			nulls[1] = false;
+			slow_request_to_datums(&entry, &values[2], &nulls[2]);
+			tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+		}
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Histogram snapshots
+ *
+ * For computing percentiles, and deltas between two points in time, a
+ * histogram can be retrieved as an int8 array: the count, the sum in
+ * microseconds, and then the number of values in each bucket (not cumulative,
+ * unlike in the views). Snapshots of the same histogram can be added and
+ * subtracted element by element.
+ */
+#define HISTOGRAM_SNAPSHOT_LEN (2 + NUM_IO_WAIT_BUCKETS)
+
+typedef struct
+{
+	const char *name;
+	size_t		offset;			/* of the IOHistogramData in
+								 * neon_per_backend_counters */
+} histogram_def;
+
+#define HISTOGRAM_DEF(_name, _field) \
+	{ _name, offsetof(neon_per_backend_counters, _field) }
+
+static const histogram_def histogram_defs[] = {
+	HISTOGRAM_DEF("getpage_wait_seconds", getpage_hist),
+	HISTOGRAM_DEF("file_cache_read_wait_seconds", file_cache_read_hist),
+	HISTOGRAM_DEF("file_cache_write_wait_seconds", file_cache_write_hist),
+	HISTOGRAM_DEF("getpage_decompress_seconds", getpage_decompress_hist),
+	HISTOGRAM_DEF("pageserver_connect_seconds", pageserver_connect_hist),
+	HISTOGRAM_DEF("getpage_queue_seconds", getpage_phase_hist[GETPAGE_PHASE_QUEUE]),
+	HISTOGRAM_DEF("getpage_send_seconds", getpage_phase_hist[GETPAGE_PHASE_SEND]),
+	HISTOGRAM_DEF("getpage_network_seconds", getpage_phase_hist[GETPAGE_PHASE_NETWORK]),
+	HISTOGRAM_DEF("getpage_consume_seconds", getpage_phase_hist[GETPAGE_PHASE_CONSUME]),
+	HISTOGRAM_DEF("exists_wait_seconds", request_type_counters[NEON_REQUEST_EXISTS].wait_hist),
+	HISTOGRAM_DEF("nblocks_wait_seconds", request_type_counters[NEON_REQUEST_NBLOCKS].wait_hist),
+	HISTOGRAM_DEF("dbsize_wait_seconds", request_type_counters[NEON_REQUEST_DBSIZE].wait_hist),
+	HISTOGRAM_DEF("slru_wait_seconds", request_type_counters[NEON_REQUEST_SLRU].wait_hist),
+};
+
+#undef HISTOGRAM_DEF
+
+static ArrayType *
+histogram_to_array(IOHistogram hist)
+{
+	Datum		elems[HISTOGRAM_SNAPSHOT_LEN];
+
+	elems[0] = Int64GetDatum((int64) hist->wait_us_count);
+	elems[1] = Int64GetDatum((int64) hist->wait_us_sum);
+	for (int bucketno = 0; bucketno < NUM_IO_WAIT_BUCKETS; bucketno++)
+		elems[2 + bucketno] = Int64GetDatum((int64) hist->wait_us_bucket[bucketno]);
+
+	return construct_array(elems, HISTOGRAM_SNAPSHOT_LEN, INT8OID,
+						   sizeof(int64), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE);
+}
+
+/*
+ * Extract the elements of a histogram snapshot, checking that it looks like
+ * one.
+ */
+static void
+array_to_histogram(ArrayType *arr, int64 *values)
+{
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+
+	if (ARR_NDIM(arr) != 1 || ARR_ELEMTYPE(arr) != INT8OID)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("histogram snapshot must be a one-dimensional int8 array")));
+
+	deconstruct_array(arr, INT8OID, sizeof(int64), FLOAT8PASSBYVAL,
+					  TYPALIGN_DOUBLE, &elems, &nulls, &nelems);
+	if (nelems != HISTOGRAM_SNAPSHOT_LEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("histogram snapshot must have %d elements, not %d",
+						HISTOGRAM_SNAPSHOT_LEN, nelems)));
+
+	for (int i = 0; i < nelems; i++)
+	{
+		if (nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("histogram snapshot must not contain nulls")));
+		values[i] = DatumGetInt64(elems[i]);
+	}
+	pfree(elems);
+	pfree(nulls);
+}
+
+/*
+ * neon_get_histogram(metric text, pid integer) returns int8[]
+ *
+ * Snapshot of the named histogram, summed across all backends, or only of the
+ * backend with the given pid if it's not NULL.
+ */
+PG_FUNCTION_INFO_V1(neon_get_histogram);
+Datum
+neon_get_histogram(PG_FUNCTION_ARGS)
+{
+	char	   *name;
+	const histogram_def *def = NULL;
+	IOHistogramData totals = {0};
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+	name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+	for (int i = 0; i < lengthof(histogram_defs); i++)
+	{
+		if (strcmp(histogram_defs[i].name, name) == 0)
+		{
+			def = &histogram_defs[i];
+			break;
+		}
+	}
+	if (def == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unknown histogram \"%s\"", name)));
+
+	for (int procno = 0; procno < NUM_NEON_PERF_COUNTER_SLOTS; procno++)
+	{
+		neon_per_backend_counters *counters = &neon_per_backend_counters_shared[procno];
+
+		if (!PG_ARGISNULL(1) && GetPGProcByNumber(procno)->pid != PG_GETARG_INT32(1))
+			continue;
+
+		histogram_merge_into(&totals, (IOHistogram) ((char *) counters + def->offset));
+	}
+
+	PG_RETURN_ARRAYTYPE_P(histogram_to_array(&totals));
+}
+
+/*
+ * neon_histogram_add(a int8[], b int8[]) returns int8[]
+ *
+ * Element-wise sum of two snapshots. This is also the transition function of
+ * the neon_histogram_sum() aggregate.
+ */
+PG_FUNCTION_INFO_V1(neon_histogram_add);
+Datum
+neon_histogram_add(PG_FUNCTION_ARGS)
+{
+	int64		a[HISTOGRAM_SNAPSHOT_LEN];
+	int64		b[HISTOGRAM_SNAPSHOT_LEN];
+	IOHistogramData result;
+
+	array_to_histogram(PG_GETARG_ARRAYTYPE_P(0), a);
+	array_to_histogram(PG_GETARG_ARRAYTYPE_P(1), b);
+
+	result.wait_us_count = a[0] + b[0];
+	result.wait_us_sum = a[1] + b[1];
+	for (int bucketno = 0; bucketno < NUM_IO_WAIT_BUCKETS; bucketno++)
+		result.wait_us_bucket[bucketno] = a[2 + bucketno] + b[2 + bucketno];
+
+	PG_RETURN_ARRAYTYPE_P(histogram_to_array(&result));
+}
+
+/*
+ * neon_histogram_sub(a int8[], b int8[]) returns int8[]
+ *
+ * Element-wise difference of two snapshots of the same histogram, taken at
+ * different times. 'b' must be the older one. Counts are never reset, but a
+ * backend slot can be reused by a new backend, so a per-backend snapshot can
+ * go backwards; buckets that did are clamped to zero.
+ */
+PG_FUNCTION_INFO_V1(neon_histogram_sub);
+Datum
+neon_histogram_sub(PG_FUNCTION_ARGS)
+{
+	int64		a[HISTOGRAM_SNAPSHOT_LEN];
+	int64		b[HISTOGRAM_SNAPSHOT_LEN];
+	IOHistogramData result;
+
+	array_to_histogram(PG_GETARG_ARRAYTYPE_P(0), a);
+	array_to_histogram(PG_GETARG_ARRAYTYPE_P(1), b);
+
+	result.wait_us_count = Max(a[0] - b[0], 0);
+	result.wait_us_sum = Max(a[1] - b[1], 0);
+	for (int bucketno = 0; bucketno < NUM_IO_WAIT_BUCKETS; bucketno++)
+		result.wait_us_bucket[bucketno] = Max(a[2 + bucketno] - b[2 + bucketno], 0);
+
+	PG_RETURN_ARRAYTYPE_P(histogram_to_array(&result));
+}
+
+/*
+ * neon_histogram_percentile(hist int8[], fraction float8) returns float8
+ *
+ * Estimate the given percentile of a snapshot, in seconds. The value is
+ * interpolated linearly within the bucket that it falls into. Returns NULL if
+ * the histogram is empty.
+ */
+PG_FUNCTION_INFO_V1(neon_histogram_percentile);
+Datum
+neon_histogram_percentile(PG_FUNCTION_ARGS)
+{
+	int64		values[HISTOGRAM_SNAPSHOT_LEN];
+	float8		fraction = PG_GETARG_FLOAT8(1);
+	int64		total = 0;
+	float8		target;
+	int64		accum = 0;
+
+	if (isnan(fraction) || fraction < 0 || fraction > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("percentile fraction %g is not between 0 and 1", fraction)));
+
+	array_to_histogram(PG_GETARG_ARRAYTYPE_P(0), values);
+
+	/* Use the buckets rather than the count, in case the snapshot was edited */
+	for (int bucketno = 0; bucketno < NUM_IO_WAIT_BUCKETS; bucketno++)
+		total += values[2 + bucketno];
+	if (total <= 0)
+		PG_RETURN_NULL();
+
+	target = fraction * total;
+	for (int bucketno = 0; bucketno < NUM_IO_WAIT_BUCKETS; bucketno++)
+	{
+		int64		n = values[2 + bucketno];
+		uint64		lower = io_wait_bucket_lower(bucketno);
+		uint64		upper = io_wait_bucket_upper(bucketno);
+
+		if (n > 0 && accum + n >= target)
+		{
+			float8		us;
+
+			/* The last bucket has no upper bound; report its lower bound */
+			if (upper == UINT64_MAX)
+				us = (float8) lower;
+			else
+				us = lower + (upper - lower) * ((target - accum) / n);
+			PG_RETURN_FLOAT8(us / 1000000.0);
+		}
+		accum += n;
+	}
+
+	pg_unreachable();
+}
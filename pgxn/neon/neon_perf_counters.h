@@ -8,24 +8,102 @@
 #ifndef NEON_PERF_COUNTERS_H
 #define NEON_PERF_COUNTERS_H
 
+#include "access/xlogdefs.h"
+#include "datatype/timestamp.h"
+#include "port/atomics.h"
+#include "port/pg_bitutils.h"
 #if PG_VERSION_NUM >= 170000
 #include "storage/procnumber.h"
 #else
 #include "storage/backendid.h"
 #include "storage/proc.h"
 #endif
+#if PG_VERSION_NUM < 150000
+#include "miscadmin.h"
+#include "postmaster/autovacuum.h"
+#include "postmaster/postmaster.h"
+#include "replication/walsender.h"
+#endif
+
+/*
+ * Latencies are collected in log-linear histograms, like HdrHistogram: each
+ * value below IO_WAIT_SUB_BUCKETS us has a bucket of its own, and above that,
+ * each power-of-two range is divided into IO_WAIT_SUB_BUCKETS / 2 buckets of
+ * equal width, up to 2^IO_WAIT_COARSE_BITS us (about 1 ms). That keeps the
+ * relative error below 25% with 1 us resolution at the low end, where LFC
+ * hits and successful prefetches fall. Above 1 ms, where the requests go to
+ * the pageserver, each power of two only has 2 buckets, to keep the
+ * histograms small. Values of 2^IO_WAIT_MAX_BITS us (about 16.8 s) and above
+ * all go to the last bucket.
+ */
+#define IO_WAIT_SUB_BUCKET_BITS	3
+#define IO_WAIT_SUB_BUCKETS		(1 << IO_WAIT_SUB_BUCKET_BITS)
+#define IO_WAIT_COARSE_BITS		10
+#define IO_WAIT_MAX_BITS		24
+#define IO_WAIT_FIRST_COARSE_BUCKET \
+	(IO_WAIT_SUB_BUCKETS + \
+	 (IO_WAIT_COARSE_BITS - IO_WAIT_SUB_BUCKET_BITS) * (IO_WAIT_SUB_BUCKETS / 2))
+#define NUM_IO_WAIT_BUCKETS \
+	(IO_WAIT_FIRST_COARSE_BUCKET + (IO_WAIT_MAX_BITS - IO_WAIT_COARSE_BITS) * 2 + 1)
+
+/* Bucket that a latency of 'latency_us' falls into */
+static inline int
+io_wait_bucket(uint64 latency_us)
+{
+	int			msb;
+
+	if (latency_us < IO_WAIT_SUB_BUCKETS)
+		return (int) latency_us;
+
+	msb = pg_leftmost_one_pos64(latency_us);
+	if (msb >= IO_WAIT_MAX_BITS)
+		return NUM_IO_WAIT_BUCKETS - 1;
+
+	/* the top bits below the leading one select the bucket in the octave */
+	if (msb < IO_WAIT_COARSE_BITS)
+		return IO_WAIT_SUB_BUCKETS +
+			(msb - IO_WAIT_SUB_BUCKET_BITS) * (IO_WAIT_SUB_BUCKETS / 2) +
+			(int) (latency_us >> (msb - IO_WAIT_SUB_BUCKET_BITS + 1)) - IO_WAIT_SUB_BUCKETS / 2;
+
+	return IO_WAIT_FIRST_COARSE_BUCKET +
+		(msb - IO_WAIT_COARSE_BITS) * 2 +
+		(int) (latency_us >> (msb - 1)) - 2;
+}
+
+/*
+ * Upper bound of a bucket, in us. The bucket holds latencies below this
+ * bound, and at or above the bound of the previous bucket. The last bucket has
+ * no upper bound, and returns UINT64_MAX.
+ */
+static inline uint64
+io_wait_bucket_upper(int bucketno)
+{
+	int			octave;
+	int			sub;
+
+	if (bucketno < IO_WAIT_SUB_BUCKETS)
+		return bucketno + 1;
+	if (bucketno >= NUM_IO_WAIT_BUCKETS - 1)
+		return UINT64_MAX;
 
-static const uint64 io_wait_bucket_thresholds[] = {
-	       2,        3,        6,        10,  /* 0 us   - 10 us */
-	      20,       30,       60,       100,  /* 10 us  - 100 us */
-	     200,      300,      600,	   1000,  /* 100 us - 1 ms */
-	    2000,     3000,     6000,     10000,  /* 1 ms   - 10 ms */
-	   20000,    30000,    60000,    100000,  /* 10 ms  - 100 ms */
-	  200000,   300000,   600000,   1000000,  /* 100 ms - 1 s */
-	 2000000,  3000000,  6000000,  10000000,  /* 1 s - 10 s */
-	UINT64_MAX,
-};
-#define NUM_IO_WAIT_BUCKETS (lengthof(io_wait_bucket_thresholds))
+	if (bucketno < IO_WAIT_FIRST_COARSE_BUCKET)
+	{
+		octave = (bucketno - IO_WAIT_SUB_BUCKETS) / (IO_WAIT_SUB_BUCKETS / 2);
+		sub = (bucketno - IO_WAIT_SUB_BUCKETS) % (IO_WAIT_SUB_BUCKETS / 2);
+		return (uint64) (IO_WAIT_SUB_BUCKETS / 2 + sub + 1) << (octave + 1);
+	}
+
+	octave = (bucketno - IO_WAIT_FIRST_COARSE_BUCKET) / 2;
+	sub = (bucketno - IO_WAIT_FIRST_COARSE_BUCKET) % 2;
+	return (uint64) (2 + sub + 1) << (IO_WAIT_COARSE_BITS - 1 + octave);
+}
+
+/* Lower bound of a bucket, in us */
+static inline uint64
+io_wait_bucket_lower(int bucketno)
+{
+	return bucketno == 0 ? 0 : io_wait_bucket_upper(bucketno - 1);
+}
 
 typedef struct IOHistogramData
 {
@@ -36,6 +114,47 @@ typedef struct IOHistogramData
 
 typedef IOHistogramData *IOHistogram;
 
+/*
+ * Phases of a GetPage request that goes through the prefetch ring, from the
+ * time it's registered until the backend has copied out the page.
+ */
+typedef enum
+{
+	GETPAGE_PHASE_QUEUE,		/* registered, until the flush started */
+	GETPAGE_PHASE_SEND,			/* flush started, until it completed */
+	GETPAGE_PHASE_NETWORK,		/* flushed, until the response was received */
+	GETPAGE_PHASE_CONSUME,		/* response used, until the page was copied
+								 * out and written to the LFC */
+} GetPagePhase;
+
+#define NUM_GETPAGE_PHASES (GETPAGE_PHASE_CONSUME + 1)
+
+/*
+ * Request types other than GetPage, that are counted separately. These are
+ * sent synchronously, so each of them is a full round trip to the pageserver.
+ */
+typedef enum
+{
+	NEON_REQUEST_EXISTS,
+	NEON_REQUEST_NBLOCKS,
+	NEON_REQUEST_DBSIZE,
+	NEON_REQUEST_SLRU,
+} NeonRequestType;
+
+#define NUM_NEON_REQUEST_TYPES (NEON_REQUEST_SLRU + 1)
+
+typedef struct
+{
+	/* Time from sending the request until the response was received */
+	IOHistogramData wait_hist;
+
+	uint64		requests_total;
+
+	/* Size of the requests sent and the responses received, in bytes */
+	uint64		request_bytes_total;
+	uint64		response_bytes_total;
+} RequestTypeCounters;
+
 typedef struct
 {
 	/*
@@ -57,6 +176,12 @@ typedef struct
 	uint64		getpage_prefetch_requests_total;
 	uint64		getpage_sync_requests_total;
 
+	/*
+	 * Number of GetPageRange requests sent (protocol version 4 and up). The
+	 * blocks they cover are included in the two counters above.
+	 */
+	uint64		getpage_range_requests_total;
+
 	/*
 	 * Total number of readahead misses; consisting of either prefetches that
 	 * don't satisfy the LSN bounds, or cases where no readahead was issued
@@ -71,6 +196,12 @@ typedef struct
 	 */
 	uint64		getpage_prefetch_discards_total;
 
+	/*
+	 * Number of prefetch responses that arrived while an older prefetch
+	 * request, to another shard, was still waiting for its response.
+	 */
+	uint64		getpage_prefetch_out_of_order_total;
+
 	/*
 	 * Total number of requests send to pageserver. (prefetch_requests_total
 	 * and sync_request_total count only GetPage requests, this counts all
@@ -91,6 +222,18 @@ typedef struct
 	 * this can be smaller than pageserver_requests_sent_total.
 	 */
 	uint64		pageserver_send_flushes_total;
+
+	/*
+	 * Number of times a request had to wait for the requests queued before it
+	 * to be sent, because neon.pageserver_send_queue_size was reached.
+	 */
+	uint64		pageserver_send_queue_drains_total;
+
+	/*
+	 * Number of pageserver connections that exchange the pagestream messages
+	 * without libpq, see neon.pageserver_raw_framing.
+	 */
+	uint64		pageserver_raw_framing_connections_total;
 	
 	/*
 	 * Number of open requests to PageServer.
@@ -115,18 +258,111 @@ typedef struct
 	/* LFC I/O time buckets */
 	IOHistogramData file_cache_read_hist;
 	IOHistogramData file_cache_write_hist;
+
+	/*
+	 * Number of compressed GetPage responses received from the pageserver
+	 * (see neon.pageserver_compression), and their total size before and
+	 * after decompression. The compression ratio and the network traffic
+	 * saved can be derived from the two byte counters.
+	 */
+	uint64		getpage_compressed_responses_total;
+	uint64		getpage_compressed_bytes_total;
+	uint64		getpage_decompressed_bytes_total;
+
+	/* Time spent decompressing GetPage responses */
+	IOHistogramData getpage_decompress_hist;
+
+	/*
+	 * Number of GetPageIfModified requests sent to revalidate a stale copy of
+	 * a page, and how many of them were answered with NotModified, i.e. did
+	 * not need to transfer the page image.
+	 */
+	uint64		getpage_revalidate_requests_total;
+	uint64		getpage_not_modified_total;
+
+	/*
+	 * Number of requests this backend submitted through the communicator
+	 * process, and, counted in the communicator's own slot, how many of them
+	 * were answered by an identical request that was already in flight.
+	 */
+	uint64		communicator_requests_total;
+	uint64		communicator_coalesced_requests_total;
+
+	/*
+	 * Number of GetPage requests that took long enough to be sent to a
+	 * secondary pageserver too (see neon.pageserver_hedge_percentile), and
+	 * how many of those were answered by the secondary first.
+	 */
+	uint64		pageserver_hedged_requests_total;
+	uint64		pageserver_hedge_wins_total;
+
+	/*
+	 * Time from starting a connection to a pageserver until the pagestream
+	 * handshake completed, including TCP, TLS and authentication. See
+	 * neon.pageserver_eager_connect.
+	 */
+	IOHistogramData pageserver_connect_hist;
+
+	/*
+	 * Breakdown of getpage_hist into the phases of the request, see
+	 * GetPagePhase. Only requests that were answered from the prefetch ring
+	 * are included. A revalidation of an expired prefetch (GetPageIfModified)
+	 * counts its round trip as network time.
+	 */
+	IOHistogramData getpage_phase_hist[NUM_GETPAGE_PHASES];
+
+	/*
+	 * Exists, Nblocks, DbSize and GetSlruSegment requests, see
+	 * NeonRequestType. These are not included in any of the counters above,
+	 * except pageserver_requests_sent_total.
+	 */
+	RequestTypeCounters request_type_counters[NUM_NEON_REQUEST_TYPES];
 } neon_per_backend_counters;
 
+/*
+ * The GetPage phase histograms are also collected per shard, to show if one
+ * pageserver is slower than the others. Keeping them for each shard in each
+ * backend would take too much shared memory, so these are shared by all
+ * backends and updated with atomic operations.
+ */
+typedef struct
+{
+	pg_atomic_uint64 wait_us_count;
+	pg_atomic_uint64 wait_us_sum;
+	pg_atomic_uint64 wait_us_bucket[NUM_IO_WAIT_BUCKETS];
+} IOHistogramAtomicData;
+
+typedef struct
+{
+	IOHistogramAtomicData getpage_phase_hist[NUM_GETPAGE_PHASES];
+} neon_per_shard_counters;
+
+/* Pointer to the shared memory array of neon_per_shard_counters, one per shard */
+extern neon_per_shard_counters *neon_per_shard_counters_shared;
+
 /* Pointer to the shared memory array of neon_per_backend_counters structs */
 extern neon_per_backend_counters *neon_per_backend_counters_shared;
 
+/*
+ * MaxBackends, also for sizing shared memory. On v14, shared_preload_libraries
+ * request their shared memory in _PG_init(), before InitializeMaxBackends()
+ * has set MaxBackends, so compute it the same way it does.
+ */
+#if PG_VERSION_NUM >= 150000
+#define NEON_MAX_BACKENDS MaxBackends
+#else
+#define NEON_MAX_BACKENDS \
+	(MaxConnections + autovacuum_max_workers + 1 + \
+	 max_worker_processes + max_wal_senders)
+#endif
+
 /*
  * Size of the perf counters array in shared memory. One slot for each backend
  * and aux process. IOW one for each PGPROC slot, except for slots reserved
  * for prepared transactions, because they're not real processes and cannot do
  * I/O.
  */
-#define NUM_NEON_PERF_COUNTER_SLOTS (MaxBackends + NUM_AUXILIARY_PROCS)
+#define NUM_NEON_PERF_COUNTER_SLOTS (NEON_MAX_BACKENDS + NUM_AUXILIARY_PROCS)
 
 #if PG_VERSION_NUM >= 170000
 #define MyNeonCounters (&neon_per_backend_counters_shared[MyProcNumber])
@@ -134,9 +370,63 @@ extern neon_per_backend_counters *neon_per_backend_counters_shared;
 #define MyNeonCounters (&neon_per_backend_counters_shared[MyProc->pgprocno])
 #endif
 
+/*
+ * Flight recorder of slow requests
+ *
+ * Each backend keeps the last neon.slow_request_log_size requests that took
+ * longer than neon.slow_request_threshold in a ring buffer in shared memory,
+ * so that the relation, block and LSN of slow requests can be looked up
+ * after the fact, with the neon_slow_requests view.
+ */
+typedef enum
+{
+	SLOW_REQUEST_SYNC,			/* not a GetPage request */
+	SLOW_REQUEST_PREFETCH_RECEIVED, /* prefetched, response had arrived */
+	SLOW_REQUEST_PREFETCH_INFLIGHT, /* prefetched, still waiting for response */
+	SLOW_REQUEST_PREFETCH_MISS, /* not prefetched, sent by the read itself */
+} SlowRequestPrefetchStatus;
+
+typedef struct
+{
+	TimestampTz end_time;		/* when the response was used */
+	uint8		tag;			/* NeonMessageTag of the request */
+	uint8		prefetch_status;	/* see SlowRequestPrefetchStatus */
+	uint8		forknum;
+	bool		has_phases;		/* are phase_us valid? */
+	uint16		shard_no;
+	Oid			spcOid;
+	Oid			dbOid;
+	Oid			relNumber;
+	uint32		blkno;			/* block number, or SLRU segment number */
+	XLogRecPtr	request_lsn;
+	XLogRecPtr	not_modified_since;
+	uint64		latency_us;
+	uint64		phase_us[NUM_GETPAGE_PHASES];
+} SlowRequestEntry;
+
+extern int	neon_slow_request_log_size;
+extern int	neon_slow_request_threshold;
+
+/* Should a request that took 'latency_us' be recorded? */
+static inline bool
+slow_request_should_log(uint64 latency_us)
+{
+	return neon_slow_request_log_size > 0 &&
+		latency_us >= (uint64) neon_slow_request_threshold * 1000;
+}
+
+extern void log_slow_request(const SlowRequestEntry *entry);
+
 extern void inc_getpage_wait(uint64 latency);
 extern void inc_page_cache_read_wait(uint64 latency);
 extern void inc_page_cache_write_wait(uint64 latency);
+extern void inc_pageserver_connect_wait(uint64 latency);
+extern void inc_getpage_phase(int shard_no, GetPagePhase phase, uint64 latency);
+extern void inc_request_wait(NeonRequestType type, uint64 latency,
+							 uint64 request_bytes);
+extern void inc_request_response_bytes(NeonRequestType type, uint64 bytes);
+extern void inc_getpage_decompress(uint64 latency, uint64 compressed_bytes,
+								   uint64 decompressed_bytes);
 
 extern Size NeonPerfCountersShmemSize(void);
 extern void NeonPerfCountersShmemInit(void);
@@ -34,6 +34,8 @@ typedef enum
 	T_NeonGetPageRequest,
 	T_NeonDbSizeRequest,
 	T_NeonGetSlruSegmentRequest,
+	T_NeonGetPageRangeRequest,	/* protocol version 4 and up */
+	T_NeonGetPageIfModifiedRequest,	/* protocol version 4 and up */
 	/* future tags above this line */
 	T_NeonTestRequest = 99, /* only in cfg(feature = "testing") */
 
@@ -44,6 +46,9 @@ typedef enum
 	T_NeonErrorResponse,
 	T_NeonDbSizeResponse,
 	T_NeonGetSlruSegmentResponse,
+	T_NeonGetPageRangeResponse,	/* protocol version 4 and up */
+	T_NeonGetPageCompressedResponse,	/* only if compression was negotiated */
+	T_NeonNotModifiedResponse,	/* protocol version 4 and up */
 	/* future tags above this line */
 	T_NeonTestResponse = 199, /* only in cfg(feature = "testing") */
 } NeonMessageTag;
@@ -102,6 +107,17 @@ typedef enum {
  * as well as other fields from requests, which allows to verify that we receive response for our request.
  * We copy fields from request to response to make checking more reliable: request ID is formed from process ID
  * and local counter, so in principle there can be duplicated requests IDs if process PID is reused.
+ *
+ * V4 version of protocol uses the same format as V3, and adds the GetPageRange
+ * request, which fetches up to MAX_GETPAGE_RANGE_BLOCKS consecutive blocks of
+ * a relation fork with a single request and response. All blocks of the
+ * range must belong to the same shard.
+ *
+ * V4 also adds the GetPageIfModified request, to revalidate a copy of a page
+ * that we already have. 'page_lsn' is the LSN in the page header of our copy.
+ * If the page hasn't been modified since, the pageserver responds with a
+ * small NotModified response instead of the full page; otherwise with a
+ * regular GetPage response.
  */
 typedef NeonMessage NeonRequest;
 
@@ -140,6 +156,45 @@ typedef struct
 	int			segno;
 } NeonGetSlruSegmentRequest;
 
+/*
+ * Compression of GetPage responses, negotiated when the connection is
+ * established (see neon.pageserver_compression). The pageserver then sends
+ * each page image either as a regular GetPage response, or compressed with
+ * the negotiated algorithm in a GetPageCompressed response, whichever is
+ * smaller. GetPageCompressed responses are decompressed in
+ * nm_unpack_response(), so the rest of the code only ever sees regular
+ * GetPage responses.
+ *
+ * The values are sent on the wire; keep in sync with
+ * PagestreamCompressionAlgorithm in the pageserver.
+ */
+typedef enum
+{
+	PAGESTREAM_COMPRESSION_NONE = 0,
+	PAGESTREAM_COMPRESSION_ZSTD = 1,
+} PagestreamCompression;
+
+/* Keep in sync with PAGESTREAM_MAX_GETPAGE_RANGE_BLOCKS in the pageserver */
+#define MAX_GETPAGE_RANGE_BLOCKS 128
+
+typedef struct
+{
+	NeonRequest hdr;
+	NRelFileInfo rinfo;
+	ForkNumber	forknum;
+	BlockNumber blkno;
+	BlockNumber nblocks;
+} NeonGetPageRangeRequest;
+
+typedef struct
+{
+	NeonRequest hdr;
+	NRelFileInfo rinfo;
+	ForkNumber	forknum;
+	BlockNumber blkno;
+	XLogRecPtr	page_lsn;
+} NeonGetPageIfModifiedRequest;
+
 /* supertype of all the Neon*Response structs below */
 typedef NeonMessage NeonResponse;
 
@@ -163,6 +218,23 @@ typedef struct
 
 #define PS_GETPAGERESPONSE_SIZE (MAXALIGN(offsetof(NeonGetPageResponse, page) + BLCKSZ))
 
+/*
+ * The pages of a GetPageRange response are unpacked into separate
+ * NeonGetPageResponse messages, so that they can be handed out to the
+ * prefetch slots of the individual blocks. req.nblocks is the number of
+ * pages in the response.
+ */
+typedef struct
+{
+	NeonGetPageRangeRequest req;
+	NeonGetPageResponse *pages[FLEXIBLE_ARRAY_MEMBER];
+} NeonGetPageRangeResponse;
+
+typedef struct
+{
+	NeonGetPageIfModifiedRequest req;
+} NeonNotModifiedResponse;
+
 typedef struct
 {
 	NeonDbSizeRequest req;
@@ -184,7 +256,14 @@ typedef struct
 } NeonGetSlruSegmentResponse;
 
 
-extern StringInfoData nm_pack_request(NeonRequest *msg);
+/*
+ * Upper bound on the encoded size of any request. The largest one is
+ * GetPageIfModified: a 25 byte header and 25 bytes of payload.
+ */
+#define NM_MAX_REQUEST_SIZE		64
+
+extern int	nm_request_size(NeonRequest *msg);
+extern int	nm_encode_request(NeonRequest *msg, char *buf);
 extern NeonResponse *nm_unpack_response(StringInfo s);
 extern char *nm_to_string(NeonMessage *msg);
 
@@ -212,6 +291,16 @@ typedef struct
 	 * Returns NULL when the data is not yet available. 
 	 */
 	NeonResponse *(*try_receive) (shardno_t shard_no);
+	/*
+	 * Wait until a response may be available from any of the shards marked
+	 * in 'shard_bitmap', for at most 'timeout' ms (-1 to wait forever).
+	 * Whatever arrived is read into the connections' input buffers, so that
+	 * try_receive() can return it.
+	 *
+	 * Returns false if the connection to one of the shards was lost.
+	 */
+	bool		(*wait_any) (const uint8 *shard_bitmap, shardno_t max_shard_no,
+							 long timeout);
 	/*
 	 * Make sure all requests are sent to PageServer.
 	 */
@@ -226,6 +315,12 @@ extern void prefetch_on_ps_disconnect(void);
 
 extern page_server_api *page_server;
 
+/* lower-level access to the connections, for the communicator process */
+extern int	pageserver_receive_raw(shardno_t shard_no, char **buffer);
+extern void pageserver_free_raw(shardno_t shard_no, char *buffer);
+extern pgsocket pageserver_socket(shardno_t shard_no);
+extern uint64 pageserver_generation(shardno_t shard_no);
+
 extern char *page_server_connstring;
 extern int	flush_every_n_requests;
 extern int	readahead_buffer_size;
@@ -233,6 +328,7 @@ extern char *neon_timeline;
 extern char *neon_tenant;
 extern int32 max_cluster_size;
 extern int  neon_protocol_version;
+extern int  neon_pageserver_compression;
 
 extern shardno_t get_shard_number(BufferTag* tag);
 
@@ -59,6 +59,7 @@
 #include "postmaster/autovacuum.h"
 #include "postmaster/interrupt.h"
 #include "port/pg_iovec.h"
+#include "portability/instr_time.h"
 #include "replication/walsender.h"
 #include "storage/bufmgr.h"
 #include "storage/buf_internals.h"
@@ -66,6 +67,7 @@
 #include "storage/md.h"
 #include "storage/smgr.h"
 
+#include "communicator.h"
 #include "neon_perf_counters.h"
 #include "pagestore_client.h"
 #include "bitmap.h"
@@ -74,6 +76,10 @@
 #include "access/xlogrecovery.h"
 #endif
 
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
 /*
  * If DEBUG_COMPARE_LOCAL is defined, we pass through all the SMGR API
  * calls to md.c, and *also* do the calls to the Page Server. On every
@@ -152,6 +158,12 @@ static uint32 local_request_counter;
  * _prefetch requests between the initial _prefetch and the _read of a buffer,
  * the prefetch request will have been dropped from this prefetch buffer, and
  * your prefetch was wasted.
+ *
+ * With protocol version 4, consecutive blocks that are registered together
+ * are requested with a single GetPageRange request. Such a request still
+ * occupies one ring buffer slot per block, but only the first slot of the
+ * range has a response to receive; the response is split over the slots of
+ * all blocks of the range when it arrives.
  */
 
 /*
@@ -190,10 +202,21 @@ typedef struct PrefetchRequest
 	shardno_t	shard_no;
 	uint8		status;		/* see PrefetchStatus for valid values */
 	uint8		flags;		/* see PrefetchRequestFlags */
+	uint8		range_len;	/* number of slots covered by the request sent
+							 * for this slot: 1 for GetPage requests, the
+							 * number of blocks for the first slot of a
+							 * GetPageRange request, and 0 for its other
+							 * slots */
 	neon_request_lsns request_lsns;
 	NeonRequestId reqid;
 	NeonResponse *response;		/* may be null */
 	uint64		my_ring_index;
+
+	/* When the request reached each phase, see GetPagePhase */
+	TimestampTz registered_at;
+	TimestampTz flush_started_at;
+	TimestampTz flushed_at;
+	TimestampTz received_at;
 } PrefetchRequest;
 
 /* prefetch buffer lookup hash table */
@@ -231,9 +254,15 @@ typedef struct PrfHashEntry
  * ring_unused >= ring_flush >= ring_receive >= ring_last >= 0
  *
  * ring_unused points to the first unused slot of the buffer
- * ring_receive is the next request that is to be received
+ * ring_receive is the oldest request that is still waiting for a response
  * ring_last is the oldest received entry in the buffer
  *
+ * Each shard answers its requests in order, but different shards answer
+ * independently of each other, so the slots between ring_receive and
+ * ring_unused may already have received their response (or even be
+ * unused again): only the slots before ring_receive are known to not be
+ * waiting for a response anymore.
+ *
  * Apart from being an entry in the ring buffer of prefetch requests, each
  * PrefetchRequest that is not UNUSED is indexed in prf_hash by buftag.
  */
@@ -248,7 +277,7 @@ typedef struct PrefetchState
 	/* buffer indexes */
 	uint64		ring_unused;	/* first unused slot */
 	uint64		ring_flush;		/* next request to flush */
-	uint64		ring_receive;	/* next slot that is to receive a response */
+	uint64		ring_receive;	/* oldest slot waiting for a response */
 	uint64		ring_last;		/* min slot with a response value */
 
 	/* metrics / statistics  */
@@ -264,6 +293,8 @@ typedef struct PrefetchState
 	int			max_shard_no;
 	/* Mark shards involved in prefetch */
 	uint8		shard_bitmap[(MAX_SHARDS + 7)/8];
+	/* count of requests (not blocks) waiting for a response, per shard */
+	uint16		shard_n_inflight[MAX_SHARDS];
 	PrefetchRequest prf_buffer[];	/* prefetch buffers */
 } PrefetchState;
 
@@ -282,17 +313,18 @@ static PrefetchState *MyPState;
 )
 
 #define ReceiveBufferNeedsCompaction() (\
-	(MyPState->n_responses_buffered / 8) < ( \
-		MyPState->ring_receive - \
-			MyPState->ring_last - \
-			MyPState->n_responses_buffered \
-	) \
+	MyPState->ring_receive - MyPState->ring_last > \
+		(uint64) MyPState->n_responses_buffered + \
+		MyPState->n_responses_buffered / 8 \
 )
 
 static bool compact_prefetch_buffers(void);
 static void consume_prefetch_responses(void);
-static bool prefetch_read(PrefetchRequest *slot);
-static void prefetch_do_request(PrefetchRequest *slot, neon_request_lsns *force_request_lsns);
+static bool prefetch_read(shardno_t shard_no);
+static PrefetchRequest *prefetch_next_slot_for_shard(shardno_t shard_no);
+static void prefetch_store_response(PrefetchRequest *slot, NeonResponse *response);
+static void prefetch_do_request(PrefetchRequest *slot, neon_request_lsns *force_request_lsns,
+								BlockNumber nblocks);
 static bool prefetch_wait_for(uint64 ring_index);
 static void prefetch_cleanup_trailing_unused(void);
 static inline void prefetch_set_unused(uint64 ring_index);
@@ -367,6 +399,10 @@ compact_prefetch_buffers(void)
 		target_slot->reqid = source_slot->reqid;
 		target_slot->request_lsns = source_slot->request_lsns;
 		target_slot->my_ring_index = empty_ring_index;
+		target_slot->registered_at = source_slot->registered_at;
+		target_slot->flush_started_at = source_slot->flush_started_at;
+		target_slot->flushed_at = source_slot->flushed_at;
+		target_slot->received_at = source_slot->received_at;
 
 		prfh_delete(MyPState->prf_hash, source_slot);
 		prfh_insert(MyPState->prf_hash, target_slot, &found);
@@ -412,46 +448,34 @@ compact_prefetch_buffers(void)
  *
  * This procedure handles that.
  *
+ * Responses are taken from every shard that has requests in flight, so
+ * that a shard that is slow to respond doesn't hold up the others.
+ *
  * Note that this is only valid as long as the only pipelined
  * operations in the TCP buffer are getPage@Lsn requests.
  */
 static void
 prefetch_pump_state(void)
 {
-	while (MyPState->ring_receive != MyPState->ring_flush)
-	{
-		NeonResponse   *response;
-		PrefetchRequest *slot;
-		MemoryContext	old;
-
-		slot = GetPrfSlot(MyPState->ring_receive);
+	if (MyPState->n_requests_inflight == 0)
+		return;
 
-		old = MemoryContextSwitchTo(MyPState->errctx);
-		response = page_server->try_receive(slot->shard_no);
-		MemoryContextSwitchTo(old);
+	for (shardno_t shard_no = 0; shard_no < MAX_SHARDS; shard_no++)
+	{
+		while (MyPState->shard_n_inflight[shard_no] > 0)
+		{
+			NeonResponse   *response;
+			MemoryContext	old;
 
-		if (response == NULL)
-			break;
+			old = MemoryContextSwitchTo(MyPState->errctx);
+			response = page_server->try_receive(shard_no);
+			MemoryContextSwitchTo(old);
 
-		/* The slot should still be valid */
-		if (slot->status != PRFS_REQUESTED ||
-			slot->response != NULL ||
-			slot->my_ring_index != MyPState->ring_receive)
-			neon_shard_log(slot->shard_no, ERROR,
-						   "Incorrect prefetch slot state after receive: status=%d response=%p my=%lu receive=%lu",
-						   slot->status, slot->response,
-						   (long) slot->my_ring_index, (long) MyPState->ring_receive);
-
-		/* update prefetch state */
-		MyPState->n_responses_buffered += 1;
-		MyPState->n_requests_inflight -= 1;
-		MyPState->ring_receive += 1;
-		MyNeonCounters->getpage_prefetches_buffered =
-			MyPState->n_responses_buffered;
+			if (response == NULL)
+				break;
 
-		/* update slot state */
-		slot->status = PRFS_RECEIVED;
-		slot->response = response;
+			prefetch_store_response(prefetch_next_slot_for_shard(shard_no), response);
+		}
 	}
 }
 
@@ -469,14 +493,15 @@ readahead_buffer_resize(int newsize, void *extra)
 		return;
 
 	/*
-	 * Make sure that we don't lose track of active prefetch requests by
-	 * ensuring we have received all but the last n requests (n = newsize).
+	 * Make sure that we don't lose track of active prefetch requests. As
+	 * responses can arrive out of order, a request that is still in flight
+	 * can be older than responses that we keep, so if not all slots fit in
+	 * the new buffer, receive all responses first.
 	 */
-	if (MyPState->n_requests_inflight > newsize)
+	if (MyPState->ring_unused - MyPState->ring_last > newsize)
 	{
-		Assert(MyPState->ring_unused >= MyPState->n_requests_inflight - newsize);
-		prefetch_wait_for(MyPState->ring_unused - (MyPState->n_requests_inflight - newsize));
-		Assert(MyPState->n_requests_inflight <= newsize);
+		consume_prefetch_responses();
+		Assert(MyPState->n_requests_inflight == 0);
 	}
 
 	/* construct the new PrefetchState, and copy over the memory contexts */
@@ -494,6 +519,7 @@ readahead_buffer_resize(int newsize, void *extra)
 	newPState->ring_receive = newsize;
 	newPState->max_shard_no = MyPState->max_shard_no;
 	memcpy(newPState->shard_bitmap, MyPState->shard_bitmap, sizeof(MyPState->shard_bitmap));
+	memcpy(newPState->shard_n_inflight, MyPState->shard_n_inflight, sizeof(MyPState->shard_n_inflight));
 
 	/*
 	 * Copy over the prefetches.
@@ -529,7 +555,7 @@ readahead_buffer_resize(int newsize, void *extra)
 				pg_unreachable();
 			case PRFS_REQUESTED:
 				newPState->n_requests_inflight += 1;
-				newPState->ring_receive -= 1;
+				newPState->ring_receive = nfree;
 				newPState->ring_last -= 1;
 				break;
 			case PRFS_RECEIVED:
@@ -566,6 +592,37 @@ readahead_buffer_resize(int newsize, void *extra)
 
 
 
+/*
+ * Count the time a GetPage request answered from the prefetch ring spent in
+ * each phase before the response arrived, and return them in 'phase_us'. The
+ * caller counts the last phase, GETPAGE_PHASE_CONSUME, once it is done with
+ * the page.
+ */
+static void
+prefetch_count_phases(PrefetchRequest *slot, uint64 *phase_us)
+{
+	TimestampTz flush_started_at = slot->flush_started_at;
+	TimestampTz flushed_at = slot->flushed_at;
+
+	Assert(slot->status == PRFS_RECEIVED);
+
+	/*
+	 * If the request went out without an explicit flush, because the output
+	 * buffer filled up, count it as not having waited in the queue at all.
+	 */
+	if (flushed_at == 0)
+		flush_started_at = flushed_at = slot->registered_at;
+
+#define ELAPSED_US(start, end) ((end) >= (start) ? (end) - (start) : 0)
+	phase_us[GETPAGE_PHASE_QUEUE] = ELAPSED_US(slot->registered_at, flush_started_at);
+	phase_us[GETPAGE_PHASE_SEND] = ELAPSED_US(flush_started_at, flushed_at);
+	phase_us[GETPAGE_PHASE_NETWORK] = ELAPSED_US(flushed_at, slot->received_at);
+#undef ELAPSED_US
+
+	for (int phase = GETPAGE_PHASE_QUEUE; phase < GETPAGE_PHASE_CONSUME; phase++)
+		inc_getpage_phase(slot->shard_no, phase, phase_us[phase]);
+}
+
 /*
  * Make sure that there are no responses still in the buffer.
  *
@@ -575,8 +632,11 @@ readahead_buffer_resize(int newsize, void *extra)
 static void
 consume_prefetch_responses(void)
 {
-	if (MyPState->ring_receive < MyPState->ring_unused)
-		prefetch_wait_for(MyPState->ring_unused - 1);
+	while (MyPState->ring_receive < MyPState->ring_unused)
+	{
+		if (!prefetch_wait_for(MyPState->ring_receive))
+			break;
+	}
 }
 
 static void
@@ -598,9 +658,16 @@ prefetch_cleanup_trailing_unused(void)
 }
 
 
+/*
+ * Flush the requests that have been registered since the last flush, to all
+ * shards, and advance ring_flush past them.
+ */
 static bool
 prefetch_flush_requests(void)
 {
+	TimestampTz start_ts = GetCurrentTimestamp();
+	TimestampTz end_ts;
+
 	for (shardno_t shard_no = 0; shard_no < MyPState->max_shard_no; shard_no++)
 	{
 		if (BITMAP_ISSET(MyPState->shard_bitmap, shard_no))
@@ -611,12 +678,88 @@ prefetch_flush_requests(void)
 		}
 	}
 	MyPState->max_shard_no = 0;
+
+	end_ts = GetCurrentTimestamp();
+	for (uint64 ring_index = MyPState->ring_flush;
+		 ring_index < MyPState->ring_unused;
+		 ring_index++)
+	{
+		PrefetchRequest *slot = GetPrfSlot(ring_index);
+
+		/* the response may already have arrived, if libpq sent it early */
+		if (slot->status == PRFS_REQUESTED)
+		{
+			slot->flush_started_at = start_ts;
+			slot->flushed_at = end_ts;
+		}
+	}
+	MyPState->ring_flush = MyPState->ring_unused;
+
 	return true;
 }
 
+/*
+ * Find the slot that the next response from the shard belongs to. Each
+ * shard answers its requests in the order they were sent, so that is the
+ * oldest slot that is still waiting for a response from the shard.
+ */
+static PrefetchRequest *
+prefetch_next_slot_for_shard(shardno_t shard_no)
+{
+	for (uint64 ring_index = MyPState->ring_receive;
+		 ring_index < MyPState->ring_unused;
+		 ring_index++)
+	{
+		PrefetchRequest *slot = GetPrfSlot(ring_index);
+
+		if (slot->status == PRFS_REQUESTED && slot->shard_no == shard_no)
+		{
+			/* the other slots of a range are received together with the first */
+			Assert(slot->range_len > 0);
+			return slot;
+		}
+	}
+
+	neon_shard_log(shard_no, ERROR,
+				   "Incorrect prefetch state: no request in flight, receive=%lu unused=%lu",
+				   (long) MyPState->ring_receive, (long) MyPState->ring_unused);
+	pg_unreachable();
+}
+
+/*
+ * Mark the shards that have prefetch requests in flight in 'shards', and
+ * return how many there are.
+ */
+static int
+prefetch_inflight_shards(uint8 *shards, shardno_t *max_shard_no)
+{
+	int			nshards = 0;
+
+	memset(shards, 0, (MAX_SHARDS + 7) / 8);
+	*max_shard_no = 0;
+
+	for (shardno_t shard_no = 0; shard_no < MAX_SHARDS; shard_no++)
+	{
+		if (MyPState->shard_n_inflight[shard_no] > 0)
+		{
+			BITMAP_SET(shards, shard_no);
+			*max_shard_no = shard_no + 1;
+			nshards++;
+		}
+	}
+	return nshards;
+}
+
 /*
  * Wait for slot of ring_index to have received its response.
- * The caller is responsible for making sure the request buffer is flushed.
+ *
+ * All requests that have not been flushed yet are flushed first, to all
+ * shards at once. While we wait, responses from all shards with requests in
+ * flight are received in whichever order they arrive, so that waiting for
+ * one shard doesn't leave the responses of the others stuck in the TCP
+ * buffers.
+ *
+ * Returns false if the request was lost because the connection was lost.
  *
  * NOTE: this function may indirectly update MyPState->pfs_hash; which
  * invalidates any active pointers into the hash table.
@@ -626,34 +769,52 @@ prefetch_flush_requests(void)
 static bool
 prefetch_wait_for(uint64 ring_index)
 {
-	PrefetchRequest *entry;
-
-	if (MyPState->ring_flush <= ring_index &&
-		MyPState->ring_unused > MyPState->ring_flush)
-	{
-		if (!prefetch_flush_requests())
-			return false;
-		MyPState->ring_flush = MyPState->ring_unused;
-	}
+	uint8		shards[(MAX_SHARDS + 7) / 8];
+	shardno_t	max_shard_no;
 
 	Assert(MyPState->ring_unused > ring_index);
 
-	while (MyPState->ring_receive <= ring_index)
+	/* Pick up whatever has arrived already */
+	prefetch_pump_state();
+
+	while (ring_index >= MyPState->ring_receive &&
+		   GetPrfSlot(ring_index)->status == PRFS_REQUESTED)
 	{
-		entry = GetPrfSlot(MyPState->ring_receive);
+		/*
+		 * We are going to block, so there is no point in holding back any
+		 * requests we have queued up.
+		 */
+		if (MyPState->ring_unused > MyPState->ring_flush)
+		{
+			if (!prefetch_flush_requests())
+				return false;
+		}
 
-		Assert(entry->status == PRFS_REQUESTED);
-		if (!prefetch_read(entry))
-			return false;
+		if (prefetch_inflight_shards(shards, &max_shard_no) == 1)
+		{
+			/* Only one shard to wait for; read its next response */
+			if (!prefetch_read(GetPrfSlot(ring_index)->shard_no))
+				return false;
+		}
+		else
+		{
+			if (!page_server->wait_any(shards, max_shard_no, -1))
+				return false;
+			prefetch_pump_state();
+		}
 	}
-	return true;
+
+	/* The slot was dropped if we lost the connection while receiving */
+	if (ring_index < MyPState->ring_last)
+		return false;
+	return GetPrfSlot(ring_index)->status != PRFS_UNUSED;
 }
 
 /*
- * Read the response of a prefetch request into its slot.
+ * Read the next response from the shard into the slot it belongs to.
  *
- * The caller is responsible for making sure that the request for this buffer
- * was flushed to the PageServer.
+ * The caller is responsible for making sure that the requests to the shard
+ * were flushed to the PageServer.
  *
  * NOTE: this function may indirectly update MyPState->pfs_hash; which
  * invalidates any active pointers into the hash table.
@@ -661,22 +822,19 @@ prefetch_wait_for(uint64 ring_index)
  * NOTE: this does IO, and can get canceled out-of-line.
  */
 static bool
-prefetch_read(PrefetchRequest *slot)
+prefetch_read(shardno_t shard_no)
 {
 	NeonResponse *response;
 	MemoryContext old;
+	PrefetchRequest *slot;
 	BufferTag	buftag;
-	shardno_t	shard_no;
 	uint64		my_ring_index;
 
-	Assert(slot->status == PRFS_REQUESTED);
-	Assert(slot->response == NULL);
-	Assert(slot->my_ring_index == MyPState->ring_receive);
+	slot = prefetch_next_slot_for_shard(shard_no);
 
-	if (slot->status != PRFS_REQUESTED ||
-		slot->response != NULL ||
-		slot->my_ring_index != MyPState->ring_receive)
-		neon_shard_log(slot->shard_no, ERROR,
+	Assert(slot->response == NULL);
+	if (slot->response != NULL)
+		neon_shard_log(shard_no, ERROR,
 					   "Incorrect prefetch read: status=%d response=%p my=%lu receive=%lu",
 					   slot->status, slot->response,
 					   (long)slot->my_ring_index, (long)MyPState->ring_receive);
@@ -687,7 +845,6 @@ prefetch_read(PrefetchRequest *slot)
 	 * values in the error message
 	 */
 	buftag = slot->buftag;
-	shard_no = slot->shard_no;
 	my_ring_index = slot->my_ring_index;
 
 	old = MemoryContextSwitchTo(MyPState->errctx);
@@ -695,25 +852,7 @@ prefetch_read(PrefetchRequest *slot)
 	MemoryContextSwitchTo(old);
 	if (response)
 	{
-		/* The slot should still be valid */
-		if (slot->status != PRFS_REQUESTED ||
-			slot->response != NULL ||
-			slot->my_ring_index != MyPState->ring_receive)
-			neon_shard_log(shard_no, ERROR,
-						   "Incorrect prefetch slot state after receive: status=%d response=%p my=%lu receive=%lu",
-						   slot->status, slot->response,
-						   (long) slot->my_ring_index, (long) MyPState->ring_receive);
-
-		/* update prefetch state */
-		MyPState->n_responses_buffered += 1;
-		MyPState->n_requests_inflight -= 1;
-		MyPState->ring_receive += 1;
-		MyNeonCounters->getpage_prefetches_buffered =
-			MyPState->n_responses_buffered;
-
-		/* update slot state */
-		slot->status = PRFS_RECEIVED;
-		slot->response = response;
+		prefetch_store_response(slot, response);
 		return true;
 	}
 	else
@@ -731,6 +870,107 @@ prefetch_read(PrefetchRequest *slot)
 	}
 }
 
+/*
+ * Store a received response in its slot, and advance ring_receive past the
+ * slots that are no longer waiting for a response.
+ *
+ * The response to a GetPageRange request covers the slots of all blocks of
+ * the range, which are filled in together.
+ */
+static void
+prefetch_store_response(PrefetchRequest *slot, NeonResponse *response)
+{
+	int			nslots = slot->range_len;
+	TimestampTz now = GetCurrentTimestamp();
+
+	/* The slot should still be valid */
+	if (slot->status != PRFS_REQUESTED ||
+		slot->response != NULL ||
+		slot->my_ring_index < MyPState->ring_receive ||
+		nslots < 1)
+		neon_shard_log(slot->shard_no, ERROR,
+					   "Incorrect prefetch slot state after receive: status=%d response=%p my=%lu receive=%lu range=%d",
+					   slot->status, slot->response,
+					   (long) slot->my_ring_index, (long) MyPState->ring_receive,
+					   nslots);
+
+	/* a faster shard overtook the shard of the oldest request in flight */
+	if (slot->my_ring_index > MyPState->ring_receive)
+		MyNeonCounters->getpage_prefetch_out_of_order_total++;
+
+	if (nslots == 1)
+	{
+		slot->status = PRFS_RECEIVED;
+		slot->response = response;
+		slot->received_at = now;
+	}
+	else if (response->tag == T_NeonGetPageRangeResponse)
+	{
+		NeonGetPageRangeResponse *range_resp = (NeonGetPageRangeResponse *) response;
+
+		if (range_resp->req.nblocks != nslots)
+			NEON_PANIC_CONNECTION_STATE(slot->shard_no, PANIC,
+										"Expected %d pages in GetPageRange response, but got %u",
+										nslots, range_resp->req.nblocks);
+
+		for (int i = 0; i < nslots; i++)
+		{
+			PrefetchRequest *member = GetPrfSlot(slot->my_ring_index + i);
+
+			Assert(member->status == PRFS_REQUESTED);
+			Assert(member->reqid == slot->reqid);
+
+			member->status = PRFS_RECEIVED;
+			member->response = (NeonResponse *) range_resp->pages[i];
+			member->received_at = now;
+		}
+		pfree(range_resp);
+	}
+	else if (response->tag == T_NeonErrorResponse)
+	{
+		NeonErrorResponse *err_resp = (NeonErrorResponse *) response;
+		Size		err_size = offsetof(NeonErrorResponse, message) +
+			strlen(err_resp->message) + 1;
+
+		/* Every block of the range fails with the same error */
+		for (int i = 0; i < nslots; i++)
+		{
+			PrefetchRequest *member = GetPrfSlot(slot->my_ring_index + i);
+
+			Assert(member->status == PRFS_REQUESTED);
+			Assert(member->reqid == slot->reqid);
+
+			member->status = PRFS_RECEIVED;
+			member->received_at = now;
+			if (i == 0)
+				member->response = response;
+			else
+			{
+				member->response = MemoryContextAlloc(MyPState->errctx, err_size);
+				memcpy(member->response, err_resp, err_size);
+			}
+		}
+	}
+	else
+	{
+		NEON_PANIC_CONNECTION_STATE(slot->shard_no, PANIC,
+									"Expected GetPageRange (0x%02x) or Error (0x%02x) response to GetPageRangeRequest, but got 0x%02x",
+									T_NeonGetPageRangeResponse, T_NeonErrorResponse, response->tag);
+	}
+
+	/* update prefetch state */
+	MyPState->n_responses_buffered += nslots;
+	MyPState->n_requests_inflight -= nslots;
+	MyPState->shard_n_inflight[slot->shard_no] -= 1;
+	while (MyPState->ring_receive < MyPState->ring_unused &&
+		   GetPrfSlot(MyPState->ring_receive)->status != PRFS_REQUESTED)
+		MyPState->ring_receive += 1;
+	MyNeonCounters->getpage_prefetches_buffered =
+		MyPState->n_responses_buffered;
+	MyNeonCounters->pageserver_open_requests =
+		MyPState->n_requests_inflight;
+}
+
 /*
  * Disconnect hook - drop prefetches when the connection drops
  *
@@ -740,6 +980,10 @@ prefetch_read(PrefetchRequest *slot)
 void
 prefetch_on_ps_disconnect(void)
 {
+	/* nothing to do in processes that never initialized the prefetch queue */
+	if (MyPState == NULL)
+		return;
+
 	MyPState->ring_flush = MyPState->ring_unused;
 
 	while (MyPState->ring_receive < MyPState->ring_unused)
@@ -749,7 +993,13 @@ prefetch_on_ps_disconnect(void)
 
 		slot = GetPrfSlot(ring_index);
 
-		Assert(slot->status == PRFS_REQUESTED);
+		/* Responses that arrived before the disconnect are still good */
+		if (slot->status != PRFS_REQUESTED)
+		{
+			MyPState->ring_receive += 1;
+			continue;
+		}
+
 		Assert(slot->my_ring_index == ring_index);
 
 		/*
@@ -769,6 +1019,7 @@ prefetch_on_ps_disconnect(void)
 		pgBufferUsage.prefetch.expired += 1;
 		MyNeonCounters->getpage_prefetch_discards_total += 1;
 	}
+	memset(MyPState->shard_n_inflight, 0, sizeof(MyPState->shard_n_inflight));
 
 	/*
 	 * We can have gone into retry due to network error, so update stats with
@@ -840,25 +1091,27 @@ prefetch_set_unused(uint64 ring_index)
 /*
  * Send one prefetch request to the pageserver. To wait for the response, call
  * prefetch_wait_for().
+ *
+ * The request covers 'nblocks' consecutive slots starting at 'slot', whose
+ * buffer tags have already been filled in. If nblocks > 1, a GetPageRange
+ * request is sent, and the caller must provide the LSNs to use for the whole
+ * range.
  */
 static void
-prefetch_do_request(PrefetchRequest *slot, neon_request_lsns *force_request_lsns)
+prefetch_do_request(PrefetchRequest *slot, neon_request_lsns *force_request_lsns,
+					BlockNumber nblocks)
 {
 	bool		found;
-	uint64		mySlotNo PG_USED_FOR_ASSERTS_ONLY = slot->my_ring_index;
-
-	NeonGetPageRequest request = {
-		.hdr.tag = T_NeonGetPageRequest,
-		.hdr.reqid = GENERATE_REQUEST_ID(),
-		/* lsn and not_modified_since are filled in below */
-		.rinfo = BufTagGetNRelFileInfo(slot->buftag),
-		.forknum = slot->buftag.forkNum,
-		.blkno = slot->buftag.blockNum,
-	};
+	uint64		mySlotNo = slot->my_ring_index;
+	NeonRequestId reqid = GENERATE_REQUEST_ID();
+	NeonGetPageRequest page_request;
+	NeonGetPageRangeRequest range_request;
+	NeonRequest *request;
+	TimestampTz now = GetCurrentTimestamp();
 
 	Assert(mySlotNo == MyPState->ring_unused);
-
-	slot->reqid = request.hdr.reqid;
+	Assert(nblocks >= 1 && nblocks <= MAX_GETPAGE_RANGE_BLOCKS);
+	Assert(nblocks == 1 || (force_request_lsns != NULL && neon_protocol_version >= 4));
 
 	if (force_request_lsns)
 		slot->request_lsns = *force_request_lsns;
@@ -866,29 +1119,120 @@ prefetch_do_request(PrefetchRequest *slot, neon_request_lsns *force_request_lsns
 		neon_get_request_lsns(BufTagGetNRelFileInfo(slot->buftag),
 							  slot->buftag.forkNum, slot->buftag.blockNum,
 							  &slot->request_lsns, 1, NULL);
-	request.hdr.lsn = slot->request_lsns.request_lsn;
-	request.hdr.not_modified_since = slot->request_lsns.not_modified_since;
+
+	if (nblocks == 1)
+	{
+		page_request = (NeonGetPageRequest) {
+			.hdr.tag = T_NeonGetPageRequest,
+			.hdr.reqid = reqid,
+			.hdr.lsn = slot->request_lsns.request_lsn,
+			.hdr.not_modified_since = slot->request_lsns.not_modified_since,
+			.rinfo = BufTagGetNRelFileInfo(slot->buftag),
+			.forknum = slot->buftag.forkNum,
+			.blkno = slot->buftag.blockNum,
+		};
+		request = (NeonRequest *) &page_request;
+	}
+	else
+	{
+		range_request = (NeonGetPageRangeRequest) {
+			.hdr.tag = T_NeonGetPageRangeRequest,
+			.hdr.reqid = reqid,
+			.hdr.lsn = slot->request_lsns.request_lsn,
+			.hdr.not_modified_since = slot->request_lsns.not_modified_since,
+			.rinfo = BufTagGetNRelFileInfo(slot->buftag),
+			.forknum = slot->buftag.forkNum,
+			.blkno = slot->buftag.blockNum,
+			.nblocks = nblocks,
+		};
+		request = (NeonRequest *) &range_request;
+		MyNeonCounters->getpage_range_requests_total++;
+	}
 
 	Assert(slot->response == NULL);
 	Assert(slot->my_ring_index == MyPState->ring_unused);
 
-	while (!page_server->send(slot->shard_no, (NeonRequest *) &request))
+	while (!page_server->send(slot->shard_no, request))
 	{
 		Assert(mySlotNo == MyPState->ring_unused);
 		/* loop */
 	}
 
 	/* update prefetch state */
-	MyPState->n_requests_inflight += 1;
-	MyPState->n_unused -= 1;
-	MyPState->ring_unused += 1;
+	MyPState->n_requests_inflight += nblocks;
+	MyPState->n_unused -= nblocks;
+	MyPState->ring_unused += nblocks;
+	MyPState->shard_n_inflight[slot->shard_no] += 1;
 	BITMAP_SET(MyPState->shard_bitmap, slot->shard_no);
 	MyPState->max_shard_no = Max(slot->shard_no+1, MyPState->max_shard_no);
 
 	/* update slot state */
-	slot->status = PRFS_REQUESTED;
-	prfh_insert(MyPState->prf_hash, slot, &found);
-	Assert(!found);
+	for (BlockNumber i = 0; i < nblocks; i++)
+	{
+		PrefetchRequest *member = GetPrfSlot(mySlotNo + i);
+
+		Assert(member->response == NULL);
+		Assert(member->shard_no == slot->shard_no);
+
+		member->reqid = reqid;
+		member->request_lsns = slot->request_lsns;
+		member->range_len = (i == 0) ? nblocks : 0;
+		member->status = PRFS_REQUESTED;
+		member->registered_at = now;
+		prfh_insert(MyPState->prf_hash, member, &found);
+		Assert(!found);
+	}
+}
+
+/*
+ * prefetch_range_length() - number of blocks to request together with 'tag'
+ *
+ * Returns how many blocks, starting at the block of 'tag' (which is block
+ * 'first' of the caller's mask), can be requested with one GetPageRange
+ * request: the following blocks must be wanted by the mask, not be in the
+ * prefetch buffers yet, live on the same shard, and if the caller specified
+ * request LSNs, those must be identical.
+ */
+static BlockNumber
+prefetch_range_length(BufferTag tag, shardno_t shard_no, int first,
+					  BlockNumber nblocks, const bits8 *mask,
+					  const neon_request_lsns *frlsns)
+{
+	PrefetchRequest hashkey;
+	BlockNumber maxlen = Min(nblocks - first, MAX_GETPAGE_RANGE_BLOCKS);
+	BlockNumber len;
+
+	/*
+	 * The communicator process passes responses to us in page-sized slots, so
+	 * range requests are not used with it.
+	 */
+	if (neon_protocol_version < 4 || neon_use_communicator)
+		return 1;
+
+	memset(&hashkey.buftag, 0, sizeof(BufferTag));
+	hashkey.buftag = tag;
+
+	for (len = 1; len < maxlen; len++)
+	{
+		int			i = first + len;
+
+		if (PointerIsValid(mask) && !BITMAP_ISSET(mask, i))
+			break;
+
+		if (frlsns &&
+			(frlsns[i].request_lsn != frlsns[first].request_lsn ||
+			 frlsns[i].not_modified_since != frlsns[first].not_modified_since ||
+			 frlsns[i].effective_request_lsn != frlsns[first].effective_request_lsn))
+			break;
+
+		hashkey.buftag.blockNum = tag.blockNum + len;
+		if (prfh_lookup(MyPState->prf_hash, &hashkey) != NULL)
+			break;
+		if (get_shard_number(&hashkey.buftag) != shard_no)
+			break;
+	}
+
+	return len;
 }
 
 /*
@@ -916,6 +1260,7 @@ prefetch_register_bufferv(BufferTag tag, neon_request_lsns *frlsns,
 {
 	uint64		min_ring_index;
 	PrefetchRequest hashkey;
+	neon_request_lsns range_lsns[PG_IOV_MAX];
 #if USE_ASSERT_CHECKING
 	bool		any_hits = false;
 #endif
@@ -935,7 +1280,7 @@ Retry:
 	 * the latest available 
 	 */
 	MyNeonCounters->pageserver_open_requests =
-		MyPState->ring_unused - MyPState->ring_receive;
+		MyPState->n_requests_inflight;
 	MyNeonCounters->getpage_prefetches_buffered =
 		MyPState->n_responses_buffered;
 
@@ -946,6 +1291,8 @@ Retry:
 		PrfHashEntry *entry = NULL;
 		uint64		ring_index;
 		neon_request_lsns *lsns;
+		shardno_t	shard_no;
+		BlockNumber range_len;
 
 		if (PointerIsValid(mask) && !BITMAP_ISSET(mask, i))
 			continue;
@@ -1039,6 +1386,34 @@ Retry:
 		/* There should be no buffer overflow */
 		Assert(MyPState->ring_last + readahead_buffer_size >= MyPState->ring_unused);
 
+		/*
+		 * See if the following blocks can be fetched with the same request.
+		 * If the caller didn't specify the LSNs, we need to look them up for
+		 * the whole range to find out how many blocks can share them.
+		 */
+		shard_no = get_shard_number(&hashkey.buftag);
+		range_len = prefetch_range_length(hashkey.buftag, shard_no, i,
+										  nblocks, mask, frlsns);
+		if (range_len > 1 && !frlsns)
+		{
+			range_len = Min(range_len, PG_IOV_MAX);
+			neon_get_request_lsns(BufTagGetNRelFileInfo(hashkey.buftag),
+								  hashkey.buftag.forkNum,
+								  hashkey.buftag.blockNum,
+								  range_lsns, range_len, NULL);
+			for (int j = 1; j < range_len; j++)
+			{
+				if (range_lsns[j].request_lsn != range_lsns[0].request_lsn ||
+					range_lsns[j].not_modified_since != range_lsns[0].not_modified_since ||
+					range_lsns[j].effective_request_lsn != range_lsns[0].effective_request_lsn)
+				{
+					range_len = j;
+					break;
+				}
+			}
+			lsns = &range_lsns[0];
+		}
+
 		/*
 		 * If the prefetch queue is full, we need to make room by clearing the
 		 * oldest slot. If the oldest slot holds a buffer that was already
@@ -1052,8 +1427,10 @@ Retry:
 		 * when the request is already in the output buffer, and 'not sending'
 		 * a prefetch request kind of goes against the principles of
 		 * prefetching)
+		 *
+		 * A range request needs a free slot for each of its blocks.
 		 */
-		if (MyPState->ring_last + readahead_buffer_size == MyPState->ring_unused)
+		while (MyPState->ring_last + readahead_buffer_size < MyPState->ring_unused + range_len)
 		{
 			uint64		cleanup_index = MyPState->ring_last;
 
@@ -1096,40 +1473,54 @@ Retry:
 				}
 			}
 		}
+		slot = NULL;
 
 		/*
-		 * The next buffer pointed to by `ring_unused` is now definitely empty, so
-		 * we can insert the new request to it.
+		 * The buffers starting at `ring_unused` are now definitely empty, so
+		 * we can insert the new request into them.
 		 */
 		ring_index = MyPState->ring_unused;
 
 		Assert(MyPState->ring_last <= ring_index &&
 			   ring_index <= MyPState->ring_unused);
 
-		slot = GetPrfSlotNoCheck(ring_index);
+		for (BlockNumber j = 0; j < range_len; j++)
+		{
+			PrefetchRequest *member = GetPrfSlotNoCheck(ring_index + j);
 
-		Assert(slot->status == PRFS_UNUSED);
+			Assert(member->status == PRFS_UNUSED);
 
-		/*
-		 * We must update the slot data before insertion, because the hash
-		 * function reads the buffer tag from the slot.
-		 */
-		slot->buftag = hashkey.buftag;
-		slot->shard_no = get_shard_number(&tag);
-		slot->my_ring_index = ring_index;
+			/*
+			 * We must update the slot data before insertion, because the hash
+			 * function reads the buffer tag from the slot.
+			 */
+			member->buftag = hashkey.buftag;
+			member->buftag.blockNum += j;
+			member->shard_no = shard_no;
+			member->my_ring_index = ring_index + j;
+		}
+		slot = GetPrfSlotNoCheck(ring_index);
 
 		min_ring_index = Min(min_ring_index, ring_index);
 
 		if (is_prefetch)
-			MyNeonCounters->getpage_prefetch_requests_total++;
+			MyNeonCounters->getpage_prefetch_requests_total += range_len;
 		else
-			MyNeonCounters->getpage_sync_requests_total++;
+		{
+			MyNeonCounters->getpage_sync_requests_total += range_len;
+			/* the first block was already counted as a miss above */
+			pgBufferUsage.prefetch.misses += range_len - 1;
+			MyNeonCounters->getpage_prefetch_misses_total += range_len - 1;
+		}
+
+		prefetch_do_request(slot, lsns, range_len);
 
-		prefetch_do_request(slot, lsns);
+		/* skip over the blocks that were included in the request */
+		i += range_len - 1;
 	}
 
 	MyNeonCounters->pageserver_open_requests =
-		MyPState->ring_unused - MyPState->ring_receive;
+		MyPState->n_requests_inflight;
 
 	Assert(any_hits);
 
@@ -1149,7 +1540,6 @@ Retry:
 			 */
 			goto Retry;
 		}
-		MyPState->ring_flush = MyPState->ring_unused;
 	}
 
 	return min_ring_index;
@@ -1162,6 +1552,95 @@ equal_requests(NeonRequest* a, NeonRequest* b)
 }
 
 
+/*
+ * Map a request or response tag to the request type it is counted under in
+ * the perf counters, or -1 if it is not counted separately.
+ */
+static int
+neon_request_type(NeonMessageTag tag)
+{
+	switch (tag)
+	{
+		case T_NeonExistsRequest:
+		case T_NeonExistsResponse:
+			return NEON_REQUEST_EXISTS;
+		case T_NeonNblocksRequest:
+		case T_NeonNblocksResponse:
+			return NEON_REQUEST_NBLOCKS;
+		case T_NeonDbSizeRequest:
+		case T_NeonDbSizeResponse:
+			return NEON_REQUEST_DBSIZE;
+		case T_NeonGetSlruSegmentRequest:
+		case T_NeonGetSlruSegmentResponse:
+			return NEON_REQUEST_SLRU;
+		default:
+			return -1;
+	}
+}
+
+/*
+ * Count a synchronous request to 'shard_no' that was sent at 'start_ts' and
+ * has now been answered, and log it if it was slow.
+ */
+static void
+neon_count_request(NeonRequest *req, shardno_t shard_no, TimestampTz start_ts)
+{
+	int			type = neon_request_type(messageTag(req));
+	TimestampTz end_ts;
+	uint64		latency_us;
+	SlowRequestEntry slow = {0};
+
+	if (type < 0)
+		return;
+
+	end_ts = GetCurrentTimestamp();
+	latency_us = end_ts >= start_ts ? (end_ts - start_ts) : 0;
+	inc_request_wait((NeonRequestType) type, latency_us, nm_request_size(req));
+
+	if (!slow_request_should_log(latency_us))
+		return;
+
+	slow.end_time = end_ts;
+	slow.tag = messageTag(req);
+	slow.prefetch_status = SLOW_REQUEST_SYNC;
+	slow.shard_no = shard_no;
+	slow.request_lsn = req->lsn;
+	slow.not_modified_since = req->not_modified_since;
+	slow.latency_us = latency_us;
+	switch (messageTag(req))
+	{
+		case T_NeonExistsRequest:
+			{
+				NeonExistsRequest *exists_req = (NeonExistsRequest *) req;
+
+				slow.spcOid = NInfoGetSpcOid(exists_req->rinfo);
+				slow.dbOid = NInfoGetDbOid(exists_req->rinfo);
+				slow.relNumber = NInfoGetRelNumber(exists_req->rinfo);
+				slow.forknum = exists_req->forknum;
+				break;
+			}
+		case T_NeonNblocksRequest:
+			{
+				NeonNblocksRequest *nblocks_req = (NeonNblocksRequest *) req;
+
+				slow.spcOid = NInfoGetSpcOid(nblocks_req->rinfo);
+				slow.dbOid = NInfoGetDbOid(nblocks_req->rinfo);
+				slow.relNumber = NInfoGetRelNumber(nblocks_req->rinfo);
+				slow.forknum = nblocks_req->forknum;
+				break;
+			}
+		case T_NeonDbSizeRequest:
+			slow.dbOid = ((NeonDbSizeRequest *) req)->dbNode;
+			break;
+		case T_NeonGetSlruSegmentRequest:
+			slow.blkno = ((NeonGetSlruSegmentRequest *) req)->segno;
+			break;
+		default:
+			break;
+	}
+	log_slow_request(&slow);
+}
+
 /*
  * Note: this function can get canceled and use a long jump to the next catch
  * context. Take care.
@@ -1172,6 +1651,7 @@ page_server_request(void const *req)
 	NeonResponse *resp;
 	BufferTag tag = {0};
 	shardno_t shard_no;
+	TimestampTz start_ts = GetCurrentTimestamp();
 
 	switch (messageTag(req))
 	{
@@ -1188,6 +1668,10 @@ page_server_request(void const *req)
 			CopyNRelFileInfoToBufTag(tag, ((NeonGetPageRequest *) req)->rinfo);
 			tag.blockNum = ((NeonGetPageRequest *) req)->blkno;
 			break;
+		case T_NeonGetPageIfModifiedRequest:
+			CopyNRelFileInfoToBufTag(tag, ((NeonGetPageIfModifiedRequest *) req)->rinfo);
+			tag.blockNum = ((NeonGetPageIfModifiedRequest *) req)->blkno;
+			break;
 		default:
 			neon_log(ERROR, "Unexpected request tag: %d", messageTag(req));
 	}
@@ -1197,7 +1681,8 @@ page_server_request(void const *req)
 	 * Current sharding model assumes that all metadata is present only at shard 0.
 	 * We still need to call get_shard_no() to check if shard map is up-to-date.
 	 */
-	if (((NeonRequest *) req)->tag != T_NeonGetPageRequest)
+	if (((NeonRequest *) req)->tag != T_NeonGetPageRequest &&
+		((NeonRequest *) req)->tag != T_NeonGetPageIfModifiedRequest)
 	{
 		shard_no = 0;
 	}
@@ -1231,24 +1716,99 @@ page_server_request(void const *req)
 
 	} while (resp == NULL);
 
+	neon_count_request((NeonRequest *) req, shard_no, start_ts);
+
 	return resp;
 }
 
 
-StringInfoData
-nm_pack_request(NeonRequest *msg)
+/*
+ * Helpers for nm_encode_request(). These store the value in network byte
+ * order at *p, and return the position just after it.
+ */
+static inline char *
+nm_put8(char *p, uint8 v)
 {
-	StringInfoData s;
+	*p = (char) v;
+	return p + 1;
+}
 
-	initStringInfo(&s);
+static inline char *
+nm_put32(char *p, uint32 v)
+{
+	v = pg_hton32(v);
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
 
-	pq_sendbyte(&s, msg->tag);
-	if (neon_protocol_version >= 3)
+static inline char *
+nm_put64(char *p, uint64 v)
+{
+	v = pg_hton64(v);
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+static inline char *
+nm_put_rel(char *p, NRelFileInfo rinfo, ForkNumber forknum)
+{
+	p = nm_put32(p, NInfoGetSpcOid(rinfo));
+	p = nm_put32(p, NInfoGetDbOid(rinfo));
+	p = nm_put32(p, NInfoGetRelNumber(rinfo));
+	return nm_put8(p, forknum);
+}
+
+/*
+ * nm_request_size() - number of bytes nm_encode_request() writes for 'msg'
+ *
+ * All requests have a fixed layout, so this depends only on the message tag
+ * and the protocol version.
+ */
+int
+nm_request_size(NeonRequest *msg)
+{
+	/* tag, [reqid,] lsn, not_modified_since */
+	int			size = 1 + (neon_protocol_version >= 3 ? 8 : 0) + 8 + 8;
+
+	switch (messageTag(msg))
 	{
-		pq_sendint64(&s, msg->reqid);
+		case T_NeonExistsRequest:
+		case T_NeonNblocksRequest:
+			return size + 13;
+		case T_NeonDbSizeRequest:
+			return size + 4;
+		case T_NeonGetPageRequest:
+			return size + 17;
+		case T_NeonGetSlruSegmentRequest:
+			return size + 5;
+		case T_NeonGetPageRangeRequest:
+			return size + 21;
+		case T_NeonGetPageIfModifiedRequest:
+			return size + 25;
+		default:
+			neon_log(ERROR, "unexpected neon message tag 0x%02x", msg->tag);
+			return 0;			/* keep compiler quiet */
 	}
-	pq_sendint64(&s, msg->lsn);
-	pq_sendint64(&s, msg->not_modified_since);
+}
+
+/*
+ * nm_encode_request() - serialize a request into the pagestream format
+ *
+ * Writes the request to 'buf', which must have room for at least
+ * nm_request_size(msg) bytes (NM_MAX_REQUEST_SIZE is always enough), and
+ * returns the number of bytes written. This is called for every request we
+ * send, so it writes the fields directly instead of building a StringInfo.
+ */
+int
+nm_encode_request(NeonRequest *msg, char *buf)
+{
+	char	   *p = buf;
+
+	p = nm_put8(p, msg->tag);
+	if (neon_protocol_version >= 3)
+		p = nm_put64(p, msg->reqid);
+	p = nm_put64(p, msg->lsn);
+	p = nm_put64(p, msg->not_modified_since);
 
 	switch (messageTag(msg))
 	{
@@ -1257,42 +1817,29 @@ nm_pack_request(NeonRequest *msg)
 			{
 				NeonExistsRequest *msg_req = (NeonExistsRequest *) msg;
 
-				pq_sendint32(&s, NInfoGetSpcOid(msg_req->rinfo));
-				pq_sendint32(&s, NInfoGetDbOid(msg_req->rinfo));
-				pq_sendint32(&s, NInfoGetRelNumber(msg_req->rinfo));
-				pq_sendbyte(&s, msg_req->forknum);
-
+				p = nm_put_rel(p, msg_req->rinfo, msg_req->forknum);
 				break;
 			}
 		case T_NeonNblocksRequest:
 			{
 				NeonNblocksRequest *msg_req = (NeonNblocksRequest *) msg;
 
-				pq_sendint32(&s, NInfoGetSpcOid(msg_req->rinfo));
-				pq_sendint32(&s, NInfoGetDbOid(msg_req->rinfo));
-				pq_sendint32(&s, NInfoGetRelNumber(msg_req->rinfo));
-				pq_sendbyte(&s, msg_req->forknum);
-
+				p = nm_put_rel(p, msg_req->rinfo, msg_req->forknum);
 				break;
 			}
 		case T_NeonDbSizeRequest:
 			{
 				NeonDbSizeRequest *msg_req = (NeonDbSizeRequest *) msg;
 
-				pq_sendint32(&s, msg_req->dbNode);
-
+				p = nm_put32(p, msg_req->dbNode);
 				break;
 			}
 		case T_NeonGetPageRequest:
 			{
 				NeonGetPageRequest *msg_req = (NeonGetPageRequest *) msg;
 
-				pq_sendint32(&s, NInfoGetSpcOid(msg_req->rinfo));
-				pq_sendint32(&s, NInfoGetDbOid(msg_req->rinfo));
-				pq_sendint32(&s, NInfoGetRelNumber(msg_req->rinfo));
-				pq_sendbyte(&s, msg_req->forknum);
-				pq_sendint32(&s, msg_req->blkno);
-
+				p = nm_put_rel(p, msg_req->rinfo, msg_req->forknum);
+				p = nm_put32(p, msg_req->blkno);
 				break;
 			}
 
@@ -1300,9 +1847,30 @@ nm_pack_request(NeonRequest *msg)
 			{
 				NeonGetSlruSegmentRequest *msg_req = (NeonGetSlruSegmentRequest *) msg;
 
-				pq_sendbyte(&s, msg_req->kind);
-				pq_sendint32(&s, msg_req->segno);
+				p = nm_put8(p, msg_req->kind);
+				p = nm_put32(p, msg_req->segno);
+				break;
+			}
 
+		case T_NeonGetPageRangeRequest:
+			{
+				NeonGetPageRangeRequest *msg_req = (NeonGetPageRangeRequest *) msg;
+
+				Assert(neon_protocol_version >= 4);
+				p = nm_put_rel(p, msg_req->rinfo, msg_req->forknum);
+				p = nm_put32(p, msg_req->blkno);
+				p = nm_put32(p, msg_req->nblocks);
+				break;
+			}
+
+		case T_NeonGetPageIfModifiedRequest:
+			{
+				NeonGetPageIfModifiedRequest *msg_req = (NeonGetPageIfModifiedRequest *) msg;
+
+				Assert(neon_protocol_version >= 4);
+				p = nm_put_rel(p, msg_req->rinfo, msg_req->forknum);
+				p = nm_put32(p, msg_req->blkno);
+				p = nm_put64(p, msg_req->page_lsn);
 				break;
 			}
 
@@ -1313,19 +1881,34 @@ nm_pack_request(NeonRequest *msg)
 		case T_NeonErrorResponse:
 		case T_NeonDbSizeResponse:
 		case T_NeonGetSlruSegmentResponse:
+		case T_NeonGetPageRangeResponse:
+		case T_NeonGetPageCompressedResponse:
+		case T_NeonNotModifiedResponse:
 		default:
 			neon_log(ERROR, "unexpected neon message tag 0x%02x", msg->tag);
 			break;
 	}
-	return s;
+
+	Assert(p - buf == nm_request_size(msg));
+	Assert(p - buf <= NM_MAX_REQUEST_SIZE);
+	return p - buf;
 }
 
+#ifdef USE_ZSTD
+/*
+ * Decompression context for compressed GetPage responses, created on first
+ * use and kept for the life of the backend.
+ */
+static ZSTD_DCtx *page_dctx = NULL;
+#endif
+
 NeonResponse *
 nm_unpack_response(StringInfo s)
 {
 	NeonMessageTag tag = pq_getmsgbyte(s);
 	NeonResponse resp_hdr = {0}; /* make valgrind happy */
 	NeonResponse *resp = NULL;
+	int			type;
 
 	resp_hdr.tag = tag;
 	if (neon_protocol_version >= 3)
@@ -1399,6 +1982,95 @@ nm_unpack_response(StringInfo s)
 				break;
 			}
 
+		case T_NeonGetPageCompressedResponse:
+			{
+				NeonGetPageResponse *msg_resp;
+				uint8		algorithm;
+				int			compressed_size;
+				const char *compressed;
+				instr_time	start,
+							end;
+
+				/* The compressed response always carries the V3 header */
+				if (neon_protocol_version < 3)
+					neon_log(ERROR, "unexpected compressed GetPage response with protocol version %d",
+							 neon_protocol_version);
+
+				msg_resp = MemoryContextAllocZero(MyPState->bufctx, PS_GETPAGERESPONSE_SIZE);
+				NInfoGetSpcOid(msg_resp->req.rinfo) = pq_getmsgint(s, 4);
+				NInfoGetDbOid(msg_resp->req.rinfo) = pq_getmsgint(s, 4);
+				NInfoGetRelNumber(msg_resp->req.rinfo) = pq_getmsgint(s, 4);
+				msg_resp->req.forknum = pq_getmsgbyte(s);
+				msg_resp->req.blkno = pq_getmsgint(s, 4);
+				msg_resp->req.hdr = resp_hdr;
+				/* hand it out as a regular GetPage response */
+				msg_resp->req.hdr.tag = T_NeonGetPageResponse;
+
+				algorithm = pq_getmsgbyte(s);
+				compressed_size = s->len - s->cursor;
+				compressed = pq_getmsgbytes(s, compressed_size);
+				pq_getmsgend(s);
+
+				INSTR_TIME_SET_CURRENT(start);
+				switch (algorithm)
+				{
+#ifdef USE_ZSTD
+					case PAGESTREAM_COMPRESSION_ZSTD:
+						{
+							size_t		page_size;
+
+							if (page_dctx == NULL)
+							{
+								page_dctx = ZSTD_createDCtx();
+								if (page_dctx == NULL)
+									neon_log(ERROR, "could not create zstd decompression context");
+							}
+							page_size = ZSTD_decompressDCtx(page_dctx, msg_resp->page, BLCKSZ,
+															compressed, compressed_size);
+							if (ZSTD_isError(page_size))
+								neon_log(ERROR, "could not decompress page: %s",
+										 ZSTD_getErrorName(page_size));
+							if (page_size != BLCKSZ)
+								neon_log(ERROR, "unexpected size of decompressed page: %zu",
+										 page_size);
+							break;
+						}
+#endif
+					default:
+						neon_log(ERROR, "unsupported page compression algorithm %u",
+								 algorithm);
+				}
+				INSTR_TIME_SET_CURRENT(end);
+				INSTR_TIME_SUBTRACT(end, start);
+				inc_getpage_decompress(INSTR_TIME_GET_MICROSEC(end),
+									   compressed_size, BLCKSZ);
+
+				resp = (NeonResponse *) msg_resp;
+				break;
+			}
+
+		case T_NeonNotModifiedResponse:
+			{
+				NeonNotModifiedResponse *msg_resp;
+
+				if (neon_protocol_version < 4)
+					neon_log(ERROR, "unexpected NotModified response with protocol version %d",
+							 neon_protocol_version);
+
+				msg_resp = palloc0(sizeof(NeonNotModifiedResponse));
+				NInfoGetSpcOid(msg_resp->req.rinfo) = pq_getmsgint(s, 4);
+				NInfoGetDbOid(msg_resp->req.rinfo) = pq_getmsgint(s, 4);
+				NInfoGetRelNumber(msg_resp->req.rinfo) = pq_getmsgint(s, 4);
+				msg_resp->req.forknum = pq_getmsgbyte(s);
+				msg_resp->req.blkno = pq_getmsgint(s, 4);
+				msg_resp->req.page_lsn = pq_getmsgint64(s);
+				msg_resp->req.hdr = resp_hdr;
+				pq_getmsgend(s);
+
+				resp = (NeonResponse *) msg_resp;
+				break;
+			}
+
 		case T_NeonDbSizeResponse:
 			{
 				NeonDbSizeResponse *msg_resp = palloc0(sizeof(NeonDbSizeResponse));
@@ -1455,6 +2127,56 @@ nm_unpack_response(StringInfo s)
 				break;
 			}
 
+		case T_NeonGetPageRangeResponse:
+			{
+				NeonGetPageRangeResponse *msg_resp;
+				NeonGetPageRangeRequest req = {0};
+
+				if (neon_protocol_version < 4)
+					neon_log(ERROR, "unexpected GetPageRange response with protocol version %d",
+							 neon_protocol_version);
+
+				NInfoGetSpcOid(req.rinfo) = pq_getmsgint(s, 4);
+				NInfoGetDbOid(req.rinfo) = pq_getmsgint(s, 4);
+				NInfoGetRelNumber(req.rinfo) = pq_getmsgint(s, 4);
+				req.forknum = pq_getmsgbyte(s);
+				req.blkno = pq_getmsgint(s, 4);
+				req.nblocks = pq_getmsgint(s, 4);
+				req.hdr = resp_hdr;
+
+				if (req.nblocks == 0 || req.nblocks > MAX_GETPAGE_RANGE_BLOCKS)
+					neon_log(ERROR, "invalid number of pages in GetPageRange response: %u",
+							 req.nblocks);
+
+				msg_resp = palloc0(offsetof(NeonGetPageRangeResponse, pages) +
+								   req.nblocks * sizeof(NeonGetPageResponse *));
+				msg_resp->req = req;
+
+				/*
+				 * Unpack every page into a regular GetPage response, so that
+				 * the prefetch code can treat them the same as responses to
+				 * single-block requests.
+				 */
+				for (BlockNumber i = 0; i < req.nblocks; i++)
+				{
+					NeonGetPageResponse *page_resp;
+
+					page_resp = MemoryContextAllocZero(MyPState->bufctx, PS_GETPAGERESPONSE_SIZE);
+					page_resp->req.hdr = resp_hdr;
+					page_resp->req.hdr.tag = T_NeonGetPageResponse;
+					page_resp->req.rinfo = req.rinfo;
+					page_resp->req.forknum = req.forknum;
+					page_resp->req.blkno = req.blkno + i;
+					memcpy(page_resp->page, pq_getmsgbytes(s, BLCKSZ), BLCKSZ);
+
+					msg_resp->pages[i] = page_resp;
+				}
+				pq_getmsgend(s);
+
+				resp = (NeonResponse *) msg_resp;
+				break;
+			}
+
 			/*
 			 * pagestore_client -> pagestore
 			 *
@@ -1465,11 +2187,17 @@ nm_unpack_response(StringInfo s)
 		case T_NeonGetPageRequest:
 		case T_NeonDbSizeRequest:
 		case T_NeonGetSlruSegmentRequest:
+		case T_NeonGetPageRangeRequest:
+		case T_NeonGetPageIfModifiedRequest:
 		default:
 			neon_log(ERROR, "unexpected neon message tag 0x%02x", tag);
 			break;
 	}
 
+	type = neon_request_type(tag);
+	if (type >= 0)
+		inc_request_response_bytes((NeonRequestType) type, s->len);
+
 	return resp;
 }
 
@@ -1546,6 +2274,34 @@ nm_to_string(NeonMessage *msg)
 				appendStringInfoChar(&s, '}');
 				break;
 			}
+		case T_NeonGetPageRangeRequest:
+			{
+				NeonGetPageRangeRequest *msg_req = (NeonGetPageRangeRequest *) msg;
+
+				appendStringInfoString(&s, "{\"type\": \"NeonGetPageRangeRequest\"");
+				appendStringInfo(&s, ", \"rinfo\": \"%u/%u/%u\"", RelFileInfoFmt(msg_req->rinfo));
+				appendStringInfo(&s, ", \"forknum\": %d", msg_req->forknum);
+				appendStringInfo(&s, ", \"blkno\": %u", msg_req->blkno);
+				appendStringInfo(&s, ", \"nblocks\": %u", msg_req->nblocks);
+				appendStringInfo(&s, ", \"lsn\": \"%X/%X\"", LSN_FORMAT_ARGS(msg_req->hdr.lsn));
+				appendStringInfo(&s, ", \"not_modified_since\": \"%X/%X\"", LSN_FORMAT_ARGS(msg_req->hdr.not_modified_since));
+				appendStringInfoChar(&s, '}');
+				break;
+			}
+		case T_NeonGetPageIfModifiedRequest:
+			{
+				NeonGetPageIfModifiedRequest *msg_req = (NeonGetPageIfModifiedRequest *) msg;
+
+				appendStringInfoString(&s, "{\"type\": \"NeonGetPageIfModifiedRequest\"");
+				appendStringInfo(&s, ", \"rinfo\": \"%u/%u/%u\"", RelFileInfoFmt(msg_req->rinfo));
+				appendStringInfo(&s, ", \"forknum\": %d", msg_req->forknum);
+				appendStringInfo(&s, ", \"blkno\": %u", msg_req->blkno);
+				appendStringInfo(&s, ", \"page_lsn\": \"%X/%X\"", LSN_FORMAT_ARGS(msg_req->page_lsn));
+				appendStringInfo(&s, ", \"lsn\": \"%X/%X\"", LSN_FORMAT_ARGS(msg_req->hdr.lsn));
+				appendStringInfo(&s, ", \"not_modified_since\": \"%X/%X\"", LSN_FORMAT_ARGS(msg_req->hdr.not_modified_since));
+				appendStringInfoChar(&s, '}');
+				break;
+			}
 			/* pagestore -> pagestore_client */
 		case T_NeonExistsResponse:
 			{
@@ -1610,6 +2366,28 @@ nm_to_string(NeonMessage *msg)
 								 msg_resp->n_blocks);
 				appendStringInfoChar(&s, '}');
 
+				break;
+			}
+		case T_NeonGetPageRangeResponse:
+			{
+				NeonGetPageRangeResponse *msg_resp = (NeonGetPageRangeResponse *) msg;
+
+				appendStringInfoString(&s, "{\"type\": \"NeonGetPageRangeResponse\"");
+				appendStringInfo(&s, ", \"blkno\": %u", msg_resp->req.blkno);
+				appendStringInfo(&s, ", \"nblocks\": %u", msg_resp->req.nblocks);
+				appendStringInfoChar(&s, '}');
+
+				break;
+			}
+		case T_NeonNotModifiedResponse:
+			{
+				NeonNotModifiedResponse *msg_resp = (NeonNotModifiedResponse *) msg;
+
+				appendStringInfoString(&s, "{\"type\": \"NeonNotModifiedResponse\"");
+				appendStringInfo(&s, ", \"blkno\": %u", msg_resp->req.blkno);
+				appendStringInfo(&s, ", \"page_lsn\": \"%X/%X\"", LSN_FORMAT_ARGS(msg_resp->req.page_lsn));
+				appendStringInfoChar(&s, '}');
+
 				break;
 			}
 
@@ -2953,6 +3731,103 @@ neon_writeback(SMgrRelation reln, ForkNumber forknum,
 #endif
 }
 
+/*
+ * neon_revalidate_page() -- Check that a locally held copy of a page is still
+ * the latest version as of the given request LSNs.
+ *
+ * 'buffer' holds a copy of the page that was fetched earlier. It is sent to
+ * the pageserver as a GetPageIfModified request, carrying the LSN in the
+ * page header. If the pageserver's version of the page has the same LSN, it
+ * only replies NotModified and 'buffer' is left as is; otherwise 'buffer' is
+ * overwritten with the new image. Returns true if the page was not modified.
+ *
+ * Requires protocol version 4.
+ */
+static bool
+neon_revalidate_page(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
+					 neon_request_lsns *request_lsns, void *buffer)
+{
+	NeonResponse *resp;
+	bool		not_modified = false;
+	NeonGetPageIfModifiedRequest request = {
+		.hdr.tag = T_NeonGetPageIfModifiedRequest,
+		.hdr.reqid = GENERATE_REQUEST_ID(),
+		.hdr.lsn = request_lsns->request_lsn,
+		.hdr.not_modified_since = request_lsns->not_modified_since,
+		.rinfo = rinfo,
+		.forknum = forkNum,
+		.blkno = blkno,
+		.page_lsn = PageGetLSN((Page) buffer)
+	};
+
+	Assert(neon_protocol_version >= 4);
+
+	MyNeonCounters->getpage_revalidate_requests_total++;
+	resp = page_server_request(&request);
+
+	switch (resp->tag)
+	{
+		case T_NeonNotModifiedResponse:
+		{
+			NeonNotModifiedResponse *nm_resp = (NeonNotModifiedResponse *) resp;
+
+			if (!equal_requests(resp, &request.hdr) ||
+				!RelFileInfoEquals(nm_resp->req.rinfo, request.rinfo) ||
+				nm_resp->req.forknum != request.forknum ||
+				nm_resp->req.blkno != request.blkno ||
+				nm_resp->req.page_lsn != request.page_lsn)
+			{
+				NEON_PANIC_CONNECTION_STATE(-1, PANIC,
+											"Unexpect response {reqid=%lx,lsn=%X/%08X, since=%X/%08X, rel=%u/%u/%u.%u, block=%u, page_lsn=%X/%08X} to get page if modified request {reqid=%lx,lsn=%X/%08X, since=%X/%08X, rel=%u/%u/%u.%u, block=%u, page_lsn=%X/%08X}",
+											resp->reqid, LSN_FORMAT_ARGS(resp->lsn), LSN_FORMAT_ARGS(resp->not_modified_since), RelFileInfoFmt(nm_resp->req.rinfo), nm_resp->req.forknum, nm_resp->req.blkno, LSN_FORMAT_ARGS(nm_resp->req.page_lsn),
+											request.hdr.reqid, LSN_FORMAT_ARGS(request.hdr.lsn), LSN_FORMAT_ARGS(request.hdr.not_modified_since), RelFileInfoFmt(request.rinfo), request.forknum, request.blkno, LSN_FORMAT_ARGS(request.page_lsn));
+			}
+			MyNeonCounters->getpage_not_modified_total++;
+			not_modified = true;
+			break;
+		}
+		case T_NeonGetPageResponse:
+		{
+			NeonGetPageResponse *getpage_resp = (NeonGetPageResponse *) resp;
+
+			if (!equal_requests(resp, &request.hdr) ||
+				!RelFileInfoEquals(getpage_resp->req.rinfo, request.rinfo) ||
+				getpage_resp->req.forknum != request.forknum ||
+				getpage_resp->req.blkno != request.blkno)
+			{
+				NEON_PANIC_CONNECTION_STATE(-1, PANIC,
+											"Unexpect response {reqid=%lx,lsn=%X/%08X, since=%X/%08X, rel=%u/%u/%u.%u, block=%u} to get page if modified request {reqid=%lx,lsn=%X/%08X, since=%X/%08X, rel=%u/%u/%u.%u, block=%u}",
+											resp->reqid, LSN_FORMAT_ARGS(resp->lsn), LSN_FORMAT_ARGS(resp->not_modified_since), RelFileInfoFmt(getpage_resp->req.rinfo), getpage_resp->req.forknum, getpage_resp->req.blkno,
+											request.hdr.reqid, LSN_FORMAT_ARGS(request.hdr.lsn), LSN_FORMAT_ARGS(request.hdr.not_modified_since), RelFileInfoFmt(request.rinfo), request.forknum, request.blkno);
+			}
+			memcpy(buffer, getpage_resp->page, BLCKSZ);
+			break;
+		}
+		case T_NeonErrorResponse:
+			if (!equal_requests(resp, &request.hdr))
+			{
+				elog(WARNING, NEON_TAG "Error message {reqid=%lx,lsn=%X/%08X, since=%X/%08X} doesn't match get page if modified request {reqid=%lx,lsn=%X/%08X, since=%X/%08X}",
+					 resp->reqid, LSN_FORMAT_ARGS(resp->lsn), LSN_FORMAT_ARGS(resp->not_modified_since),
+					 request.hdr.reqid, LSN_FORMAT_ARGS(request.hdr.lsn), LSN_FORMAT_ARGS(request.hdr.not_modified_since));
+			}
+			ereport(ERROR,
+					(errcode(ERRCODE_IO_ERROR),
+					 errmsg(NEON_TAG "[reqid %lx] could not read block %u in rel %u/%u/%u.%u from page server at lsn %X/%08X",
+							resp->reqid, blkno, RelFileInfoFmt(rinfo),
+							forkNum, LSN_FORMAT_ARGS(request_lsns->effective_request_lsn)),
+					 errdetail("page server returned error: %s",
+							   ((NeonErrorResponse *) resp)->message)));
+			break;
+		default:
+			NEON_PANIC_CONNECTION_STATE(-1, PANIC,
+										"Expected GetPage (0x%02x), NotModified (0x%02x) or Error (0x%02x) response to GetPageIfModifiedRequest, but got 0x%02x",
+										T_NeonGetPageResponse, T_NeonNotModifiedResponse, T_NeonErrorResponse, resp->tag);
+	}
+	pfree(resp);
+
+	return not_modified;
+}
+
 static void
 #if PG_MAJORVERSION_NUM < 16
 neon_read_at_lsnv(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber base_blockno, neon_request_lsns *request_lsns,
@@ -3003,7 +3878,8 @@ neon_read_at_lsnv(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber base_block
 		void	   *buffer = buffers[i];
 		BlockNumber blockno = base_blockno + i;
 		neon_request_lsns *reqlsns = &request_lsns[i];
-		TimestampTz		start_ts, end_ts;
+		TimestampTz		start_ts, consume_ts, end_ts;
+		SlowRequestEntry slow;
 
 		if (PointerIsValid(mask) && !BITMAP_ISSET(mask, i))
 			continue;
@@ -3023,6 +3899,8 @@ Retry:
 		if (entry != NULL)
 		{
 			slot = entry->slot;
+			slow.prefetch_status = slot->status == PRFS_RECEIVED ?
+				SLOW_REQUEST_PREFETCH_RECEIVED : SLOW_REQUEST_PREFETCH_INFLIGHT;
 			if (neon_prefetch_response_usable(reqlsns, slot))
 			{
 				ring_index = slot->my_ring_index;
@@ -3042,6 +3920,56 @@ Retry:
 					if (!prefetch_wait_for(slot->my_ring_index))
 						goto Retry;
 				}
+
+				/*
+				 * The prefetched page was read at an LSN that is too old for
+				 * this read, but quite often it hasn't been modified since.
+				 * Rather than downloading the whole page again, ask the
+				 * pageserver to send it only if its LSN has changed.
+				 *
+				 * Only do this for the main fork: FSM and VM updates don't
+				 * always bump the page LSN.
+				 */
+				if (neon_protocol_version >= 4 &&
+					forkNum == MAIN_FORKNUM &&
+					slot->status == PRFS_RECEIVED &&
+					slot->response->tag == T_NeonGetPageResponse)
+				{
+					Page		page = (Page) ((NeonGetPageResponse *) slot->response)->page;
+
+					if (!PageIsNew(page) && PageGetLSN(page) != InvalidXLogRecPtr)
+					{
+						TimestampTz revalidate_ts;
+
+						memcpy(buffer, page, BLCKSZ);
+						slow.shard_no = slot->shard_no;
+						slow.tag = T_NeonGetPageIfModifiedRequest;
+						slow.request_lsn = reqlsns->request_lsn;
+						slow.not_modified_since = reqlsns->not_modified_since;
+
+						prefetch_set_unused(slot->my_ring_index);
+						pgBufferUsage.prefetch.expired += 1;
+						MyNeonCounters->getpage_prefetch_discards_total++;
+
+						/*
+						 * The revalidation is a synchronous round trip, count
+						 * all of it as network time.
+						 */
+						revalidate_ts = GetCurrentTimestamp();
+						neon_revalidate_page(rinfo, forkNum, blockno, reqlsns, buffer);
+						consume_ts = GetCurrentTimestamp();
+						slow.phase_us[GETPAGE_PHASE_QUEUE] = 0;
+						slow.phase_us[GETPAGE_PHASE_SEND] = 0;
+						slow.phase_us[GETPAGE_PHASE_NETWORK] =
+							consume_ts >= revalidate_ts ? (consume_ts - revalidate_ts) : 0;
+						for (int phase = GETPAGE_PHASE_QUEUE; phase < GETPAGE_PHASE_CONSUME; phase++)
+							inc_getpage_phase(slow.shard_no, phase, slow.phase_us[phase]);
+
+						lfc_write(rinfo, forkNum, blockno, buffer);
+						goto Done;
+					}
+				}
+
 				/* drop caches */
 				prefetch_set_unused(slot->my_ring_index);
 				pgBufferUsage.prefetch.expired += 1;
@@ -3058,6 +3986,7 @@ Retry:
 				ring_index = prefetch_register_bufferv(hashkey.buftag, reqlsns, 1, NULL, false);
 				Assert(ring_index != UINT64_MAX);
 				slot = GetPrfSlot(ring_index);
+				slow.prefetch_status = SLOW_REQUEST_PREFETCH_MISS;
 			}
 			else
 			{
@@ -3083,6 +4012,13 @@ Retry:
 		Assert(memcmp(&hashkey.buftag, &slot->buftag, sizeof(BufferTag)) == 0);
 		Assert(hashkey.buftag.blockNum == base_blockno + i);
 
+		consume_ts = GetCurrentTimestamp();
+		prefetch_count_phases(slot, slow.phase_us);
+		slow.shard_no = slot->shard_no;
+		slow.tag = slot->range_len == 1 ? T_NeonGetPageRequest : T_NeonGetPageRangeRequest;
+		slow.request_lsn = slot->request_lsns.request_lsn;
+		slow.not_modified_since = slot->request_lsns.not_modified_since;
+
 		resp = slot->response;
 
 		switch (resp->tag)
@@ -3137,10 +4073,28 @@ Retry:
 
 		/* buffer was used, clean up for later reuse */
 		prefetch_set_unused(ring_index);
+
+Done:
 		prefetch_cleanup_trailing_unused();
 
 		end_ts = GetCurrentTimestamp();
-		inc_getpage_wait(end_ts >= start_ts ? (end_ts - start_ts) : 0);
+		slow.latency_us = end_ts >= start_ts ? (end_ts - start_ts) : 0;
+		slow.phase_us[GETPAGE_PHASE_CONSUME] = end_ts >= consume_ts ? (end_ts - consume_ts) : 0;
+		inc_getpage_wait(slow.latency_us);
+		inc_getpage_phase(slow.shard_no, GETPAGE_PHASE_CONSUME,
+						  slow.phase_us[GETPAGE_PHASE_CONSUME]);
+
+		if (slow_request_should_log(slow.latency_us))
+		{
+			slow.end_time = end_ts;
+			slow.has_phases = true;
+			slow.spcOid = NInfoGetSpcOid(rinfo);
+			slow.dbOid = NInfoGetDbOid(rinfo);
+			slow.relNumber = NInfoGetRelNumber(rinfo);
+			slow.forknum = forkNum;
+			slow.blkno = blockno;
+			log_slow_request(&slow);
+		}
 	}
 }
 
@@ -4052,6 +5006,7 @@ neon_read_slru_segment(SMgrRelation reln, const char* path, int segno, void* buf
 	shardno_t	shard_no = 0; /* All SLRUs are at shard 0 */
 	NeonResponse *resp;
 	NeonGetSlruSegmentRequest request;
+	TimestampTz start_ts;
 
 	/*
 	 * Compute a request LSN to use, similar to neon_get_request_lsns() but the
@@ -4099,6 +5054,7 @@ neon_read_slru_segment(SMgrRelation reln, const char* path, int segno, void* buf
 		.segno = segno
 	};
 
+	start_ts = GetCurrentTimestamp();
 	do
 	{
 		while (!page_server->send(shard_no, &request.hdr) || !page_server->flush(shard_no));
@@ -4107,6 +5063,7 @@ neon_read_slru_segment(SMgrRelation reln, const char* path, int segno, void* buf
 
 		resp = page_server->receive(shard_no);
 	} while (resp == NULL);
+	neon_count_request(&request.hdr, shard_no, start_ts);
 
 	switch (resp->tag)
 	{
@@ -4,11 +4,22 @@
  *
  * This is an implementation of the SMGR interface, used in the WAL redo
  * process. It has no persistent storage, the pages that are written out
- * are kept in a small number of in-memory buffers.
+ * are kept in in-memory buffers.
  *
  * Normally, replaying a WAL record only needs to access a handful of
  * buffers, which fit in the normal buffer cache, so this is just for
- * "overflow" storage when the buffer cache is not large enough.
+ * "overflow" storage when the buffer cache is not large enough. Some
+ * records touch many more pages than that, though, e.g. large multi-inserts
+ * or records of custom resource managers. So the pages are found through an
+ * open-addressing hash table, and the capacity can be raised with the
+ * --inmem-smgr-pages option of the WAL redo process.
+ *
+ * The contents are discarded once per target block, in BeginRedo(), so that
+ * the records of a block see each other's evicted pages. To make that cheap,
+ * each hash table slot is stamped with the generation it was filled in, and
+ * a reset just starts a new generation. The page buffers are kept around for
+ * reuse, so memory is only allocated up to the largest number of pages the
+ * records of one block have needed.
  *
  *
  * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
@@ -21,10 +32,13 @@
 #include "../neon/neon_pgversioncompat.h"
 
 #include "access/xlog.h"
+#include "common/hashfn.h"
+#include "port/pg_bitutils.h"
 #include "storage/block.h"
 #include "storage/buf_internals.h"
 #include RELFILEINFO_HDR
 #include "storage/smgr.h"
+#include "utils/memutils.h"
 
 #if PG_VERSION_NUM >= 150000
 #include "access/xlogutils.h"
@@ -32,35 +46,86 @@
 
 #include "inmem_smgr.h"
 
-/* Size of the in-memory smgr */
-#define MAX_PAGES 64
-
 /* If more than WARN_PAGES are used, print a warning in the log */
 #define WARN_PAGES 32
 
-static BufferTag page_tag[MAX_PAGES];
-static char page_body[MAX_PAGES][BLCKSZ];
+/* Maximum number of pages, see --inmem-smgr-pages */
+int			inmem_smgr_pages = DEFAULT_INMEM_SMGR_PAGES;
+
+typedef struct InmemPage
+{
+	BufferTag	tag;
+	char	   *body;
+} InmemPage;
+
+typedef struct InmemSlot
+{
+	uint32		generation;		/* slot is in use if equal to 'generation' */
+	int			page;			/* index into 'pages' */
+} InmemSlot;
+
+static MemoryContext InmemSmgrContext;
+
+/* The pages in the order they were written, 'inmem_smgr_pages' entries */
+static InmemPage *pages;
 static int	used_pages;
+/* number of entries in 'pages' that have a body allocated */
+static int	allocated_pages;
+
+/* Hash table, at least twice as many slots as pages so that probing stays short */
+static InmemSlot *slots;
+static uint32 slot_mask;
+static uint32 generation = 1;
+
+/*
+ * Allocate the page array and the hash table, on first use, so that the
+ * capacity set on the command line is in effect.
+ */
+static void
+inmem_setup(void)
+{
+	uint32		nslots;
+
+	InmemSmgrContext = AllocSetContextCreate(TopMemoryContext,
+											 "inmem smgr",
+											 ALLOCSET_DEFAULT_SIZES);
+	nslots = pg_nextpower2_32((uint32) inmem_smgr_pages * 2);
+	pages = MemoryContextAlloc(InmemSmgrContext,
+							   inmem_smgr_pages * sizeof(InmemPage));
+	slots = MemoryContextAllocZero(InmemSmgrContext,
+								   nslots * sizeof(InmemSlot));
+	slot_mask = nslots - 1;
+}
 
+/*
+ * Look up a page. Returns its index in 'pages', or -1 if it's not there. In
+ * that case, *freeslot is set to the hash table slot to insert it into.
+ */
 static int
-locate_page(SMgrRelation reln, ForkNumber forknum, BlockNumber blkno)
+locate_page(const BufferTag *tag, uint32 *freeslot)
 {
-	NRelFileInfo rinfo = InfoFromSMgrRel(reln);
+	uint32		i;
 
-	/* We only hold a small number of pages, so linear search */
-	for (int i = 0; i < used_pages; i++)
+	if (slots == NULL)
+		return -1;
+
+	i = hash_bytes((const unsigned char *) tag, sizeof(BufferTag)) & slot_mask;
+	for (;;)
 	{
-		if (RelFileInfoEquals(rinfo, BufTagGetNRelFileInfo(page_tag[i]))
-			&& forknum == page_tag[i].forkNum
-			&& blkno == page_tag[i].blockNum)
+		InmemSlot  *slot = &slots[i];
+
+		if (slot->generation != generation)
 		{
-			return i;
+			*freeslot = i;
+			return -1;
 		}
+		if (BufferTagsEqual(&pages[slot->page].tag, tag))
+			return slot->page;
+		/* the table is never more than half full, so this terminates */
+		i = (i + 1) & slot_mask;
 	}
-	return -1;
 }
 
-
 /* neon wal-redo storage manager functionality */
 static void inmem_init(void);
 static void inmem_open(SMgrRelation reln);
@@ -109,6 +174,16 @@ static void
 inmem_init(void)
 {
 	used_pages = 0;
+
+	/* Forget all the pages at once by starting a new generation */
+	generation++;
+	if (generation == 0)
+	{
+		/* wrapped around, so old slots could look current again */
+		if (slots != NULL)
+			memset(slots, 0, (slot_mask + 1) * sizeof(InmemSlot));
+		generation = 1;
+	}
 }
 
 /*
@@ -119,10 +194,11 @@ inmem_exists(SMgrRelation reln, ForkNumber forknum)
 {
 	NRelFileInfo rinfo = InfoFromSMgrRel(reln);
 
+	/* This is rarely called, so a linear search is fine */
 	for (int i = 0; i < used_pages; i++)
 	{
-		if (RelFileInfoEquals(rinfo, BufTagGetNRelFileInfo(page_tag[i]))
-			&& forknum == page_tag[i].forkNum)
+		if (RelFileInfoEquals(rinfo, BufTagGetNRelFileInfo(pages[i].tag))
+			&& forknum == pages[i].tag.forkNum)
 		{
 			return true;
 		}
@@ -237,13 +313,16 @@ inmem_read(SMgrRelation reln, ForkNumber forknum, BlockNumber blkno,
 		   void *buffer)
 #endif
 {
+	BufferTag	tag;
+	uint32		freeslot;
 	int			pg;
 
-	pg = locate_page(reln, forknum, blkno);
+	InitBufferTag(&tag, &InfoFromSMgrRel(reln), forknum, blkno);
+	pg = locate_page(&tag, &freeslot);
 	if (pg < 0)
 		memset(buffer, 0, BLCKSZ);
 	else
-		memcpy(buffer, page_body[pg], BLCKSZ);
+		memcpy(buffer, pages[pg].body, BLCKSZ);
 }
 
 #if PG_MAJORVERSION_NUM >= 17
@@ -273,9 +352,15 @@ inmem_write(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 			const void *buffer, bool skipFsync)
 #endif
 {
+	BufferTag	tag;
+	uint32		freeslot;
 	int			pg;
 
-	pg = locate_page(reln, forknum, blocknum);
+	if (slots == NULL)
+		inmem_setup();
+
+	InitBufferTag(&tag, &InfoFromSMgrRel(reln), forknum, blocknum);
+	pg = locate_page(&tag, &freeslot);
 	if (pg < 0)
 	{
 		/*
@@ -291,13 +376,23 @@ inmem_write(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 			 forknum,
 			 blocknum,
 			 used_pages);
-		if (used_pages == MAX_PAGES)
-			elog(ERROR, "Inmem storage overflow");
+		if (used_pages == inmem_smgr_pages)
+			ereport(ERROR,
+					(errmsg("Inmem storage overflow"),
+					 errdetail("The WAL records of the block touch more than %d pages.",
+							   inmem_smgr_pages),
+					 errhint("Raise --inmem-smgr-pages.")));
 
 		pg = used_pages;
 		used_pages++;
-
-		InitBufferTag(&page_tag[pg], &InfoFromSMgrRel(reln), forknum, blocknum);
+		if (pg == allocated_pages)
+		{
+			pages[pg].body = MemoryContextAlloc(InmemSmgrContext, BLCKSZ);
+			allocated_pages++;
+		}
+		pages[pg].tag = tag;
+		slots[freeslot].generation = generation;
+		slots[freeslot].page = pg;
 	}
 	else
 	{
@@ -305,9 +400,9 @@ inmem_write(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 			 RelFileInfoFmt(InfoFromSMgrRel(reln)),
 			 forknum,
 			 blocknum,
-			 used_pages);
+			 pg);
 	}
-	memcpy(page_body[pg], buffer, BLCKSZ);
+	memcpy(pages[pg].body, buffer, BLCKSZ);
 }
 
 #if PG_MAJORVERSION_NUM >= 17
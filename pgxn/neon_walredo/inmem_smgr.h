@@ -11,6 +11,12 @@
 #ifndef INMEM_SMGR_H
 #define INMEM_SMGR_H
 
+/* Default and maximum number of pages that the WAL records of a block can overflow */
+#define DEFAULT_INMEM_SMGR_PAGES 1024
+#define MAX_INMEM_SMGR_PAGES (1024 * 1024)
+
+extern int	inmem_smgr_pages;
+
 extern const f_smgr *smgr_inmem(ProcNumber backend, NRelFileInfo rinfo);
 extern void smgr_init_inmem(void);
 
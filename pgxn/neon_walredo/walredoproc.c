@@ -23,11 +23,80 @@
  * BeginRedoForBlock ('B'): Prepare for WAL replay for given block
  * PushPage ('P'): Copy a page image (in the payload) to buffer cache
  * ApplyRecord ('A'): Apply a WAL record (in the payload)
+ * ApplyRecords ('L'): Apply a list of WAL records, see below
  * GetPage ('G'): Return a page image from buffer cache.
+ * ApplyBatch ('M'): Reconstruct many pages, see below
  * Ping ('H'): Return the input message.
+ * GetStats ('S'): Return statistics, see GetStats()
+ * UseSlot ('U'): Select the redo slot for the following messages, see below
  *
- * Currently, you only get a response to GetPage requests; the response is
- * simply a 8k page, without any headers. Errors are logged to stderr.
+ * Currently, you only get a response to GetPage, ApplyBatch, Ping and
+ * GetStats requests; the response is simply a 8k page per page requested,
+ * without any headers, except for GetStats. Errors are logged to stderr.
+ *
+ * ApplyRecords is the same as an ApplyRecord for each of the records in it,
+ * but the records are decoded straight from the message, and the buffer that
+ * they're decoded into is sized for the largest of them up front. Also, if
+ * the list is a single record with a full-page image of the block, the image
+ * is restored without running the record's redo function.
+ *
+ * ApplyBatch carries a number of independent jobs, each equivalent to a
+ * BeginRedoForBlock, an optional PushPage, any number of ApplyRecords and a
+ * GetPage. The jobs are applied back to back, and all the resulting pages are
+ * returned with a single write, in the order of the jobs. That saves a pipe
+ * round trip and a write() per page, when the caller has many pages to
+ * reconstruct at once.
+ *
+ * Redo slots
+ * ----------
+ *
+ * With --redo-slots=N, the process keeps N independent redo contexts, each
+ * with its own target block and XLogReaderState. UseSlot selects the one that
+ * the following BeginRedoForBlock, PushPage, ApplyRecord(s) and GetPage
+ * messages apply to, so the messages of up to N blocks can be interleaved.
+ * Without UseSlot, everything goes to slot 0, like before. ApplyBatch uses a
+ * slot of its own, so it doesn't disturb a block in progress in any of them.
+ *
+ * Only one slot's block is in the buffer cache at a time. When a message for
+ * another slot arrives, the page of the loaded slot is copied out and its
+ * buffer dropped, and the page of the other slot is pushed back in. That's
+ * two page copies per switch, but it keeps the buffer cache and the
+ * in-memory smgr to a single block like without slots, and two slots can
+ * work on the same block.
+ *
+ * Shared memory ring
+ * ------------------
+ *
+ * With --shmem-ring, the pageserver passes a memfd as file descriptor 3,
+ * which we map before entering seccomp mode. It starts with a
+ * WalRedoRingHeader, followed by a request ring and a response ring. Instead
+ * of sending an ApplyBatch message through the pipe, the pageserver can then
+ * copy its payload into the request ring and send a small RingRequest ('R')
+ * message pointing to it. We process the message in place, and advance
+ * request_consumed when we're done with it.
+ *
+ * In this mode, every response on stdout starts with a tag byte. 'R' is
+ * followed by the position and length of the response in the response ring;
+ * the pageserver advances response_consumed after copying it out. 'D' is
+ * followed by the response itself, for when it doesn't fit in the ring.
+ *
+ * The pipes are still used to wake up the other side, one small write per
+ * request, so we don't need any additional syscalls under seccomp. But the
+ * records and pages don't go through the pipes, nor through stdin_buf and
+ * the StringInfo.
+ *
+ * Fork server
+ * -----------
+ *
+ * With --fork-server, we do all the initialization above, but instead of
+ * serving WAL redo requests, we wait for spawn requests on stdin, which is a
+ * Unix domain socket. Each request is a 'F' byte and a flags byte (bit 0:
+ * attach to a shared memory ring), with the stdin, stdout and stderr of the
+ * new process, and the ring if requested, attached as SCM_RIGHTS. We fork a
+ * child that takes those over, and reply with its PID as an int32 and a pidfd
+ * for it, or PID 0 and no pidfd if we couldn't fork. The child then enters
+ * seccomp mode and serves requests as usual. The fork server itself never
+ * processes any WAL, so it's as trusted as a freshly started process.
  *
  * FIXME:
  * - this currently requires a valid PGDATA, and creates a lock file there
@@ -50,7 +119,13 @@
 #include <limits.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
@@ -89,6 +164,7 @@
 #include "libpq/pqformat.h"
 #include "miscadmin.h"
 #include "pgstat.h"
+#include "port/atomics.h"
 #include "postmaster/autovacuum.h"
 #include "postmaster/bgworker_internals.h"
 #include "postmaster/bgwriter.h"
@@ -131,14 +207,98 @@ static int	ReadRedoCommand(StringInfo inBuf);
 static void BeginRedoForBlock(StringInfo input_message);
 static void PushPage(StringInfo input_message);
 static void ApplyRecord(StringInfo input_message);
+static void ApplyRecords(StringInfo input_message);
+static void ApplyRecordList(StringInfo input_message);
 static void apply_error_callback(void *arg);
 static bool redo_block_filter(XLogReaderState *record, uint8 block_id);
 static void GetPage(StringInfo input_message);
+static void ApplyBatch(StringInfo input_message);
+static void RingRequest(StringInfo input_message);
 static void Ping(StringInfo input_message);
+static void GetStats(StringInfo input_message);
+static void UseSlot(StringInfo input_message);
+static void LoadRedoSlot(int slotno);
+static void GetRedoTag(StringInfo input_message, NRelFileInfo *rinfo,
+					   ForkNumber *forknum, BlockNumber *blknum);
+static void BeginRedo(NRelFileInfo rinfo, ForkNumber forknum, BlockNumber blknum);
+static void PushPageImage(NRelFileInfo rinfo, ForkNumber forknum, BlockNumber blknum,
+						  const char *content);
+static void RedoRecord(XLogRecPtr lsn, XLogRecord *record, int len);
+#if PG_VERSION_NUM >= 150000
+static void ReserveDecodeArena(size_t required_space);
+#endif
+static bool RestoreTargetImage(XLogRecPtr lsn, XLogRecord *record, int len);
+static Page GetRedoPage(void);
+static void EndRedo(void);
+static void write_stdout(const char *buf, size_t count);
+static char *response_begin(size_t len);
+static void response_end(void);
+static void send_response(const char *buf, size_t len);
+static void ring_attach(void);
+static bool ForkServerLoop(void);
 static ssize_t buffered_read(void *buf, size_t count);
+static void ConfigureWalRedoShmemSizes(void);
 static void CreateFakeSharedMemoryAndSemaphores(void);
 
+/*
+ * The block being reconstructed, between BeginRedoForBlock and GetPage. Its
+ * buffer, wal_redo_buffer, stays pinned for all the records of the block once
+ * it has been read in, so that we don't need to look it up for every record.
+ */
 static BufferTag target_redo_tag;
+static NRelFileInfo target_redo_rinfo;
+static bool target_redo_in_progress = false;
+
+/*
+ * The redo slots, see "Redo slots" above. The globals above, and
+ * reader_state, belong to the loaded slot; the others are kept here. The slot
+ * after the last one that UseSlot can select is used by ApplyBatch.
+ */
+#define MAX_REDO_SLOTS 1024
+
+typedef struct RedoSlot
+{
+	BufferTag	tag;
+	NRelFileInfo rinfo;
+	bool		in_progress;	/* between BeginRedo and EndRedo */
+	char	   *page;			/* the parked page, if 'parked' */
+	bool		parked;
+	XLogReaderState *reader;	/* allocated on first use */
+} RedoSlot;
+
+static RedoSlot *redo_slots;
+static int	num_redo_slots = 1;
+static int	selected_redo_slot = 0;
+static int	loaded_redo_slot = 0;
+
+/* Statistics, returned by GetStats */
+static uint64 redo_records_applied = 0;
+static uint64 redo_records_skipped = 0;
+
+/*
+ * Layout of the beginning of the shared memory ring. The pageserver has the
+ * same definition, keep them in sync.
+ */
+#define WALREDO_RING_FD			3
+#define WALREDO_RING_MAGIC		0x4e57524eU	/* "NWRN" */
+#define WALREDO_RING_VERSION	1
+#define WALREDO_RING_HEADER_SIZE 4096	/* the rings start at this offset */
+#define WALREDO_RING_ALIGN		8
+
+typedef struct WalRedoRingHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint64		request_size;	/* size of the request ring, in bytes */
+	uint64		response_size;	/* size of the response ring, in bytes */
+	pg_atomic_uint64 request_consumed;	/* advanced by us */
+	pg_atomic_uint64 response_consumed; /* advanced by the pageserver */
+} WalRedoRingHeader;
+
+static WalRedoRingHeader *ring = NULL;
+static char *ring_requests;
+static char *ring_responses;
+static uint64 ring_response_produced = 0;
 
 static XLogReaderState *reader_state;
 
@@ -241,6 +401,9 @@ WalRedoMain(int argc, char *argv[])
 {
 	int			firstchar;
 	StringInfoData input_message;
+	bool		use_ring;
+	bool		fork_server = false;
+	bool		postmaster_shmem_sizes;
 #ifdef HAVE_LIBSECCOMP
 	bool		enable_seccomp;
 #endif
@@ -266,8 +429,40 @@ WalRedoMain(int argc, char *argv[])
 	NBuffers = 4;
 
 	/*
-	 * install the simple in-memory smgr
+	 * install the simple in-memory smgr, with the capacity from
+	 * --inmem-smgr-pages if given
 	 */
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--inmem-smgr-pages=", 19) == 0)
+		{
+			char	   *endptr;
+			long		val;
+
+			errno = 0;
+			val = strtol(argv[i] + 19, &endptr, 10);
+			if (errno != 0 || *endptr != '\0' ||
+				val < 1 || val > MAX_INMEM_SMGR_PAGES)
+				ereport(FATAL,
+						(errmsg("invalid value for --inmem-smgr-pages: \"%s\"",
+								argv[i] + 19)));
+			inmem_smgr_pages = (int) val;
+		}
+		if (strncmp(argv[i], "--redo-slots=", 13) == 0)
+		{
+			char	   *endptr;
+			long		val;
+
+			errno = 0;
+			val = strtol(argv[i] + 13, &endptr, 10);
+			if (errno != 0 || *endptr != '\0' ||
+				val < 1 || val > MAX_REDO_SLOTS)
+				ereport(FATAL,
+						(errmsg("invalid value for --redo-slots: \"%s\"",
+								argv[i] + 13)));
+			num_redo_slots = (int) val;
+		}
+	}
 	smgr_hook = smgr_inmem;
 	smgr_init_hook = smgr_init_inmem;
 
@@ -283,8 +478,25 @@ WalRedoMain(int argc, char *argv[])
 	max_worker_processes = 0;
 	max_parallel_workers = 0;
 	max_wal_senders = 0;
+	/* the autovacuum launcher still gets its slot */
+	autovacuum_max_workers = 0;
 	InitializeMaxBackends();
 
+	/*
+	 * Size the rest of the fake shared memory for this single process, too.
+	 * Every tenant has its own WAL redo process, so with thousands of tenants
+	 * on a pageserver, anything we allocate and initialize here adds up.
+	 *
+	 * --postmaster-shmem-sizes keeps the postmaster's sizes instead, to
+	 * measure what this saves.
+	 */
+	postmaster_shmem_sizes = false;
+	for (int i = 1; i < argc; i++)
+		if (strcmp(argv[i], "--postmaster-shmem-sizes") == 0)
+			postmaster_shmem_sizes = true;
+	if (!postmaster_shmem_sizes)
+		ConfigureWalRedoShmemSizes();
+
 	/* Disable lastWrittenLsnCache */
 	lastWrittenLsnCacheSize = 0;
 
@@ -344,6 +556,27 @@ WalRedoMain(int argc, char *argv[])
 	}
 	reader_state = XLogReaderAllocate(wal_segment_size, NULL, XL_ROUTINE(), NULL);
 
+	/* One more for ApplyBatch. Slot 0 starts out loaded. */
+	redo_slots = MemoryContextAllocZero(TopMemoryContext,
+										(num_redo_slots + 1) * sizeof(RedoSlot));
+	redo_slots[0].reader = reader_state;
+
+	use_ring = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--shmem-ring") == 0)
+			use_ring = true;
+		if (strcmp(argv[i], "--fork-server") == 0)
+			fork_server = true;
+	}
+
+	/* In fork server mode, this only returns in a forked child */
+	if (fork_server)
+		use_ring = ForkServerLoop();
+
+	if (use_ring)
+		ring_attach();
+
 #ifdef HAVE_LIBSECCOMP
 	/* We prefer opt-out to opt-in for greater security */
 	enable_seccomp = true;
@@ -394,14 +627,34 @@ WalRedoMain(int argc, char *argv[])
 				ApplyRecord(&input_message);
 				break;
 
+			case 'L':			/* ApplyRecords */
+				ApplyRecords(&input_message);
+				break;
+
 			case 'G':			/* GetPage */
 				GetPage(&input_message);
 				break;
 
+			case 'M':			/* ApplyBatch */
+				ApplyBatch(&input_message);
+				break;
+
+			case 'R':			/* RingRequest */
+				RingRequest(&input_message);
+				break;
+
 			case 'H': 			/* Ping */
 				Ping(&input_message);
 				break;
 
+			case 'S':			/* GetStats */
+				GetStats(&input_message);
+				break;
+
+			case 'U':			/* UseSlot */
+				UseSlot(&input_message);
+				break;
+
 				/*
 				 * EOF means we're done. Perform normal shutdown.
 				 */
@@ -438,6 +691,38 @@ WalRedoMain(int argc, char *argv[])
 }
 
 
+/*
+ * Shrink the settings that shared memory is sized by to what WAL redo needs.
+ *
+ * The lock tables and the predicate lock tables are initialized up front, so
+ * they count towards the RSS of every process even though WAL redo never
+ * takes any heavyweight or predicate locks. Replication slots and logical
+ * replication workers aren't used at all. The values are the minimums that
+ * the GUCs allow, except for the ones set to zero, which are never used.
+ *
+ * Most of the buffers are sized by NBuffers, which is set above.
+ */
+static void
+ConfigureWalRedoShmemSizes(void)
+{
+	max_locks_per_xact = 10;
+	max_predicate_locks_per_xact = 10;
+	max_prepared_xacts = 0;
+	max_replication_slots = 0;
+	max_logical_replication_workers = 0;
+
+#if PG_MAJORVERSION_NUM >= 17
+	/*
+	 * The SLRU buffers that are sized automatically are already at their
+	 * minimum with our NBuffers, but these have fixed defaults.
+	 */
+	multixact_offset_buffers = 16;
+	multixact_member_buffers = 16;
+	notify_buffers = 16;
+	serializable_buffers = 16;
+#endif
+}
+
 /*
  * Initialize dummy shmem.
  *
@@ -463,7 +748,9 @@ CreateFakeSharedMemoryAndSemaphores(void)
 #else
 	/*
 	 * Postgres v14 doesn't have a separate CalculateShmemSize(). Use result of the
-	 * corresponging calculation in CreateSharedMemoryAndSemaphores()
+	 * corresponging calculation in CreateSharedMemoryAndSemaphores(), with the
+	 * default settings. It's more than we need after ConfigureWalRedoShmemSizes(),
+	 * but the part we don't touch doesn't count towards RSS.
 	 */
 	size = 1409024;
 	numSemas = 10;
@@ -721,7 +1008,6 @@ BeginRedoForBlock(StringInfo input_message)
 	NRelFileInfo rinfo;
 	ForkNumber forknum;
 	BlockNumber blknum;
-	SMgrRelation reln;
 
 	/*
 	 * message format:
@@ -732,20 +1018,52 @@ BeginRedoForBlock(StringInfo input_message)
 	 * ForkNumber
 	 * BlockNumber
 	 */
-	forknum = pq_getmsgbyte(input_message);
+	GetRedoTag(input_message, &rinfo, &forknum, &blknum);
+	LoadRedoSlot(selected_redo_slot);
+	BeginRedo(rinfo, forknum, blknum);
+}
+
+/*
+ * Read the block reference that most messages start with.
+ */
+static void
+GetRedoTag(StringInfo input_message, NRelFileInfo *rinfo,
+		   ForkNumber *forknum, BlockNumber *blknum)
+{
+	*forknum = pq_getmsgbyte(input_message);
 #if PG_MAJORVERSION_NUM < 16
-	rinfo.spcNode = pq_getmsgint(input_message, 4);
-	rinfo.dbNode = pq_getmsgint(input_message, 4);
-	rinfo.relNode = pq_getmsgint(input_message, 4);
+	rinfo->spcNode = pq_getmsgint(input_message, 4);
+	rinfo->dbNode = pq_getmsgint(input_message, 4);
+	rinfo->relNode = pq_getmsgint(input_message, 4);
 #else
-	rinfo.spcOid = pq_getmsgint(input_message, 4);
-	rinfo.dbOid = pq_getmsgint(input_message, 4);
-	rinfo.relNumber = pq_getmsgint(input_message, 4);
+	rinfo->spcOid = pq_getmsgint(input_message, 4);
+	rinfo->dbOid = pq_getmsgint(input_message, 4);
+	rinfo->relNumber = pq_getmsgint(input_message, 4);
 #endif
-	blknum = pq_getmsgint(input_message, 4);
+	*blknum = pq_getmsgint(input_message, 4);
+}
+
+static void
+BeginRedo(NRelFileInfo rinfo, ForkNumber forknum, BlockNumber blknum)
+{
+	SMgrRelation reln;
+
+	/* In case the previous block was never fetched with GetPage */
+	if (BufferIsValid(wal_redo_buffer))
+		ReleaseBuffer(wal_redo_buffer);
 	wal_redo_buffer = InvalidBuffer;
 
+	/*
+	 * Forget the pages that the previous block's records overflowed to the
+	 * in-memory smgr. We do this once per block rather than once per record,
+	 * so that the records of a block see each other's changes even if a page
+	 * is evicted in between.
+	 */
+	smgr_init_inmem();
+
 	InitBufferTag(&target_redo_tag, &rinfo, forknum, blknum);
+	target_redo_rinfo = rinfo;
+	target_redo_in_progress = true;
 
 	elog(TRACE, "BeginRedoForBlock %u/%u/%u.%d blk %u",
 		 RelFileInfoFmt(rinfo),
@@ -770,8 +1088,6 @@ PushPage(StringInfo input_message)
 	ForkNumber forknum;
 	BlockNumber blknum;
 	const char *content;
-	Buffer		buf;
-	Page		page;
 
 	/*
 	 * message format:
@@ -783,25 +1099,30 @@ PushPage(StringInfo input_message)
 	 * BlockNumber
 	 * 8k page content
 	 */
-	forknum = pq_getmsgbyte(input_message);
-#if PG_MAJORVERSION_NUM < 16
-	rinfo.spcNode = pq_getmsgint(input_message, 4);
-	rinfo.dbNode = pq_getmsgint(input_message, 4);
-	rinfo.relNode = pq_getmsgint(input_message, 4);
-#else
-	rinfo.spcOid = pq_getmsgint(input_message, 4);
-	rinfo.dbOid = pq_getmsgint(input_message, 4);
-	rinfo.relNumber = pq_getmsgint(input_message, 4);
-#endif
-	blknum = pq_getmsgint(input_message, 4);
+	GetRedoTag(input_message, &rinfo, &forknum, &blknum);
 	content = pq_getmsgbytes(input_message, BLCKSZ);
 
+	LoadRedoSlot(selected_redo_slot);
+	PushPageImage(rinfo, forknum, blknum, content);
+}
+
+static void
+PushPageImage(NRelFileInfo rinfo, ForkNumber forknum, BlockNumber blknum,
+			  const char *content)
+{
+	Buffer		buf;
+	Page		page;
+
 	buf = NeonRedoReadBuffer(rinfo, forknum, blknum, RBM_ZERO_AND_LOCK);
-	wal_redo_buffer = buf;
 	page = BufferGetPage(buf);
 	memcpy(page, content, BLCKSZ);
 	MarkBufferDirty(buf); /* pro forma */
-	UnlockReleaseBuffer(buf);
+	LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+
+	/* Keep the page pinned until EndRedo() */
+	if (BufferIsValid(wal_redo_buffer))
+		ReleaseBuffer(wal_redo_buffer);
+	wal_redo_buffer = buf;
 }
 
 /*
@@ -812,17 +1133,9 @@ PushPage(StringInfo input_message)
 static void
 ApplyRecord(StringInfo input_message)
 {
-	char	   *errormsg;
 	XLogRecPtr	lsn;
 	XLogRecord *record;
 	int			nleft;
-	ErrorContextCallback errcallback;
-#if PG_VERSION_NUM >= 150000
-	DecodedXLogRecord *decoded;
-#define STATIC_DECODEBUF_SIZE (64 * 1024)
-	static char *static_decodebuf = NULL;
-	size_t		required_space;
-#endif
 
 	/*
 	 * message format:
@@ -832,15 +1145,266 @@ ApplyRecord(StringInfo input_message)
 	 */
 	lsn = pq_getmsgint64(input_message);
 
-	smgrinit();					/* reset inmem smgr state */
-
 	/* note: the input must be aligned here */
+	nleft = input_message->len - input_message->cursor;
 	record = (XLogRecord *) pq_getmsgbytes(input_message, sizeof(XLogRecord));
 
-	nleft = input_message->len - input_message->cursor;
-	if (record->xl_tot_len != sizeof(XLogRecord) + nleft)
+	LoadRedoSlot(selected_redo_slot);
+	RedoRecord(lsn, record, nleft);
+}
+
+/*
+ * Receive a list of WAL records for the current block, and apply them.
+ */
+static void
+ApplyRecords(StringInfo input_message)
+{
+	/*
+	 * message format:
+	 *
+	 * record list, see ApplyRecordList()
+	 */
+	LoadRedoSlot(selected_redo_slot);
+	ApplyRecordList(input_message);
+	pq_getmsgend(input_message);
+}
+
+/*
+ * Read the next record of a record list. Returns a pointer to it in the
+ * message.
+ */
+static const char *
+GetListRecord(StringInfo input_message, XLogRecPtr *lsn, int *len)
+{
+	*lsn = pq_getmsgint64(input_message);
+	*len = pq_getmsgint(input_message, 4);
+	if (*len < (int) sizeof(XLogRecord))
+		ereport(ERROR,
+				(errcode(ERRCODE_PROTOCOL_VIOLATION),
+				 errmsg("invalid record length in record list: %d", *len)));
+	input_message->cursor = TYPEALIGN(WALREDO_RING_ALIGN, input_message->cursor);
+	return pq_getmsgbytes(input_message, *len);
+}
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * Records are decoded into this arena. It grows to fit the largest record
+ * seen, up to DECODE_ARENA_MAX_SIZE; larger records get a buffer of their
+ * own.
+ */
+#define DECODE_ARENA_MIN_SIZE (64 * 1024)
+#define DECODE_ARENA_MAX_SIZE (4 * 1024 * 1024)
+static char *decode_arena = NULL;
+static size_t decode_arena_size = 0;
+
+static void
+ReserveDecodeArena(size_t required_space)
+{
+	size_t		size;
+
+	size = Min(Max(required_space, DECODE_ARENA_MIN_SIZE), DECODE_ARENA_MAX_SIZE);
+	if (size <= decode_arena_size)
+		return;
+
+	if (decode_arena)
+		pfree(decode_arena);
+	decode_arena = MemoryContextAlloc(TopMemoryContext, size);
+	decode_arena_size = size;
+}
+#endif
+
+/*
+ * Return the record at 'data' as a MAXALIGNed pointer. The decoder needs an
+ * aligned record, so copy it if it isn't. The copy is valid until the next
+ * call.
+ */
+static XLogRecord *
+AlignedRecord(const char *data, int len)
+{
+	static char *aligned_record = NULL;
+	static int	aligned_record_size = 0;
+
+	if ((uintptr_t) data % MAXIMUM_ALIGNOF == 0)
+		return (XLogRecord *) data;
+
+	if (aligned_record_size < len)
+	{
+		if (aligned_record)
+			pfree(aligned_record);
+		aligned_record_size = Max(len, BLCKSZ);
+		aligned_record = MemoryContextAlloc(TopMemoryContext, aligned_record_size);
+	}
+	memcpy(aligned_record, data, len);
+	return (XLogRecord *) aligned_record;
+}
+
+/*
+ * Apply a list of records to the current block.
+ *
+ * format:
+ *
+ * int32 number of records
+ * for each record:
+ *   LSN (the *end* of the record)
+ *   int32 record length
+ *   zero padding to the next 8-byte boundary from the start of payload
+ *   record
+ *
+ * The padding lets us decode the records in place, without copying them out
+ * of the message first.
+ *
+ * The pageserver starts the list at the latest record that initializes the
+ * page, which is often one with a full-page image of it. If that record is
+ * all there is, we restore the image without running its redo function.
+ */
+static void
+ApplyRecordList(StringInfo input_message)
+{
+	typedef struct ListRecord
+	{
+		XLogRecPtr	lsn;
+		int			len;
+		const char *data;
+	} ListRecord;
+	static ListRecord *list = NULL;
+	static int	list_size = 0;
+	int			nrecords;
+
+	nrecords = pq_getmsgint(input_message, 4);
+	if (nrecords < 0 || nrecords > MaxAllocSize / sizeof(ListRecord))
+		ereport(ERROR,
+				(errcode(ERRCODE_PROTOCOL_VIOLATION),
+				 errmsg("invalid number of records: %d", nrecords)));
+
+	if (list_size < nrecords)
+	{
+		if (list)
+			pfree(list);
+		list_size = Max(nrecords, 64);
+		list = MemoryContextAlloc(TopMemoryContext, list_size * sizeof(ListRecord));
+	}
+
+	for (int i = 0; i < nrecords; i++)
+		list[i].data = GetListRecord(input_message, &list[i].lsn, &list[i].len);
+
+#if PG_VERSION_NUM >= 150000
+	/* Size the decode arena for the largest record, before decoding any */
+	{
+		size_t		max_space = 0;
+
+		for (int i = 0; i < nrecords; i++)
+			max_space = Max(max_space, DecodeXLogRecordRequiredSpace(list[i].len));
+		ReserveDecodeArena(max_space);
+	}
+#endif
+
+	if (nrecords == 1 &&
+		RestoreTargetImage(list[0].lsn,
+						   AlignedRecord(list[0].data, list[0].len),
+						   list[0].len))
+	{
+		redo_records_skipped++;
+		return;
+	}
+
+	for (int i = 0; i < nrecords; i++)
+		RedoRecord(list[i].lsn, AlignedRecord(list[i].data, list[i].len),
+				   list[i].len);
+}
+
+/*
+ * If redo of the record restores a full-page image of the target block,
+ * put the image into the buffer cache the way redo would, and return true.
+ * Otherwise return false, and leave the block alone.
+ *
+ * A redo function must not touch a page that was restored from an image, so
+ * this is all that redo of the record does to the target block. A record that
+ * fails to decode, or whose image fails to restore, is reported when we get
+ * to apply it.
+ */
+static bool
+RestoreTargetImage(XLogRecPtr lsn, XLogRecord *record, int len)
+{
+	char	   *errormsg;
+	bool		result = false;
+
+	if (record->xl_tot_len != len)
+		return false;
+
+	XLogBeginRead(reader_state, lsn);
+#if PG_VERSION_NUM >= 150000
+	/* Not worth a buffer of its own */
+	if (DecodeXLogRecordRequiredSpace(len) > decode_arena_size)
+		return false;
+	if (!DecodeXLogRecord(reader_state, (DecodedXLogRecord *) decode_arena,
+						  record, lsn, &errormsg))
+		return false;
+	reader_state->record = (DecodedXLogRecord *) decode_arena;
+#else
+	reader_state->ReadRecPtr = lsn;
+	reader_state->decoded_record = record;
+	if (!DecodeXLogRecord(reader_state, record, &errormsg))
+	{
+		reader_state->decoded_record = NULL;
+		return false;
+	}
+#endif
+
+	for (int block_id = 0; block_id <= XLogRecMaxBlockId(reader_state); block_id++)
+	{
+		NRelFileInfo rinfo;
+		ForkNumber	forknum;
+		BlockNumber blknum;
+
+		if (!XLogRecHasBlockRef(reader_state, block_id) ||
+			!XLogRecHasBlockImage(reader_state, block_id) ||
+			!XLogRecBlockImageApply(reader_state, block_id))
+			continue;
+
+		XLogRecGetBlockTag(reader_state, block_id, &rinfo, &forknum, &blknum);
+		if (blknum == target_redo_tag.blockNum &&
+			forknum == target_redo_tag.forkNum &&
+			RelFileInfoEquals(rinfo, target_redo_rinfo))
+		{
+			PGAlignedBlock image;
+
+			if (RestoreBlockImage(reader_state, block_id, image.data))
+			{
+				/* Like XLogReadBufferForRedoExtended() */
+				if (!PageIsNew((Page) image.data))
+					PageSetLSN((Page) image.data, lsn);
+				PushPageImage(rinfo, forknum, blknum, image.data);
+				result = true;
+			}
+			break;
+		}
+	}
+
+#if PG_VERSION_NUM >= 150000
+	reader_state->record = NULL;
+#else
+	reader_state->decoded_record = NULL;
+#endif
+	return result;
+}
+
+/*
+ * Apply a WAL record of 'len' bytes, ending at 'lsn'. 'record' must be
+ * MAXALIGNed.
+ */
+static void
+RedoRecord(XLogRecPtr lsn, XLogRecord *record, int len)
+{
+	char	   *errormsg;
+	ErrorContextCallback errcallback;
+#if PG_VERSION_NUM >= 150000
+	DecodedXLogRecord *decoded;
+	size_t		required_space;
+#endif
+
+	if (record->xl_tot_len != len)
 		elog(ERROR, "mismatch between record (%d) and message size (%d)",
-			 record->xl_tot_len, (int) sizeof(XLogRecord) + nleft);
+			 record->xl_tot_len, len);
 
 	/* Setup error traceback support for ereport() */
 	errcallback.callback = apply_error_callback;
@@ -852,16 +1416,13 @@ ApplyRecord(StringInfo input_message)
 
 #if PG_VERSION_NUM >= 150000
 	/*
-	 * For reasonably small records, reuse a fixed size buffer to reduce
-	 * palloc overhead.
+	 * Decode into the arena, to avoid palloc overhead. Only very large
+	 * records need a buffer of their own.
 	 */
 	required_space = DecodeXLogRecordRequiredSpace(record->xl_tot_len);
-	if (required_space <= STATIC_DECODEBUF_SIZE)
-	{
-		if (static_decodebuf == NULL)
-			static_decodebuf = MemoryContextAlloc(TopMemoryContext, STATIC_DECODEBUF_SIZE);
-		decoded = (DecodedXLogRecord *) static_decodebuf;
-	}
+	ReserveDecodeArena(required_space);
+	if (required_space <= decode_arena_size)
+		decoded = (DecodedXLogRecord *) decode_arena;
 	else
 		decoded = palloc(required_space);
 
@@ -901,16 +1462,15 @@ ApplyRecord(StringInfo input_message)
 	/*
 	 * If no base image of the page was provided by PushPage, initialize
 	 * wal_redo_buffer here. The first WAL record must initialize the page
-	 * in that case.
+	 * in that case. It stays pinned for the rest of the records.
 	 */
 	if (BufferIsInvalid(wal_redo_buffer))
 	{
-		wal_redo_buffer = NeonRedoReadBuffer(BufTagGetNRelFileInfo(target_redo_tag),
+		wal_redo_buffer = NeonRedoReadBuffer(target_redo_rinfo,
 											 target_redo_tag.forkNum,
 											 target_redo_tag.blockNum,
 											 RBM_NORMAL);
 		Assert(!BufferIsInvalid(wal_redo_buffer));
-		ReleaseBuffer(wal_redo_buffer);
 	}
 
 	redo_read_buffer_filter = NULL;
@@ -918,11 +1478,13 @@ ApplyRecord(StringInfo input_message)
 	/* Pop the error context stack */
 	error_context_stack = errcallback.previous;
 
+	redo_records_applied++;
+
 	elog(TRACE, "applied WAL record with LSN %X/%X",
 		 (uint32) (lsn >> 32), (uint32) lsn);
 
 #if PG_VERSION_NUM >= 150000
-	if ((char *) decoded != static_decodebuf)
+	if ((char *) decoded != decode_arena)
 		pfree(decoded);
 #endif
 }
@@ -957,36 +1519,44 @@ apply_error_callback(void *arg)
 static bool
 redo_block_filter(XLogReaderState *record, uint8 block_id)
 {
-	BufferTag	target_tag;
 	NRelFileInfo rinfo;
+	ForkNumber	forknum;
+	BlockNumber blknum;
 
 #if PG_VERSION_NUM >= 150000
-	XLogRecGetBlockTag(record, block_id,
-					   &rinfo, &target_tag.forkNum, &target_tag.blockNum);
+	XLogRecGetBlockTag(record, block_id, &rinfo, &forknum, &blknum);
 #else
-	if (!XLogRecGetBlockTag(record, block_id,
-							&rinfo, &target_tag.forkNum, &target_tag.blockNum))
+	if (!XLogRecGetBlockTag(record, block_id, &rinfo, &forknum, &blknum))
 	{
 		/* Caller specified a bogus block_id */
 		elog(PANIC, "failed to locate backup block with ID %d", block_id);
 	}
 #endif
-	CopyNRelFileInfoToBufTag(target_tag, rinfo);
+
+	/*
+	 * Compare against the target block that BeginRedo() unpacked, most
+	 * selective field first, instead of building a BufferTag for every block
+	 * reference.
+	 */
+	if (blknum == target_redo_tag.blockNum &&
+		forknum == target_redo_tag.forkNum &&
+		RelFileInfoEquals(rinfo, target_redo_rinfo))
+		return false;
 
 	/*
 	 * Can a WAL redo function ever access a relation other than the one that
 	 * it modifies? I don't see why it would.
 	 * Custom RMGRs may be affected by this.
 	 */
-	if (!RelFileInfoEquals(rinfo, BufTagGetNRelFileInfo(target_redo_tag)))
+	if (!RelFileInfoEquals(rinfo, target_redo_rinfo))
 		elog(WARNING, "REDO accessing unexpected page: %u/%u/%u.%u blk %u",
-			 RelFileInfoFmt(rinfo), target_tag.forkNum, target_tag.blockNum);
+			 RelFileInfoFmt(rinfo), forknum, blknum);
 
 	/*
-	 * If this block isn't one we are currently restoring, then return 'true'
-	 * so that this gets ignored
+	 * This block isn't one we are currently restoring, so return 'true' so
+	 * that this gets ignored
 	 */
-	return !BufferTagsEqual(&target_tag, &target_redo_tag);
+	return true;
 }
 
 /*
@@ -1000,9 +1570,7 @@ GetPage(StringInfo input_message)
 	NRelFileInfo rinfo;
 	ForkNumber forknum;
 	BlockNumber blknum;
-	Buffer		buf;
-	Page		page;
-	int			tot_written;
+	BufferTag	tag;
 
 	/*
 	 * message format:
@@ -1013,65 +1581,250 @@ GetPage(StringInfo input_message)
 	 * ForkNumber
 	 * BlockNumber
 	 */
-	forknum = pq_getmsgbyte(input_message);
-#if PG_MAJORVERSION_NUM < 16
-	rinfo.spcNode = pq_getmsgint(input_message, 4);
-	rinfo.dbNode = pq_getmsgint(input_message, 4);
-	rinfo.relNode = pq_getmsgint(input_message, 4);
-#else
-	rinfo.spcOid = pq_getmsgint(input_message, 4);
-	rinfo.dbOid = pq_getmsgint(input_message, 4);
-	rinfo.relNumber = pq_getmsgint(input_message, 4);
-#endif
-	blknum = pq_getmsgint(input_message, 4);
-
-	/* FIXME: check that we got a BeginRedoForBlock message or this earlier */
+	GetRedoTag(input_message, &rinfo, &forknum, &blknum);
+	LoadRedoSlot(selected_redo_slot);
 
-	buf = NeonRedoReadBuffer(rinfo, forknum, blknum, RBM_NORMAL);
-	Assert(buf == wal_redo_buffer);
-	page = BufferGetPage(buf);
-	/* single thread, so don't bother locking the page */
+	InitBufferTag(&tag, &rinfo, forknum, blknum);
+	if (!BufferTagsEqual(&tag, &target_redo_tag))
+		ereport(ERROR,
+				(errcode(ERRCODE_PROTOCOL_VIOLATION),
+				 errmsg("GetPage for %u/%u/%u.%u blk %u does not match BeginRedoForBlock",
+						RelFileInfoFmt(rinfo), forknum, blknum)));
 
 	/* Response: Page content */
-	tot_written = 0;
-	do {
-		ssize_t		rc;
+	send_response(GetRedoPage(), BLCKSZ);
+	EndRedo();
 
-		rc = write(STDOUT_FILENO, &page[tot_written], BLCKSZ - tot_written);
-		if (rc < 0) {
-			/* If interrupted by signal, just retry */
-			if (errno == EINTR)
-				continue;
-			ereport(ERROR,
-					(errcode_for_file_access(),
-					 errmsg("could not write to stdout: %m")));
-		}
-		tot_written += rc;
-	} while (tot_written < BLCKSZ);
+	elog(TRACE, "Page sent back for block %u", blknum);
+}
 
-	ReleaseBuffer(buf);
-	DropRelationAllLocalBuffers(rinfo);
+/*
+ * Get the page being reconstructed. Single thread, so don't bother locking
+ * it.
+ */
+static Page
+GetRedoPage(void)
+{
+	/* Normally PushPage or the first record has read it in already */
+	if (BufferIsInvalid(wal_redo_buffer))
+		wal_redo_buffer = NeonRedoReadBuffer(target_redo_rinfo,
+											 target_redo_tag.forkNum,
+											 target_redo_tag.blockNum,
+											 RBM_NORMAL);
+	return BufferGetPage(wal_redo_buffer);
+}
+
+/*
+ * Finish the redo of the target block, releasing its buffer.
+ */
+static void
+EndRedo(void)
+{
+	if (BufferIsValid(wal_redo_buffer))
+		ReleaseBuffer(wal_redo_buffer);
+	DropRelationAllLocalBuffers(target_redo_rinfo);
 	wal_redo_buffer = InvalidBuffer;
+	target_redo_in_progress = false;
+}
 
-	elog(TRACE, "Page sent back for block %u", blknum);
+/*
+ * Make 'slotno' the loaded slot, parking the block of the slot that was
+ * loaded before.
+ */
+static void
+LoadRedoSlot(int slotno)
+{
+	RedoSlot   *slot;
+
+	if (slotno == loaded_redo_slot)
+		return;
+
+	/* Copy the page out of the buffer cache, and drop it from there */
+	slot = &redo_slots[loaded_redo_slot];
+	slot->tag = target_redo_tag;
+	slot->rinfo = target_redo_rinfo;
+	slot->in_progress = target_redo_in_progress;
+	slot->parked = BufferIsValid(wal_redo_buffer);
+	if (slot->parked)
+	{
+		if (slot->page == NULL)
+			slot->page = MemoryContextAlloc(TopMemoryContext, BLCKSZ);
+		memcpy(slot->page, BufferGetPage(wal_redo_buffer), BLCKSZ);
+	}
+	if (target_redo_in_progress)
+		EndRedo();
+
+	slot = &redo_slots[slotno];
+	if (slot->reader == NULL)
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+
+		slot->reader = XLogReaderAllocate(wal_segment_size, NULL, XL_ROUTINE(), NULL);
+		MemoryContextSwitchTo(oldcxt);
+		if (slot->reader == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("out of memory"),
+					 errdetail("Failed while allocating a WAL reading processor.")));
+	}
+	reader_state = slot->reader;
+	loaded_redo_slot = slotno;
+
+	/* Bring in the new slot's block where it left off */
+	target_redo_tag = slot->tag;
+	target_redo_rinfo = slot->rinfo;
+	if (slot->in_progress)
+	{
+		BeginRedo(slot->rinfo, slot->tag.forkNum, slot->tag.blockNum);
+		if (slot->parked)
+			PushPageImage(slot->rinfo, slot->tag.forkNum, slot->tag.blockNum,
+						  slot->page);
+	}
+	slot->parked = false;
+}
+
+/*
+ * Reconstruct a batch of pages, and send them all back at once.
+ */
+static void
+ApplyBatch(StringInfo input_message)
+{
+	char	   *result_pages;
+	int			njobs;
+
+	/*
+	 * message format:
+	 *
+	 * int32 number of jobs
+	 * for each job:
+	 *   spcNode
+	 *   dbNode
+	 *   relNode
+	 *   ForkNumber
+	 *   BlockNumber
+	 *   byte: 1 if a base page image follows, 0 otherwise
+	 *   [8k page content]
+	 *   record list, see ApplyRecordList()
+	 */
+	njobs = pq_getmsgint(input_message, 4);
+	if (njobs < 0 || njobs > MaxAllocSize / BLCKSZ)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROTOCOL_VIOLATION),
+				 errmsg("invalid number of jobs in batch: %d", njobs)));
+
+	/* In ring mode, this points straight into the response ring */
+	result_pages = response_begin((Size) njobs * BLCKSZ);
+
+	/* Leave the blocks in progress in the other slots alone */
+	LoadRedoSlot(num_redo_slots);
+
+	for (int i = 0; i < njobs; i++)
+	{
+		NRelFileInfo rinfo;
+		ForkNumber	forknum;
+		BlockNumber blknum;
+
+		GetRedoTag(input_message, &rinfo, &forknum, &blknum);
+		BeginRedo(rinfo, forknum, blknum);
+
+		if (pq_getmsgbyte(input_message) != 0)
+			PushPageImage(rinfo, forknum, blknum,
+						  pq_getmsgbytes(input_message, BLCKSZ));
+
+		ApplyRecordList(input_message);
+
+		memcpy(&result_pages[(Size) i * BLCKSZ], GetRedoPage(), BLCKSZ);
+		EndRedo();
+	}
+	pq_getmsgend(input_message);
+
+	/* Response: the page contents, in the order of the jobs */
+	response_end();
+
+	elog(TRACE, "%d pages sent back for batch", njobs);
 }
 
 
 static void
 Ping(StringInfo input_message)
 {
-	int			tot_written;
-	/* Response: the input message */
-	tot_written = 0;
-	do {
-		ssize_t		rc;
-		/* We don't need alignment, but it's bad practice to use char[BLCKSZ] */
+	/* We don't need alignment, but it's bad practice to use char[BLCKSZ] */
 #if PG_VERSION_NUM >= 160000
-		static const PGIOAlignedBlock response;
+	static const PGIOAlignedBlock response;
 #else
-		static const PGAlignedBlock response;
+	static const PGAlignedBlock response;
 #endif
-		rc = write(STDOUT_FILENO, &response.data[tot_written], BLCKSZ - tot_written);
+
+	/* Response: the input message */
+	send_response(response.data, BLCKSZ);
+
+	elog(TRACE, "Page sent back for ping");
+}
+
+/*
+ * Return statistics about the records we have processed.
+ */
+static void
+GetStats(StringInfo input_message)
+{
+	char	   *response;
+	uint64		val;
+
+	pq_getmsgend(input_message);
+
+	/*
+	 * Response:
+	 *
+	 * int64 number of records applied
+	 * int64 number of records not applied, because they were the only record
+	 *       of an ApplyRecords or ApplyBatch job, and had a full-page image of
+	 *       the block that we restored instead
+	 */
+	response = response_begin(2 * sizeof(val));
+	val = pg_hton64(redo_records_applied);
+	memcpy(response, &val, sizeof(val));
+	val = pg_hton64(redo_records_skipped);
+	memcpy(response + sizeof(val), &val, sizeof(val));
+	response_end();
+}
+
+/*
+ * Select the redo slot for the following messages. The slot is loaded when
+ * the next of them arrives.
+ */
+static void
+UseSlot(StringInfo input_message)
+{
+	int			slotno;
+
+	/*
+	 * message format:
+	 *
+	 * int32 slot number
+	 */
+	slotno = pq_getmsgint(input_message, 4);
+	pq_getmsgend(input_message);
+
+	if (slotno < 0 || slotno >= num_redo_slots)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROTOCOL_VIOLATION),
+				 errmsg("invalid redo slot %d, there are %d",
+						slotno, num_redo_slots)));
+	selected_redo_slot = slotno;
+}
+
+/*
+ * Write all of 'buf' to stdout, retrying on partial writes.
+ */
+static void
+write_stdout(const char *buf, size_t count)
+{
+	size_t		tot_written = 0;
+
+	do {
+		ssize_t		rc;
+
+		rc = write(STDOUT_FILENO, &buf[tot_written], count - tot_written);
 		if (rc < 0) {
 			/* If interrupted by signal, just retry */
 			if (errno == EINTR)
@@ -1081,11 +1834,440 @@ Ping(StringInfo input_message)
 					 errmsg("could not write to stdout: %m")));
 		}
 		tot_written += rc;
-	} while (tot_written < BLCKSZ);
+	} while (tot_written < count);
+}
 
-	elog(TRACE, "Page sent back for ping");
+/*
+ * Map the shared memory ring that the pageserver passed to us.
+ *
+ * This must be called before entering seccomp mode.
+ */
+static void
+ring_attach(void)
+{
+	struct stat st;
+	void	   *p;
+
+	if (fstat(WALREDO_RING_FD, &st) != 0)
+		ereport(FATAL,
+				(errcode_for_file_access(),
+				 errmsg("[neon-wal-redo] could not stat shared memory ring: %m")));
+	if (st.st_size < WALREDO_RING_HEADER_SIZE)
+		ereport(FATAL,
+				(errcode(ERRCODE_PROTOCOL_VIOLATION),
+				 errmsg("[neon-wal-redo] shared memory ring is too small")));
+
+	p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, WALREDO_RING_FD, 0);
+	if (p == MAP_FAILED)
+		ereport(FATAL,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("[neon-wal-redo] could not map shared memory ring: %m")));
+	close(WALREDO_RING_FD);
+
+	ring = (WalRedoRingHeader *) p;
+	if (ring->magic != WALREDO_RING_MAGIC || ring->version != WALREDO_RING_VERSION ||
+		ring->request_size == 0 || ring->response_size == 0 ||
+		ring->request_size % WALREDO_RING_ALIGN != 0 ||
+		ring->response_size % WALREDO_RING_ALIGN != 0 ||
+		WALREDO_RING_HEADER_SIZE + ring->request_size + ring->response_size > st.st_size)
+		ereport(FATAL,
+				(errcode(ERRCODE_PROTOCOL_VIOLATION),
+				 errmsg("[neon-wal-redo] invalid shared memory ring header")));
+
+	ring_requests = (char *) p + WALREDO_RING_HEADER_SIZE;
+	ring_responses = ring_requests + ring->request_size;
 }
 
+/*
+ * Process a message whose payload is in the request ring.
+ */
+static void
+RingRequest(StringInfo input_message)
+{
+	int			msgtype;
+	uint64		pos;
+	int			len;
+	uint64		off;
+	StringInfoData ring_message;
+
+	/*
+	 * message format:
+	 *
+	 * byte: type of the message in the ring, only ApplyBatch is supported
+	 * int64 position of the payload in the request ring
+	 * int32 payload length
+	 */
+	msgtype = pq_getmsgbyte(input_message);
+	pos = pq_getmsgint64(input_message);
+	len = pq_getmsgint(input_message, 4);
+	pq_getmsgend(input_message);
+
+	if (ring == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROTOCOL_VIOLATION),
+				 errmsg("ring request without a shared memory ring")));
+
+	off = pos % ring->request_size;
+	if (pos % WALREDO_RING_ALIGN != 0 || len < 0 || off + len > ring->request_size)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROTOCOL_VIOLATION),
+				 errmsg("invalid ring request at %llu, length %d",
+						(unsigned long long) pos, len)));
+
+	/* The pq_getmsg* functions don't modify the buffer */
+	ring_message.data = ring_requests + off;
+	ring_message.len = len;
+	ring_message.maxlen = len;
+	ring_message.cursor = 0;
+
+	switch (msgtype)
+	{
+		case 'M':
+			ApplyBatch(&ring_message);
+			break;
+
+		default:
+			ereport(ERROR,
+					(errcode(ERRCODE_PROTOCOL_VIOLATION),
+					 errmsg("invalid ring message type %d", msgtype)));
+	}
+
+	/* Done with the request, let the pageserver reuse the space */
+	pg_memory_barrier();
+	pg_atomic_write_u64(&ring->request_consumed, pos + len);
+}
+
+/*
+ * State of the response being built between response_begin() and
+ * response_end().
+ */
+static char *response_scratch = NULL;
+static size_t response_scratch_size = 0;
+static bool response_in_ring;
+static uint64 response_pos;
+static size_t response_len;
+
+/*
+ * Get a buffer for a response of 'len' bytes. Fill it in, and call
+ * response_end() to send it.
+ *
+ * In ring mode, the buffer is in the response ring if there's room for it.
+ */
+static char *
+response_begin(size_t len)
+{
+	response_len = len;
+
+	if (ring != NULL)
+	{
+		uint64		consumed;
+		uint64		pos;
+		uint64		off;
+
+		consumed = pg_atomic_read_u64(&ring->response_consumed);
+		/* don't overwrite the space before the pageserver is done with it */
+		pg_memory_barrier();
+
+		pos = TYPEALIGN(WALREDO_RING_ALIGN, ring_response_produced);
+		off = pos % ring->response_size;
+		if (off + len > ring->response_size)
+		{
+			/* doesn't fit at the end, wrap around */
+			pos += ring->response_size - off;
+			off = 0;
+		}
+		if (len <= ring->response_size && pos + len - consumed <= ring->response_size)
+		{
+			response_in_ring = true;
+			response_pos = pos;
+			return ring_responses + off;
+		}
+	}
+
+	/* Leave space for the tag byte in ring mode */
+	response_in_ring = false;
+	if (response_scratch_size < len + 1)
+	{
+		if (response_scratch)
+			pfree(response_scratch);
+		response_scratch = MemoryContextAlloc(TopMemoryContext, len + 1);
+		response_scratch_size = len + 1;
+	}
+	return response_scratch + 1;
+}
+
+static void
+response_end(void)
+{
+	if (response_in_ring)
+	{
+		char		hdr[1 + sizeof(uint64) + sizeof(uint32)];
+		uint64		pos = pg_hton64(response_pos);
+		uint32		len = pg_hton32((uint32) response_len);
+
+		hdr[0] = 'R';
+		memcpy(&hdr[1], &pos, sizeof(pos));
+		memcpy(&hdr[1 + sizeof(pos)], &len, sizeof(len));
+		ring_response_produced = response_pos + response_len;
+
+		/* the write() orders the response before the notification */
+		write_stdout(hdr, sizeof(hdr));
+	}
+	else if (ring != NULL)
+	{
+		response_scratch[0] = 'D';
+		write_stdout(response_scratch, response_len + 1);
+	}
+	else
+		write_stdout(response_scratch + 1, response_len);
+}
+
+/*
+ * Send a response that's already in a buffer.
+ */
+static void
+send_response(const char *buf, size_t len)
+{
+	if (ring == NULL)
+	{
+		write_stdout(buf, len);
+		return;
+	}
+	memcpy(response_begin(len), buf, len);
+	response_end();
+}
+
+#ifdef __linux__
+
+static void
+fork_server_sigchld(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	/* The pageserver waits for the children through their pidfds */
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		;
+
+	errno = save_errno;
+}
+
+/*
+ * Receive a spawn request. Returns the number of file descriptors received,
+ * or -1 on EOF.
+ */
+static int
+fork_server_recv(char *req, int reqlen, int *fds, int maxfds)
+{
+	struct msghdr msg = {0};
+	struct iovec iov;
+	union
+	{
+		char		buf[CMSG_SPACE(sizeof(int) * 4)];
+		struct cmsghdr align;
+	}			cmsgbuf;
+	struct cmsghdr *cmsg;
+	ssize_t		n;
+	int			nfds = 0;
+
+	Assert(maxfds <= 4);
+
+	iov.iov_base = req;
+	iov.iov_len = reqlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+	do
+	{
+		n = recvmsg(STDIN_FILENO, &msg, MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		ereport(FATAL,
+				(errcode_for_socket_access(),
+				 errmsg("[neon-wal-redo] could not receive spawn request: %m")));
+	if (n == 0)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		int			count;
+
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (nfds + count > maxfds)
+			ereport(FATAL,
+					(errcode(ERRCODE_PROTOCOL_VIOLATION),
+					 errmsg("[neon-wal-redo] too many file descriptors in spawn request")));
+		memcpy(&fds[nfds], CMSG_DATA(cmsg), count * sizeof(int));
+		nfds += count;
+	}
+
+	if (n != reqlen || (msg.msg_flags & MSG_CTRUNC) != 0)
+		ereport(FATAL,
+				(errcode(ERRCODE_PROTOCOL_VIOLATION),
+				 errmsg("[neon-wal-redo] invalid spawn request")));
+	return nfds;
+}
+
+/*
+ * Reply to a spawn request with the PID of the child and a pidfd for it, or
+ * with PID 0 if it failed.
+ */
+static void
+fork_server_reply(pid_t pid, int pidfd)
+{
+	struct msghdr msg = {0};
+	struct iovec iov;
+	union
+	{
+		char		buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	}			cmsgbuf;
+	uint32		n = pg_hton32((uint32) pid);
+	ssize_t		rc;
+
+	iov.iov_base = &n;
+	iov.iov_len = sizeof(n);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (pidfd >= 0)
+	{
+		struct cmsghdr *cmsg;
+
+		msg.msg_control = cmsgbuf.buf;
+		msg.msg_controllen = sizeof(cmsgbuf.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &pidfd, sizeof(int));
+	}
+
+	do
+	{
+		rc = sendmsg(STDIN_FILENO, &msg, 0);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0)
+		ereport(FATAL,
+				(errcode_for_socket_access(),
+				 errmsg("[neon-wal-redo] could not reply to spawn request: %m")));
+}
+
+/*
+ * Serve spawn requests, see "Fork server" at the top of the file.
+ *
+ * Returns only in a forked child, after it has taken over the file
+ * descriptors that came with the request. Returns true if the child should
+ * attach to a shared memory ring.
+ */
+static bool
+ForkServerLoop(void)
+{
+	sigset_t	sigchld;
+
+	/*
+	 * We don't need any of the file descriptors that the pageserver might
+	 * have leaked to us, and neither do the children.
+	 */
+	if (syscall(__NR_close_range, 3, ~0U, 0) != 0)
+		ereport(FATAL,
+				(errcode(ERRCODE_SYSTEM_ERROR),
+				 errmsg("[neon-wal-redo] could not close files >= fd 3")));
+
+	sigemptyset(&sigchld);
+	sigaddset(&sigchld, SIGCHLD);
+	pqsignal(SIGCHLD, fork_server_sigchld);
+
+	set_ps_display("fork server");
+
+	for (;;)
+	{
+		char		req[2];
+		int			fds[4];
+		int			nfds;
+		bool		with_ring;
+		pid_t		pid;
+		int			pidfd = -1;
+
+		nfds = fork_server_recv(req, sizeof(req), fds, lengthof(fds));
+		if (nfds < 0)
+		{
+			/* The pageserver is gone, the children can live on without us */
+			proc_exit(0);
+		}
+		with_ring = (req[1] & 1) != 0;
+		if (req[0] != 'F' || nfds != (with_ring ? 4 : 3))
+			ereport(FATAL,
+					(errcode(ERRCODE_PROTOCOL_VIOLATION),
+					 errmsg("[neon-wal-redo] invalid spawn request")));
+
+		/*
+		 * Don't let the SIGCHLD handler reap the child before we have a pidfd
+		 * for it.
+		 */
+		sigprocmask(SIG_BLOCK, &sigchld, NULL);
+		pid = fork();
+		if (pid == 0)
+		{
+			pqsignal(SIGCHLD, SIG_DFL);
+			sigprocmask(SIG_UNBLOCK, &sigchld, NULL);
+			InitProcessGlobals();
+			MyProc->pid = MyProcPid;
+			/* Don't run the fork server's exit callbacks, like a postmaster child */
+			on_exit_reset();
+
+			/*
+			 * The received file descriptors are all >= 3, so these don't
+			 * clobber each other.
+			 */
+			if (dup2(fds[0], STDIN_FILENO) < 0 ||
+				dup2(fds[1], STDOUT_FILENO) < 0 ||
+				dup2(fds[2], STDERR_FILENO) < 0 ||
+				(with_ring && fds[3] != WALREDO_RING_FD &&
+				 dup2(fds[3], WALREDO_RING_FD) < 0))
+				_exit(1);
+			if (syscall(__NR_close_range, with_ring ? WALREDO_RING_FD + 1 : 3, ~0U, 0) != 0)
+				_exit(1);
+			return with_ring;
+		}
+
+		if (pid > 0)
+		{
+			pidfd = syscall(__NR_pidfd_open, pid, 0);
+			if (pidfd < 0)
+			{
+				kill(pid, SIGKILL);
+				pid = 0;
+			}
+		}
+		else
+			pid = 0;
+		sigprocmask(SIG_UNBLOCK, &sigchld, NULL);
+
+		fork_server_reply(pid, pidfd);
+
+		for (int i = 0; i < nfds; i++)
+			close(fds[i]);
+		if (pidfd >= 0)
+			close(pidfd);
+	}
+}
+
+#else							/* !__linux__ */
+
+static bool
+ForkServerLoop(void)
+{
+	ereport(FATAL,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("[neon-wal-redo] fork server mode is only supported on Linux")));
+	return false;
+}
+
+#endif							/* __linux__ */
+
 
 /* Buffer used by buffered_read() */
 static char stdin_buf[16 * 1024];
@@ -0,0 +1,54 @@
+"""
+Helpers for tests of how the compute reads pages from the pageserver: an
+endpoint that has to read almost every page from the pageserver, and a table
+that is large enough to need many GetPage requests to scan.
+"""
+
+from __future__ import annotations
+
+from typing import TYPE_CHECKING
+
+if TYPE_CHECKING:
+    from typing import Any
+
+    from psycopg2.extensions import cursor
+
+    from fixtures.neon_fixtures import Endpoint, NeonEnv
+
+FILLER_LEN = 200
+
+
+def start_uncached_endpoint(
+    env: NeonEnv, config_lines: list[str] | None = None, **kwargs: Any
+) -> Endpoint:
+    """
+    Start an endpoint on the main branch with tiny shared buffers and no local
+    file cache, so that scans read their pages from the pageserver.
+    """
+    return env.endpoints.create_start(
+        "main",
+        config_lines=[
+            "shared_buffers=1MB",
+            "neon.file_cache_size_limit=0",
+            *(config_lines or []),
+        ],
+        **kwargs,
+    )
+
+
+def create_table(cur: cursor, n_rec: int, table: str = "t") -> None:
+    """
+    Create the neon extension, and a table with rows 1..n_rec, each padded with
+    FILLER_LEN characters, so that a page holds a few dozen rows.
+    """
+    cur.execute("CREATE EXTENSION IF NOT EXISTS neon")
+    cur.execute(f"CREATE TABLE {table}(pk integer, filler text default repeat('?', {FILLER_LEN}))")
+    cur.execute(f"insert into {table} (pk) values (generate_series(1,{n_rec}))")
+
+
+def check_table(cur: cursor, n_rec: int, table: str = "t") -> None:
+    """
+    Scan a table created with create_table(), and check that it has all its rows.
+    """
+    cur.execute(f"select sum(pk), count(*), sum(length(filler)) from {table}")
+    assert cur.fetchone() == (n_rec * (n_rec + 1) // 2, n_rec, FILLER_LEN * n_rec)
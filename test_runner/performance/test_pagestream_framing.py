@@ -0,0 +1,60 @@
+from __future__ import annotations
+
+import os
+
+import pytest
+from fixtures.benchmark_fixture import MetricReport, NeonBenchmarker
+from fixtures.neon_fixtures import NeonEnvBuilder
+from fixtures.page_reads import create_table, start_uncached_endpoint
+
+
+def backend_cpu_seconds(pid: int) -> float:
+    """User + system CPU time used by a local process, from /proc"""
+    with open(f"/proc/{pid}/stat") as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    # utime and stime are fields 14 and 15, counting from the pid
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+@pytest.mark.parametrize("raw_framing", [False, True], ids=["copy", "raw"])
+def test_pagestream_framing(
+    neon_env_builder: NeonEnvBuilder, zenbenchmark: NeonBenchmarker, raw_framing: bool
+):
+    """
+    Compare the compute-side CPU cost of GetPage round trips with the
+    pagestream messages going through libpq COPY, and with the raw framing.
+    """
+    env = neon_env_builder.init_start()
+    n_rec = 500000
+    n_iters = 5
+
+    endpoint = start_uncached_endpoint(
+        env, config_lines=[f"neon.pageserver_raw_framing={'on' if raw_framing else 'off'}"]
+    )
+    create_table(endpoint.connect().cursor(), n_rec)
+
+    cur = endpoint.connect().cursor()
+    cur.execute("set max_parallel_workers_per_gather=0")
+    cur.execute("set effective_io_concurrency=100")
+    cur.execute("select pg_backend_pid()")
+    pid = cur.fetchone()[0]
+
+    cpu_before = backend_cpu_seconds(pid)
+    with zenbenchmark.record_duration("scan"):
+        for _ in range(n_iters):
+            cur.execute("select count(*) from t")
+            assert cur.fetchone() == (n_rec,)
+    cpu = backend_cpu_seconds(pid) - cpu_before
+
+    cur.execute(
+        "select value from neon_perf_counters where metric = 'pageserver_raw_framing_connections_total'"
+    )
+    assert (cur.fetchone()[0] > 0) == raw_framing
+
+    cur.execute("select pg_relation_size('t') / 8192")
+    n_pages = cur.fetchone()[0] * n_iters
+
+    zenbenchmark.record("backend_cpu", cpu, "s", MetricReport.LOWER_IS_BETTER)
+    zenbenchmark.record(
+        "backend_cpu_per_page", cpu / n_pages * 1e6, "us", MetricReport.LOWER_IS_BETTER
+    )
@@ -0,0 +1,77 @@
+from __future__ import annotations
+
+from pathlib import Path
+
+from fixtures.benchmark_fixture import MetricReport, NeonBenchmarker
+from fixtures.neon_fixtures import NeonEnvBuilder
+
+
+def read_proc_status_kb(pid: int, field: str) -> int:
+    for line in Path(f"/proc/{pid}/status").read_text().splitlines():
+        if line.startswith(f"{field}:"):
+            value, unit = line.split()[1:]
+            assert unit == "kB"
+            return int(value)
+    raise KeyError(field)
+
+
+#
+# Measure the memory footprint of a WAL redo process. Every tenant on a
+# pageserver has one, so this multiplies by the number of active tenants.
+#
+# The same is measured with the shared memory sized like for a postmaster,
+# which is how it used to be, to show what sizing it for the single WAL redo
+# process saves.
+#
+def test_walredo_rss(neon_env_builder: NeonEnvBuilder, zenbenchmark: NeonBenchmarker):
+    env = neon_env_builder.init_start()
+    tenant_id = env.initial_tenant
+
+    endpoint = env.endpoints.create_start(
+        "main",
+        config_lines=[
+            "shared_buffers=1MB",
+            "neon.file_cache_size_limit=0",
+        ],
+    )
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE TABLE foo (t text)")
+    cur.execute(
+        """
+        INSERT INTO foo
+            SELECT 'long string to consume some space' || g
+            FROM generate_series(1, 100000) g
+        """
+    )
+    cur.execute("UPDATE foo SET t = t || 'x'")
+
+    def measure() -> tuple[int, int]:
+        # The table doesn't fit in shared_buffers, so this reads pages from the
+        # pageserver, which reconstructs them with WAL redo
+        cur.execute("SELECT count(*) FROM foo")
+        assert cur.fetchone() == (100000,)
+
+        walredo = env.pageserver.http_client().tenant_status(tenant_id)["walredo"]
+        assert walredo is not None and walredo["process"] is not None
+        pid = walredo["process"]["pid"]
+        return read_proc_status_kb(pid, "VmHWM"), read_proc_status_kb(pid, "VmRSS")
+
+    peak_rss, rss = measure()
+
+    # Restart the pageserver to get a new WAL redo process with the old sizing,
+    # and do the same redo with it
+    env.pageserver.stop()
+    env.pageserver.patch_config_toml_nonrecursive({"walredo_postmaster_shmem_sizes": True})
+    env.pageserver.start()
+    postmaster_peak_rss, postmaster_rss = measure()
+
+    zenbenchmark.record("walredo_peak_rss", peak_rss, "KiB", MetricReport.LOWER_IS_BETTER)
+    zenbenchmark.record("walredo_rss", rss, "KiB", MetricReport.LOWER_IS_BETTER)
+    zenbenchmark.record(
+        "walredo_postmaster_shmem_peak_rss", postmaster_peak_rss, "KiB", MetricReport.TEST_PARAM
+    )
+    zenbenchmark.record(
+        "walredo_postmaster_shmem_rss", postmaster_rss, "KiB", MetricReport.TEST_PARAM
+    )
+
+    assert peak_rss < postmaster_peak_rss
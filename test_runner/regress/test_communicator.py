@@ -0,0 +1,62 @@
+from __future__ import annotations
+
+import threading
+
+from fixtures.neon_fixtures import NeonEnv
+from fixtures.page_reads import check_table, create_table, start_uncached_endpoint
+
+
+def test_communicator(neon_simple_env: NeonEnv):
+    """
+    Run concurrent scans and updates with neon.use_communicator enabled, so
+    that all page requests go through the shared communicator process, and
+    check that they see the right data.
+    """
+    env = neon_simple_env
+    n_rec = 50000
+    n_threads = 4
+
+    endpoint = start_uncached_endpoint(
+        env,
+        config_lines=[
+            "neon.protocol_version=3",
+            "neon.use_communicator=on",
+        ],
+    )
+
+    cur = endpoint.connect().cursor()
+    create_table(cur, n_rec)
+
+    cur.execute("select count(*) from pg_stat_activity where backend_type = 'Neon communicator'")
+    assert cur.fetchone() == (1,)
+
+    errors = []
+
+    def scan():
+        try:
+            conn = endpoint.connect()
+            c = conn.cursor()
+            c.execute("set effective_io_concurrency=32")
+            c.execute("set max_parallel_workers_per_gather=0")
+            for _ in range(3):
+                check_table(c, n_rec)
+            conn.close()
+        except Exception as e:
+            errors.append(e)
+
+    threads = [threading.Thread(target=scan) for _ in range(n_threads)]
+    for t in threads:
+        t.start()
+    for i in range(10):
+        cur.execute(f"update t set filler = repeat('!', 200) where pk % 100 = {i}")
+    for t in threads:
+        t.join()
+    assert errors == []
+
+    cur.execute("select sum(pk), count(*) from t where filler = repeat('!', 200)")
+    assert cur.fetchone()[1] == n_rec // 10
+
+    cur.execute(
+        "select value from neon_perf_counters where metric = 'communicator_requests_total'"
+    )
+    assert cur.fetchone()[0] > 0
@@ -0,0 +1,51 @@
+from __future__ import annotations
+
+import json
+
+from fixtures.neon_fixtures import NeonEnv
+from fixtures.page_reads import create_table, start_uncached_endpoint
+
+
+def test_explain_neon_io(neon_simple_env: NeonEnv):
+    """
+    Check that EXPLAIN (ANALYZE, BUFFERS) shows the pageserver wait time and
+    prefetch counters of the plan nodes that read from the pageserver.
+    """
+    env = neon_simple_env
+    n_rec = 20000
+
+    endpoint = start_uncached_endpoint(env)
+
+    cur = endpoint.connect().cursor()
+    create_table(cur, n_rec)
+    cur.execute("set max_parallel_workers_per_gather=0")
+
+    cur.execute("explain (analyze, buffers, format json) select sum(pk) from t")
+    plan = cur.fetchone()[0]
+    if isinstance(plan, str):
+        plan = json.loads(plan)
+    nodes = plan[0]["Neon I/O"]
+
+    scans = [n for n in nodes if n["Node Type"] == "Seq Scan"]
+    assert len(scans) == 1
+    scan = scans[0]
+    assert scan["Relation Name"] == "t"
+    assert scan["Pageserver Wait Time"] > 0
+    assert scan["Prefetch Hits"] + scan["Prefetch Misses"] > 0
+
+    # The parent node includes the I/O of its child
+    aggs = [n for n in nodes if n["Node Type"] == "Aggregate"]
+    assert len(aggs) == 1
+    assert aggs[0]["Pageserver Wait Time"] >= scan["Pageserver Wait Time"]
+
+    cur.execute("explain (analyze, buffers) select sum(pk) from t")
+    text = "\n".join(row[0] for row in cur.fetchall())
+    assert "Neon I/O:" in text
+    assert "Seq Scan on t (node" in text
+
+    # Plain EXPLAIN ANALYZE and neon.explain_io=off leave the output alone
+    cur.execute("explain (analyze) select sum(pk) from t")
+    assert "Neon I/O" not in "\n".join(row[0] for row in cur.fetchall())
+    cur.execute("set neon.explain_io=off")
+    cur.execute("explain (analyze, buffers) select sum(pk) from t")
+    assert "Neon I/O" not in "\n".join(row[0] for row in cur.fetchall())
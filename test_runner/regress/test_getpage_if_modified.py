@@ -0,0 +1,80 @@
+from __future__ import annotations
+
+from fixtures.neon_fixtures import NeonEnv
+from fixtures.page_reads import check_table, create_table, start_uncached_endpoint
+
+
+def test_getpage_if_modified(neon_simple_env: NeonEnv):
+    """
+    With protocol version 4, prefetched pages that have become too old to use
+    are revalidated with GetPageIfModified requests instead of being fetched
+    again. Interleave a scan that prefetches far ahead with updates from
+    another session, and check that the scan still sees the right data, and
+    that pages that were not modified are not sent again.
+    """
+    env = neon_simple_env
+    n_rec = 20000
+
+    endpoint = start_uncached_endpoint(env, config_lines=["neon.protocol_version=4"])
+
+    cur = endpoint.connect().cursor()
+    create_table(cur, n_rec)
+
+    writer = endpoint.connect().cursor()
+
+    cur.execute("set effective_io_concurrency=100")
+    cur.execute("set max_parallel_workers_per_gather=0")
+    cur.execute("begin isolation level repeatable read")
+    cur.execute("declare c cursor for select pk from t")
+    total = 0
+    while True:
+        cur.execute("fetch 1000 from c")
+        rows = cur.fetchall()
+        if not rows:
+            break
+        total += sum(r[0] for r in rows)
+        # Modify some pages ahead of the scan, invalidating their prefetches
+        writer.execute(f"update t set filler = repeat('!', 200) where pk % 997 = {total % 997}")
+    cur.execute("commit")
+
+    assert total == n_rec * (n_rec + 1) // 2
+
+    check_table(cur, n_rec)
+
+    # Same thing, but with the updates going to another table, so that the
+    # prefetched pages of 't' go stale without being modified. Restart first,
+    # to empty the last-written LSN cache: the pages of 't' then get the
+    # global last-written LSN, which the writer keeps advancing.
+    cur.execute("vacuum t")
+    create_table(cur, n_rec, table="u")
+    endpoint.stop()
+    endpoint.start()
+
+    cur = endpoint.connect().cursor()
+    writer = endpoint.connect().cursor()
+
+    cur.execute("set effective_io_concurrency=100")
+    cur.execute("set max_parallel_workers_per_gather=0")
+    cur.execute("begin")
+    cur.execute("declare c cursor for select pk from t")
+    total = 0
+    while True:
+        cur.execute("fetch 1000 from c")
+        rows = cur.fetchall()
+        if not rows:
+            break
+        total += sum(r[0] for r in rows)
+        writer.execute(f"update u set filler = repeat('!', 200) where pk % 10 = {total % 10}")
+    cur.execute("commit")
+
+    assert total == n_rec * (n_rec + 1) // 2
+
+    cur.execute(
+        "select metric, value from neon_perf_counters "
+        "where metric in ('getpage_revalidate_requests_total', 'getpage_not_modified_total')"
+    )
+    counters = dict(cur.fetchall())
+    assert len(counters) == 2
+    assert counters["getpage_revalidate_requests_total"] > 0
+    assert counters["getpage_not_modified_total"] > 0
+    assert counters["getpage_not_modified_total"] <= counters["getpage_revalidate_requests_total"]
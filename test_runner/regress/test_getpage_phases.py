@@ -0,0 +1,44 @@
+from __future__ import annotations
+
+from fixtures.neon_fixtures import NeonEnvBuilder
+from fixtures.page_reads import check_table, create_table, start_uncached_endpoint
+
+
+def test_getpage_phases(neon_env_builder: NeonEnvBuilder):
+    """
+    Check that the GetPage phase histograms are collected for each shard, and
+    summed up across shards in neon_perf_counters.
+    """
+    shard_count = 2
+    neon_env_builder.num_pageservers = shard_count
+    env = neon_env_builder.init_start(initial_tenant_shard_count=shard_count)
+    n_rec = 20000
+
+    endpoint = start_uncached_endpoint(env)
+
+    cur = endpoint.connect().cursor()
+    create_table(cur, n_rec)
+
+    cur.execute("set effective_io_concurrency=32")
+    cur.execute("set max_parallel_workers_per_gather=0")
+    check_table(cur, n_rec)
+
+    phases = ["queue", "send", "network", "consume"]
+
+    cur.execute(
+        "select shard, metric, value from neon_shard_perf_counters "
+        "where metric like 'getpage_%_seconds_count'"
+    )
+    per_shard = {(shard, metric): value for shard, metric, value in cur.fetchall()}
+    for shard in range(shard_count):
+        for phase in phases:
+            assert per_shard[(shard, f"getpage_{phase}_seconds_count")] > 0
+
+    # Every read that was answered from the prefetch ring also counts in the
+    # total GetPage wait time
+    cur.execute(
+        "select metric, value from neon_perf_counters "
+        "where metric in ('getpage_wait_seconds_count', 'getpage_consume_seconds_count')"
+    )
+    totals = dict(cur.fetchall())
+    assert 0 < totals["getpage_consume_seconds_count"] <= totals["getpage_wait_seconds_count"]
@@ -0,0 +1,53 @@
+from __future__ import annotations
+
+import pytest
+from fixtures.neon_fixtures import NeonEnvBuilder
+from fixtures.page_reads import check_table, create_table, start_uncached_endpoint
+
+
+@pytest.mark.parametrize("shard_count", [None, 4])
+def test_getpage_range(neon_env_builder: NeonEnvBuilder, shard_count: int | None):
+    """
+    Sequential scans with protocol version 4 fetch consecutive blocks with
+    GetPageRange requests. Check that they return the same data as the
+    single-block requests of protocol version 3, also when the scanned ranges
+    cross shard stripe boundaries.
+    """
+    if shard_count is not None:
+        neon_env_builder.num_pageservers = shard_count
+    env = neon_env_builder.init_start(
+        initial_tenant_shard_count=shard_count,
+        # Small stripes, so that prefetched ranges regularly cross shard boundaries
+        initial_tenant_shard_stripe_size=16,
+    )
+    n_rec = 100000
+
+    endpoint = start_uncached_endpoint(env)
+    create_table(endpoint.connect().cursor(), n_rec)
+    endpoint.stop()
+
+    for protocol_version in [3, 4]:
+        endpoint = start_uncached_endpoint(
+            env,
+            config_lines=[f"neon.protocol_version={protocol_version}"],
+            endpoint_id=f"ep-v{protocol_version}",
+        )
+        cur = endpoint.connect().cursor()
+        cur.execute("set effective_io_concurrency=32")
+        cur.execute("set max_parallel_workers_per_gather=0")
+        check_table(cur, n_rec)
+        cur.execute(
+            "select value from neon_perf_counters where metric = 'getpage_range_requests_total'"
+        )
+        range_requests = cur.fetchone()[0]
+        if protocol_version >= 4:
+            assert range_requests > 0
+        else:
+            assert range_requests == 0
+        endpoint.stop()
+
+    if shard_count is None:
+        metric = env.pageserver.http_client().get_metric_value(
+            "pageserver_compute_commands", {"command": "PageStreamV4"}
+        )
+        assert metric is not None and metric > 0
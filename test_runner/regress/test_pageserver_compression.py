@@ -0,0 +1,39 @@
+from __future__ import annotations
+
+from fixtures.neon_fixtures import NeonEnvBuilder
+from fixtures.page_reads import check_table, create_table, start_uncached_endpoint
+from fixtures.pg_version import PgVersion
+from fixtures.utils import skip_on_postgres
+
+
+@skip_on_postgres(PgVersion.V14, reason="Postgres 14 is built without zstd")
+def test_pageserver_compression(neon_env_builder: NeonEnvBuilder):
+    """
+    Read a table with neon.pageserver_compression enabled, so that the page
+    images are sent zstd-compressed, and check that the data is intact and
+    that the compressed responses show up in the perf counters.
+    """
+    env = neon_env_builder.init_start()
+    n_rec = 10000
+
+    endpoint = start_uncached_endpoint(
+        env,
+        config_lines=[
+            "neon.protocol_version=3",
+            "neon.pageserver_compression=zstd",
+        ],
+    )
+    cur = endpoint.connect().cursor()
+    # The filler compresses well
+    create_table(cur, n_rec)
+    check_table(cur, n_rec)
+
+    cur.execute(
+        "select metric, value from neon_perf_counters where metric in ("
+        "'getpage_compressed_responses_total',"
+        "'getpage_compressed_bytes_total',"
+        "'getpage_decompressed_bytes_total')"
+    )
+    counters = dict(cur.fetchall())
+    assert counters["getpage_compressed_responses_total"] > 0
+    assert counters["getpage_compressed_bytes_total"] < counters["getpage_decompressed_bytes_total"]
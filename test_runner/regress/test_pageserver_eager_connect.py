@@ -0,0 +1,53 @@
+from __future__ import annotations
+
+from fixtures.neon_fixtures import NeonEnvBuilder
+
+
+def test_pageserver_eager_connect(neon_env_builder: NeonEnvBuilder):
+    """
+    With neon.pageserver_eager_connect, a new backend connects to all shards
+    right after authentication, before running any query.
+    """
+    shard_count = 4
+    neon_env_builder.num_pageservers = shard_count
+    env = neon_env_builder.init_start(initial_tenant_shard_count=shard_count)
+
+    endpoint = env.endpoints.create_start(
+        "main",
+        config_lines=[
+            "neon.pageserver_eager_connect=on",
+        ],
+    )
+
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE EXTENSION IF NOT EXISTS neon")
+    cur.execute("CREATE TABLE t(pk integer)")
+    cur.execute("insert into t values (generate_series(1, 1000))")
+
+    # The per-backend counters are not reset when a backend slot is reused, so
+    # only look at how much they change.
+    def backend_connects(cur) -> int:
+        cur.execute(
+            "select value from neon_backend_perf_counters "
+            "where pid = pg_backend_pid() and metric = 'pageserver_connect_seconds_count'"
+        )
+        return int(cur.fetchone()[0])
+
+    def total_connects(cur) -> int:
+        cur.execute(
+            "select value from neon_perf_counters "
+            "where metric = 'pageserver_connect_seconds_count'"
+        )
+        return int(cur.fetchone()[0])
+
+    # A fresh backend has connected to every shard before its first query
+    connects_before = total_connects(cur)
+    fresh = endpoint.connect().cursor()
+    assert total_connects(cur) - connects_before >= shard_count
+    assert backend_connects(fresh) >= shard_count
+
+    # ... so the query itself doesn't need to connect
+    connects_before = backend_connects(fresh)
+    fresh.execute("select sum(pk) from t")
+    assert fresh.fetchone() == (500500,)
+    assert backend_connects(fresh) == connects_before
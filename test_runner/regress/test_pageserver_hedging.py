@@ -0,0 +1,51 @@
+from __future__ import annotations
+
+from fixtures.neon_fixtures import NeonEnv
+from fixtures.page_reads import check_table, create_table, start_uncached_endpoint
+
+
+def test_pageserver_hedging(neon_simple_env: NeonEnv):
+    """
+    Configure the pageserver as its own secondary in the shard map, make a
+    fraction of its GetPage requests slow, and check that slow requests get
+    hedged, that some of the hedges win, and that scans return the right data.
+    """
+    env = neon_simple_env
+    n_rec = 20000
+
+    endpoint = start_uncached_endpoint(env)
+
+    cur = endpoint.connect().cursor()
+    create_table(cur, n_rec)
+
+    cur.execute("SELECT setting FROM pg_settings WHERE name='neon.pageserver_connstring'")
+    connstring = cur.fetchall()[0][0]
+    cur.execute(
+        "alter system set neon.pageserver_connstring=%s",
+        (f"{connstring}|{connstring}",),
+    )
+    cur.execute("select pg_reload_conf()")
+
+    env.pageserver.http_client().configure_failpoints(
+        ("ps::handle-pagerequest-message::getpage", "5%sleep(200)")
+    )
+
+    conn = endpoint.connect()
+    c = conn.cursor()
+    c.execute("set neon.pageserver_hedge_percentile=90")
+    c.execute("set neon.pageserver_hedge_min_delay='5ms'")
+    c.execute("set max_parallel_workers_per_gather=0")
+    for _ in range(3):
+        check_table(c, n_rec)
+
+    env.pageserver.http_client().configure_failpoints(
+        ("ps::handle-pagerequest-message::getpage", "off")
+    )
+
+    c.execute(
+        "select metric, value from neon_perf_counters "
+        "where metric in ('pageserver_hedged_requests_total', 'pageserver_hedge_wins_total')"
+    )
+    counters = dict(c.fetchall())
+    assert counters["pageserver_hedged_requests_total"] > 0
+    assert counters["pageserver_hedge_wins_total"] > 0
@@ -0,0 +1,38 @@
+from __future__ import annotations
+
+from fixtures.neon_fixtures import NeonEnv
+from fixtures.page_reads import check_table, create_table, start_uncached_endpoint
+
+
+def test_pageserver_raw_framing(neon_simple_env: NeonEnv):
+    """
+    Run scans, with and without prefetching, with the pagestream messages
+    exchanged without libpq, and check that the connections did use the raw
+    framing, and that the scans see the right data.
+    """
+    env = neon_simple_env
+    n_rec = 50000
+
+    endpoint = start_uncached_endpoint(env, config_lines=["neon.pageserver_raw_framing=on"])
+
+    cur = endpoint.connect().cursor()
+    create_table(cur, n_rec)
+
+    cur.execute("set max_parallel_workers_per_gather=0")
+    for io_concurrency in [0, 100]:
+        cur.execute(f"set effective_io_concurrency={io_concurrency}")
+        check_table(cur, n_rec)
+
+    def raw_connections() -> int:
+        cur.execute(
+            "select value from neon_perf_counters where metric = 'pageserver_raw_framing_connections_total'"
+        )
+        return int(cur.fetchone()[0])
+
+    assert raw_connections() > 0
+
+    # The connection survives a pageserver restart, and reconnects with the raw framing
+    before = raw_connections()
+    env.pageserver.restart()
+    check_table(cur, n_rec)
+    assert raw_connections() > before
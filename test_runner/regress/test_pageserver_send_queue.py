@@ -0,0 +1,40 @@
+from __future__ import annotations
+
+from fixtures.neon_fixtures import NeonEnv
+from fixtures.page_reads import check_table, create_table, start_uncached_endpoint
+
+
+def test_pageserver_send_queue(neon_simple_env: NeonEnv):
+    """
+    Run deep prefetching scans with the smallest send queue, so that the
+    backend has to wait for queued requests to drain before sending more,
+    and check that it did wait, and that the scans return the right data.
+    """
+    env = neon_simple_env
+    n_rec = 50000
+
+    endpoint = start_uncached_endpoint(env, config_lines=["neon.readahead_buffer_size=1024"])
+
+    cur = endpoint.connect().cursor()
+    create_table(cur, n_rec)
+
+    # Slow down the pageserver, so that requests pile up
+    env.pageserver.http_client().configure_failpoints(
+        ("ps::handle-pagerequest-message::getpage", "10%sleep(10)")
+    )
+
+    cur.execute("set neon.pageserver_send_queue_size='8kB'")
+    cur.execute("set neon.flush_output_after=-1")
+    cur.execute("set effective_io_concurrency=1000")
+    cur.execute("set max_parallel_workers_per_gather=0")
+    for _ in range(2):
+        check_table(cur, n_rec)
+
+    env.pageserver.http_client().configure_failpoints(
+        ("ps::handle-pagerequest-message::getpage", "off")
+    )
+
+    cur.execute(
+        "select value from neon_perf_counters where metric = 'pageserver_send_queue_drains_total'"
+    )
+    assert cur.fetchone()[0] > 0
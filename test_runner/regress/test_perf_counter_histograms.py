@@ -0,0 +1,74 @@
+from __future__ import annotations
+
+import pytest
+from fixtures.neon_fixtures import NeonEnv
+from fixtures.page_reads import check_table, create_table, start_uncached_endpoint
+from psycopg2.errors import InvalidParameterValue
+
+
+def test_perf_counter_histograms(neon_simple_env: NeonEnv):
+    """
+    Test histogram snapshots and the percentile functions on top of them.
+    """
+    env = neon_simple_env
+    n_rec = 20000
+
+    endpoint = start_uncached_endpoint(env)
+
+    cur = endpoint.connect().cursor()
+    create_table(cur, n_rec)
+
+    cur.execute("select neon_histogram('getpage_wait_seconds', pg_backend_pid())")
+    before = cur.fetchone()[0]
+
+    check_table(cur, n_rec)
+
+    cur.execute(
+        "select neon_histogram_sub(neon_histogram('getpage_wait_seconds', pg_backend_pid()), %s)",
+        (before,),
+    )
+    delta = cur.fetchone()[0]
+    count, sum_us, buckets = delta[0], delta[1], delta[2:]
+    assert count > 0
+    assert count == sum(buckets)
+    assert sum_us > 0
+
+    cur.execute(
+        "select neon_histogram_percentile(%s, 0), neon_histogram_percentile(%s, 0.5), "
+        "neon_histogram_percentile(%s, 0.99), neon_histogram_percentile(%s, 1)",
+        (delta, delta, delta, delta),
+    )
+    p0, p50, p99, p100 = cur.fetchone()
+    assert 0 <= p0 <= p50 <= p99 <= p100
+    # The average must be within the range of the estimated percentiles
+    assert p0 <= sum_us / count / 1e6 <= p100
+
+    # The aggregate merges snapshots like the function does
+    cur.execute(
+        "select neon_histogram_sum(h) = neon_histogram_add(%s, %s) "
+        "from (values (%s::int8[]), (%s::int8[])) as v(h)",
+        (before, delta, before, delta),
+    )
+    assert cur.fetchone() == (True,)
+
+    cur.execute(
+        "select neon_histogram_percentile(neon_histogram_sub(%s, %s), 0.5)", (before, before)
+    )
+    assert cur.fetchone() == (None,)
+
+    # The views export the histograms with the same bucket bounds as before
+    # the buckets were made finer, so that the exported series stay the same.
+    cur.execute(
+        "select bucket_le, value from neon_perf_counters "
+        "where metric = 'getpage_wait_seconds_bucket' order by bucket_le"
+    )
+    rows = cur.fetchall()
+    assert [le for le, _ in rows][:4] == [2e-06, 3e-06, 6e-06, 1e-05]
+    assert len(rows) == 29
+    assert rows[-1][0] == float("inf")
+    values = [value for _, value in rows]
+    assert values == sorted(values)
+    assert values[-1] > 0
+
+    with pytest.raises(InvalidParameterValue):
+        cur.execute("select neon_histogram('no_such_histogram')")
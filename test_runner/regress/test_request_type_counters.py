@@ -0,0 +1,45 @@
+from __future__ import annotations
+
+from fixtures.neon_fixtures import NeonEnv
+
+
+def test_request_type_counters(neon_simple_env: NeonEnv):
+    """
+    Check that Exists, Nblocks and DbSize requests are counted separately,
+    with a wait time histogram and the bytes sent and received.
+    """
+    env = neon_simple_env
+    endpoint = env.endpoints.create_start("main")
+
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE EXTENSION IF NOT EXISTS neon")
+    cur.execute("CREATE TABLE t(pk integer)")
+    cur.execute("insert into t values (generate_series(1, 1000))")
+
+    # Start a new backend, with an empty relation size cache
+    endpoint.stop()
+    endpoint.start()
+    cur = endpoint.connect().cursor()
+    cur.execute("select count(*) from t")
+    assert cur.fetchone() == (1000,)
+    cur.execute("select pg_database_size(current_database())")
+
+    def counters(cur, prefix: str) -> dict[str, float]:
+        cur.execute(
+            "select metric, value from neon_perf_counters "
+            "where metric in (%s, %s, %s, %s)",
+            (
+                f"{prefix}_requests_total",
+                f"{prefix}_wait_seconds_count",
+                f"{prefix}_request_bytes_total",
+                f"{prefix}_response_bytes_total",
+            ),
+        )
+        return dict(cur.fetchall())
+
+    for prefix in ["nblocks", "dbsize"]:
+        c = counters(cur, prefix)
+        assert c[f"{prefix}_requests_total"] > 0
+        assert c[f"{prefix}_wait_seconds_count"] == c[f"{prefix}_requests_total"]
+        assert c[f"{prefix}_request_bytes_total"] > 0
+        assert c[f"{prefix}_response_bytes_total"] > 0
@@ -0,0 +1,47 @@
+from __future__ import annotations
+
+from fixtures.neon_fixtures import NeonEnv
+from fixtures.page_reads import check_table, create_table, start_uncached_endpoint
+
+
+def test_slow_request_log(neon_simple_env: NeonEnv):
+    """
+    Make GetPage requests slow with a failpoint, and check that they show up
+    in the neon_slow_requests view with the relation they were for.
+    """
+    env = neon_simple_env
+    n_rec = 1000
+
+    endpoint = start_uncached_endpoint(env, config_lines=["neon.slow_request_log_size=16"])
+
+    cur = endpoint.connect().cursor()
+    create_table(cur, n_rec)
+    cur.execute("select pg_relation_filenode('t')")
+    filenode = cur.fetchone()[0]
+
+    env.pageserver.http_client().configure_failpoints(
+        ("ps::handle-pagerequest-message::getpage", "sleep(50)")
+    )
+
+    conn = endpoint.connect()
+    c = conn.cursor()
+    c.execute("set neon.slow_request_threshold='20ms'")
+    c.execute("set max_parallel_workers_per_gather=0")
+    check_table(c, n_rec)
+
+    env.pageserver.http_client().configure_failpoints(
+        ("ps::handle-pagerequest-message::getpage", "off")
+    )
+
+    c.execute(
+        "select blkno, latency, network, prefetch from neon_slow_requests "
+        "where pid = pg_backend_pid() and request like 'GetPage%%' and relnumber = %s",
+        (filenode,),
+    )
+    rows = c.fetchall()
+    assert 0 < len(rows) <= 16
+    for blkno, latency, network, prefetch in rows:
+        assert blkno is not None
+        assert latency >= 0.02
+        assert network is not None
+        assert prefetch in ("received", "in flight", "miss")
@@ -0,0 +1,62 @@
+from __future__ import annotations
+
+import struct
+from pathlib import Path
+
+from fixtures.neon_fixtures import NeonEnvBuilder
+
+
+def read_corpus_pg_versions(path: Path) -> list[int]:
+    """
+    Returns the pg_version of each entry in a walredo corpus file. Each entry is a
+    big-endian u32 length, followed by the serialized entry, which starts with
+    the pg_version as a big-endian u32.
+    """
+    data = path.read_bytes()
+    versions = []
+    off = 0
+    while off < len(data):
+        (length,) = struct.unpack_from(">I", data, off)
+        off += 4
+        assert off + length <= len(data), "truncated corpus entry"
+        (pg_version,) = struct.unpack_from(">I", data, off)
+        versions.append(pg_version)
+        off += length
+    return versions
+
+
+#
+# Capture the WAL redo requests of a small workload to a corpus file, for
+# replaying in the bench_walredo_replay benchmark. The corpus is left in the
+# test output directory.
+#
+def test_walredo_capture(neon_env_builder: NeonEnvBuilder, test_output_dir: Path):
+    corpus_path = test_output_dir / "walredo_corpus"
+    neon_env_builder.pageserver_config_override = f"walredo_capture_path='{corpus_path}'"
+    env = neon_env_builder.init_start()
+
+    endpoint = env.endpoints.create_start(
+        "main",
+        config_lines=[
+            "shared_buffers=1MB",
+            "neon.file_cache_size_limit=0",
+        ],
+    )
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE TABLE foo (id int, t text)")
+    cur.execute("INSERT INTO foo SELECT g, 'row ' || g FROM generate_series(1, 20000) g")
+    cur.execute("UPDATE foo SET t = t || 'x' WHERE id % 3 = 0")
+    cur.execute("CREATE INDEX ON foo (id)")
+    # The table doesn't fit in shared_buffers, so this reads pages from the
+    # pageserver, which reconstructs them with WAL redo
+    cur.execute("SELECT count(*) FROM foo")
+    assert cur.fetchone() == (20000,)
+
+    # The corpus is written by a background thread, stop the pageserver so that
+    # it's not in the middle of writing an entry
+    endpoint.stop()
+    env.pageserver.stop()
+
+    versions = read_corpus_pg_versions(corpus_path)
+    assert len(versions) > 0
+    assert set(versions) == {int(env.pg_version)}